@@ -4,6 +4,7 @@ import numpy as np
 
 from gliclass  import GLiClassModel, ZeroShotClassificationPipeline
 from transformers import AutoTokenizer
+from transformers.modeling_outputs import BaseModelOutput
 
 import torch, json
 from onnxruntime.quantization import quantize_dynamic, QuantType
@@ -16,6 +17,153 @@ def get_original_logits(model, tokenized_inputs) -> list:
 
     return logits.tolist()
 
+class TextEncoderWrapper(torch.nn.Module):
+    """Text tower of a bi-encoder: (input_ids, attention_mask) -> text_embeddings [batch, hidden]."""
+    def __init__(self, model):
+        super().__init__()
+        self.model = model.model
+
+    def forward(self, input_ids, attention_mask):
+        return self.model.encode_text(input_ids, attention_mask)
+
+class LabelEncoderWrapper(torch.nn.Module):
+    """Label tower of a bi-encoder, one label per row: (input_ids, attention_mask) -> label_embeddings [labels, hidden]."""
+    def __init__(self, model):
+        super().__init__()
+        self.model = model.model
+
+    def forward(self, input_ids, attention_mask):
+        labels_mask = torch.ones(1, input_ids.shape[0], dtype=attention_mask.dtype, device=attention_mask.device)
+        class_embeddings = self.model.encode_classes(input_ids.unsqueeze(0), attention_mask.unsqueeze(0), labels_mask)
+        return class_embeddings.squeeze(0)
+
+class ScorerWrapper(torch.nn.Module):
+    """Scorer of a bi-encoder: (text_embeddings [batch, hidden], label_embeddings [batch, labels, hidden]) -> logits."""
+    def __init__(self, model):
+        super().__init__()
+        self.model = model.model
+
+    def forward(self, text_embeddings, label_embeddings):
+        logits = self.model.scorer(text_embeddings, label_embeddings)
+        if getattr(self.model.config, "normalize_features", False):
+            logits = logits * self.model.logit_scale.to(label_embeddings.device)
+        return logits
+
+class PrecomputedEncoder(torch.nn.Module):
+    """Stands in for the encoder of a uni-encoder and returns hidden states computed beforehand."""
+    def __init__(self, hidden_states):
+        super().__init__()
+        self.hidden_states = hidden_states
+
+    def forward(self, *args, **kwargs):
+        return BaseModelOutput(last_hidden_state=self.hidden_states)
+
+class PackedUniEncoderWrapper(torch.nn.Module):
+    """Uni-encoder over packed rows: several prompts share a row and only attend to themselves.
+
+    (input_ids, segment_ids, position_ids [rows, row_length], token_index, token_mask [segments, segment_length])
+    -> logits [segments, num_labels]. segment_ids is 1, 2, ... per prompt of a row and 0 for padding, the
+    block-diagonal attention mask is built from it. token_index holds the flat positions (row * row_length + column)
+    of the tokens of every prompt, which are gathered back into one row per prompt for the classification head.
+    """
+    def __init__(self, model):
+        super().__init__()
+        self.gliclass = model
+        self.model = model.model
+        self.encoder = model.model.encoder_model
+
+    def forward(self, input_ids, segment_ids, position_ids, token_index, token_mask):
+        same_segment = segment_ids.unsqueeze(2) == segment_ids.unsqueeze(1)
+        attention_mask = (same_segment & (segment_ids.unsqueeze(2) > 0)).to(token_mask.dtype)
+        hidden_states = self.encoder(input_ids=input_ids, attention_mask=attention_mask,
+                                     position_ids=position_ids)[0]
+
+        hidden_size = hidden_states.shape[-1]
+        segment_states = hidden_states.reshape(-1, hidden_size)[token_index]
+        segment_states = segment_states * token_mask.unsqueeze(-1).to(segment_states.dtype)
+        segment_input_ids = input_ids.reshape(-1)[token_index] * token_mask
+
+        # The head of the model runs unchanged on the per-prompt hidden states
+        self.model.encoder_model = PrecomputedEncoder(segment_states)
+        try:
+            logits = self.gliclass(input_ids=segment_input_ids, attention_mask=token_mask).logits
+        finally:
+            self.model.encoder_model = self.encoder
+        return logits
+
+def export_packed_uni_encoder(gliclass_model, tokenized_inputs, save_path) -> str:
+    """Exports the uni-encoder for packed rows (model-packed.onnx) and returns its path."""
+    if not hasattr(gliclass_model.model, "encoder_model"):
+        raise NotImplementedError("Packed export needs a uni-encoder with an encoder_model")
+    # Two copies of the example prompt in one row, so the traced graph sees more than one segment
+    prompt_ids = tokenized_inputs["input_ids"][:1]
+    prompt_length = prompt_ids.shape[1]
+    input_ids = torch.cat([prompt_ids, prompt_ids], dim=1)
+    segment_ids = torch.cat([torch.full_like(prompt_ids, 1), torch.full_like(prompt_ids, 2)], dim=1)
+    positions = torch.arange(prompt_length, dtype=prompt_ids.dtype).unsqueeze(0)
+    position_ids = torch.cat([positions, positions], dim=1)
+    token_index = torch.arange(2 * prompt_length, dtype=prompt_ids.dtype).reshape(2, prompt_length)
+    token_mask = torch.ones_like(token_index)
+
+    path = os.path.join(save_path, "model-packed.onnx")
+    torch.onnx.export(
+        PackedUniEncoderWrapper(gliclass_model).eval(),
+        (input_ids, segment_ids, position_ids, token_index, token_mask),
+        path,
+        input_names=["input_ids", "segment_ids", "position_ids", "token_index", "token_mask"],
+        output_names=["logits"],
+        dynamic_axes={
+            "input_ids": {0: "rows", 1: "row_length"},
+            "segment_ids": {0: "rows", 1: "row_length"},
+            "position_ids": {0: "rows", 1: "row_length"},
+            "token_index": {0: "segments", 1: "segment_length"},
+            "token_mask": {0: "segments", 1: "segment_length"},
+            "logits": {0: "segments", 1: "num_labels"}
+        },
+        opset_version=14
+    )
+    return path
+
+def export_bi_encoder(gliclass_model, tokenizer, labels_tokenizer, text, labels, save_path) -> list:
+    """Exports the text encoder, label encoder and scorer of a bi-encoder and returns the exported model paths."""
+    text_inputs = tokenizer([text], return_tensors="pt")
+    label_inputs = labels_tokenizer(labels, padding=True, return_tensors="pt")
+    text_encoder, label_encoder, scorer = (TextEncoderWrapper(gliclass_model).eval(),
+                                           LabelEncoderWrapper(gliclass_model).eval(),
+                                           ScorerWrapper(gliclass_model).eval())
+    with torch.no_grad():
+        text_embeddings = text_encoder(text_inputs["input_ids"], text_inputs["attention_mask"])
+        label_embeddings = label_encoder(label_inputs["input_ids"], label_inputs["attention_mask"]).unsqueeze(0)
+
+    exports = [
+        ("text_encoder.onnx", text_encoder, (text_inputs["input_ids"], text_inputs["attention_mask"]),
+         ["input_ids", "attention_mask"], "text_embeddings",
+         {"input_ids": {0: "batch_size", 1: "sequence_length"},
+          "attention_mask": {0: "batch_size", 1: "sequence_length"},
+          "text_embeddings": {0: "batch_size"}}),
+        ("label_encoder.onnx", label_encoder, (label_inputs["input_ids"], label_inputs["attention_mask"]),
+         ["input_ids", "attention_mask"], "label_embeddings",
+         {"input_ids": {0: "num_labels", 1: "sequence_length"},
+          "attention_mask": {0: "num_labels", 1: "sequence_length"},
+          "label_embeddings": {0: "num_labels"}}),
+        ("scorer.onnx", scorer, (text_embeddings, label_embeddings),
+         ["text_embeddings", "label_embeddings"], "logits",
+         {"text_embeddings": {0: "batch_size"},
+          "label_embeddings": {0: "batch_size", 1: "num_labels"},
+          "logits": {0: "batch_size", 1: "num_labels"}}),
+    ]
+    paths = []
+    for file_name, module, inputs, input_names, output_name, dynamic_axes in exports:
+        path = os.path.join(save_path, file_name)
+        torch.onnx.export(module, inputs, path, input_names=input_names, output_names=[output_name],
+                          dynamic_axes=dynamic_axes, opset_version=14)
+        paths.append(path)
+
+    # The C engine reads the label tokenizer next to the models (tokenizer.json is used if it is missing)
+    if labels_tokenizer is not tokenizer:
+        labels_tokenizer.backend_tokenizer.save(os.path.join(save_path, "label_tokenizer.json"))
+    return paths
+
 def create_config(original_model_name, architecture_type, prompt_first, original_logits, save_path) -> None:
     data = {
         "original_model_name" : original_model_name,
@@ -33,6 +181,8 @@ if __name__ == "__main__":
     parser.add_argument('--save_path', type=str, default = 'onnx/')
     parser.add_argument('--quantize', type=bool, default = True)
     parser.add_argument('--classification_type', type=str, default = "multi-label")
+    parser.add_argument('--packed', action='store_true',
+                        help="Also export model-packed.onnx, which runs several prompts per row (uni-encoder only)")
 
     args = parser.parse_args()
     
@@ -48,8 +198,10 @@ if __name__ == "__main__":
     gliclass_model = GLiClassModel.from_pretrained(args.model_path)
     architecture_type = gliclass_model.config.architecture_type
     prompt_first = gliclass_model.config.prompt_first
-    if architecture_type != 'uni-encoder':
+    if architecture_type not in ['uni-encoder', 'bi-encoder']:
         raise NotImplementedError("This artchitecture is not implemented for ONNX yet")
+    if args.packed and architecture_type != 'uni-encoder':
+        raise NotImplementedError("Packed rows are only supported for uni-encoders")
     
     tokenizer = AutoTokenizer.from_pretrained(args.model_path)
     pipeline = ZeroShotClassificationPipeline(gliclass_model, tokenizer, classification_type=args.classification_type, device=device)
@@ -59,34 +211,44 @@ if __name__ == "__main__":
 
     tokenized_inputs = pipeline.pipe.prepare_inputs(text, labels)
 
-    all_inputs = (tokenized_inputs['input_ids'], tokenized_inputs['attention_mask'])
-    input_names = ['input_ids', 'attention_mask']
-    dynamic_axes={
-            "input_ids": {0: "batch_size", 1: "sequence_length"},
-            "attention_mask": {0: "batch_size", 1: "sequence_length"},
-            "logits": {0: "position", 1: "batch_size"}
-        }
-
     print("Converting...")
-    torch.onnx.export(
-        gliclass_model,             # Model
-        all_inputs,                 # Inputs for exprt
-        onnx_save_path,             # output file name
-        input_names=input_names,    # Output data name
-        output_names=["logits"],    # output logits names
-        dynamic_axes=dynamic_axes,  # Dynamic Axes
-        opset_version=14
-    )
+    if architecture_type == 'bi-encoder':
+        # Bi-encoders with a separate label model have their own label tokenizer
+        label_model_name = getattr(gliclass_model.config, "label_model_name", None)
+        labels_tokenizer = AutoTokenizer.from_pretrained(label_model_name) if label_model_name else tokenizer
+        exported_paths = export_bi_encoder(gliclass_model, tokenizer, labels_tokenizer, text, labels, args.save_path)
+    else:
+        all_inputs = (tokenized_inputs['input_ids'], tokenized_inputs['attention_mask'])
+        input_names = ['input_ids', 'attention_mask']
+        dynamic_axes={
+                "input_ids": {0: "batch_size", 1: "sequence_length"},
+                "attention_mask": {0: "batch_size", 1: "sequence_length"},
+                "logits": {0: "position", 1: "batch_size"}
+            }
+
+        torch.onnx.export(
+            gliclass_model,             # Model
+            all_inputs,                 # Inputs for exprt
+            onnx_save_path,             # output file name
+            input_names=input_names,    # Output data name
+            output_names=["logits"],    # output logits names
+            dynamic_axes=dynamic_axes,  # Dynamic Axes
+            opset_version=14
+        )
+        exported_paths = [onnx_save_path]
+        if args.packed:
+            exported_paths.append(export_packed_uni_encoder(gliclass_model, tokenized_inputs, args.save_path))
 
     if args.quantize:
-        quantized_save_path = os.path.join(args.save_path, "model-int8-quantized.onnx")
-        # Quantize the ONNX model
+        # Quantize the ONNX models
         print("Quantizing the model...")
-        quantize_dynamic(
-            onnx_save_path,  # Input model
-            quantized_save_path,  # Output model
-            weight_type = QuantType.QUInt8  # Quantize weights to 8-bit integers
-        )
+        for exported_path in exported_paths:
+            quantized_save_path = os.path.splitext(exported_path)[0] + "-int8-quantized.onnx"
+            quantize_dynamic(
+                exported_path,  # Input model
+                quantized_save_path,  # Output model
+                weight_type = QuantType.QUInt8  # Quantize weights to 8-bit integers
+            )
     print("Creating configuration file...")
     config_path = args.save_path + "config.json"
     create_config(
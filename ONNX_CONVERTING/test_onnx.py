@@ -1,7 +1,7 @@
 import onnxruntime, argparse, json
 import torch, os
 import numpy as np
-from transformers import AutoTokenizer
+from transformers import AutoTokenizer, PreTrainedTokenizerFast
 from gliclass import GLiClassModel, ZeroShotClassificationPipeline
 from typing import Tuple, List
 
@@ -22,6 +22,21 @@ def prepare_onnx_inputs(pipeline, text, labels):
         ort_session.get_inputs()[1].name: np.array(inputs["attention_mask"])
     }
 
+def run_bi_encoder(onnx_path, suffix, tokenizer, labels_tokenizer, text, labels) -> torch.Tensor:
+    text_encoder = onnxruntime.InferenceSession(onnx_path + "text_encoder" + suffix)
+    label_encoder = onnxruntime.InferenceSession(onnx_path + "label_encoder" + suffix)
+    scorer = onnxruntime.InferenceSession(onnx_path + "scorer" + suffix)
+
+    text_inputs = tokenizer([text], return_tensors="np")
+    label_inputs = labels_tokenizer(labels, padding=True, return_tensors="np")
+    text_embeddings = text_encoder.run(None, {"input_ids": text_inputs["input_ids"].astype(np.int64),
+                                              "attention_mask": text_inputs["attention_mask"].astype(np.int64)})[0]
+    label_embeddings = label_encoder.run(None, {"input_ids": label_inputs["input_ids"].astype(np.int64),
+                                                "attention_mask": label_inputs["attention_mask"].astype(np.int64)})[0]
+    logits = scorer.run(None, {"text_embeddings": text_embeddings,
+                               "label_embeddings": label_embeddings[np.newaxis]})[0]
+    return torch.tensor(logits)
+
 def run_inference_and_compare(ort_session, onnx_inputs, original_logits) -> bool:
     onnx_outputs = ort_session.run(None, onnx_inputs)
     onnx_tensor = torch.tensor(onnx_outputs[0])
@@ -45,6 +60,20 @@ if __name__ == "__main__":
     original_model_name, architecture_type, original_logits = load_config(args.onnx_path + "config.json")
     original_logits = torch.Tensor(original_logits)
 
+    if architecture_type == "bi-encoder":
+        tokenizer = AutoTokenizer.from_pretrained(original_model_name)
+        label_tokenizer_path = args.onnx_path + "label_tokenizer.json"
+        labels_tokenizer = PreTrainedTokenizerFast(tokenizer_file=label_tokenizer_path) if os.path.exists(label_tokenizer_path) else tokenizer
+        text = "ONNX is an open-source format designed to enable the interoperability of AI models across various frameworks and tools."
+        labels = ['format', 'model', 'tool', 'cat']
+        suffix = "-int8-quantized.onnx" if args.test_quantized else ".onnx"
+        onnx_tensor = run_bi_encoder(args.onnx_path, suffix, tokenizer, labels_tokenizer, text, labels)
+        print(f"ONNX Outputs: {onnx_tensor}")
+        comparison_result = torch.allclose(original_logits, onnx_tensor, atol=1e-3)
+        print(f"Comparison result: {comparison_result}")
+        assert comparison_result, "The comparison failed. Logits are different"
+        exit(0)
+
     if args.test_quantized:
         onnx_model = next((file for file in files if "quantized.onnx" in file), None)
     else:
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#include "benchmark.h"
+#include "model.h"
+#include "tokenizer.h"
+#include "parallel_processor.h"
+#include "memory_tracker.h"
+#include "read_data.h"
+#include "configs.h"
+#include "paths.h"
+
+#define DEFAULT_ALLOCATION_PASSES 5
+
+/**
+ * Runs every batch of the corpus once and releases its logits.
+ *
+ * @return 0 if all batches ran, 1 otherwise.
+ */
+static int run_pass(OrtSession* session, TokenizerHandle tokenizer, bool prompt_first, const ClassificationRequest* corpus) {
+    size_t num_batches = (corpus->num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+    int failed = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(|:failed)
+    for (size_t b = 0; b < num_batches; ++b) {
+        size_t start = b * BATCH_SIZE;
+        size_t count = corpus->num_texts - start < BATCH_SIZE ? corpus->num_texts - start : BATCH_SIZE;
+        OrtValue* output = run_request_batch(session, tokenizer, prompt_first, corpus, start, count);
+        if (output == NULL) {
+            failed |= 1;
+        } else {
+            g_ort->ReleaseValue(output);
+        }
+    }
+    return failed;
+}
+
+/**
+ * Allocation benchmark: classifies a corpus several times with memory tracking enabled and reports the
+ * bytes allocated per stage, the peak live bytes per stage and batch shape and the RSS after every pass.
+ * The run fails if a batch left buffers alive after it finished, or if prompts, tokens or tensors are
+ * still alive after a pass. A RSS that keeps growing after the first pass points to untracked leaks.
+ *
+ * Usage: allocations /path/to/data.json [passes] [prompt_first] [model]
+ *
+ * @return 0 if all passes ran and no buffer outlived its batch, 1 otherwise.
+ */
+int run_allocation_benchmark(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: allocations /path/to/data.json [passes] [prompt_first] [model]\n");
+        return 1;
+    }
+    int num_passes = argc > 2 ? atoi(argv[2]) : DEFAULT_ALLOCATION_PASSES;
+    bool prompt_first = argc > 3 ? string_to_bool(argv[3]) : false;
+    const char* model_path = argc > 4 ? argv[4] : MODEL_PATH;
+    if (num_passes <= 0) {
+        fprintf(stderr, "Error: passes must be positive\n");
+        return 1;
+    }
+
+    enable_memory_tracking();
+    ClassificationRequest corpus;
+    if (load_corpus(argv[1], &corpus) != 0) {
+        return 1;
+    }
+    TokenizerHandle tokenizer = create_tokenizer(TOKENIZER_PATH);
+    initialize_ort_api();
+    OrtEnv* env = tokenizer ? initialize_ort_environment() : NULL;
+    OrtSession* session = env ? create_ort_session(env, model_path, NUM_THREADS) : NULL;
+    int exit_code = 0;
+    if (!session) {
+        fprintf(stderr, "Error: Failed to set up the allocation benchmark\n");
+        exit_code = 1;
+    }
+
+    printf("%-6s %10s %12s %14s %14s\n", "pass", "time(s)", "RSS(MiB)", "batch live(B)", "leaked batches");
+    for (int pass = 0; pass < num_passes && exit_code == 0; ++pass) {
+        double start_time = omp_get_wtime();
+        if (run_pass(session, tokenizer, prompt_first, &corpus) != 0) {
+            fprintf(stderr, "Error: Some batches of pass %d failed\n", pass);
+            exit_code = 1;
+        }
+        MemorySnapshot snapshot;
+        get_memory_snapshot(&snapshot);
+        int64_t batch_live = snapshot.stages[MEMORY_PROMPTS].live + snapshot.stages[MEMORY_TOKENS].live +
+                             snapshot.stages[MEMORY_TENSORS].live;
+        printf("%-6d %10.3f %12.1f %14lld %14zu\n", pass, omp_get_wtime() - start_time, snapshot.rss_kb / 1024.0,
+               (long long)batch_live, snapshot.leaked_batches);
+        if (batch_live != 0 || snapshot.leaked_batches > 0) {
+            fprintf(stderr, "Error: Leak check failed, buffers outlived their batch in pass %d\n", pass);
+            exit_code = 1;
+        }
+    }
+    print_memory_stats(stdout);
+
+    release_ort_session(session);
+    if (env) g_ort->ReleaseEnv(env);
+    if (tokenizer) tokenizers_free(tokenizer);
+    free_request(&corpus);
+    return exit_code;
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "benchmark.h"
+#include "model.h"
+#include "tokenizer.h"
+#include "parallel_processor.h"
+#include "configs.h"
+#include "paths.h"
+#include "model_cache.h"
+
+#define DEFAULT_MEMORY_WORKERS 4
+
+/**
+ * Body of one worker process: loads the model, runs the first batch of the corpus so all weights are
+ * touched, reports its memory usage and keeps the session alive until the parent releases it.
+ *
+ * @return The exit code of the worker.
+ */
+static int memory_worker(const char* model_path, bool use_mmap, const ClassificationRequest* corpus,
+                         int result_fd, int release_fd) {
+    ProcessMemory memory;
+    memset(&memory, 0, sizeof(memory));
+    int exit_code = 1;
+
+    initialize_ort_api();
+    OrtEnv* env = initialize_ort_environment();
+    TokenizerHandle tokenizer = create_tokenizer(TOKENIZER_PATH);
+    SessionConfig config = { NUM_THREADS, use_mmap, NULL, NULL };
+    OrtSession* session = (env && tokenizer) ? create_ort_session_with_config(env, model_path, &config) : NULL;
+    if (session) {
+        size_t batch_size = corpus->num_texts < BATCH_SIZE ? corpus->num_texts : BATCH_SIZE;
+        OrtValue* input_ids = NULL;
+        OrtValue* attention_mask = NULL;
+        if (preprocess_batch((const char**)corpus->texts, (const char***)corpus->labels, corpus->num_labels, batch_size,
+                             corpus->same_labels, false, tokenizer, &input_ids, &attention_mask) == 0) {
+            OrtValue* output = run_inference(session, input_ids, attention_mask);
+            if (output) {
+                g_ort->ReleaseValue(output);
+                exit_code = read_process_memory(&memory);
+            }
+            g_ort->ReleaseValue(input_ids);
+            g_ort->ReleaseValue(attention_mask);
+        }
+    }
+
+    // Report (zeros on failure) and wait until every worker is resident
+    if (write(result_fd, &memory, sizeof(memory)) != (ssize_t)sizeof(memory)) {
+        exit_code = 1;
+    }
+    char release;
+    while (read(release_fd, &release, 1) > 0) {
+    }
+
+    release_ort_session(session);
+    if (tokenizer) tokenizers_free(tokenizer);
+    if (env) g_ort->ReleaseEnv(env);
+    return exit_code;
+}
+
+/**
+ * Starts num_workers co-located worker processes with the same loading mode and sums their memory usage.
+ *
+ * @return 0 if all workers reported their memory, 1 otherwise.
+ */
+static int measure_workers(const char* model_path, bool use_mmap, const ClassificationRequest* corpus,
+                           int num_workers, ProcessMemory* total) {
+    memset(total, 0, sizeof(*total));
+    int result_pipe[2], release_pipe[2];
+    if (pipe(result_pipe) != 0 || pipe(release_pipe) != 0) {
+        fprintf(stderr, "Error: Failed to create pipes for workers\n");
+        return 1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t* pids = (pid_t*)calloc(num_workers, sizeof(pid_t));
+    if (!pids) {
+        fprintf(stderr, "Error: Memory allocation for worker ids failed\n");
+        return 1;
+    }
+    int started = 0;
+    for (int i = 0; i < num_workers; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(result_pipe[0]);
+            close(release_pipe[1]);
+            _exit(memory_worker(model_path, use_mmap, corpus, result_pipe[1], release_pipe[0]));
+        }
+        if (pid < 0) {
+            fprintf(stderr, "Error: Failed to start worker %d\n", i);
+            break;
+        }
+        pids[started++] = pid;
+    }
+    close(result_pipe[1]);
+    close(release_pipe[0]);
+
+    int result = started == num_workers ? 0 : 1;
+    for (int i = 0; i < started; ++i) {
+        ProcessMemory memory;
+        if (read(result_pipe[0], &memory, sizeof(memory)) != (ssize_t)sizeof(memory) || memory.rss_kb == 0) {
+            result = 1;
+            continue;
+        }
+        total->rss_kb += memory.rss_kb;
+        total->pss_kb += memory.pss_kb;
+        total->shared_kb += memory.shared_kb;
+        total->private_kb += memory.private_kb;
+    }
+
+    // All workers are resident at this point, let them exit
+    close(release_pipe[1]);
+    for (int i = 0; i < started; ++i) {
+        int status = 0;
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            result = 1;
+        }
+    }
+    close(result_pipe[0]);
+    free(pids);
+    return result;
+}
+
+static void print_memory_row(const char* mode, const ProcessMemory* total, int num_workers) {
+    printf("%-8s %14.1f %14.1f %14.1f %14.1f %16.1f\n", mode,
+           total->rss_kb / 1024.0, total->pss_kb / 1024.0, total->shared_kb / 1024.0,
+           total->private_kb / 1024.0, total->pss_kb / 1024.0 / num_workers);
+}
+
+/**
+ * Memory benchmark for co-located workers: compares regular model loading (private copy per process)
+ * with loading from a shared read-only memory mapping. The summed PSS is the physical memory used by
+ * all workers together, so the difference between the two modes is the saving of the page cache sharing.
+ *
+ * Usage: memory /path/to/data.json [num_workers] [model]
+ *
+ * @return 0 if both modes were measured, 1 otherwise.
+ */
+int run_memory_benchmark(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: memory /path/to/data.json [num_workers] [model]\n");
+        return 1;
+    }
+    int num_workers = argc > 2 ? atoi(argv[2]) : DEFAULT_MEMORY_WORKERS;
+    const char* model_path = argc > 3 ? argv[3] : MODEL_PATH;
+    if (num_workers <= 0) {
+        fprintf(stderr, "Error: num_workers must be positive\n");
+        return 1;
+    }
+
+    ClassificationRequest corpus;
+    if (load_corpus(argv[1], &corpus) != 0) {
+        return 1;
+    }
+
+    ProcessMemory file_total, mmap_total;
+    printf("Measuring %d workers with regular loading of %s\n", num_workers, model_path);
+    int file_result = measure_workers(model_path, false, &corpus, num_workers, &file_total);
+    printf("Measuring %d workers with memory-mapped loading of %s\n", num_workers, model_path);
+    int mmap_result = measure_workers(model_path, true, &corpus, num_workers, &mmap_total);
+
+    printf("\n%-8s %14s %14s %14s %14s %16s\n", "loading", "RSS(MiB)", "PSS(MiB)", "shared(MiB)", "private(MiB)", "PSS/worker(MiB)");
+    if (file_result == 0) print_memory_row("file", &file_total, num_workers);
+    if (mmap_result == 0) print_memory_row("mmap", &mmap_total, num_workers);
+    if (file_result == 0 && mmap_result == 0 && file_total.pss_kb > 0) {
+        printf("\nPhysical memory saved by mmap: %.1f MiB (%.1f%%)\n",
+               (file_total.pss_kb - mmap_total.pss_kb) / 1024.0,
+               100.0 * (file_total.pss_kb - mmap_total.pss_kb) / file_total.pss_kb);
+    }
+    if (!is_ort_format_model(model_path)) {
+        printf("NOTE: weights of ONNX models without external data are copied while parsing; "
+               "use the cached .ort model (%s) to share them\n", MODEL_CACHE_DIR);
+    }
+
+    free_request(&corpus);
+    return (file_result == 0 && mmap_result == 0) ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#include "benchmark.h"
+#include "model.h"
+#include "tokenizer.h"
+#include "postprocessor.h"
+#include "parallel_processor.h"
+#include "label_prefilter.h"
+#include "read_data.h"
+#include "configs.h"
+#include "paths.h"
+
+#define DEFAULT_PREFILTER_SIZES "5,10,20,50"
+#define MAX_PREFILTER_SIZES 16
+
+/**
+ * Classifies every text of a corpus and records which of its labels are predicted
+ * (above THRESHOLD for multi-label, the best label for single-label).
+ *
+ * @param decisions Output array of num_texts arrays with one flag per label of the text.
+ * @param time Output time of the classification in seconds.
+ * @return 0 if successful, 1 if memory could not be allocated or a batch failed.
+ */
+static int classify_decisions(OrtSession* session, TokenizerHandle tokenizer, bool prompt_first,
+                              const ClassificationRequest* corpus, bool** decisions, double* time) {
+    for (size_t i = 0; i < corpus->num_texts; ++i) {
+        decisions[i] = (bool*)calloc(corpus->num_labels[i] ? corpus->num_labels[i] : 1, sizeof(bool));
+        if (!decisions[i]) {
+            fprintf(stderr, "Error: Memory allocation for benchmark decisions failed\n");
+            return 1;
+        }
+    }
+    bool single_label = strcmp(corpus->classification_type, "single-label") == 0;
+    size_t num_batches = (corpus->num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+    int failed = 0;
+    double start_time = omp_get_wtime();
+    #pragma omp parallel for schedule(dynamic) reduction(|:failed)
+    for (size_t b = 0; b < num_batches; ++b) {
+        size_t start = b * BATCH_SIZE;
+        size_t count = corpus->num_texts - start < BATCH_SIZE ? corpus->num_texts - start : BATCH_SIZE;
+        OrtValue* output = run_request_batch(session, tokenizer, prompt_first, corpus, start, count);
+        float* logits = NULL;
+        int64_t rows = 0, cols = 0;
+        if (output == NULL || get_output_logits(output, g_ort, &logits, &rows, &cols) != 0 || (size_t)rows != count) {
+            failed |= 1;
+        } else {
+            for (size_t i = 0; i < count; ++i) {
+                size_t text = start + i;
+                size_t num_classes = corpus->num_labels[text] < (size_t)cols ? corpus->num_labels[text] : (size_t)cols;
+                size_t best = 0;
+                for (size_t j = 0; j < num_classes; ++j) {
+                    float score = logits[i * cols + j];
+                    if (score > logits[i * cols + best]) best = j;
+                    if (!single_label && sigmoid(score) > THRESHOLD) decisions[text][j] = true;
+                }
+                if (single_label && num_classes > 0) decisions[text][best] = true;
+            }
+        }
+        if (output) g_ort->ReleaseValue(output);
+    }
+    *time = omp_get_wtime() - start_time;
+    if (failed) {
+        fprintf(stderr, "Error: Some batches of the prefilter benchmark failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void free_decisions(bool** decisions, size_t num_texts) {
+    for (size_t i = 0; decisions && i < num_texts; ++i) {
+        free(decisions[i]);
+    }
+    free(decisions);
+}
+
+static size_t find_label(char** labels, size_t num_labels, const char* label) {
+    for (size_t j = 0; j < num_labels; ++j) {
+        if (strcmp(labels[j], label) == 0) return j;
+    }
+    return num_labels;
+}
+
+/**
+ * Benchmark of the label prefilter: classifies a corpus with per-text labels once with all labels
+ * (the reference) and once per prefilter size N with only the N best labels of every text.
+ * Reports the labels left per text, the prefilter time, texts per second, the share of reference
+ * predictions whose label survives the prefilter (label recall), the share the model still predicts
+ * (decision recall) and the predictions the reference does not make.
+ *
+ * Usage: prefilter /path/to/data.json [N,N,...] [prompt_first] [model]
+ *
+ * @return 0 if all runs succeeded, 1 otherwise.
+ */
+int run_prefilter_benchmark(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: prefilter /path/to/data.json [N,N,...] [prompt_first] [model]\n");
+        return 1;
+    }
+    const char* size_list = argc > 2 ? argv[2] : DEFAULT_PREFILTER_SIZES;
+    bool prompt_first = argc > 3 ? string_to_bool(argv[3]) : false;
+    const char* model_path = argc > 4 ? argv[4] : MODEL_PATH;
+
+    size_t sizes[MAX_PREFILTER_SIZES];
+    size_t num_sizes = 0;
+    for (const char* p = size_list; *p && num_sizes < MAX_PREFILTER_SIZES; ) {
+        char* end = NULL;
+        long value = strtol(p, &end, 10);
+        if (end == p || value <= 0) {
+            fprintf(stderr, "Error: Invalid prefilter size list %s\n", size_list);
+            return 1;
+        }
+        sizes[num_sizes++] = (size_t)value;
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    ClassificationRequest corpus;
+    if (load_corpus(argv[1], &corpus) != 0) {
+        return 1;
+    }
+    if (corpus.same_labels || corpus.taxonomy) {
+        fprintf(stderr, "Error: The prefilter benchmark needs a corpus with per-text labels\n");
+        free_request(&corpus);
+        return 1;
+    }
+
+    TokenizerHandle tokenizer = create_tokenizer(TOKENIZER_PATH);
+    initialize_ort_api();
+    OrtEnv* env = tokenizer ? initialize_ort_environment() : NULL;
+    OrtSession* session = env ? create_ort_session(env, model_path, NUM_THREADS) : NULL;
+    bool** reference = (bool**)calloc(corpus.num_texts, sizeof(bool*));
+    int exit_code = 0;
+    double reference_time = 0.0;
+    size_t total_labels = 0, reference_positives = 0;
+    if (!session || !reference) {
+        fprintf(stderr, "Error: Failed to set up the prefilter benchmark\n");
+        exit_code = 1;
+        goto cleanup;
+    }
+    if (classify_decisions(session, tokenizer, prompt_first, &corpus, reference, &reference_time) != 0) {
+        exit_code = 1;
+        goto cleanup;
+    }
+    for (size_t i = 0; i < corpus.num_texts; ++i) {
+        total_labels += corpus.num_labels[i];
+        for (size_t j = 0; j < corpus.num_labels[i]; ++j) {
+            reference_positives += reference[i][j];
+        }
+    }
+
+    printf("Prefiltering %zu texts, %zu reference predictions: %s\n\n", corpus.num_texts, reference_positives, model_path);
+    printf("%-8s %10s %14s %10s %12s %9s %12s %15s %7s\n", "top-N", "labels", "prefilter(ms)", "time(s)",
+           "texts/s", "speedup", "label rec.", "decision rec.", "extra");
+    printf("%-8s %10.1f %14s %10.3f %12.1f %8.2fx %11.1f%% %14.1f%% %7d\n", "all",
+           corpus.num_texts ? (double)total_labels / corpus.num_texts : 0.0, "-", reference_time,
+           reference_time > 0 ? corpus.num_texts / reference_time : 0.0, 1.0, 100.0, 100.0, 0);
+
+    for (size_t s = 0; s < num_sizes; ++s) {
+        // Every size starts from the full label sets
+        ClassificationRequest filtered;
+        if (load_corpus(argv[1], &filtered) != 0) {
+            exit_code = 1;
+            break;
+        }
+        PrefilterStats stats;
+        bool** decisions = (bool**)calloc(filtered.num_texts, sizeof(bool*));
+        double time = 0.0;
+        if (!decisions || prefilter_request_labels(&filtered, sizes[s], &stats) != 0 ||
+            classify_decisions(session, tokenizer, prompt_first, &filtered, decisions, &time) != 0) {
+            free_decisions(decisions, filtered.num_texts);
+            free_request(&filtered);
+            exit_code = 1;
+            break;
+        }
+
+        size_t kept = 0, recovered = 0, extra = 0, labels = 0;
+        for (size_t i = 0; i < corpus.num_texts; ++i) {
+            labels += filtered.num_labels[i];
+            for (size_t j = 0; j < corpus.num_labels[i]; ++j) {
+                if (!reference[i][j]) continue;
+                size_t k = find_label(filtered.labels[i], filtered.num_labels[i], corpus.labels[i][j]);
+                if (k < filtered.num_labels[i]) {
+                    kept++;
+                    recovered += decisions[i][k];
+                }
+            }
+            for (size_t k = 0; k < filtered.num_labels[i]; ++k) {
+                if (!decisions[i][k]) continue;
+                size_t j = find_label(corpus.labels[i], corpus.num_labels[i], filtered.labels[i][k]);
+                if (j == corpus.num_labels[i] || !reference[i][j]) extra++;
+            }
+        }
+        double label_recall = reference_positives ? 100.0 * kept / reference_positives : 100.0;
+        double decision_recall = reference_positives ? 100.0 * recovered / reference_positives : 100.0;
+        char size_name[32];
+        snprintf(size_name, sizeof(size_name), "%zu", sizes[s]);
+        printf("%-8s %10.1f %14.3f %10.3f %12.1f %8.2fx %11.1f%% %14.1f%% %7zu\n", size_name,
+               corpus.num_texts ? (double)labels / corpus.num_texts : 0.0, stats.time * 1000.0, time,
+               time > 0 ? corpus.num_texts / time : 0.0, time > 0 ? reference_time / time : 0.0,
+               label_recall, decision_recall, extra);
+
+        free_decisions(decisions, filtered.num_texts);
+        free_request(&filtered);
+    }
+
+cleanup:
+    free_decisions(reference, corpus.num_texts);
+    release_ort_session(session);
+    if (env) g_ort->ReleaseEnv(env);
+    if (tokenizer) tokenizers_free(tokenizer);
+    free_request(&corpus);
+    return exit_code;
+}
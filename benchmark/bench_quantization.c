@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include "cJSON.h"
+
+#include "benchmark.h"
+#include "model.h"
+#include "tokenizer.h"
+#include "postprocessor.h"
+#include "parallel_processor.h"
+#include "read_data.h"
+#include "configs.h"
+#include "paths.h"
+
+#define NUM_VARIANTS 2
+
+/**
+ * Structure to store the results of running one model variant over the corpus.
+ */
+typedef struct {
+    const char* name;           /**< Variant name (fp32 or int8). */
+    const char* model_path;     /**< Path to the ONNX model. */
+    double session_time;        /**< Session creation time in seconds. */
+    float reference_diff;       /**< Max absolute difference against original_logits, negative if not checked. */
+    double* latencies;          /**< Run latency of each batch in seconds. */
+    double total_time;          /**< Total inference time over the corpus in seconds. */
+    float** logits;             /**< Copy of the logits of each batch. */
+    int64_t* num_classes;       /**< Number of logits per text in each batch. */
+    bool ok;                    /**< Whether the variant was loaded and ran over the whole corpus. */
+} VariantResult;
+
+/**
+ * Reads original_logits and prompt_first from the model configuration file written by convert_to_onnx.py.
+ *
+ * @param path The path to config.json.
+ * @param logits Pointer that will store the dynamically allocated reference logits (row-major).
+ * @param rows Pointer that will store the number of rows.
+ * @param cols Pointer that will store the number of columns.
+ * @param prompt_first Pointer that will store the prompt_first flag of the model.
+ * @return 0 if successful, or 1 if the file is missing or malformed.
+ */
+static int load_reference_logits(const char* path, float** logits, size_t* rows, size_t* cols, bool* prompt_first) {
+    char* json_string = read_file(path);
+    if (!json_string) {
+        return 1;
+    }
+    cJSON* json = cJSON_Parse(json_string);
+    free(json_string);
+    if (!json) {
+        fprintf(stderr, "Failed to parse JSON: %s\n", cJSON_GetErrorPtr());
+        return 1;
+    }
+
+    cJSON* prompt_first_json = cJSON_GetObjectItemCaseSensitive(json, "prompt_first");
+    *prompt_first = cJSON_IsBool(prompt_first_json) && cJSON_IsTrue(prompt_first_json);
+
+    cJSON* logits_json = cJSON_GetObjectItemCaseSensitive(json, "original_logits");
+    if (!cJSON_IsArray(logits_json) || cJSON_GetArraySize(logits_json) == 0 ||
+        !cJSON_IsArray(cJSON_GetArrayItem(logits_json, 0))) {
+        fprintf(stderr, "Error: original_logits are missing in %s\n", path);
+        cJSON_Delete(json);
+        return 1;
+    }
+    *rows = cJSON_GetArraySize(logits_json);
+    *cols = cJSON_GetArraySize(cJSON_GetArrayItem(logits_json, 0));
+    *logits = (float*)malloc(*rows * *cols * sizeof(float));
+    if (!*logits) {
+        fprintf(stderr, "Error: Memory allocation for reference logits failed\n");
+        cJSON_Delete(json);
+        return 1;
+    }
+    for (size_t i = 0; i < *rows; ++i) {
+        cJSON* row = cJSON_GetArrayItem(logits_json, i);
+        for (size_t j = 0; j < *cols; ++j) {
+            cJSON* value = cJSON_GetArrayItem(row, j);
+            (*logits)[i * *cols + j] = cJSON_IsNumber(value) ? (float)value->valuedouble : NAN;
+        }
+    }
+    cJSON_Delete(json);
+    return 0;
+}
+
+/**
+ * Runs the reference sample of convert_to_onnx.py through the session and compares the logits with original_logits.
+ *
+ * @return The max absolute difference, or -1 if the check could not be run.
+ */
+static float check_reference(OrtSession* session, TokenizerHandle tokenizer, bool prompt_first,
+                             const float* reference, size_t rows, size_t cols) {
+    // Same sample as in ONNX_CONVERTING/convert_to_onnx.py
+    const char* text = "ONNX is an open-source format designed to enable the interoperability of AI models across various frameworks and tools.";
+    const char* labels[] = { "format", "model", "tool", "cat" };
+    const char** reference_labels[] = { labels };
+    size_t num_labels[] = { 4 };
+
+    OrtValue* input_ids = NULL;
+    OrtValue* attention_mask = NULL;
+    if (preprocess_batch(&text, reference_labels, num_labels, 1, true, prompt_first, tokenizer,
+                         &input_ids, &attention_mask) != 0) {
+        return -1.0f;
+    }
+    OrtValue* output = run_inference(session, input_ids, attention_mask);
+    g_ort->ReleaseValue(input_ids);
+    g_ort->ReleaseValue(attention_mask);
+
+    float* logits = NULL;
+    int64_t out_rows = 0, out_cols = 0;
+    float max_diff = -1.0f;
+    if (output && get_output_logits(output, g_ort, &logits, &out_rows, &out_cols) == 0) {
+        if ((size_t)out_rows != rows || (size_t)out_cols != cols) {
+            fprintf(stderr, "Error: Reference logits shape [%zu, %zu] does not match model output [%lld, %lld]\n",
+                    rows, cols, (long long)out_rows, (long long)out_cols);
+        } else {
+            max_diff = 0.0f;
+            for (size_t i = 0; i < rows * cols; ++i) {
+                float diff = fabsf(logits[i] - reference[i]);
+                if (diff > max_diff) {
+                    max_diff = diff;
+                }
+            }
+        }
+    }
+    if (output) {
+        g_ort->ReleaseValue(output);
+    }
+    return max_diff;
+}
+
+/**
+ * Runs one model variant over all preprocessed batches and records latencies and logits.
+ */
+static void run_variant(OrtEnv* env, VariantResult* result, TokenizerHandle tokenizer, bool prompt_first,
+                        const float* reference, size_t ref_rows, size_t ref_cols,
+                        OrtValue** input_ids_tensors, OrtValue** attention_mask_tensors, size_t num_batches) {
+    result->ok = false;
+    result->reference_diff = -1.0f;
+    if (num_batches == 0 || !input_ids_tensors || !input_ids_tensors[0]) {
+        fprintf(stderr, "Error: The corpus has no batches to run %s on\n", result->model_path);
+        return;
+    }
+
+    double start_time = omp_get_wtime();
+    OrtSession* session = create_ort_session(env, result->model_path, NUM_THREADS);
+    result->session_time = omp_get_wtime() - start_time;
+    if (session == NULL) {
+        fprintf(stderr, "Error: Failed to create session for %s\n", result->model_path);
+        return;
+    }
+
+    if (reference) {
+        result->reference_diff = check_reference(session, tokenizer, prompt_first, reference, ref_rows, ref_cols);
+    }
+
+    // Warm up on the first batch so one-time allocations are not counted as latency
+    OrtValue* warmup = run_inference(session, input_ids_tensors[0], attention_mask_tensors[0]);
+    if (warmup) {
+        g_ort->ReleaseValue(warmup);
+    }
+
+    result->latencies = (double*)calloc(num_batches, sizeof(double));
+    result->logits = (float**)calloc(num_batches, sizeof(float*));
+    result->num_classes = (int64_t*)calloc(num_batches, sizeof(int64_t));
+    if (!result->latencies || !result->logits || !result->num_classes) {
+        fprintf(stderr, "Error: Memory allocation for benchmark results failed\n");
+        release_ort_session(session);
+        return;
+    }
+
+    bool all_ok = true;
+    double corpus_start = omp_get_wtime();
+    for (size_t i = 0; i < num_batches; ++i) {
+        double batch_start = omp_get_wtime();
+        OrtValue* output = run_inference(session, input_ids_tensors[i], attention_mask_tensors[i]);
+        result->latencies[i] = omp_get_wtime() - batch_start;
+
+        float* logits = NULL;
+        int64_t rows = 0, cols = 0;
+        if (output == NULL || get_output_logits(output, g_ort, &logits, &rows, &cols) != 0) {
+            all_ok = false;
+        } else {
+            result->num_classes[i] = cols;
+            result->logits[i] = (float*)malloc(rows * cols * sizeof(float));
+            if (result->logits[i]) {
+                memcpy(result->logits[i], logits, rows * cols * sizeof(float));
+            } else {
+                all_ok = false;
+            }
+        }
+        if (output) {
+            g_ort->ReleaseValue(output);
+        }
+    }
+    result->total_time = omp_get_wtime() - corpus_start;
+    result->ok = all_ok;
+
+    release_ort_session(session);
+}
+
+static void free_variant(VariantResult* result, size_t num_batches) {
+    for (size_t i = 0; result->logits && i < num_batches; ++i) {
+        free(result->logits[i]);
+    }
+    free(result->logits);
+    free(result->latencies);
+    free(result->num_classes);
+}
+
+/**
+ * Compares the logits and decisions of two variants over the corpus and prints the divergence.
+ */
+static void report_divergence(const VariantResult* base, const VariantResult* other, const ClassificationRequest* corpus,
+                              size_t num_batches) {
+    bool multi_label = strcmp(corpus->classification_type, "multi-label") == 0;
+    double max_logit_diff = 0.0, sum_logit_diff = 0.0, max_prob_diff = 0.0;
+    size_t num_values = 0, flipped_decisions = 0, changed_texts = 0;
+
+    for (size_t b = 0; b < num_batches; ++b) {
+        if (base->num_classes[b] != other->num_classes[b] || !base->logits[b] || !other->logits[b]) {
+            continue;
+        }
+        size_t batch_size = (b == num_batches - 1) ? corpus->num_texts - b * BATCH_SIZE : BATCH_SIZE;
+        size_t cols = (size_t)base->num_classes[b];
+        for (size_t i = 0; i < batch_size; ++i) {
+            const float* row_a = base->logits[b] + i * cols;
+            const float* row_b = other->logits[b] + i * cols;
+            size_t text_labels = corpus->num_labels[b * BATCH_SIZE + i];
+            if (text_labels > cols) {
+                text_labels = cols;
+            }
+            size_t argmax_a = 0, argmax_b = 0;
+            size_t text_flips = 0;
+            for (size_t j = 0; j < text_labels; ++j) {
+                double diff = fabs((double)row_a[j] - (double)row_b[j]);
+                float prob_a = sigmoid(row_a[j]);
+                float prob_b = sigmoid(row_b[j]);
+                double prob_diff = fabs((double)prob_a - (double)prob_b);
+                max_logit_diff = diff > max_logit_diff ? diff : max_logit_diff;
+                max_prob_diff = prob_diff > max_prob_diff ? prob_diff : max_prob_diff;
+                sum_logit_diff += diff;
+                num_values++;
+                if ((prob_a > THRESHOLD) != (prob_b > THRESHOLD)) {
+                    text_flips++;
+                }
+                if (row_a[j] > row_a[argmax_a]) argmax_a = j;
+                if (row_b[j] > row_b[argmax_b]) argmax_b = j;
+            }
+            if (multi_label) {
+                flipped_decisions += text_flips;
+                changed_texts += text_flips > 0;
+            } else if (argmax_a != argmax_b) {
+                flipped_decisions++;
+                changed_texts++;
+            }
+        }
+    }
+
+    printf("\nDivergence %s vs %s:\n", other->name, base->name);
+    printf("  logits: max |diff| %.6f, mean |diff| %.6f\n", max_logit_diff, num_values ? sum_logit_diff / num_values : 0.0);
+    printf("  scores: max |diff| %.6f\n", max_prob_diff);
+    if (multi_label) {
+        printf("  decisions flipped at threshold %.2f: %zu of %zu (%.3f%%)\n", THRESHOLD,
+               flipped_decisions, num_values, num_values ? 100.0 * flipped_decisions / num_values : 0.0);
+    } else {
+        printf("  top-1 label changed: %zu of %zu texts\n", flipped_decisions, corpus->num_texts);
+    }
+    printf("  texts with identical predictions: %.3f%%\n",
+           corpus->num_texts ? 100.0 * (corpus->num_texts - changed_texts) / corpus->num_texts : 0.0);
+}
+
+/**
+ * Accuracy-versus-latency harness for the fp32 and int8 quantized models.
+ * Both variants run over the same tokenized corpus, one batch at a time, and are checked against
+ * original_logits from MODEL_CONFIG_PATH.
+ *
+ * Usage: quantization /path/to/data.json [fp32_model] [int8_model]
+ *
+ * @return 0 if the fp32 model matches the reference logits and both variants ran, 1 otherwise.
+ */
+int run_quantization_benchmark(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: quantization /path/to/data.json [fp32_model] [int8_model]\n");
+        return 1;
+    }
+    VariantResult variants[NUM_VARIANTS];
+    memset(variants, 0, sizeof(variants));
+    variants[0].name = "fp32";
+    variants[0].model_path = argc > 2 ? argv[2] : MODEL_PATH;
+    variants[1].name = "int8";
+    variants[1].model_path = argc > 3 ? argv[3] : QUANTIZED_MODEL_PATH;
+
+    ClassificationRequest corpus;
+    if (load_corpus(argv[1], &corpus) != 0) {
+        return 1;
+    }
+
+    float* reference = NULL;
+    size_t ref_rows = 0, ref_cols = 0;
+    bool prompt_first = false;
+    if (load_reference_logits(MODEL_CONFIG_PATH, &reference, &ref_rows, &ref_cols, &prompt_first) != 0) {
+        fprintf(stderr, "Warning: Reference check is skipped, prompt_first defaults to false\n");
+        reference = NULL;
+    }
+
+    TokenizerHandle tokenizer = create_tokenizer(TOKENIZER_PATH);
+    if (!tokenizer) {
+        free(reference);
+        free_request(&corpus);
+        return 1;
+    }
+    initialize_ort_api();
+    OrtEnv* env = initialize_ort_environment();
+    if (env == NULL) {
+        tokenizers_free(tokenizer);
+        free(reference);
+        free_request(&corpus);
+        return 1;
+    }
+
+    // Tokenize the corpus once, both variants consume the same tensors
+    size_t num_batches = (corpus.num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+    OrtValue** input_ids_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    OrtValue** attention_mask_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    parallel_preprocess(corpus.texts, corpus.labels, corpus.num_labels, corpus.num_texts,
+                        corpus.same_labels, prompt_first, tokenizer, input_ids_tensors, attention_mask_tensors);
+
+    for (int v = 0; v < NUM_VARIANTS; ++v) {
+        printf("Running %s: %s\n", variants[v].name, variants[v].model_path);
+        run_variant(env, &variants[v], tokenizer, prompt_first, reference, ref_rows, ref_cols,
+                    input_ids_tensors, attention_mask_tensors, num_batches);
+    }
+
+    printf("\n%-6s %12s %14s %10s %14s %10s %10s %10s\n",
+           "model", "session(s)", "ref max|diff|", "ref check", "texts/s", "p50(ms)", "p95(ms)", "p99(ms)");
+    for (int v = 0; v < NUM_VARIANTS; ++v) {
+        VariantResult* r = &variants[v];
+        if (!r->ok) {
+            printf("%-6s failed to run over the corpus\n", r->name);
+            continue;
+        }
+        double throughput = r->total_time > 0 ? corpus.num_texts / r->total_time : 0.0;
+        double p50 = percentile(r->latencies, num_batches, 50.0) * 1000.0;
+        double p95 = percentile(r->latencies, num_batches, 95.0) * 1000.0;
+        double p99 = percentile(r->latencies, num_batches, 99.0) * 1000.0;
+        const char* check = r->reference_diff < 0 ? "skipped" : (r->reference_diff <= REFERENCE_TOLERANCE ? "pass" : "FAIL");
+        printf("%-6s %12.3f %14.6f %10s %14.2f %10.2f %10.2f %10.2f\n",
+               r->name, r->session_time, r->reference_diff, check, throughput, p50, p95, p99);
+    }
+
+    int exit_code = 0;
+    if (variants[0].ok && variants[1].ok) {
+        report_divergence(&variants[0], &variants[1], &corpus, num_batches);
+        printf("  speedup: %.2fx\n", variants[1].total_time > 0 ? variants[0].total_time / variants[1].total_time : 0.0);
+    } else {
+        exit_code = 1;
+    }
+    if (variants[0].reference_diff > REFERENCE_TOLERANCE) {
+        exit_code = 1;
+    }
+
+    for (int v = 0; v < NUM_VARIANTS; ++v) {
+        free_variant(&variants[v], num_batches);
+    }
+    for (size_t i = 0; i < num_batches; ++i) {
+        if (input_ids_tensors[i]) g_ort->ReleaseValue(input_ids_tensors[i]);
+        if (attention_mask_tensors[i]) g_ort->ReleaseValue(attention_mask_tensors[i]);
+    }
+    free(input_ids_tensors);
+    free(attention_mask_tensors);
+    free(reference);
+    tokenizers_free(tokenizer);
+    g_ort->ReleaseEnv(env);
+    free_request(&corpus);
+    return exit_code;
+}
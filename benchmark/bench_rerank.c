@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "benchmark.h"
+#include "model.h"
+#include "tokenizer.h"
+#include "postprocessor.h"
+#include "parallel_processor.h"
+#include "reranker.h"
+#include "read_data.h"
+#include "configs.h"
+#include "paths.h"
+
+#define DEFAULT_RERANK_REPEATS 3
+
+/**
+ * Scores every passage the way the classification path does: each row "<<LABEL>>query<<SEP>>passage"
+ * is prepared and tokenized as a whole.
+ *
+ * @param scores Output array of num_passages scores (NaN for passages of failed batches).
+ * @return 0 if successful, 1 if memory could not be allocated.
+ */
+static int score_rows(OrtSession* session, TokenizerHandle tokenizer, bool prompt_first,
+                      const RerankRequest* request, float* scores) {
+    size_t num_batches = (request->num_passages + BATCH_SIZE - 1) / BATCH_SIZE;
+    OrtValue** input_ids_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    OrtValue** attention_mask_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    OrtValue** output_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    if (!input_ids_tensors || !attention_mask_tensors || !output_tensors) {
+        fprintf(stderr, "Error: Memory allocation for batch tensors failed\n");
+        free(input_ids_tensors);
+        free(attention_mask_tensors);
+        free(output_tensors);
+        return 1;
+    }
+
+    char** labels[] = { (char**)&request->query };
+    size_t num_labels[] = { 1 };
+    parallel_preprocess(request->passages, labels, num_labels, request->num_passages, true, prompt_first,
+                        tokenizer, input_ids_tensors, attention_mask_tensors);
+    parallel_inference(session, input_ids_tensors, attention_mask_tensors, output_tensors, num_batches);
+
+    for (size_t i = 0; i < request->num_passages; ++i) {
+        scores[i] = NAN;
+    }
+    for (size_t b = 0; b < num_batches; ++b) {
+        float* logits = NULL;
+        int64_t rows = 0, cols = 0;
+        if (get_output_logits(output_tensors[b], g_ort, &logits, &rows, &cols) == 0 && cols > 0) {
+            for (size_t i = 0; i < (size_t)rows && b * BATCH_SIZE + i < request->num_passages; ++i) {
+                scores[b * BATCH_SIZE + i] = sigmoid(logits[i * cols]);
+            }
+        }
+        if (output_tensors[b]) g_ort->ReleaseValue(output_tensors[b]);
+        if (input_ids_tensors[b]) g_ort->ReleaseValue(input_ids_tensors[b]);
+        if (attention_mask_tensors[b]) g_ort->ReleaseValue(attention_mask_tensors[b]);
+    }
+    free(input_ids_tensors);
+    free(attention_mask_tensors);
+    free(output_tensors);
+    return 0;
+}
+
+/**
+ * Benchmark of the reranker: scores the passages of a rerank request with full rows tokenized per
+ * passage (the classification path), with the reranker (query tokenized once) and with the reranker
+ * stopping early. Reports passages per second of every variant and checks that the reranker returns
+ * the same passages and scores as the full rows.
+ *
+ * Usage: rerank /path/to/rerank.json [prompt_first] [model] [repeats]
+ *
+ * @return 0 if all variants ran and the reranker agrees with the full rows, 1 otherwise.
+ */
+int run_rerank_benchmark(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: rerank /path/to/rerank.json [prompt_first] [model] [repeats]\n");
+        return 1;
+    }
+    bool prompt_first = argc > 2 ? string_to_bool(argv[2]) : false;
+    const char* model_path = argc > 3 ? argv[3] : MODEL_PATH;
+    int repeats = argc > 4 ? atoi(argv[4]) : DEFAULT_RERANK_REPEATS;
+    if (repeats <= 0) {
+        repeats = DEFAULT_RERANK_REPEATS;
+    }
+
+    char* json_string = read_file(argv[1]);
+    if (!json_string) {
+        return 1;
+    }
+    RerankRequest request;
+    int parsed = parse_rerank_request(json_string, &request);
+    free(json_string);
+    if (parsed != 0) {
+        return 1;
+    }
+    RerankConfig config = { request.top_k ? request.top_k : RERANK_TOP_K, request.min_score, false };
+
+    TokenizerHandle tokenizer = create_tokenizer(TOKENIZER_PATH);
+    initialize_ort_api();
+    OrtEnv* env = tokenizer ? initialize_ort_environment() : NULL;
+    OrtSession* session = env ? create_ort_session(env, model_path, NUM_THREADS) : NULL;
+    float* scores = (float*)malloc(request.num_passages * sizeof(float));
+    RerankResult* full_results = (RerankResult*)malloc(config.top_k * sizeof(RerankResult));
+    RerankResult* results = (RerankResult*)malloc(config.top_k * sizeof(RerankResult));
+    int exit_code = 0;
+    if (!session || !scores || !full_results || !results) {
+        fprintf(stderr, "Error: Failed to set up the rerank benchmark\n");
+        exit_code = 1;
+        goto cleanup;
+    }
+
+    printf("Reranking %zu passages, top %zu, %d repeats: %s\n\n", request.num_passages, config.top_k, repeats, model_path);
+    printf("%-12s %12s %12s %14s\n", "variant", "scored", "time(s)", "passages/s");
+
+    // Full rows, tokenized per passage
+    double best_time = 0.0;
+    for (int r = 0; r < repeats; ++r) {
+        double start_time = omp_get_wtime();
+        if (score_rows(session, tokenizer, prompt_first, &request, scores) != 0) {
+            exit_code = 1;
+            goto cleanup;
+        }
+        double time = omp_get_wtime() - start_time;
+        if (r == 0 || time < best_time) best_time = time;
+    }
+    printf("%-12s %12zu %12.3f %14.1f\n", "full-rows", request.num_passages, best_time,
+           best_time > 0 ? request.num_passages / best_time : 0.0);
+
+    // Reranker, with and without early stopping
+    size_t num_full_results = 0;
+    for (int variant = 0; variant < 2; ++variant) {
+        config.early_stop = variant == 1;
+        RerankStats stats;
+        size_t num_results = 0;
+        best_time = 0.0;
+        for (int r = 0; r < repeats; ++r) {
+            if (rerank_passages(session, tokenizer, prompt_first, request.query, (const char* const*)request.passages,
+                                request.num_passages, &config, variant == 0 ? full_results : results,
+                                variant == 0 ? &num_full_results : &num_results, &stats) != 0) {
+                exit_code = 1;
+                goto cleanup;
+            }
+            if (r == 0 || stats.time < best_time) best_time = stats.time;
+        }
+        printf("%-12s %12zu %12.3f %14.1f\n", config.early_stop ? "early-stop" : "rerank", stats.num_scored,
+               best_time, best_time > 0 ? request.num_passages / best_time : 0.0);
+        if (stats.num_truncated > 0) {
+            printf("  %zu passages were truncated to fit next to the query\n", stats.num_truncated);
+        }
+    }
+
+    // The reranker must rank like the full rows
+    float max_diff = 0.0f;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < num_full_results; ++i) {
+        float diff = fabsf(full_results[i].score - scores[full_results[i].index]);
+        if (isnan(diff) || diff > max_diff) max_diff = isnan(diff) ? INFINITY : diff;
+    }
+    size_t expected = 0;
+    for (size_t i = 0; i < request.num_passages; ++i) {
+        if (scores[i] >= config.min_score) expected++;
+    }
+    if (expected > config.top_k) expected = config.top_k;
+    for (size_t i = 0; i < num_full_results; ++i) {
+        size_t better = 0; // Passages of the full rows scoring clearly above the returned one
+        for (size_t j = 0; j < request.num_passages; ++j) {
+            if (scores[j] > full_results[i].score + REFERENCE_TOLERANCE) better++;
+        }
+        if (better > i) mismatches++;
+    }
+    printf("\nRerank vs full rows: max |score diff| %.6f, %zu of %zu ranks mismatched (%zu expected results)\n",
+           max_diff, mismatches, num_full_results, expected);
+    if (max_diff > REFERENCE_TOLERANCE || mismatches > 0 || num_full_results != expected) {
+        exit_code = 1;
+    }
+
+cleanup:
+    free(scores);
+    free(full_results);
+    free(results);
+    release_ort_session(session);
+    if (env) g_ort->ReleaseEnv(env);
+    if (tokenizer) tokenizers_free(tokenizer);
+    free_rerank_request(&request);
+    return exit_code;
+}
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "benchmark.h"
+#include "read_data.h"
+
+/**
+ * Loads a benchmark corpus from a JSON file in the input format of the main program.
+ *
+ * @param path The path to the JSON file.
+ * @param corpus Pointer to the ClassificationRequest structure to fill.
+ * @return 0 if successful, or 1 if the file could not be read or parsed.
+ */
+int load_corpus(const char* path, ClassificationRequest* corpus) {
+    memset(corpus, 0, sizeof(*corpus));
+    char* json_string = read_file(path);
+    if (!json_string) {
+        return 1;
+    }
+    ClassificationRequest* requests = NULL;
+    size_t num_requests = 0;
+    int result = parse_requests(json_string, &requests, &num_requests);
+    free(json_string);
+    if (result != 0 || num_requests != 1) {
+        fprintf(stderr, "Error: Corpus %s must contain exactly one valid request\n", path);
+        for (size_t i = 0; i < num_requests; ++i) {
+            free_request(&requests[i]);
+        }
+        free(requests);
+        return 1;
+    }
+    *corpus = requests[0];
+    free(requests);
+    return 0;
+}
+
+/**
+ * Reads the memory usage of the calling process.
+ *
+ * @param memory Pointer to the ProcessMemory structure to fill.
+ * @return 0 if successful, or 1 if /proc/self/smaps_rollup could not be read.
+ */
+int read_process_memory(ProcessMemory* memory) {
+    memset(memory, 0, sizeof(*memory));
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if (!file) {
+        fprintf(stderr, "Error: Failed to open /proc/self/smaps_rollup\n");
+        return 1;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        long value = 0;
+        if (sscanf(line, "Rss: %ld kB", &value) == 1) {
+            memory->rss_kb = value;
+        } else if (sscanf(line, "Pss: %ld kB", &value) == 1) {
+            memory->pss_kb = value;
+        } else if (sscanf(line, "Shared_Clean: %ld kB", &value) == 1 || sscanf(line, "Shared_Dirty: %ld kB", &value) == 1) {
+            memory->shared_kb += value;
+        } else if (sscanf(line, "Private_Clean: %ld kB", &value) == 1 || sscanf(line, "Private_Dirty: %ld kB", &value) == 1) {
+            memory->private_kb += value;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Computes a percentile of the values (nearest-rank method). The values are sorted in place.
+ *
+ * @param values Array of values.
+ * @param count Number of values.
+ * @param p Percentile in the range [0, 100].
+ * @return The percentile value, or 0 if there are no values.
+ */
+double percentile(double* values, size_t count, double p) {
+    if (count == 0) {
+        return 0.0;
+    }
+    qsort(values, count, sizeof(double), compare_doubles);
+    size_t rank = (size_t)(p / 100.0 * (double)count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    if (rank > count) {
+        rank = count;
+    }
+    return values[rank - 1];
+}
+
+static void print_benchmark_usage(const char* program) {
+    printf("Usage: %s <mode> [arguments]\n\n", program);
+    printf("Modes:\n");
+    printf("  quantization /path/to/data.json [fp32_model] [int8_model]\n");
+    printf("      Runs the fp32 and int8 models on the same corpus, reports throughput, latency,\n");
+    printf("      logit and decision divergence and checks both against original_logits in config.json\n");
+    printf("  memory /path/to/data.json [num_workers] [model]\n");
+    printf("      Runs co-located worker processes with regular and memory-mapped model loading\n");
+    printf("      and reports their combined RSS, PSS and private memory\n");
+    printf("  rerank /path/to/rerank.json [prompt_first] [model] [repeats]\n");
+    printf("      Scores the passages of a rerank request with full rows and with the reranker (query tokenized\n");
+    printf("      once, with and without early stopping), reports passages/s and checks that the rankings agree\n");
+    printf("  prefilter /path/to/data.json [N,N,...] [prompt_first] [model]\n");
+    printf("      Classifies per-text labels with all labels and with the N best labels of the prefilter,\n");
+    printf("      reports texts/s and the recall of the predictions made with all labels\n");
+    printf("  allocations /path/to/data.json [passes] [prompt_first] [model]\n");
+    printf("      Classifies the corpus several times with memory tracking, reports bytes and peak live bytes\n");
+    printf("      per stage and batch shape and the RSS per pass, fails if buffers outlive their batch\n");
+}
+
+/**
+ * Entry point of the benchmark harness. The first argument selects the benchmark mode.
+ */
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        print_benchmark_usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "quantization") == 0) {
+        return run_quantization_benchmark(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "memory") == 0) {
+        return run_memory_benchmark(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "rerank") == 0) {
+        return run_rerank_benchmark(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "prefilter") == 0) {
+        return run_prefilter_benchmark(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "allocations") == 0) {
+        return run_allocation_benchmark(argc - 1, argv + 1);
+    }
+    fprintf(stderr, "Error: Unknown benchmark mode %s\n\n", argv[1]);
+    print_benchmark_usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,30 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "read_data.h"
+
+#define REFERENCE_TOLERANCE 1e-3f // Absolute tolerance for logits against config.json (same as test_onnx.py)
+
+/**
+ * Structure to store the memory usage of a process in kilobytes (from /proc/self/smaps_rollup).
+ */
+typedef struct {
+    long rss_kb;        /**< Resident set size. */
+    long pss_kb;        /**< Proportional set size: shared pages are divided between the processes mapping them. */
+    long shared_kb;     /**< Resident pages shared with other processes. */
+    long private_kb;    /**< Resident pages private to the process. */
+} ProcessMemory;
+
+int read_process_memory(ProcessMemory* memory);
+int load_corpus(const char* path, ClassificationRequest* corpus);
+double percentile(double* values, size_t count, double p);
+
+int run_quantization_benchmark(int argc, char* argv[]);
+int run_memory_benchmark(int argc, char* argv[]);
+int run_rerank_benchmark(int argc, char* argv[]);
+int run_prefilter_benchmark(int argc, char* argv[]);
+int run_allocation_benchmark(int argc, char* argv[]);
+
+#endif // BENCHMARK_H
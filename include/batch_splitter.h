@@ -0,0 +1,24 @@
+#ifndef BATCH_SPLITTER_H
+#define BATCH_SPLITTER_H
+
+#include <stddef.h>
+#include "onnxruntime_c_api.h"
+
+/**
+ * Structure to store the statistics of the batch splitting of the process.
+ */
+typedef struct {
+    size_t num_splits;          /**< Batches split in half, before Run (over the memory limit) or after a failed Run. */
+    size_t num_failed_runs;     /**< Run calls that failed and were retried on halves. */
+    size_t num_failed_rows;     /**< Rows that could not be run even alone (their logits are NaN). */
+    size_t learned_limit;       /**< Largest estimate below the smallest batch that ran out of memory, 0 if none did. */
+} BatchSplitStats;
+
+void set_batch_memory_limit(size_t max_bytes);
+size_t estimate_batch_memory(size_t rows, size_t seq_length);
+OrtValue* run_inference_adaptive(OrtSession* session, OrtValue* input_ids_tensor, OrtValue* attention_mask_tensor,
+                                 size_t first_text, size_t prompt_chars);
+void get_batch_split_stats(BatchSplitStats* stats);
+void print_batch_split_stats(void);
+
+#endif // BATCH_SPLITTER_H
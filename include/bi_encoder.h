@@ -0,0 +1,32 @@
+#ifndef BI_ENCODER_H
+#define BI_ENCODER_H
+
+#include <stddef.h>
+#include "onnxruntime_c_api.h"
+#include "tokenizers_c.h"
+#include "model.h"
+#include "label_cache.h"
+#include "read_data.h"
+
+/**
+ * Structure to store a bi-encoder model: texts and labels are encoded by separate encoders and
+ * a scorer turns a text embedding and the embeddings of its labels into logits.
+ *
+ * Label embeddings do not depend on the text, so they are computed once and kept in a persistent
+ * label cache; the cost per text does not depend on the number or length of labels.
+ */
+typedef struct {
+    TokenizerHandle tokenizer;          /**< Tokenizer of the text encoder. */
+    TokenizerHandle label_tokenizer;    /**< Tokenizer of the label encoder (may be the text tokenizer). */
+    OrtSession* text_encoder;           /**< Text encoder: input_ids, attention_mask -> text embeddings [batch x dim]. */
+    OrtSession* label_encoder;          /**< Label encoder: input_ids, attention_mask -> label embeddings [labels x dim]. */
+    OrtSession* scorer;                 /**< Scorer: text_embeddings, label_embeddings [batch x labels x dim] -> logits. */
+    LabelEmbeddingCache label_cache;    /**< Persistent cache of label embeddings. */
+    size_t embedding_dim;               /**< Size of the label embeddings declared by the label encoder, 0 if symbolic. */
+} BiEncoder;
+
+int load_bi_encoder(OrtEnv* env, const SessionConfig* config, BiEncoder* model);
+int classify_request_bi_encoder(BiEncoder* model, const ClassificationRequest* request);
+void free_bi_encoder(BiEncoder* model);
+
+#endif // BI_ENCODER_H
@@ -0,0 +1,24 @@
+#ifndef CASCADE_H
+#define CASCADE_H
+
+#include <stddef.h>
+#include "model_registry.h"
+#include "read_data.h"
+
+/**
+ * Structure to store the statistics of a cascade run.
+ */
+typedef struct {
+    size_t num_texts;           /**< Number of texts in the request. */
+    size_t accepted_small;      /**< Texts finalized by the small model. */
+    size_t accepted_large;      /**< Texts sent to and finalized by the large model. */
+    size_t failed;              /**< Texts sent to the large model whose batch failed. */
+    double small_time;          /**< Time spent in the small model stage in seconds. */
+    double large_time;          /**< Time spent in the large model stage in seconds. */
+} CascadeStats;
+
+int classify_request_cascade(const HostedModel* small_model, const HostedModel* large_model,
+                             const ClassificationRequest* request, float margin, CascadeStats* stats);
+void print_cascade_stats(const CascadeStats* stats, const char* small_name, const char* large_name);
+
+#endif // CASCADE_H
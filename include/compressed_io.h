@@ -0,0 +1,43 @@
+#ifndef COMPRESSED_IO_H
+#define COMPRESSED_IO_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define COMPRESSION_MAGIC_SIZE 4 // Bytes read to detect the format of an input
+
+/**
+ * Compression formats of inputs and outputs. gzip needs a build with zlib (USE_ZLIB), zstd one with libzstd (USE_ZSTD).
+ */
+typedef enum {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD
+} CompressionFormat;
+
+/**
+ * Structure to store a pipe between the program and a compressed file descriptor. A background thread
+ * decompresses the file into the pipe (input) or compresses what the program writes into the pipe (output).
+ */
+typedef struct {
+    int plain_fd;               /**< End of the pipe the program reads plain data from or writes plain data to. */
+    int thread_fd;              /**< End of the pipe of the background thread, -1 if no thread runs. */
+    int file_fd;                /**< The compressed file descriptor. */
+    CompressionFormat format;   /**< Format of the output, or of the input once detected. */
+    bool compress;              /**< true for an output pipe. */
+    bool running;               /**< The background thread was started and not joined yet. */
+    pthread_t thread;           /**< The background thread. */
+    int result;                 /**< 0 if the thread converted all data, -1 otherwise. */
+} CompressedPipe;
+
+CompressionFormat detect_compression(const unsigned char* data, size_t size);
+CompressionFormat compression_from_path(const char* path);
+const char* compression_name(CompressionFormat format);
+int decompress_to_buffer(int fd, const unsigned char* prefix, size_t prefix_size, CompressionFormat format,
+                         char** data, size_t* size);
+int open_decompressing_pipe(int file_fd, CompressedPipe* pipe);
+int open_compressing_pipe(int file_fd, CompressionFormat format, CompressedPipe* pipe);
+int close_compressed_pipe(CompressedPipe* pipe);
+
+#endif // COMPRESSED_IO_H
@@ -2,8 +2,35 @@
 #define CONFIGS_H
 
 #define BATCH_SIZE 8    // Number of texts in one batch for processing by the model
+#define LABEL_BATCH_SIZE 64 // Number of labels in one batch for the label encoder of a bi-encoder
 #define MAX_LENGTH 2048 // Maximum length of tokenized text (number of tokens)
 #define THRESHOLD 0.5f  // Threshold for making a classification decision 
-#define NUM_THREADS 8   // Number of threads for CPU (does not affect GPU performance)
+#define NUM_THREADS 8   // CPU cores per batch worker when --batch-workers is not given (does not affect GPU performance)
+#define GRAPH_OPTIMIZATION_LEVEL ORT_ENABLE_ALL // ONNX Runtime graph optimization level (CPU and GPU)
+#define DEFAULT_SEQ_BUCKETS "64,128,256,512,1024,2048" // Sequence length buckets used by --warmup when --buckets is not given
+#define CASCADE_MARGIN 0.3f // Confidence margin for the small model of a cascade (distance from THRESHOLD or between top-2 scores)
+#define USE_MODEL_CACHE 1 // Cache the optimized graph in MODEL_CACHE_DIR and reuse it on later starts (CPU only)
+#define SHARD_SIZE 256 // Number of texts in one shard handed to a worker process by the coordinator (--coordinate)
+#define SHARD_BIND_ADDRESS "127.0.0.1:0" // Address the coordinator listens on when --bind is not given (port 0 picks a free port)
+#define SHARD_STRAGGLER_FACTOR 2.0 // A shard running this many times longer than expected is also sent to an idle worker
+#define SHARD_JOIN_TIMEOUT 30 // Seconds the coordinator waits for a worker while none is connected
+#define JOURNAL_SYNC_INTERVAL 2.0 // Seconds between fsync calls of the job journal (--journal), finished batches are lost at most this far back
+#define RERANK_TOP_K 10 // Number of passages returned by --rerank when neither the request nor --top-k sets it
+#define STREAM_MAX_WAIT_MS 20.0 // Longest time a record of --stream waits for its micro-batch to fill up (milliseconds)
+#define TAXONOMY_TOP_K 2 // Labels of every taxonomy level whose children are expanded even below THRESHOLD (request "top_k")
+#define TAXONOMY_MAX_DEPTH 16 // Maximum number of taxonomy levels
+#define PREFILTER_BM25_K1 1.2f // BM25 term frequency saturation of the label prefilter (--prefilter)
+#define PREFILTER_BM25_B 0.75f // BM25 text length normalization of the label prefilter
+#define BATCH_MEMORY_PER_TOKEN 49152 // Estimated activation bytes of one token (hidden states and feed-forward) checked against --max-batch-memory
+#define BATCH_MEMORY_PER_ATTENTION 144 // Estimated bytes of one query-key pair of the attention scores (all heads)
+#define COMPRESSION_CHUNK_SIZE 131072 // Bytes (de)compressed at once by compressed inputs and --output
+#define OUTPUT_GZIP_LEVEL 6 // zlib level of --output *.gz
+#define OUTPUT_ZSTD_LEVEL 3 // zstd level of --output *.zst
+#define MEMORY_SAMPLE_INTERVAL_MS 100 // Milliseconds between two RSS samples of --memory-stats
+#define COST_CHARS_PER_TOKEN 4.0 // Prompt characters per token assumed by the batch cost model until batches were measured
+#define COST_ATTENTION_CROSSOVER 512.0 // Sequence length at which attention costs as much as the rest of a Run, until the cost model is fitted
+#define COST_MIN_SAMPLES 8 // Measured runs needed before the batch cost model is fitted to them
+#define MEMORY_MAX_SAMPLES 64 // RSS samples kept by --memory-stats, the interval doubles when they are full
+#define PACKED_ROW_LENGTH 512 // Tokens of one packed row of --packed when --pack-length is not given (prompts are packed up to this length)
 
 #endif // CONFIGS_H
\ No newline at end of file
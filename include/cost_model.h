@@ -0,0 +1,26 @@
+#ifndef COST_MODEL_H
+#define COST_MODEL_H
+
+#include <stddef.h>
+#include "onnxruntime_c_api.h"
+#include "read_data.h"
+
+/**
+ * Structure to store the batch cost model of the process: Run seconds of a batch with rows x seq_length
+ * tokens are estimated as linear * rows * seq_length + quadratic * rows * seq_length^2.
+ */
+typedef struct {
+    double linear;              /**< Seconds per token (hidden states and feed-forward). */
+    double quadratic;           /**< Seconds per query-key pair (attention). */
+    double chars_per_token;     /**< Prompt characters per token, estimates the sequence length before tokenization. */
+    size_t num_samples;         /**< Measured runs the model is fitted to (defaults are used below COST_MIN_SAMPLES). */
+} BatchCostModel;
+
+size_t batch_prompt_chars(const ClassificationRequest* request, size_t start, size_t count);
+double estimate_batch_cost(size_t rows, size_t prompt_chars);
+void record_batch_run(size_t rows, size_t seq_length, size_t prompt_chars, double seconds);
+int order_batches_by_cost(const ClassificationRequest* request, size_t num_batches, size_t* order);
+void get_batch_cost_model(BatchCostModel* model);
+void print_batch_cost_model(void);
+
+#endif // COST_MODEL_H
@@ -0,0 +1,38 @@
+#ifndef JOB_JOURNAL_H
+#define JOB_JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "read_data.h"
+#include "model_registry.h"
+
+/**
+ * Structure to store an append-only journal of the finished batches of a job and where their predictions are.
+ */
+typedef struct {
+    int fd;                     /**< Journal file opened for appending. */
+    char* path;                 /**< Path of the journal file. */
+    const ClassificationRequest* requests; /**< Requests of the job. */
+    size_t* first_batch;        /**< Index of the first batch of every request. */
+    size_t num_requests;        /**< Number of requests of the job. */
+    size_t num_batches;         /**< Number of batches of all requests. */
+    off_t* offsets;             /**< Offset of the predictions of every batch in the file, -1 if not finished. */
+    size_t* sizes;              /**< Length of the predictions of every batch. */
+    size_t num_done;            /**< Number of finished batches. */
+    off_t end;                  /**< Length of the valid part of the file. */
+    double last_sync;           /**< Time of the last fsync. */
+    pthread_mutex_t mutex;      /**< Serializes appends. */
+} JobJournal;
+
+int open_job_journal(const char* path, const char* job_id, const ClassificationRequest* requests, size_t num_requests,
+                     JobJournal* journal);
+int append_journal_batch(JobJournal* journal, size_t batch, const char* output, size_t size);
+int sync_job_journal(JobJournal* journal);
+int write_journal_output(const JobJournal* journal, FILE* stream);
+void close_job_journal(JobJournal* journal);
+int run_journaled_requests(const ClassificationRequest* requests, HostedModel* const* models, JobJournal* journal);
+
+#endif // JOB_JOURNAL_H
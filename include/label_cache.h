@@ -0,0 +1,32 @@
+#ifndef LABEL_CACHE_H
+#define LABEL_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mapped_file.h"
+
+/**
+ * Structure to store a persistent cache of label embeddings.
+ *
+ * The cache is an append-only file keyed by the hash of the label encoder model, so the embeddings
+ * of a label are computed once and reused by every later request and process. The file is read
+ * through a shared read-only memory mapping, lookups return pointers into it.
+ */
+typedef struct {
+    char* path;             /**< Path to the cache file. */
+    uint64_t model_hash;    /**< Hash of the label encoder model the embeddings belong to. */
+    size_t dim;             /**< Size of one embedding, 0 until the first embedding is stored. */
+    MappedFile mapping;     /**< Read-only mapping of the cache file. */
+    size_t scanned_end;     /**< Offset in the file up to which entries are indexed. */
+    size_t* slots;          /**< Open addressing hash table of entry offsets (0 marks an empty slot). */
+    size_t num_slots;       /**< Size of the hash table (a power of two). */
+    size_t num_entries;     /**< Number of indexed labels. */
+} LabelEmbeddingCache;
+
+int open_label_cache(const char* path, uint64_t model_hash, LabelEmbeddingCache* cache);
+const float* lookup_label_embedding(const LabelEmbeddingCache* cache, const char* label);
+int append_label_embeddings(LabelEmbeddingCache* cache, const char* const* labels, const float* embeddings,
+                            size_t num_labels, size_t dim);
+void close_label_cache(LabelEmbeddingCache* cache);
+
+#endif // LABEL_CACHE_H
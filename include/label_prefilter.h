@@ -0,0 +1,20 @@
+#ifndef LABEL_PREFILTER_H
+#define LABEL_PREFILTER_H
+
+#include <stddef.h>
+#include "read_data.h"
+
+/**
+ * Structure to store the statistics of a label prefilter pass.
+ */
+typedef struct {
+    size_t num_texts;           /**< Texts whose labels were ranked. */
+    size_t labels_before;       /**< Labels of these texts before the prefilter. */
+    size_t labels_after;        /**< Labels kept for the model. */
+    double time;                /**< Time of the prefilter in seconds. */
+} PrefilterStats;
+
+int prefilter_request_labels(ClassificationRequest* request, size_t top_n, PrefilterStats* stats);
+void print_prefilter_stats(const PrefilterStats* stats);
+
+#endif // LABEL_PREFILTER_H
@@ -0,0 +1,17 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stddef.h>
+
+/**
+ * Structure to store a read-only memory mapping of a whole file.
+ */
+typedef struct {
+    void* data;     /**< Start of the mapping, NULL if the file is not mapped. */
+    size_t size;    /**< Size of the mapping (file size) in bytes. */
+} MappedFile;
+
+int map_file_readonly(const char* path, MappedFile* mapped);
+void unmap_file(MappedFile* mapped);
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,57 @@
+#ifndef MEMORY_TRACKER_H
+#define MEMORY_TRACKER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "onnxruntime_c_api.h"
+
+/**
+ * Stages whose allocations are tracked (--memory-stats).
+ */
+typedef enum {
+    MEMORY_REQUESTS,    /**< read_data: texts and labels of parsed requests. */
+    MEMORY_PROMPTS,     /**< preprocessor: prompts of a batch (texts joined with their labels). */
+    MEMORY_TOKENS,      /**< tokenizer: encode results and the token id, type and mask arrays of a batch. */
+    MEMORY_TENSORS,     /**< model: int64 input tensors of a batch. */
+    NUM_MEMORY_STAGES
+} MemoryStage;
+
+/**
+ * Structure to store the allocation counters of one stage.
+ */
+typedef struct {
+    size_t num_allocations; /**< Tracked allocations. */
+    size_t allocated;       /**< Bytes allocated in total. */
+    int64_t live;           /**< Bytes allocated and not released yet. */
+    int64_t peak;           /**< Largest value of live. */
+} MemoryStageStats;
+
+/**
+ * Structure to store the memory usage of the process at one point in time.
+ */
+typedef struct {
+    MemoryStageStats stages[NUM_MEMORY_STAGES];
+    int64_t live;               /**< Live bytes of all stages. */
+    int64_t peak;               /**< Largest value of live. */
+    long rss_kb;                /**< Current resident set size. */
+    long peak_rss_kb;           /**< Largest resident set size of the process. */
+    size_t num_batches;         /**< Batches that ran inside a batch scope (memory_batch_begin/end). */
+    size_t leaked_batches;      /**< Batches whose buffers outlived the batch. */
+    int64_t leaked_bytes;       /**< Bytes of the buffers that outlived their batch. */
+    double time;                /**< Seconds since tracking was enabled. */
+} MemorySnapshot;
+
+void enable_memory_tracking(void);
+bool memory_tracking_enabled(void);
+void track_allocation(MemoryStage stage, size_t bytes);
+void track_release(MemoryStage stage, size_t bytes);
+OrtAllocator* get_tracked_allocator(void);
+void memory_batch_begin(void);
+void memory_batch_shape(size_t rows, size_t seq_length);
+void memory_batch_end(void);
+void get_memory_snapshot(MemorySnapshot* snapshot);
+void print_memory_stats(FILE* stream);
+
+#endif // MEMORY_TRACKER_H
@@ -2,20 +2,44 @@
 #define MODEL_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include "onnxruntime_c_api.h"
 #include "tokenizer.h"
 
 extern const OrtApi* g_ort;
 
+/**
+ * Structure to configure how a session is created.
+ */
+typedef struct {
+    int num_threads;    /**< Intra-op and inter-op threads of the session, 0 to use the global thread pools of the environment. */
+    bool use_mmap;      /**< Create the session from a read-only shared memory mapping of the model file. */
+    const char* intra_op_affinities;                /**< Value of "session.intra_op_thread_affinities" (requires num_threads > 0), NULL to not pin. */
+    OrtPrepackedWeightsContainer* prepacked_weights; /**< Container that shares prepacked weights between sessions of the same model, NULL for none. */
+} SessionConfig;
+
 ///// TO TENSORS /////
-int64_t* flatten_int_array(int** data, size_t rows, size_t cols);
 OrtValue* create_tensor(int64_t* data, size_t rows, size_t cols) ;
 int prepare_input_tensors(TokenizedInputs* tokenized, OrtValue** input_ids_tensor, OrtValue** attention_mask_tensor);
+OrtValue* create_float_tensor(const int64_t* dims, size_t num_dims, float** data);
+OrtValue* create_float_tensor_with_data(float* data, size_t rows, size_t cols);
+OrtValue* create_int64_tensor_zeros(size_t rows, size_t cols, int64_t** data);
 
 /// ONNX ///
 void initialize_ort_api();
 OrtEnv* initialize_ort_environment();
+OrtEnv* initialize_ort_environment_with_global_thread_pools(int intra_op_threads, int inter_op_threads);
 OrtSession* create_ort_session(OrtEnv* env, const char* model_path, int num_threads);
+OrtSession* create_ort_session_with_config(OrtEnv* env, const char* model_path, const SessionConfig* config);
+void release_ort_session(OrtSession* session);
+int warmup_session(OrtSession* session, TokenizerHandle tokenizer, bool prompt_first, const SequenceBuckets* buckets,
+                   const size_t* row_counts, size_t num_row_counts, size_t max_length);
+OrtValue* run_session(OrtSession* session, const char* const* input_names, OrtValue* const* input_tensors, size_t num_inputs);
 OrtValue* run_inference(OrtSession* session, OrtValue* input_ids_tensor, OrtValue* attention_mask_tensor);
+int run_inference_into(OrtSession* session, OrtValue* input_ids_tensor, OrtValue* attention_mask_tensor,
+                       OrtValue* output_tensor);
+bool last_run_out_of_memory(void);
+double last_run_seconds(void);
+size_t get_session_output_dim(OrtSession* session);
 
 #endif // MODEL_H
\ No newline at end of file
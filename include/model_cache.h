@@ -0,0 +1,15 @@
+#ifndef MODEL_CACHE_H
+#define MODEL_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+uint64_t hash_model_file(const char* model_path);
+uint64_t model_file_key(const char* model_path);
+char* find_external_data_path(const char* model_path);
+char* get_cache_file_path(const char* model_path, const char* cache_dir, uint64_t hash, const char* suffix);
+char* get_cached_model_path(const char* model_path, const char* cache_dir);
+bool is_ort_format_model(const char* model_path);
+bool file_exists(const char* path);
+
+#endif // MODEL_CACHE_H
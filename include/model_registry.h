@@ -0,0 +1,33 @@
+#ifndef MODEL_REGISTRY_H
+#define MODEL_REGISTRY_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "onnxruntime_c_api.h"
+#include "tokenizers_c.h"
+
+/**
+ * Structure to store one model hosted by the process: its tokenizer and session under a name.
+ */
+typedef struct {
+    char* name;                 /**< Name requests use to route to the model. */
+    char* model_path;           /**< Path to the ONNX model. */
+    char* tokenizer_path;       /**< Path to the tokenizer JSON configuration. */
+    bool prompt_first;          /**< Whether the label prompt is placed before the text. */
+    TokenizerHandle tokenizer;  /**< Tokenizer of the model. */
+    OrtSession* session;        /**< Session of the model (uses the global thread pools of the environment). */
+} HostedModel;
+
+/**
+ * Structure to store all models hosted by the process. The first model is the default one.
+ */
+typedef struct {
+    HostedModel* models;        /**< Array of hosted models. */
+    size_t num_models;          /**< Number of hosted models. */
+} ModelRegistry;
+
+int load_model_registry(const char* config_path, OrtEnv* env, bool use_mmap, ModelRegistry* registry);
+HostedModel* find_model(const ModelRegistry* registry, const char* name);
+void free_model_registry(ModelRegistry* registry);
+
+#endif // MODEL_REGISTRY_H
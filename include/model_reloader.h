@@ -0,0 +1,77 @@
+#ifndef MODEL_RELOADER_H
+#define MODEL_RELOADER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <time.h>
+#include "onnxruntime_c_api.h"
+#include "tokenizers_c.h"
+#include "tokenizer.h"
+
+/**
+ * Structure to store the identity of a file a session maps. A file replaced by a rename gets a new inode,
+ * a file overwritten in place keeps its inode and changes its size or modification time.
+ */
+typedef struct {
+    dev_t device;               /**< Device of the file, 0 if it does not exist. */
+    ino_t inode;                /**< Inode of the file. */
+    off_t size;                 /**< Size of the file in bytes. */
+    struct timespec mtime;      /**< Last modification time of the file. */
+} FileIdentity;
+
+/**
+ * Structure to store one generation of the model: a session with its tokenizer. Batches hold a reference
+ * while they run, the generation is released when it was replaced and its last batch finished.
+ */
+typedef struct {
+    OrtSession* session;        /**< Session of the model. */
+    TokenizerHandle tokenizer;  /**< Tokenizer of the model. */
+    size_t generation;          /**< 0 for the model loaded at startup, incremented by every reload. */
+    size_t refs;                /**< Running batches, plus one while it is the current generation. */
+    FileIdentity model_file;    /**< Model file the session was created from (with --mmap). */
+    FileIdentity external_data; /**< External data file of the model (with --mmap, if it has one). */
+} LoadedModel;
+
+/**
+ * Structure to store the statistics of the reloads of a process.
+ */
+typedef struct {
+    size_t num_reloads;         /**< Reloads that swapped in a new generation. */
+    size_t num_failed;          /**< Reloads whose model or tokenizer could not be loaded (the old one stays). */
+    size_t num_released;        /**< Replaced generations released after their last batch finished. */
+    double last_reload_time;    /**< Seconds the last successful reload took to load and warm up. */
+} ReloadStats;
+
+/**
+ * Structure to store the model of a long running process and the background thread that reloads it.
+ * Reloads are requested with SIGHUP or request_model_reload.
+ */
+typedef struct {
+    LoadedModel* current;       /**< Generation new batches run on. */
+    pthread_mutex_t mutex;      /**< Protects current, the reference counts and the statistics. */
+    sem_t requests;             /**< Posted for every reload request (also from the signal handler). */
+    bool stopping;              /**< The reloader thread exits at its next wake-up. */
+    pthread_t thread;           /**< Thread that loads, warms up and swaps in new generations. */
+    bool running;               /**< The thread was started and not joined yet. */
+    OrtEnv* env;                /**< Environment the sessions are created in. */
+    const char* model_path;     /**< Model file read on every reload. */
+    const char* tokenizer_path; /**< Tokenizer file read on every reload. */
+    bool prompt_first;          /**< Place the labels prompt before the text (warmup of new sessions). */
+    bool use_mmap;              /**< Create the sessions from a shared memory mapping of the model file. */
+    SequenceBuckets buckets;    /**< Shapes a new session runs once before it is swapped in. */
+    ReloadStats stats;          /**< Statistics of the reloads. */
+} ModelReloader;
+
+int start_model_reloader(ModelReloader* reloader, OrtEnv* env, const char* model_path, const char* tokenizer_path,
+                         bool prompt_first, bool use_mmap, const SequenceBuckets* buckets, OrtSession* session, TokenizerHandle tokenizer);
+LoadedModel* acquire_model(ModelReloader* reloader);
+void release_model(ModelReloader* reloader, LoadedModel* model);
+void request_model_reload(ModelReloader* reloader);
+void stop_model_reloader(ModelReloader* reloader, OrtSession** session, TokenizerHandle* tokenizer);
+void print_reload_stats(FILE* stream, const ReloadStats* stats);
+
+#endif // MODEL_RELOADER_H
@@ -0,0 +1,30 @@
+#ifndef NUMA_TOPOLOGY_H
+#define NUMA_TOPOLOGY_H
+
+#include <stddef.h>
+
+/**
+ * Structure to store one NUMA node and the CPUs of the node the process may run on.
+ */
+typedef struct {
+    int id;             /**< Node number (as in /sys/devices/system/node/node<id>). */
+    int* cpus;          /**< Logical CPU numbers of the node, ascending. */
+    size_t num_cpus;    /**< Number of CPUs. */
+} NumaNode;
+
+/**
+ * Structure to store the NUMA topology of the host, limited to the CPUs of the process affinity mask.
+ */
+typedef struct {
+    NumaNode* nodes;    /**< Nodes that have at least one usable CPU. */
+    size_t num_nodes;   /**< Number of nodes. */
+} NumaTopology;
+
+int parse_cpu_list(const char* list, int** cpus, size_t* num_cpus);
+int detect_numa_topology(NumaTopology* topology);
+void print_numa_topology(const NumaTopology* topology);
+void free_numa_topology(NumaTopology* topology);
+int pin_thread_to_cpus(const int* cpus, size_t num_cpus);
+int prefer_memory_node(int node);
+
+#endif // NUMA_TOPOLOGY_H
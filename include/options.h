@@ -0,0 +1,57 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <stdbool.h>
+#include "tokenizer.h"
+#include "worker_groups.h"
+
+/**
+ * Structure to store the command line options of the program.
+ *
+ * The first two positional arguments (path to the data, "-" for --stream, and prompt_first) are required,
+ * all other options are given as "--name value" pairs after them. Worker processes of a
+ * coordinator take "--worker host:port" in place of the positional arguments.
+ */
+typedef struct {
+    const char* data_path;      /**< Path to the input JSON file. */
+    bool prompt_first;          /**< Whether the label prompt is placed before the text. */
+    const char* model_path;     /**< Path to the ONNX model selected with --model (fp32, int8 or a file path). */
+    bool use_mmap;              /**< Create sessions from read-only memory mappings of the model files (--mmap). */
+    SequenceBuckets buckets;    /**< Sequence length buckets batches are padded to (--buckets), count 0 if disabled. */
+    bool warmup;                /**< Run every bucket shape once after the session is created (--warmup). */
+    const char* models_path;    /**< Path to a model registry JSON (--models) to host several models, NULL for a single model. */
+    const char* cascade_small;  /**< Name of the small model of a cascade (--cascade small,large), NULL if disabled. */
+    const char* cascade_large;  /**< Name of the large model of a cascade. */
+    float cascade_margin;       /**< Confidence margin of the small model (--cascade-margin). */
+    bool bi_encoder;            /**< Run the bi-encoder model with the persistent label embedding cache (--bi-encoder). */
+    bool schedule;              /**< Schedule batches of all requests by priority class and deadline (--schedule). */
+    bool numa;                  /**< Run the model on NUMA-pinned worker groups (--numa round-robin|load). */
+    DispatchPolicy dispatch;    /**< Dispatch policy of the batches to the worker groups. */
+    size_t groups_per_node;     /**< Worker groups per NUMA node (--numa-groups). */
+    bool coordinate;            /**< Split the requests into shards for worker processes (--coordinate N). */
+    size_t num_local_workers;   /**< Worker processes the coordinator starts on this host. */
+    const char* bind_address;   /**< Address the coordinator listens on (--bind host:port). */
+    const char* journal_path;   /**< Journal of a resumable job (--journal), NULL to run without one. */
+    bool stream;                /**< Classify newline-delimited records from stdin as they arrive (--stream, data path "-"). */
+    double max_wait_ms;         /**< Longest wait of a streamed record for its micro-batch to fill up (--max-wait). */
+    int threads;                /**< Core budget of the process (--threads), 0 for all available CPUs. */
+    int batch_workers;          /**< Batch workers within the budget (--batch-workers), 0 to derive them. */
+    bool rerank;                /**< The input is a rerank request: one query scored against passages (--rerank). */
+    size_t top_k;               /**< Passages returned by the rerank (--top-k), 0 to use the request or RERANK_TOP_K. */
+    float min_score;            /**< Passages scoring below are not returned (--min-score), negative to use the request. */
+    bool early_stop;            /**< Stop the rerank once top_k passages reached min_score (--early-stop). */
+    const char* output_path;    /**< File the output is written to (--output), compressed for *.gz and *.zst, NULL for stdout. */
+    size_t max_batch_memory;    /**< Ceiling of the estimated memory of one Run in bytes (--max-batch-memory MB), 0 for none. */
+    bool perf_counters;         /**< Count cycles, instructions, misses and context switches per pipeline stage (--perf-counters). */
+    bool memory_stats;          /**< Track allocations per stage and batch shape and sample the RSS (--memory-stats). */
+    size_t prefilter_top_n;     /**< Labels per text kept by the lexical prefilter (--prefilter N), 0 if disabled. */
+    bool packed;                /**< Pack several prompts per row for a model exported with --packed (--packed). */
+    size_t pack_length;         /**< Tokens of one packed row (--pack-length). */
+    const char* worker_address; /**< Coordinator to work for (--worker host:port as first argument), NULL if not a worker. */
+} AppOptions;
+
+int parse_options(int argc, char* argv[], AppOptions* options);
+const char* resolve_model_variant(const char* variant);
+void print_usage(const char* program);
+
+#endif // OPTIONS_H
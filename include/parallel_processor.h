@@ -6,6 +6,12 @@
 #include "onnxruntime_c_api.h"
 #include "tokenizers_c.h"
 #include "configs.h"
+#include "read_data.h"
+#include "startup.h"
+
+int preprocess_batch(const char** batch_texts, const char*** batch_labels, size_t* batch_num_labels, size_t batch_size,
+                     bool same_labels, bool prompt_first, TokenizerHandle tokenizer_handler,
+                     OrtValue** input_ids_tensor, OrtValue** attention_mask_tensor);
 
 void parallel_preprocess(char** texts, char*** labels, size_t* num_labels, size_t num_texts,
                         bool same_labels, bool prompt_first, TokenizerHandle tokenizer_handler,
@@ -15,4 +21,22 @@ void parallel_postprocess(OrtValue** output_tensors, size_t num_batches, size_t
                          char** texts, char*** labels, size_t* num_labels,
                          bool same_labels, size_t num_labels_size, const char* classification_type);
 
+void parallel_inference(OrtSession* session, OrtValue** input_ids_tensors, OrtValue** attention_mask_tensors,
+                        OrtValue** output_tensors, size_t num_batches);
+
+OrtValue* run_request_batch(OrtSession* session, TokenizerHandle tokenizer_handler, bool prompt_first,
+                            const ClassificationRequest* request, size_t start, size_t count);
+
+int run_request_batch_into(OrtSession* session, TokenizerHandle tokenizer_handler, bool prompt_first,
+                           const ClassificationRequest* request, size_t start, size_t count, float* logits);
+
+int write_batch_predictions(FILE* stream, OrtValue* output_tensor, const ClassificationRequest* request,
+                            size_t start, size_t count, size_t index_offset);
+
+int classify_request(OrtSession* session, TokenizerHandle tokenizer_handler, bool prompt_first,
+                     const ClassificationRequest* request);
+
+int classify_request_during_startup(StartupLoader* startup, TokenizerHandle tokenizer_handler, bool prompt_first,
+                                    const ClassificationRequest* request);
+
 #endif // PARALLEL_PROCESSOR_H
\ No newline at end of file
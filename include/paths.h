@@ -3,5 +3,13 @@
 
 #define TOKENIZER_PATH "tokenizer/tokenizer.json" // Path to tokenizer file (JSON configuration)
 #define MODEL_PATH "onnx/model.onnx"              // Path to ONNX model for inference
+#define QUANTIZED_MODEL_PATH "onnx/model-int8-quantized.onnx" // Path to int8 quantized ONNX model (--model int8)
+#define PACKED_MODEL_PATH "onnx/model-packed.onnx" // Path to ONNX model taking packed rows with segment ids (--packed)
+#define MODEL_CONFIG_PATH "onnx/config.json"      // Path to model configuration with reference logits
+#define MODEL_CACHE_DIR "onnx/cache"              // Directory for optimized models (keyed by model files, CPU features and ORT version)
+#define TEXT_ENCODER_PATH "onnx/text_encoder.onnx"   // Bi-encoder: text encoder (--bi-encoder)
+#define LABEL_ENCODER_PATH "onnx/label_encoder.onnx" // Bi-encoder: label encoder, label embeddings are cached in MODEL_CACHE_DIR
+#define SCORER_PATH "onnx/scorer.onnx"               // Bi-encoder: scorer of text and label embeddings
+#define LABEL_TOKENIZER_PATH "onnx/label_tokenizer.json" // Bi-encoder: label tokenizer (TOKENIZER_PATH is used if missing)
 
 #endif // PATHS_H
\ No newline at end of file
@@ -1,10 +1,16 @@
 #ifndef POSTPROCESSOR_H
 #define POSTPROCESSOR_H
 
+#include <stdio.h>
 #include <stdbool.h>
 #include "onnxruntime_c_api.h"
 
 float sigmoid(float x);
+int get_output_logits(OrtValue* output_tensor, const OrtApi* g_ort, float** logits, int64_t* batch_size, int64_t* num_classes);
+void write_text_predictions(FILE* stream, int text_index, const char* text, const float* logits, size_t num_classes,
+                            const char* const* labels, size_t num_labels, float threshold, const char* classification_type);
+bool is_confident_prediction(const float* logits, size_t num_classes, float threshold, float margin,
+                             const char* classification_type);
 void process_output_tensor(OrtValue* output_tensor, const OrtApi* g_ort, bool same_labels, const char** const* labels,
                             const size_t* num_labels, size_t num_labels_size, float threshold, size_t num_texts, const char** texts,
                             const char* classification_type);
@@ -4,8 +4,68 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#define NUM_PRIORITY_CLASSES 3 // Number of request priority classes
+
+/**
+ * Priority classes of requests, more urgent classes are scheduled first.
+ */
+typedef enum {
+    PRIORITY_INTERACTIVE = 0,   /**< Latency sensitive traffic. */
+    PRIORITY_NORMAL = 1,        /**< Default class. */
+    PRIORITY_BULK = 2           /**< Backfill that runs when nothing else is waiting. */
+} RequestPriority;
+
+/**
+ * Structure to store one node of a label taxonomy. Leaves have no children.
+ */
+typedef struct TaxonomyNode {
+    char* label;                    /**< Label of the node, NULL for the root. */
+    struct TaxonomyNode* children;  /**< Child nodes. */
+    size_t num_children;            /**< Number of child nodes. */
+} TaxonomyNode;
+
+/**
+ * Structure to store one classification request: texts with their labels and the model it is routed to.
+ */
+typedef struct {
+    char** texts;               /**< Array of texts to classify. */
+    size_t num_texts;           /**< Number of texts. */
+    char*** labels;             /**< Labels for each text (a single set if same_labels is true). */
+    size_t* num_labels;         /**< Number of labels for each text. */
+    size_t num_labels_size;     /**< Number of labels if all texts share the same set. */
+    bool same_labels;           /**< Whether all texts share the same labels. */
+    char* classification_type;  /**< "multi-label" or "single-label". */
+    char* model_name;           /**< Name of the hosted model to route the request to, NULL for the default model. */
+    RequestPriority priority;   /**< Priority class of the request ("priority", default "normal"). */
+    double deadline_ms;         /**< Deadline in milliseconds after the request arrives ("deadline_ms"), 0 if none. */
+    bool shed_late;             /**< Drop work that can no longer meet the deadline instead of deferring it ("on_deadline_miss"). */
+    TaxonomyNode* taxonomy;     /**< Root of the label tree ("taxonomy" in place of "labels"), NULL for flat labels. */
+    size_t top_k;               /**< Taxonomy: besides labels above the threshold, the top_k labels of a level are expanded. */
+    size_t memory_bytes;        /**< Bytes of texts and labels counted as MEMORY_REQUESTS (--memory-stats), released by free_request. */
+} ClassificationRequest;
+
+/**
+ * Structure to store a rerank request: one query scored against candidate passages.
+ */
+typedef struct {
+    char* query;                /**< Query put in the label slot of every row. */
+    char** passages;            /**< Candidate passages. */
+    size_t num_passages;        /**< Number of passages. */
+    size_t top_k;               /**< Number of passages to return ("top_k", 0 if not given). */
+    float min_score;            /**< Passages scoring below are not returned ("min_score", 0 if not given). */
+} RerankRequest;
+
 char* read_file(const char* filename);
 void parse_json(const char* json_string, char*** texts, size_t* num_texts, char**** labels,
                 size_t** num_labels, size_t* num_labels_size, bool* same_labels, char** classification_type); 
+int parse_requests(const char* json_string, ClassificationRequest** requests, size_t* num_requests);
+char* request_slice_to_json(const ClassificationRequest* request, size_t start, size_t count);
+void free_request(ClassificationRequest* request);
+int parse_rerank_request(const char* json_string, RerankRequest* request);
+void free_rerank_request(RerankRequest* request);
+int parse_stream_record(const char* json_string, char** text, char*** labels, size_t* num_labels,
+                        char** classification_type);
+char* parse_stream_control(const char* json_string);
+const char* priority_class_name(RequestPriority priority);
 bool string_to_bool(const char *str);
 #endif // READ_DATA_H
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef RERANKER_H
+#define RERANKER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "onnxruntime_c_api.h"
+#include "tokenizers_c.h"
+
+/**
+ * Structure to store a scored passage of a rerank.
+ */
+typedef struct {
+    size_t index;       /**< Index of the passage in the input. */
+    float score;        /**< Relevance of the passage to the query (sigmoid of its logit). */
+} RerankResult;
+
+/**
+ * Structure to store the settings of a rerank.
+ */
+typedef struct {
+    size_t top_k;       /**< Number of passages to return. */
+    float min_score;    /**< Passages scoring below are not returned. */
+    bool early_stop;    /**< Stop scoring passages once top_k of them reached min_score. */
+} RerankConfig;
+
+/**
+ * Structure to store the statistics of a rerank.
+ */
+typedef struct {
+    size_t num_passages;        /**< Number of candidate passages. */
+    size_t num_scored;          /**< Passages actually run through the model. */
+    size_t num_truncated;       /**< Passages cut to fit into MAX_LENGTH next to the query. */
+    double time;                /**< Wall time of the rerank in seconds. */
+} RerankStats;
+
+int rerank_passages(OrtSession* session, TokenizerHandle tokenizer, bool prompt_first, const char* query,
+                    const char* const* passages, size_t num_passages, const RerankConfig* config,
+                    RerankResult* results, size_t* num_results, RerankStats* stats);
+void print_rerank_results(const RerankResult* results, size_t num_results);
+void print_rerank_stats(const RerankStats* stats);
+
+#endif // RERANKER_H
@@ -0,0 +1,34 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+#include "model_registry.h"
+#include "read_data.h"
+
+/**
+ * Structure to store the scheduling statistics of one priority class.
+ */
+typedef struct {
+    size_t num_requests;        /**< Requests of the class. */
+    size_t num_texts;           /**< Texts of the class. */
+    size_t num_batches;         /**< Batches that were run. */
+    double total_queue_delay;   /**< Sum of the queueing delays of the run batches in seconds. */
+    double max_queue_delay;     /**< Largest queueing delay of a run batch in seconds. */
+    size_t missed_deadlines;    /**< Requests that finished after their deadline or were shed. */
+    size_t deferred_batches;    /**< Batches moved behind all other work because they could not meet the deadline. */
+    size_t shed_texts;          /**< Texts dropped because they could not meet the deadline. */
+} PriorityClassStats;
+
+/**
+ * Structure to store the statistics of a scheduled run.
+ */
+typedef struct {
+    PriorityClassStats classes[NUM_PRIORITY_CLASSES];   /**< Statistics per priority class. */
+    double total_time;                                  /**< Wall time of the run in seconds. */
+} SchedulerStats;
+
+int run_scheduled_requests(const ClassificationRequest* requests, size_t num_requests, HostedModel* const* models,
+                           SchedulerStats* stats);
+void print_scheduler_stats(const SchedulerStats* stats);
+
+#endif // SCHEDULER_H
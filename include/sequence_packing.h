@@ -0,0 +1,26 @@
+#ifndef SEQUENCE_PACKING_H
+#define SEQUENCE_PACKING_H
+
+#include <stdbool.h>
+#include "onnxruntime_c_api.h"
+#include "tokenizers_c.h"
+#include "read_data.h"
+
+/**
+ * Structure to store the token utilization of the packed batches of a request.
+ */
+typedef struct {
+    size_t num_texts;       /**< Texts classified. */
+    size_t num_batches;     /**< Packed batches run. */
+    size_t num_rows;        /**< Rows of the packed batches. */
+    size_t tokens;          /**< Tokens of all prompts. */
+    size_t packed_slots;    /**< Token slots of the packed batches (rows x padded row length). */
+    size_t padded_slots;    /**< Token slots the same prompts take in unpacked batches of BATCH_SIZE texts. */
+    size_t failed_batches;  /**< Packed batches whose Run failed. */
+} PackingStats;
+
+int classify_request_packed(OrtSession* session, TokenizerHandle tokenizer_handler, bool prompt_first,
+                            const ClassificationRequest* request, size_t row_length, PackingStats* stats);
+void print_packing_stats(const PackingStats* stats);
+
+#endif // SEQUENCE_PACKING_H
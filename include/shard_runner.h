@@ -0,0 +1,13 @@
+#ifndef SHARD_RUNNER_H
+#define SHARD_RUNNER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "read_data.h"
+#include "model_registry.h"
+
+int run_shard_coordinator(const ClassificationRequest* requests, size_t num_requests, bool prompt_first,
+                          const char* bind_address, size_t num_local_workers, int argc, char* argv[]);
+int run_shard_worker(const char* coordinator_address, HostedModel* model);
+
+#endif // SHARD_RUNNER_H
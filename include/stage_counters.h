@@ -0,0 +1,46 @@
+#ifndef STAGE_COUNTERS_H
+#define STAGE_COUNTERS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Stages of the classification pipeline measured by the hardware counters (--perf-counters).
+ */
+typedef enum {
+    STAGE_PROMPT,       /**< prepare_inputs: texts and labels joined into prompts. */
+    STAGE_TOKENIZE,     /**< tokenize_inputs. */
+    STAGE_TENSORS,      /**< prepare_input_tensors: tensor creation and flattening of the token arrays. */
+    STAGE_INFERENCE,    /**< run_inference, on the calling thread only (the intra-op pool is not counted). */
+    STAGE_POSTPROCESS,  /**< Logits to printed predictions. */
+    NUM_PIPELINE_STAGES
+} PipelineStage;
+
+/**
+ * Counters read from perf_event_open for every stage.
+ */
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_TASK_CLOCK,         /**< CPU time of the thread in nanoseconds. */
+    COUNTER_CONTEXT_SWITCHES,
+    NUM_STAGE_COUNTERS
+} StageCounter;
+
+/**
+ * Structure to store the counters of the calling thread at the start of a stage.
+ */
+typedef struct {
+    uint64_t values[NUM_STAGE_COUNTERS];    /**< Counter values (hardware values scaled for multiplexing). */
+    double time;                            /**< Wall-clock time. */
+    bool active;                            /**< Counters were read, stage_end adds the difference. */
+} StageSample;
+
+void enable_stage_counters(void);
+void stage_begin(StageSample* sample);
+void stage_end(PipelineStage stage, const StageSample* start);
+void print_stage_counters(void);
+
+#endif // STAGE_COUNTERS_H
@@ -0,0 +1,42 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "onnxruntime_c_api.h"
+#include "tokenizers_c.h"
+#include "model.h"
+
+/**
+ * Structure to store the tokenizer and session of the model while they are created on background threads,
+ * so reading and parsing the input overlaps with loading the model.
+ */
+typedef struct {
+    OrtEnv* env;                /**< Environment the session is created in. */
+    const char* model_path;     /**< Model file of the session. */
+    const char* tokenizer_path; /**< Tokenizer file. */
+    SessionConfig config;       /**< How the session is created. */
+    pthread_t tokenizer_thread; /**< Thread creating the tokenizer. */
+    pthread_t session_thread;   /**< Thread creating the session. */
+    bool tokenizer_joined;      /**< The tokenizer thread was joined. */
+    bool session_joined;        /**< The session thread was joined. */
+    pthread_mutex_t mutex;      /**< Protects session_done. */
+    pthread_cond_t session_ready; /**< Signaled when the session thread finished. */
+    bool session_done;          /**< The session thread finished (session is NULL if it failed). */
+    TokenizerHandle tokenizer;  /**< Created tokenizer, NULL if it failed. */
+    OrtSession* session;        /**< Created session, NULL if it failed. */
+    double tokenizer_time;      /**< Seconds the tokenizer took to create. */
+    double session_time;        /**< Seconds the session took to create. */
+} StartupLoader;
+
+void mark_process_start(void);
+void note_first_result(void);
+void print_time_to_first_result(void);
+int start_startup_loader(StartupLoader* loader, OrtEnv* env, const char* model_path, const char* tokenizer_path,
+                         const SessionConfig* config);
+TokenizerHandle wait_startup_tokenizer(StartupLoader* loader);
+OrtSession* wait_startup_session(StartupLoader* loader);
+void finish_startup_loader(StartupLoader* loader);
+
+#endif // STARTUP_H
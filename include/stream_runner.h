@@ -0,0 +1,29 @@
+#ifndef STREAM_RUNNER_H
+#define STREAM_RUNNER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "onnxruntime_c_api.h"
+#include "tokenizers_c.h"
+#include "model_reloader.h"
+
+/**
+ * Structure to store the statistics of a stream.
+ */
+typedef struct {
+    size_t num_records;         /**< Records read, including invalid ones. */
+    size_t num_invalid;         /**< Records that could not be parsed (reported on stderr and skipped). */
+    size_t num_batches;         /**< Micro-batches run. */
+    size_t full_batches;        /**< Micro-batches flushed because they reached BATCH_SIZE. */
+    size_t waited_batches;      /**< Micro-batches flushed because their oldest record waited max_wait. */
+    size_t failed_batches;      /**< Micro-batches whose inference failed. */
+    size_t num_controls;        /**< Control records, e.g. {"control": "reload"} (not counted as records). */
+    double time;                /**< Wall time of the stream in seconds. */
+} StreamStats;
+
+int run_stream(int input_fd, FILE* output, ModelReloader* models, bool prompt_first,
+               size_t num_workers, double max_wait, StreamStats* stats);
+void print_stream_stats(FILE* stream, const StreamStats* stats);
+
+#endif // STREAM_RUNNER_H
@@ -0,0 +1,25 @@
+#ifndef TAXONOMY_H
+#define TAXONOMY_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "onnxruntime_c_api.h"
+#include "tokenizers_c.h"
+#include "read_data.h"
+
+/**
+ * Structure to store the statistics of a taxonomy classification.
+ */
+typedef struct {
+    size_t num_texts;           /**< Number of texts in the request. */
+    size_t num_levels;          /**< Taxonomy levels that were run. */
+    size_t scored_labels;       /**< Text-label pairs scored over all levels. */
+    size_t num_leaves;          /**< Leaves of the taxonomy (labels per text of a flat classification). */
+    double time;                /**< Wall time in seconds. */
+} TaxonomyStats;
+
+int classify_request_taxonomy(OrtSession* session, TokenizerHandle tokenizer, bool prompt_first,
+                              const ClassificationRequest* request, TaxonomyStats* stats);
+void print_taxonomy_stats(const TaxonomyStats* stats);
+
+#endif // TAXONOMY_H
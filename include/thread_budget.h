@@ -0,0 +1,31 @@
+#ifndef THREAD_BUDGET_H
+#define THREAD_BUDGET_H
+
+/**
+ * Structure to store how one core budget is divided between the threads of the process.
+ *
+ * Batches are prepared, tokenized and postprocessed on one OpenMP thread per core. At most
+ * batch_workers of these threads are inside Run at once (see acquire_run_slot), the others wait for
+ * a slot or work on their next batch. The threads in Run share the global intra-op pool of ONNX
+ * Runtime, whose size includes the calling thread, so batch workers plus the intra-op pool threads
+ * they do not bring themselves add up to the budget. The tokenizer runs on the OpenMP threads and
+ * does not start threads of its own.
+ */
+typedef struct {
+    int cores;              /**< Core budget of the process. */
+    int batch_workers;      /**< Batches in Run at once. */
+    int omp_threads;        /**< OpenMP threads preparing, tokenizing and postprocessing batches. */
+    int intra_op_threads;   /**< Threads of the global ORT intra-op pool, the calling batch worker included. */
+    int inter_op_threads;   /**< Threads of the global ORT inter-op pool (1: graph nodes run one after another). */
+    int tokenizer_threads;  /**< Threads of one tokenizer call. */
+} ThreadBudget;
+
+int count_available_cpus(void);
+int plan_thread_budget(int cores, int batch_workers, ThreadBudget* budget);
+void apply_thread_budget(const ThreadBudget* budget);
+void set_run_slots(int slots);
+void acquire_run_slot(void);
+void release_run_slot(void);
+void print_thread_budget(const ThreadBudget* budget);
+
+#endif // THREAD_BUDGET_H
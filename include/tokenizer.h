@@ -18,6 +18,21 @@ typedef struct {
     size_t seq_length;       /**< Maximum sequence length for the input texts. */
 } TokenizedInputs;
 
+#define MAX_SEQ_BUCKETS 16 // Maximum number of sequence length buckets
+
+/**
+ * Structure to store the sequence lengths batches are padded up to.
+ * 
+ * With buckets, every batch has one of a few known shapes, which can be planned by ONNX Runtime ahead of time.
+ */
+typedef struct {
+    size_t lengths[MAX_SEQ_BUCKETS];    /**< Bucket sequence lengths in ascending order. */
+    size_t count;                       /**< Number of buckets, 0 disables bucketing. */
+} SequenceBuckets;
+
+int parse_sequence_buckets(const char* list, SequenceBuckets* buckets);
+void set_sequence_buckets(const SequenceBuckets* buckets);
+size_t bucket_sequence_length(size_t seq_length, size_t max_length);
 TokenizedInputs tokenize_inputs(TokenizerHandle tokenizer, const char* inputs[], size_t num_texts, size_t max_length);
 void print_tokenized_inputs(const TokenizedInputs* tokenized);
 void free_tokenized_inputs(TokenizedInputs* tokenized);
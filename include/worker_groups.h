@@ -0,0 +1,52 @@
+#ifndef WORKER_GROUPS_H
+#define WORKER_GROUPS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "onnxruntime_c_api.h"
+#include "tokenizers_c.h"
+#include "read_data.h"
+#include "numa_topology.h"
+
+/**
+ * How batches are assigned to the worker groups.
+ */
+typedef enum {
+    DISPATCH_ROUND_ROBIN = 0,   /**< Batch b runs on group b % num_groups. */
+    DISPATCH_LOAD = 1           /**< Every group takes the next batch as soon as it is idle. */
+} DispatchPolicy;
+
+/**
+ * Structure to store one worker group: a session whose threads and memory are pinned to a NUMA node.
+ */
+typedef struct {
+    int node;                   /**< NUMA node of the group. */
+    int* cpus;                  /**< CPUs of the group (points into the topology), the first one runs the caller thread. */
+    size_t num_cpus;            /**< Number of CPUs, also the number of intra-op threads of the session. */
+    OrtSession* session;        /**< Session of the group. */
+    size_t num_batches;         /**< Batches run by the group so far. */
+    double busy_time;           /**< Seconds spent in Run so far. */
+} WorkerGroup;
+
+/**
+ * Structure to store the worker groups of all NUMA nodes.
+ */
+typedef struct {
+    WorkerGroup* groups;                        /**< Groups, ordered by node. */
+    size_t num_groups;                          /**< Number of groups. */
+    OrtPrepackedWeightsContainer** containers;  /**< One prepacked weights container per node, shared by its groups. */
+    size_t num_containers;                      /**< Number of containers (nodes). */
+    DispatchPolicy policy;                      /**< Dispatch policy of the batches. */
+} WorkerGroups;
+
+int parse_dispatch_policy(const char* name, DispatchPolicy* policy);
+int create_worker_groups(OrtEnv* env, const char* model_path, bool use_mmap, const NumaTopology* topology,
+                         size_t groups_per_node, DispatchPolicy policy, WorkerGroups* groups);
+void grouped_inference(WorkerGroups* groups, OrtValue** input_ids_tensors, OrtValue** attention_mask_tensors,
+                       OrtValue** output_tensors, size_t num_batches);
+int classify_request_grouped(WorkerGroups* groups, TokenizerHandle tokenizer_handler, bool prompt_first,
+                             const ClassificationRequest* request);
+void print_worker_group_stats(const WorkerGroups* groups);
+void free_worker_groups(WorkerGroups* groups);
+
+#endif // WORKER_GROUPS_H
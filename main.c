@@ -7,6 +7,8 @@
 #include <omp.h>
 #include <mqueue.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 
 // Project includes (folder include)
@@ -20,172 +22,649 @@
 #include "paths.h"
 #include "configs.h"
 #include "parallel_processor.h"
+#include "options.h"
+#include "model_registry.h"
+#include "cascade.h"
+#include "bi_encoder.h"
+#include "scheduler.h"
+#include "numa_topology.h"
+#include "worker_groups.h"
+#include "shard_runner.h"
+#include "job_journal.h"
+#include "model_cache.h"
+#include "reranker.h"
+#include "thread_budget.h"
+#include "stream_runner.h"
+#include "taxonomy.h"
+#include "label_prefilter.h"
+#include "sequence_packing.h"
+#include "batch_splitter.h"
+#include "compressed_io.h"
+#include "stage_counters.h"
+#include "memory_tracker.h"
+#include "model_reloader.h"
+#include "startup.h"
+#include "cost_model.h"
 
 // Ini variables for data
-char** texts = NULL;                // Array of strings containing texts to classify
-size_t num_texts = 0;               // Number of texts in the 'texts' array
-char*** labels = NULL;              // An array of labels for each text; there can be multiple labels for each text
-size_t* num_labels = NULL;          // Array containing the number of tags for each text
-size_t num_labels_size = 0;         // Total size of the array of labels 
-bool same_labels = false;           // Flag indicating whether the same labels are used for all texts
-char* classification_type = NULL;   // Classification type (e.g. single-label, multi-label)
+ClassificationRequest* requests = NULL; // Requests read from the input file (a single one for the regular input format)
+size_t num_requests = 0;                // Number of requests in the 'requests' array
+RerankRequest rerank_request = { 0 };   // Query and passages read from the input file with --rerank
+static FILE* stream_output = NULL;      // Predictions of --stream (the original stdout)
+static CompressedPipe output_pipe;      // Compressing pipe behind stdout with --output *.gz / *.zst
 
-const OrtApi* g_ort = NULL;         // Global pointer to ONNX Runtime API for performing model inference
+/**
+ * Frees the requests read from the input file.
+ */
+static void free_requests(void) {
+    for (size_t i = 0; i < num_requests; ++i) {
+        free_request(&requests[i]);
+    }
+    free(requests);
+    requests = NULL;
+    num_requests = 0;
+    free_rerank_request(&rerank_request);
+}
+
+/**
+ * Finishes the output at exit: flushes stdout and the stream output and waits until the compressing
+ * thread of --output has written the end of the compressed file.
+ */
+static void finish_output(void) {
+    if (stream_output) {
+        fclose(stream_output);
+        stream_output = NULL;
+    }
+    fflush(stdout);
+    close(STDOUT_FILENO); // The compressing thread sees the end of the output
+    if (close_compressed_pipe(&output_pipe) != 0) {
+        fprintf(stderr, "Error: The compressed output is incomplete\n");
+    }
+}
+
+/**
+ * Redirects stdout to a file. Outputs ending in .gz or .zst are compressed on a background thread.
+ *
+ * @param path The path of the output file.
+ * @return 0 if successful, 1 if the file could not be created or the format is not supported.
+ */
+static int redirect_output(const char* path) {
+    int file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file_fd < 0) {
+        fprintf(stderr, "Error: Failed to create output file %s\n", path);
+        return 1;
+    }
+    CompressionFormat format = compression_from_path(path);
+    if (format == COMPRESSION_NONE) {
+        int result = dup2(file_fd, STDOUT_FILENO) < 0 ? 1 : 0;
+        close(file_fd);
+        return result;
+    }
+    if (open_compressing_pipe(file_fd, format, &output_pipe) != 0) {
+        close(file_fd);
+        return 1;
+    }
+    fflush(stdout);
+    int result = dup2(output_pipe.plain_fd, STDOUT_FILENO) < 0 ? 1 : 0;
+    close(output_pipe.plain_fd);
+    atexit(finish_output);
+    return result;
+}
+
+/**
+ * Releases the environment and what the startup loader created when main returns before the model is used.
+ *
+ * @param startup The startup loader.
+ * @param env The environment the session was created in.
+ */
+static void abandon_startup(StartupLoader* startup, OrtEnv* env) {
+    finish_startup_loader(startup);
+    release_ort_session(startup->session);
+    if (startup->tokenizer) tokenizers_free(startup->tokenizer);
+    g_ort->ReleaseEnv(env);
+}
 
-// Mutex declarations
-pthread_mutex_t queue_mutex;
+/**
+ * Waits for the session of the startup loader and hands it to the model.
+ *
+ * @param startup The startup loader.
+ * @param model The model that takes over the session.
+ * @return 0 if successful, 1 if the session could not be created.
+ */
+static int take_startup_session(StartupLoader* startup, HostedModel* model) {
+    model->session = wait_startup_session(startup);
+    finish_startup_loader(startup);
+    if (model->session == NULL) {
+        fprintf(stderr, "Error: Failed to create session ONNX Runtime.\n");
+        return 1;
+    }
+    printf("Session creation time: %f seconds (tokenizer %f seconds, overlapped with reading the input)\n\n",
+           startup->session_time, startup->tokenizer_time);
+    return 0;
+}
 
-// Buffers for input and output
-OrtValue** input_ids_tensors = NULL;
-OrtValue** attention_mask_tensors = NULL;
-OrtValue** output_tensors = NULL;
+/**
+ * Runs the requests as a resumable job: batches finished by an earlier run are taken from the journal,
+ * the others are classified and journaled, and the predictions of all batches are printed in input order.
+ *
+ * @param options The command line options (journal path, input, model and prompt_first identify the job).
+ *                The model files of the requests (see model_file_key) are part of the job id as well.
+ * @param request_models The model of every request.
+ * @return 0 if successful, 1 if the journal could not be used or some batches failed.
+ */
+static int run_journaled_job(const AppOptions* options, HostedModel* const* request_models) {
+    // The models are identified by their files, so a checkpoint replaced at the same path starts a new job
+    uint64_t models_key = 14695981039346656037ULL; // FNV offset basis
+    for (size_t r = 0; r < num_requests; ++r) {
+        if (request_models[r] && (r == 0 || request_models[r] != request_models[r - 1])) {
+            models_key = (models_key ^ model_file_key(request_models[r]->model_path)) * 1099511628211ULL;
+        }
+    }
+    char job_id[512];
+    snprintf(job_id, sizeof(job_id), "input=%016llx model=%s models=%016llx prompt_first=%d batch=%d max_length=%d threshold=%g prefilter=%zu",
+             (unsigned long long)hash_model_file(options->data_path),
+             options->models_path ? options->models_path : options->model_path, (unsigned long long)models_key,
+             options->prompt_first ? 1 : 0, BATCH_SIZE, MAX_LENGTH, (double)THRESHOLD, options->prefilter_top_n);
+    JobJournal journal;
+    if (open_job_journal(options->journal_path, job_id, requests, num_requests, &journal) != 0) {
+        return 1;
+    }
+    int result = run_journaled_requests(requests, request_models, &journal);
+    if (result == 0) {
+        result = write_journal_output(&journal, stdout);
+    }
+    close_job_journal(&journal);
+    return result == 0 ? 0 : 1;
+}
+
+/**
+ * Scores the passages of the rerank request against its query and prints the best ones.
+ * Command line settings take precedence over the ones of the request.
+ *
+ * @param options The command line options (top_k, min_score and early_stop).
+ * @param model The model to score the passages with.
+ * @return 0 if successful, 1 if the rerank failed.
+ */
+static int run_rerank(const AppOptions* options, const HostedModel* model) {
+    RerankConfig config;
+    config.top_k = options->top_k ? options->top_k : (rerank_request.top_k ? rerank_request.top_k : RERANK_TOP_K);
+    config.min_score = options->min_score >= 0.0f ? options->min_score : rerank_request.min_score;
+    config.early_stop = options->early_stop;
+
+    RerankResult* results = (RerankResult*)malloc(config.top_k * sizeof(RerankResult));
+    if (!results) {
+        fprintf(stderr, "Error: Memory allocation for rerank results failed\n");
+        return 1;
+    }
+    size_t num_results = 0;
+    RerankStats stats;
+    int result = rerank_passages(model->session, model->tokenizer, model->prompt_first, rerank_request.query,
+                                 (const char* const*)rerank_request.passages, rerank_request.num_passages,
+                                 &config, results, &num_results, &stats);
+    if (result == 0) {
+        print_rerank_results(results, num_results);
+    }
+    printf("Execution time: %f seconds\n", stats.time);
+    print_rerank_stats(&stats);
+    free(results);
+    return result == 0 ? 0 : 1;
+}
 
 /**
  * Main function that runs the text classification model using ONNX Runtime.
  * It reads input data from a JSON file, preprocesses the texts, tokenizes them, runs inference using the ONNX model,
  * and processes the output logits to print the classification results. It supports multi-threading using OpenMP.
+ * With --models several models are hosted in one process on shared ONNX Runtime thread pools and each request
+ * is routed to a model by its "model" field. With --coordinate the requests are split into shards that worker
+ * processes (started with --worker host:port) classify, and the merged predictions are printed in input order.
+ * With --journal finished batches are journaled, so an interrupted run resumes where it stopped.
+ * With --rerank the input holds one query and candidate passages, which are ranked by their relevance.
+ * With --stream records are read line by line from stdin and classified in micro-batches as they arrive.
+ * SIGHUP then reloads the model and tokenizer without dropping the batches running on the old ones.
+ * With --output the predictions are written to a file, compressed if it ends in .gz or .zst. Compressed
+ * input files (and stdin of --stream) are detected and decompressed while they are read.
+ * With --prefilter the per-text labels are narrowed down to the ones sharing the most terms with their text.
+ * With --memory-stats the allocations of every stage and the RSS of the process are reported at exit.
+ * The tokenizer and session of a single model are created on background threads while the input is read,
+ * and without --warmup the first batches are tokenized before the session is ready. The time from the
+ * start of the process to the first batch of logits is reported.
  *
  * @param argc The number of command-line arguments.
- * @param argv An array of command-line arguments. argv[1] should be the path to the input JSON file.
+ * @param argv An array of command-line arguments. argv[1] should be the path to the input JSON file,
+ *             argv[2] the prompt_first flag, followed by optional "--name value" options (see print_usage).
  * @return 0 if successful, or 1 if an error occurs (e.g., invalid arguments or failed initialization).
  */
 
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        printf("Usage: %s /path/to/your_data.json [prompt_first: true/false]\n", argv[0]);
-        printf("NOTE: use this option only if you sure that all required model parts are initialized correctly\n\n");
-        printf("Recomended option\n");
-        printf("Usage: ./run_GLiClass.sh knowledgator/gliclass-small-v1.0 /path/to/your_data.json\n");
-        printf("This option will automaticly set up prompt_first for you\n");
+    mark_process_start();
+    AppOptions options;
+    if (parse_options(argc, argv, &options) != 0) {
         return 1;
     }
-    // reading data from json file
-    char* json_string = read_file(argv[1]);
-    if (!json_string) {
-        return 1;
+    if (options.memory_stats) {
+        enable_memory_tracking(); // Before the requests are read
     }
-    bool prompt_first = string_to_bool(argv[2]);
-    ///////////// Prepare inputs /////////////
-    parse_json(json_string, &texts, &num_texts, &labels, &num_labels, &num_labels_size, &same_labels, &classification_type);
-    printf("DONE: parse_json;\n");
-    if (classification_type == NULL){
-        printf("classification type is not provided\n");
+    if (options.output_path && redirect_output(options.output_path) != 0) {
         return 1;
     }
-    free(json_string);
+    if (options.stream) {
+        // Predictions go to the real stdout, everything else the program prints goes to stderr
+        int output_fd = dup(STDOUT_FILENO);
+        stream_output = output_fd >= 0 ? fdopen(output_fd, "w") : NULL;
+        if (!stream_output || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "Error: Failed to set up the output of the stream\n");
+            return 1;
+        }
+    }
     ///////////// intializing part /////////////
-    TokenizerHandle tokenizer_handler = create_tokenizer(TOKENIZER_PATH);
-    if (!tokenizer_handler) {
-        return 1; // This error is created in create_tokenizer
+    // One core budget for the batch workers, the ONNX Runtime pools and the tokenizer
+    ThreadBudget budget;
+    OrtEnv* env = NULL;
+    StartupLoader startup;
+    bool overlapped_startup = false; // Tokenizer and session of the single model load while the input is read
+    if (!options.coordinate) {
+        if (plan_thread_budget(options.threads, options.batch_workers, &budget) != 0) {
+            return 1;
+        }
+        apply_thread_budget(&budget);
+        print_thread_budget(&budget);
+
+        initialize_ort_api();
+        printf("DONE: initialize_ort_api;\n");
+    }
+    if (!options.coordinate && !options.models_path && !options.bi_encoder && !options.numa) {
+        env = initialize_ort_environment_with_global_thread_pools(budget.intra_op_threads, budget.inter_op_threads);
+        if (env == NULL) {
+            fprintf(stderr, "Error: Failed to initialize ONNX Runtime.\n");
+            return -1;
+        }
+        printf("DONE: initialize_ort_environment;\n");
+        printf("Model: %s\n", options.model_path);
+        SessionConfig session_config = { 0, options.use_mmap, NULL, NULL };
+        if (start_startup_loader(&startup, env, options.model_path, TOKENIZER_PATH, &session_config) != 0) {
+            g_ort->ReleaseEnv(env);
+            return 1;
+        }
+        overlapped_startup = true;
     }
-    printf("DONE: create_tokenizer;\n");  
 
-    initialize_ort_api();
-    printf("DONE: initialize_ort_api;\n");
+    if (!options.worker_address && !options.stream) {
+        // reading data from json file (workers receive their texts from the coordinator)
+        char* json_string = read_file(options.data_path);
+        if (!json_string) {
+            if (overlapped_startup) abandon_startup(&startup, env);
+            return 1;
+        }
+        ///////////// Prepare inputs /////////////
+        int parse_result = options.rerank ? parse_rerank_request(json_string, &rerank_request)
+                                          : parse_requests(json_string, &requests, &num_requests);
+        if (parse_result != 0) {
+            free(json_string);
+            free_requests();
+            if (overlapped_startup) abandon_startup(&startup, env);
+            return 1;
+        }
+        printf("DONE: parse_json;\n");
+        free(json_string);
+    }
+    for (size_t r = 0; r < num_requests; ++r) {
+        if (requests[r].taxonomy && (options.schedule || options.journal_path || options.coordinate ||
+                                     options.cascade_small || options.bi_encoder || options.numa || options.packed)) {
+            fprintf(stderr, "Error: Taxonomy requests can not be run with --schedule, --journal, --coordinate, "
+                            "--cascade, --bi-encoder, --numa or --packed\n");
+            free_requests();
+            if (overlapped_startup) abandon_startup(&startup, env);
+            return 1;
+        }
+    }
+    if (options.prefilter_top_n > 0) {
+        // Only the labels sharing terms with their text reach the model
+        for (size_t r = 0; r < num_requests; ++r) {
+            PrefilterStats stats;
+            if (prefilter_request_labels(&requests[r], options.prefilter_top_n, &stats) != 0) {
+                free_requests();
+                if (overlapped_startup) abandon_startup(&startup, env);
+                return 1;
+            }
+            print_prefilter_stats(&stats);
+        }
+    }
+    if (options.coordinate) {
+        // The coordinator only splits and merges, the worker processes load the model
+        int result = run_shard_coordinator(requests, num_requests, options.prompt_first, options.bind_address,
+                                           options.num_local_workers, argc, argv);
+        free_requests();
+        return result == 0 ? 0 : 1;
+    }
+    ModelRegistry registry = { NULL, 0 };
+    HostedModel single_model = { "default", (char*)options.model_path, TOKENIZER_PATH, options.prompt_first, NULL, NULL };
+    BiEncoder bi_encoder;
+    NumaTopology topology = { NULL, 0 };
+    WorkerGroups worker_groups = { NULL, 0, NULL, 0, DISPATCH_ROUND_ROBIN };
+
+    if (options.models_path) {
+        // All hosted models share the intra-op and inter-op pools of one environment
+        env = initialize_ort_environment_with_global_thread_pools(budget.intra_op_threads,
+                                                                   budget.inter_op_threads);
+        if (env == NULL) {
+            fprintf(stderr, "Error: Failed to initialize ONNX Runtime.\n");
+            free_requests();
+            return -1;
+        }
+        printf("DONE: initialize_ort_environment_with_global_thread_pools;\n");
 
-    OrtEnv* env = initialize_ort_environment();
-    if (env == NULL) {
-        fprintf(stderr, "Error: Failed to initialize ONNX Runtime.\n");
-        return -1;
+        double session_start_time = omp_get_wtime();
+        if (load_model_registry(options.models_path, env, options.use_mmap, &registry) != 0) {
+            fprintf(stderr, "Error: Failed to load models from %s.\n", options.models_path);
+            g_ort->ReleaseEnv(env);
+            free_requests();
+            return -1;
+        }
+        printf("DONE: load_model_registry (%zu models);\n", registry.num_models);
+        printf("Session creation time: %f seconds\n\n", omp_get_wtime() - session_start_time);
+    } else if (options.bi_encoder) {
+        // The text encoder, label encoder and scorer share the thread pools of one environment
+        env = initialize_ort_environment_with_global_thread_pools(budget.intra_op_threads,
+                                                                   budget.inter_op_threads);
+        if (env == NULL) {
+            fprintf(stderr, "Error: Failed to initialize ONNX Runtime.\n");
+            free_requests();
+            return -1;
+        }
+        printf("DONE: initialize_ort_environment_with_global_thread_pools;\n");
+
+        double session_start_time = omp_get_wtime();
+        SessionConfig session_config = { 0, options.use_mmap, NULL, NULL };
+        if (load_bi_encoder(env, &session_config, &bi_encoder) != 0) {
+            g_ort->ReleaseEnv(env);
+            free_requests();
+            return -1;
+        }
+        printf("DONE: load_bi_encoder;\n");
+        printf("Session creation time: %f seconds\n\n", omp_get_wtime() - session_start_time);
+    } else if (overlapped_startup) {
+        single_model.tokenizer = wait_startup_tokenizer(&startup);
+        if (!single_model.tokenizer) {
+            abandon_startup(&startup, env);
+            free_requests();
+            return 1; // This error is created in create_tokenizer
+        }
+    } else {
+        single_model.tokenizer = create_tokenizer(TOKENIZER_PATH);
+        if (!single_model.tokenizer) {
+            free_requests();
+            return 1; // This error is created in create_tokenizer
+        }
+        printf("DONE: create_tokenizer;\n");  
+
+        // Worker groups size and pin the pools of their sessions themselves, one Run per group at a time
+        set_run_slots(0);
+        env = initialize_ort_environment();
+        if (env == NULL) {
+            fprintf(stderr, "Error: Failed to initialize ONNX Runtime.\n");
+            tokenizers_free(single_model.tokenizer);
+            free_requests();
+            return -1;
+        }
+        printf("DONE: initialize_ort_environment;\n");
+
+        double session_start_time = omp_get_wtime();
+        printf("Model: %s\n", options.model_path);
+        // One session per worker group, pinned to the CPUs and memory of its NUMA node
+        if (detect_numa_topology(&topology) != 0 ||
+            create_worker_groups(env, options.model_path, options.use_mmap, &topology,
+                                 options.groups_per_node, options.dispatch, &worker_groups) != 0) {
+            fprintf(stderr, "Error: Failed to create NUMA worker groups.\n");
+            free_numa_topology(&topology);
+            tokenizers_free(single_model.tokenizer);
+            g_ort->ReleaseEnv(env);
+            free_requests();
+            return -1;
+        }
+        print_numa_topology(&topology);
+        printf("DONE: create_worker_groups (%zu groups);\n", worker_groups.num_groups);
+        printf("Session creation time: %f seconds\n\n", omp_get_wtime() - session_start_time);
     }
-    printf("DONE: initialize_ort_environment;\n");
 
-    OrtSession* session = create_ort_session(env, MODEL_PATH, NUM_THREADS);
-    if (session == NULL) {
-        fprintf(stderr, "Error: Failed to create session ONNX Runtime.\n");
-        g_ort->ReleaseEnv(env);
-        return -1;
+    // Plain requests start tokenizing their first batches while the session is still being created,
+    // every other mode (and the warmup) needs the session first
+    bool startup_pending = overlapped_startup;
+    bool defer_session = overlapped_startup && !options.warmup && !options.worker_address && !options.rerank &&
+                         !options.stream && !options.schedule && !options.journal_path && !options.packed;
+    if (startup_pending && !defer_session) {
+        startup_pending = false;
+        if (take_startup_session(&startup, &single_model) != 0) {
+            tokenizers_free(single_model.tokenizer);
+            g_ort->ReleaseEnv(env);
+            free_requests();
+            return -1;
+        }
     }
-    printf("DONE: create_ort_session;\n\n");
-    
+
+    // Pad batches to the sequence length buckets and plan their shapes ahead of the first request
+    set_sequence_buckets(&options.buckets);
+    set_batch_memory_limit(options.max_batch_memory);
+    if (options.warmup) {
+        double warmup_start_time = omp_get_wtime();
+        // Full batches and the last, partial batch of every request
+        size_t full_rows = BATCH_SIZE;
+        size_t* row_counts = (size_t*)malloc((num_requests + 1) * sizeof(size_t));
+        size_t num_row_counts = 1;
+        if (row_counts) {
+            row_counts[0] = BATCH_SIZE;
+            for (size_t r = 0; r < num_requests; ++r) {
+                row_counts[num_row_counts++] = requests[r].num_texts % BATCH_SIZE;
+            }
+        }
+        const size_t* warmup_rows = row_counts ? row_counts : &full_rows;
+        if (options.bi_encoder) {
+            warmup_session(bi_encoder.text_encoder, bi_encoder.tokenizer, options.prompt_first, &options.buckets,
+                           warmup_rows, num_row_counts, MAX_LENGTH);
+        }
+        for (size_t g = 0; g < worker_groups.num_groups; ++g) {
+            warmup_session(worker_groups.groups[g].session, single_model.tokenizer, options.prompt_first, &options.buckets,
+                           warmup_rows, num_row_counts, MAX_LENGTH);
+        }
+        size_t num_models = options.models_path ? registry.num_models : (options.bi_encoder || options.numa ? 0 : 1);
+        for (size_t m = 0; m < num_models; ++m) {
+            HostedModel* model = options.models_path ? &registry.models[m] : &single_model;
+            warmup_session(model->session, model->tokenizer, model->prompt_first, &options.buckets,
+                           warmup_rows, num_row_counts, MAX_LENGTH);
+        }
+        free(row_counts);
+        printf("DONE: warmup_session;\n");
+        printf("Warmup time: %f seconds\n\n", omp_get_wtime() - warmup_start_time);
+    }
+
     /////////////////////////////////////////////////////////
     //////////////////// INFERENCE START ////////////////////
-    // Initialize queue mutex
-    pthread_mutex_init(&queue_mutex, NULL);
-
-    // Allocate memory for tensors
-    size_t num_batches = (num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
-    input_ids_tensors = malloc(sizeof(OrtValue*) * num_batches);
-    attention_mask_tensors = malloc(sizeof(OrtValue*) * num_batches);
-    output_tensors = malloc(sizeof(OrtValue*) * num_batches);
-
-    double start_time, end_time;
-    start_time = omp_get_wtime();
-
-    // Parallel preprocessing
-    parallel_preprocess(texts, labels, num_labels, num_texts,
-                       same_labels, prompt_first, tokenizer_handler,
-                       input_ids_tensors, attention_mask_tensors);    
-    // #pragma omp parallel for schedule(dynamic)
-    // for (size_t i = 0; i < num_texts; i += BATCH_SIZE) {
-    //     size_t current_batch_size = (i + BATCH_SIZE > num_texts) ? (num_texts - i) : BATCH_SIZE;
-
-    //     // Prepare input data
-    //     const char** batch_texts = (const char**)&texts[i];
-    //     const char*** batch_labels = (const char***)(same_labels ? (void*)labels : (void*)&labels[i]);
-    //     size_t* batch_num_labels = (same_labels) ? num_labels : &num_labels[i];
-
-    //     // Prepare tokens
-    //     const char** prepared_inputs = prepare_inputs(batch_texts, batch_labels, current_batch_size, batch_num_labels, same_labels, prompt_first);
-    //     TokenizedInputs tokenized = tokenize_inputs(tokenizer_handler, prepared_inputs, current_batch_size, MAX_LENGTH);
-
-    //     // Prepare input tensors
-    //     prepare_input_tensors(&tokenized, &input_ids_tensors[i / BATCH_SIZE], &attention_mask_tensors[i / BATCH_SIZE]);
-
-    //     // Clean up memory
-    //     free_prepared_inputs((char**)prepared_inputs, current_batch_size);
-    //     free_tokenized_inputs(&tokenized);
-    // }
-
-    // Inference stage - processing batches
-    #pragma omp parallel for schedule(dynamic)
-    for (size_t i = 0; i < num_batches; i++) {
-        #ifdef USE_CUDA // GPU
-        pthread_mutex_lock(&queue_mutex);
-        output_tensors[i] = run_inference(session, input_ids_tensors[i], attention_mask_tensors[i]);
-        pthread_mutex_unlock(&queue_mutex);
-        #else
-        output_tensors[i] = run_inference(session, input_ids_tensors[i], attention_mask_tensors[i]);
-        #endif
-    }
-
-    // Postprocess stage - processing batches
-    parallel_postprocess(output_tensors, num_batches, num_texts,
-                        texts, labels, num_labels,
-                        same_labels, num_labels_size, classification_type);
-    // #pragma omp parallel for schedule(dynamic)
-    // for (size_t i = 0; i < num_batches; i++) {
-    //     size_t current_batch_size = (i == num_batches - 1) ? (num_texts - i * BATCH_SIZE) : BATCH_SIZE;
-
-    //     const char** batch_texts = (const char**)&texts[i * BATCH_SIZE];
-    //     const char*** batch_labels = (const char***)(same_labels ? (void*)labels : (void*)&labels[i * BATCH_SIZE]);
-    //     size_t* batch_num_labels = (same_labels) ? num_labels : &num_labels[i * BATCH_SIZE];
-
-    //     process_output_tensor(output_tensors[i], g_ort, same_labels, batch_labels, batch_num_labels, num_labels_size, THRESHOLD,
-    //                           current_batch_size, batch_texts, classification_type);
-    //     // Free output tensor after processing
-    //     g_ort->ReleaseValue(output_tensors[i]);
-    // }
-    
-    end_time = omp_get_wtime();
-    printf("Execution time: %f seconds\n", end_time - start_time);
-    // Free resources
-    for (size_t i = 0; i < num_batches; i++) {
-        g_ort->ReleaseValue(input_ids_tensors[i]);
-        g_ort->ReleaseValue(attention_mask_tensors[i]);
-        // g_ort->ReleaseValue(output_tensors[i]);
+    if (options.perf_counters) {
+        enable_stage_counters(); // After the warmup, which would count as inference
+    }
+    int exit_code = 0;
+    HostedModel* cascade_small = NULL;
+    HostedModel* cascade_large = NULL;
+    if (options.cascade_small) {
+        cascade_small = find_model(&registry, options.cascade_small);
+        cascade_large = find_model(&registry, options.cascade_large);
+        if (!cascade_small || !cascade_large) {
+            fprintf(stderr, "Error: Cascade models %s and %s must be listed in %s.\n",
+                    options.cascade_small, options.cascade_large, options.models_path);
+            exit_code = 1;
+        }
+    }
+    if (options.worker_address && run_shard_worker(options.worker_address, &single_model) != 0) {
+        exit_code = 1;
+    }
+    if (options.rerank) {
+        exit_code = run_rerank(&options, &single_model);
+    }
+    if (options.stream) {
+        // Records are classified as they arrive until stdin is closed, compressed stdin is decompressed
+        // on a background thread. SIGHUP or a {"control": "reload"} record reloads the model and tokenizer.
+        CompressedPipe input_pipe;
+        ModelReloader reloader;
+        if (start_model_reloader(&reloader, env, options.model_path, TOKENIZER_PATH, options.prompt_first,
+                                 options.use_mmap, &options.buckets, single_model.session, single_model.tokenizer) != 0) {
+            exit_code = 1;
+        } else if (open_decompressing_pipe(STDIN_FILENO, &input_pipe) != 0) {
+            stop_model_reloader(&reloader, &single_model.session, &single_model.tokenizer);
+            exit_code = 1;
+        } else {
+            StreamStats stats;
+            if (run_stream(input_pipe.plain_fd, stream_output, &reloader, options.prompt_first,
+                           (size_t)budget.batch_workers, options.max_wait_ms / 1000.0, &stats) != 0) {
+                exit_code = 1;
+            }
+            if (close_compressed_pipe(&input_pipe) != 0) {
+                exit_code = 1; // Corrupt or truncated input
+            }
+            // The current generation is released with the other resources below
+            stop_model_reloader(&reloader, &single_model.session, &single_model.tokenizer);
+            print_stream_stats(stderr, &stats);
+            print_reload_stats(stderr, &reloader.stats);
+        }
+    }
+    if (options.schedule || options.journal_path) {
+        // Batches of all requests share the workers
+        HostedModel** request_models = (HostedModel**)calloc(num_requests, sizeof(HostedModel*));
+        if (!request_models) {
+            fprintf(stderr, "Error: Memory allocation for request models failed\n");
+            exit_code = 1;
+        } else {
+            for (size_t r = 0; r < num_requests; ++r) {
+                request_models[r] = options.models_path ? find_model(&registry, requests[r].model_name) : &single_model;
+            }
+            if (options.journal_path) {
+                exit_code = run_journaled_job(&options, request_models);
+            } else {
+                // The most urgent batches run first
+                SchedulerStats stats;
+                if (run_scheduled_requests(requests, num_requests, request_models, &stats) != 0) {
+                    exit_code = 1;
+                }
+                print_scheduler_stats(&stats);
+            }
+            free(request_models);
+        }
     }
+    for (size_t r = 0; r < num_requests && !options.schedule && !options.journal_path; ++r) {
+        if (options.cascade_small) {
+            if (!cascade_small || !cascade_large) {
+                break;
+            }
+            // The cascade decides per text which model classifies it
+            CascadeStats stats;
+            double start_time = omp_get_wtime();
+            if (classify_request_cascade(cascade_small, cascade_large, &requests[r], options.cascade_margin, &stats) != 0) {
+                exit_code = 1;
+            }
+            printf("Execution time: %f seconds\n", omp_get_wtime() - start_time);
+            print_cascade_stats(&stats, cascade_small->name, cascade_large->name);
+            continue;
+        }
+        if (options.bi_encoder) {
+            double start_time = omp_get_wtime();
+            if (classify_request_bi_encoder(&bi_encoder, &requests[r]) != 0) {
+                exit_code = 1;
+            }
+            printf("Execution time: %f seconds\n", omp_get_wtime() - start_time);
+            continue;
+        }
 
-    free(input_ids_tensors);
-    free(attention_mask_tensors);
-    free(output_tensors);
+        HostedModel* model = options.models_path ? find_model(&registry, requests[r].model_name) : &single_model;
+        if (model == NULL) {
+            fprintf(stderr, "Error: Request %zu is routed to unknown model %s.\n", r, requests[r].model_name);
+            exit_code = 1;
+            continue;
+        }
+        if (num_requests > 1 || options.models_path) {
+            printf("Request %zu (model %s):\n", r, model->name);
+        }
 
-    // Free tokenizer
-    tokenizers_free(tokenizer_handler);
-    // Free onnx
-    g_ort->ReleaseSession(session);
-    g_ort->ReleaseEnv(env);
+        double start_time, end_time;
+        start_time = omp_get_wtime();
+        if (startup_pending && requests[r].taxonomy) {
+            startup_pending = false;
+            if (take_startup_session(&startup, &single_model) != 0) {
+                exit_code = 1;
+                break;
+            }
+        }
+        if (requests[r].taxonomy) {
+            // Level by level, only the promising branches are expanded
+            TaxonomyStats stats;
+            if (classify_request_taxonomy(model->session, model->tokenizer, model->prompt_first, &requests[r], &stats) != 0) {
+                exit_code = 1;
+            }
+            printf("Execution time: %f seconds\n", omp_get_wtime() - start_time);
+            print_taxonomy_stats(&stats);
+            continue;
+        }
+        if (options.packed) {
+            // Several short prompts share every row, each only attends to itself
+            PackingStats stats;
+            if (classify_request_packed(model->session, model->tokenizer, model->prompt_first, &requests[r],
+                                        options.pack_length, &stats) != 0) {
+                exit_code = 1;
+            }
+            printf("Execution time: %f seconds\n", omp_get_wtime() - start_time);
+            print_packing_stats(&stats);
+            continue;
+        }
+        if (options.numa) {
+            if (classify_request_grouped(&worker_groups, model->tokenizer, model->prompt_first, &requests[r]) != 0) {
+                exit_code = 1;
+            }
+        } else if (startup_pending) {
+            // The first batches are tokenized while the session is still being created
+            if (classify_request_during_startup(&startup, model->tokenizer, model->prompt_first, &requests[r]) != 0) {
+                exit_code = 1;
+            }
+            startup_pending = false;
+            if (take_startup_session(&startup, &single_model) != 0) {
+                exit_code = 1;
+                break;
+            }
+        } else if (classify_request(model->session, model->tokenizer, model->prompt_first, &requests[r]) != 0) {
+            exit_code = 1;
+        }
+        end_time = omp_get_wtime();
+        printf("Execution time: %f seconds\n", end_time - start_time);
+    }
+    if (options.numa) {
+        print_worker_group_stats(&worker_groups);
+    }
+    if (startup_pending) {
+        startup_pending = false; // No request was classified, the session is released below
+        if (take_startup_session(&startup, &single_model) != 0) {
+            exit_code = 1;
+        }
+    }
+    print_time_to_first_result();
+    print_batch_split_stats();
+    print_batch_cost_model();
+    print_stage_counters();
+    print_memory_stats(stdout);
 
-    pthread_mutex_destroy(&queue_mutex);
-    return 0;
-}
\ No newline at end of file
+    // Free resources
+    if (options.models_path) {
+        free_model_registry(&registry);
+    } else if (options.bi_encoder) {
+        free_bi_encoder(&bi_encoder);
+    } else {
+        // Free tokenizer
+        tokenizers_free(single_model.tokenizer);
+        // Free onnx
+        release_ort_session(single_model.session);
+        free_worker_groups(&worker_groups);
+        free_numa_topology(&topology);
+    }
+    g_ort->ReleaseEnv(env);
+    free_requests();
+    if (stream_output) {
+        fclose(stream_output);
+        stream_output = NULL;
+    }
+    return exit_code;
+}
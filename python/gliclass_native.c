@@ -0,0 +1,306 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <omp.h>
+
+#include "model.h"
+#include "tokenizer.h"
+#include "parallel_processor.h"
+#include "postprocessor.h"
+#include "read_data.h"
+#include "thread_budget.h"
+#include "configs.h"
+#include "paths.h"
+
+#define SCORES_CAPSULE_NAME "gliclass_native.scores"
+#define SCORES_ALIGNMENT 64 // Alignment of the score buffers (cache line, also fine for SIMD loads in NumPy)
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+static OrtEnv* module_env = NULL; // ONNX Runtime allows one environment per process, shared by all engines
+
+/**
+ * Creates the environment of the module with one thread budget for the process (see plan_thread_budget):
+ * the batches of all engines run on OpenMP threads, at most batch_workers of them in Run at once, on
+ * the global intra-op pool of the environment.
+ *
+ * @return 0 if successful, -1 with a Python exception set.
+ */
+static int create_module_env(int cores, int batch_workers) {
+    ThreadBudget budget;
+    if (plan_thread_budget(cores, batch_workers, &budget) != 0) {
+        PyErr_Format(PyExc_ValueError, "%d batch workers do not fit into a budget of %d cores", batch_workers, cores);
+        return -1;
+    }
+    apply_thread_budget(&budget);
+    initialize_ort_api();
+    module_env = initialize_ort_environment_with_global_thread_pools(budget.intra_op_threads, budget.inter_op_threads);
+    if (module_env == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Failed to create the ONNX Runtime environment");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Structure of a gliclass_native.Engine: a loaded model with its tokenizer that classifies many calls.
+ */
+typedef struct {
+    PyObject_HEAD
+    OrtSession* session;        /**< Session of the model. */
+    TokenizerHandle tokenizer;  /**< Tokenizer of the model. */
+    bool prompt_first;          /**< Place the labels prompt before the text. */
+} EngineObject;
+
+/**
+ * Releases the score buffer of an array once NumPy drops its last reference.
+ */
+static void free_scores_capsule(PyObject* capsule) {
+    free(PyCapsule_GetPointer(capsule, SCORES_CAPSULE_NAME));
+}
+
+/**
+ * Wraps a native score buffer in a NumPy array without copying it. The array owns the buffer.
+ *
+ * @return A new reference to the array, or NULL with a Python exception set (the buffer is freed).
+ */
+static PyObject* wrap_scores(float* scores, size_t num_texts, size_t num_labels) {
+    npy_intp dims[2] = { (npy_intp)num_texts, (npy_intp)num_labels };
+    PyObject* array = PyArray_SimpleNewFromData(2, dims, NPY_FLOAT32, scores);
+    if (array == NULL) {
+        free(scores);
+        return NULL;
+    }
+    PyObject* capsule = PyCapsule_New(scores, SCORES_CAPSULE_NAME, free_scores_capsule);
+    if (capsule == NULL) {
+        Py_DECREF(array);
+        free(scores);
+        return NULL;
+    }
+    if (PyArray_SetBaseObject((PyArrayObject*)array, capsule) != 0) { // Steals the capsule
+        Py_DECREF(array);
+        return NULL;
+    }
+    return array;
+}
+
+/**
+ * Gets the UTF-8 buffers of a tuple of strings. They stay valid while the tuple is alive.
+ *
+ * @return A malloc'ed array of num_items pointers, or NULL with a Python exception set.
+ */
+static char** get_utf8_strings(PyObject* items, const char* what) {
+    Py_ssize_t num_items = PyTuple_GET_SIZE(items);
+    char** strings = (char**)malloc((num_items > 0 ? (size_t)num_items : 1) * sizeof(char*));
+    if (strings == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < num_items; ++i) {
+        PyObject* item = PyTuple_GET_ITEM(items, i);
+        if (!PyUnicode_Check(item)) {
+            PyErr_Format(PyExc_TypeError, "%s must be strings, item %zd is %s", what, i, Py_TYPE(item)->tp_name);
+            free(strings);
+            return NULL;
+        }
+        strings[i] = (char*)PyUnicode_AsUTF8(item);
+        if (strings[i] == NULL) {
+            free(strings);
+            return NULL;
+        }
+    }
+    return strings;
+}
+
+static int Engine_init(EngineObject* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = { "model_path", "tokenizer_path", "prompt_first", "num_threads", "use_mmap",
+                                "batch_workers", NULL };
+    const char* model_path = MODEL_PATH;
+    const char* tokenizer_path = TOKENIZER_PATH;
+    int prompt_first = 0;
+    int num_threads = 0;
+    int use_mmap = 0;
+    int batch_workers = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|sspipi", keywords, &model_path, &tokenizer_path,
+                                     &prompt_first, &num_threads, &use_mmap, &batch_workers)) {
+        return -1;
+    }
+    if (self->session != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Engine is already initialized");
+        return -1;
+    }
+    // The first engine sizes the thread budget of the process, later engines share it
+    if (module_env == NULL && create_module_env(num_threads, batch_workers) != 0) {
+        return -1;
+    }
+
+    TokenizerHandle tokenizer = NULL;
+    OrtSession* session = NULL;
+    SessionConfig config = { 0, use_mmap != 0, NULL, NULL }; // Global thread pools of the environment
+    Py_BEGIN_ALLOW_THREADS
+    tokenizer = create_tokenizer(tokenizer_path);
+    session = tokenizer ? create_ort_session_with_config(module_env, model_path, &config) : NULL;
+    Py_END_ALLOW_THREADS
+    if (session == NULL) {
+        if (tokenizer) tokenizers_free(tokenizer);
+        PyErr_Format(PyExc_RuntimeError, "Failed to load the model %s with the tokenizer %s", model_path, tokenizer_path);
+        return -1;
+    }
+    self->session = session;
+    self->tokenizer = tokenizer;
+    self->prompt_first = prompt_first != 0;
+    return 0;
+}
+
+static void Engine_dealloc(EngineObject* self) {
+    release_ort_session(self->session);
+    if (self->tokenizer) tokenizers_free(self->tokenizer);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/**
+ * Engine.classify(texts, labels, raw=False): scores every text against the same labels.
+ * The GIL is released while the batches are tokenized and run, so other Python threads keep going.
+ *
+ * @return A float32 array of shape (len(texts), len(labels)) that wraps the native score buffer:
+ *         sigmoid scores, or the logits if raw is true. Rows of texts that could not be run are NaN.
+ *         NULL with a RuntimeError set if none of the texts could be run.
+ */
+static PyObject* Engine_classify(EngineObject* self, PyObject* args, PyObject* kwargs) {
+    static char* keywords[] = { "texts", "labels", "raw", NULL };
+    PyObject* texts_arg = NULL;
+    PyObject* labels_arg = NULL;
+    int raw = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|p", keywords, &texts_arg, &labels_arg, &raw)) {
+        return NULL;
+    }
+    if (self->session == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Engine is not initialized");
+        return NULL;
+    }
+
+    // Tuples pin the strings while the GIL is released, even if the caller changes its lists meanwhile
+    PyObject* texts_tuple = PySequence_Tuple(texts_arg);
+    PyObject* labels_tuple = texts_tuple ? PySequence_Tuple(labels_arg) : NULL;
+    char** texts = labels_tuple ? get_utf8_strings(texts_tuple, "texts") : NULL;
+    char** labels = texts ? get_utf8_strings(labels_tuple, "labels") : NULL;
+    size_t num_texts = texts_tuple ? (size_t)PyTuple_GET_SIZE(texts_tuple) : 0;
+    size_t num_labels = labels_tuple ? (size_t)PyTuple_GET_SIZE(labels_tuple) : 0;
+    size_t* text_num_labels = labels ? (size_t*)malloc((num_texts > 0 ? num_texts : 1) * sizeof(size_t)) : NULL;
+    float* scores = NULL;
+    PyObject* result = NULL;
+    if (labels && num_labels == 0) {
+        PyErr_SetString(PyExc_ValueError, "labels must not be empty");
+    } else if (labels && (text_num_labels == NULL ||
+               posix_memalign((void**)&scores, SCORES_ALIGNMENT,
+                              (num_texts > 0 ? num_texts : 1) * num_labels * sizeof(float)) != 0)) {
+        scores = NULL;
+        PyErr_NoMemory();
+    }
+
+    if (scores != NULL) {
+        for (size_t i = 0; i < num_texts; ++i) {
+            text_num_labels[i] = num_labels;
+        }
+        ClassificationRequest request = { 0 };
+        request.texts = texts;
+        request.num_texts = num_texts;
+        request.labels = &labels;
+        request.num_labels = text_num_labels;
+        request.num_labels_size = num_labels;
+        request.same_labels = true;
+        request.classification_type = "multi-label";
+
+        size_t num_batches = (num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+        size_t failed = 0;
+        Py_BEGIN_ALLOW_THREADS
+        #pragma omp parallel for schedule(dynamic) reduction(+:failed)
+        for (size_t b = 0; b < num_batches; ++b) {
+            size_t start = b * BATCH_SIZE;
+            size_t count = num_texts - start < BATCH_SIZE ? num_texts - start : BATCH_SIZE;
+            if (run_request_batch_into(self->session, self->tokenizer, self->prompt_first, &request,
+                                       start, count, scores) != 0) {
+                for (size_t i = start * num_labels; i < (start + count) * num_labels; ++i) {
+                    scores[i] = NAN; // Like the rows of a split batch that could not be run
+                }
+                failed++;
+            }
+        }
+        if (!raw) {
+            for (size_t i = 0; i < num_texts * num_labels; ++i) {
+                scores[i] = sigmoid(scores[i]); // In place, the array wraps this buffer
+            }
+        }
+        Py_END_ALLOW_THREADS
+
+        if (num_batches > 0 && failed == num_batches) {
+            free(scores);
+            PyErr_SetString(PyExc_RuntimeError, "Classification failed, see stderr for details");
+        } else {
+            result = wrap_scores(scores, num_texts, num_labels);
+        }
+    }
+
+    free(text_num_labels);
+    free(labels);
+    free(texts);
+    Py_XDECREF(labels_tuple);
+    Py_XDECREF(texts_tuple);
+    return result;
+}
+
+static PyMethodDef Engine_methods[] = {
+    { "classify", (PyCFunction)(void (*)(void))Engine_classify, METH_VARARGS | METH_KEYWORDS,
+      "classify(texts, labels, raw=False)\n--\n\n"
+      "Scores every text against the same labels. Returns a float32 array of shape (len(texts), len(labels))\n"
+      "that wraps the native buffer the model wrote into: sigmoid scores, or the logits if raw is true.\n"
+      "Rows of texts that could not be run are NaN, RuntimeError is raised if no text could be run." },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject EngineType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gliclass_native.Engine",
+    .tp_basicsize = sizeof(EngineObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Engine(model_path='" MODEL_PATH "', tokenizer_path='" TOKENIZER_PATH "', prompt_first=False, "
+              "num_threads=0, use_mmap=False, batch_workers=0)\n--\n\n"
+              "A GLiClass model loaded once and kept for many classify calls. num_threads is the core budget\n"
+              "of the process (0: all CPUs it may run on) and batch_workers the batches in Run at once\n"
+              "(0: one per " TO_STRING(NUM_THREADS) " cores); both are taken from the first Engine and shared by all.",
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Engine_init,
+    .tp_dealloc = (destructor)Engine_dealloc,
+    .tp_methods = Engine_methods,
+};
+
+static struct PyModuleDef gliclass_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "gliclass_native",
+    .m_doc = "Native GLiClass engine: tokenization and ONNX Runtime inference without the GIL.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_gliclass_native(void) {
+    import_array();
+    if (PyType_Ready(&EngineType) < 0) {
+        return NULL;
+    }
+    PyObject* module = PyModule_Create(&gliclass_module);
+    if (module == NULL) {
+        return NULL;
+    }
+    Py_INCREF(&EngineType);
+    if (PyModule_AddObject(module, "Engine", (PyObject*)&EngineType) < 0) {
+        Py_DECREF(&EngineType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "batch_splitter.h"
+#include "model.h"
+#include "tokenizer.h"
+#include "postprocessor.h"
+#include "cost_model.h"
+#include "configs.h"
+
+static size_t batch_memory_limit = 0;       // Ceiling of the estimated batch memory (--max-batch-memory), 0 for none
+static BatchSplitStats split_stats = { 0, 0, 0, 0 };
+static pthread_mutex_t split_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Sets the ceiling of the estimated memory of one Run (see estimate_batch_memory). Batches above it
+ * are split before they run. Must be called before the first batch runs.
+ *
+ * @param max_bytes The ceiling in bytes, 0 to only split batches whose Run failed.
+ */
+void set_batch_memory_limit(size_t max_bytes) {
+    batch_memory_limit = max_bytes;
+}
+
+/**
+ * Estimates the memory the activations of one Run need: the hidden states and feed-forward outputs grow
+ * with the number of tokens, the attention scores with the square of the sequence length.
+ *
+ * @param rows The number of rows of the batch.
+ * @param seq_length The sequence length of the batch.
+ * @return The estimate in bytes.
+ */
+size_t estimate_batch_memory(size_t rows, size_t seq_length) {
+    return rows * seq_length * (size_t)BATCH_MEMORY_PER_TOKEN
+         + rows * seq_length * seq_length * (size_t)BATCH_MEMORY_PER_ATTENTION;
+}
+
+static int get_input_data(OrtValue* tensor, int64_t** data, size_t* rows, size_t* cols) {
+    if (tensor == NULL) {
+        return -1;
+    }
+    OrtTensorTypeAndShapeInfo* info = NULL;
+    OrtStatus* status = g_ort->GetTensorTypeAndShape(tensor, &info);
+    if (status != NULL) {
+        g_ort->ReleaseStatus(status);
+        return -1;
+    }
+    int64_t dims[2] = { 0, 0 };
+    size_t num_dims = 0;
+    status = g_ort->GetDimensionsCount(info, &num_dims);
+    if (status == NULL && num_dims == 2) {
+        status = g_ort->GetDimensions(info, dims, 2);
+    }
+    g_ort->ReleaseTensorTypeAndShapeInfo(info);
+    if (status != NULL || num_dims != 2) {
+        if (status) g_ort->ReleaseStatus(status);
+        return -1;
+    }
+    status = g_ort->GetTensorMutableData(tensor, (void**)data);
+    if (status != NULL) {
+        g_ort->ReleaseStatus(status);
+        return -1;
+    }
+    *rows = (size_t)dims[0];
+    *cols = (size_t)dims[1];
+    return 0;
+}
+
+/**
+ * Creates the logits of rows that could not be run: one NaN per row, which the postprocessing reports
+ * as not classified.
+ */
+static OrtValue* create_failed_rows(size_t rows) {
+    int64_t dims[2] = { (int64_t)rows, 1 };
+    float* data = NULL;
+    OrtValue* tensor = create_float_tensor(dims, 2, &data);
+    for (size_t i = 0; tensor && i < rows; ++i) {
+        data[i] = NAN;
+    }
+    return tensor;
+}
+
+/**
+ * Stacks the logits of two halves of a batch. Halves may have a different number of label columns,
+ * the missing columns are NaN (they are never read, a text only has as many labels as its half has columns).
+ * Releases both halves.
+ */
+static OrtValue* concat_logits(OrtValue* first, OrtValue* second) {
+    float* a = NULL;
+    float* b = NULL;
+    int64_t rows_a = 0, cols_a = 0, rows_b = 0, cols_b = 0;
+    OrtValue* merged = NULL;
+    if (get_output_logits(first, g_ort, &a, &rows_a, &cols_a) == 0 &&
+        get_output_logits(second, g_ort, &b, &rows_b, &cols_b) == 0) {
+        int64_t cols = cols_a > cols_b ? cols_a : cols_b;
+        int64_t dims[2] = { rows_a + rows_b, cols };
+        float* data = NULL;
+        merged = create_float_tensor(dims, 2, &data);
+        for (int64_t i = 0; merged && i < rows_a + rows_b; ++i) {
+            const float* row = i < rows_a ? &a[i * cols_a] : &b[(i - rows_a) * cols_b];
+            int64_t row_cols = i < rows_a ? cols_a : cols_b;
+            for (int64_t j = 0; j < cols; ++j) {
+                data[i * cols + j] = j < row_cols ? row[j] : NAN;
+            }
+        }
+    }
+    if (first) g_ort->ReleaseValue(first);
+    if (second) g_ort->ReleaseValue(second);
+    return merged;
+}
+
+/**
+ * Runs rows [start, start + count) of a batch. The whole batch runs on its own tensors, parts of it
+ * are copied and trimmed to the sequence length bucket of their longest row. A part over the memory
+ * limit, or whose Run fails, is split in half recursively down to single rows. Only a Run that ran out
+ * of memory lowers the learned limit; other failures split the part without affecting later batches.
+ * If prompt_chars is not 0, every successful Run is added to the batch cost model with the shape that ran.
+ */
+static OrtValue* run_rows(OrtSession* session, OrtValue* input_ids_tensor, OrtValue* attention_mask_tensor,
+                          const int64_t* input_ids, const int64_t* attention_mask, size_t num_rows, size_t seq_length,
+                          size_t start, size_t count, size_t first_text, size_t prompt_chars) {
+    bool whole_batch = start == 0 && count == num_rows;
+    size_t length = seq_length;
+    if (!whole_batch) {
+        size_t longest = 1;
+        for (size_t i = start; i < start + count; ++i) {
+            for (size_t j = seq_length; j > longest; --j) {
+                if (attention_mask[i * seq_length + j - 1] != 0) {
+                    longest = j;
+                    break;
+                }
+            }
+        }
+        length = bucket_sequence_length(longest, seq_length);
+    }
+
+    size_t estimate = estimate_batch_memory(count, length);
+    pthread_mutex_lock(&split_mutex);
+    size_t limit = count > 1 ? split_stats.learned_limit : 0;
+    pthread_mutex_unlock(&split_mutex);
+    if (batch_memory_limit > 0 && (limit == 0 || batch_memory_limit < limit)) {
+        limit = batch_memory_limit;
+    }
+
+    OrtValue* output = NULL;
+    if (limit == 0 || estimate <= limit) {
+        if (whole_batch) {
+            output = run_inference(session, input_ids_tensor, attention_mask_tensor);
+        } else {
+            int64_t* ids = (int64_t*)malloc(count * length * sizeof(int64_t));
+            int64_t* mask = (int64_t*)malloc(count * length * sizeof(int64_t));
+            if (!ids || !mask) {
+                fprintf(stderr, "Error: Memory allocation for a split batch failed\n");
+                free(ids);
+                free(mask);
+                return NULL;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                memcpy(&ids[i * length], &input_ids[(start + i) * seq_length], length * sizeof(int64_t));
+                memcpy(&mask[i * length], &attention_mask[(start + i) * seq_length], length * sizeof(int64_t));
+            }
+            OrtValue* ids_tensor = create_tensor(ids, count, length);
+            OrtValue* mask_tensor = create_tensor(mask, count, length);
+            if (ids_tensor && mask_tensor) {
+                output = run_inference(session, ids_tensor, mask_tensor);
+            }
+            if (ids_tensor) g_ort->ReleaseValue(ids_tensor);
+            if (mask_tensor) g_ort->ReleaseValue(mask_tensor);
+            free(ids);
+            free(mask);
+        }
+        if (output) {
+            if (prompt_chars > 0) {
+                // The prompt characters are known only for the longest prompt of the whole batch
+                record_batch_run(count, length, whole_batch ? prompt_chars : 0, last_run_seconds());
+            }
+            return output;
+        }
+        bool out_of_memory = last_run_out_of_memory();
+        pthread_mutex_lock(&split_mutex);
+        split_stats.num_failed_runs++;
+        if (out_of_memory && count > 1 &&
+            (split_stats.learned_limit == 0 || estimate <= split_stats.learned_limit)) {
+            // Later batches of this size are split before they run instead of failing again
+            split_stats.learned_limit = estimate - 1;
+        }
+        pthread_mutex_unlock(&split_mutex);
+    }
+
+    if (count == 1) {
+        if (limit > 0 && estimate > limit) {
+            fprintf(stderr, "Error: Text %zu needs about %zu MB for inference (%zu tokens), more than the limit of %zu MB; "
+                            "it is not classified\n", first_text + start, estimate >> 20, length, limit >> 20);
+        } else {
+            fprintf(stderr, "Error: Inference failed for text %zu (%zu tokens) even alone; it is not classified\n",
+                    first_text + start, length);
+        }
+        pthread_mutex_lock(&split_mutex);
+        split_stats.num_failed_rows++;
+        pthread_mutex_unlock(&split_mutex);
+        return create_failed_rows(1);
+    }
+
+    pthread_mutex_lock(&split_mutex);
+    split_stats.num_splits++;
+    pthread_mutex_unlock(&split_mutex);
+    size_t half = count / 2;
+    OrtValue* first = run_rows(session, input_ids_tensor, attention_mask_tensor, input_ids, attention_mask,
+                               num_rows, seq_length, start, half, first_text, prompt_chars);
+    OrtValue* second = run_rows(session, input_ids_tensor, attention_mask_tensor, input_ids, attention_mask,
+                                num_rows, seq_length, start + half, count - half, first_text, prompt_chars);
+    return concat_logits(first, second);
+}
+
+/**
+ * Runs inference on a batch like run_inference, but keeps the texts of a batch that can not run as a whole.
+ * A batch whose estimated memory exceeds the limit (see set_batch_memory_limit), or whose Run fails
+ * (e.g. out of memory), is split in half and the halves are run the same way, down to single rows.
+ * The estimate of the smallest batch that ran out of memory becomes a learned limit, so later batches are
+ * split before they run and the job continues at the largest batch size that fits. Texts that can not run
+ * even alone are reported on stderr and get NaN logits.
+ *
+ * @param session A pointer to the ONNX model session.
+ * @param input_ids_tensor The input IDs tensor of the batch.
+ * @param attention_mask_tensor The attention mask tensor of the batch.
+ * @param first_text Index of the first text of the batch in its request (for error messages).
+ * @param prompt_chars The characters of the longest prompt of the batch (see batch_prompt_chars) to calibrate
+ *                     the batch cost model with its Runs, 0 to leave the cost model alone.
+ * @return The logits tensor with one row per row of the batch, or NULL if the inputs are missing or memory
+ *         could not be allocated. The caller releases it.
+ */
+OrtValue* run_inference_adaptive(OrtSession* session, OrtValue* input_ids_tensor, OrtValue* attention_mask_tensor,
+                                 size_t first_text, size_t prompt_chars) {
+    int64_t* input_ids = NULL;
+    int64_t* attention_mask = NULL;
+    size_t rows = 0, cols = 0, mask_rows = 0, mask_cols = 0;
+    if (get_input_data(input_ids_tensor, &input_ids, &rows, &cols) != 0 ||
+        get_input_data(attention_mask_tensor, &attention_mask, &mask_rows, &mask_cols) != 0 ||
+        rows != mask_rows || cols != mask_cols || rows == 0) {
+        return run_inference(session, input_ids_tensor, attention_mask_tensor);
+    }
+    return run_rows(session, input_ids_tensor, attention_mask_tensor, input_ids, attention_mask,
+                    rows, cols, 0, rows, first_text, prompt_chars);
+}
+
+/**
+ * Copies the batch splitting statistics of the process.
+ *
+ * @param stats Pointer to the BatchSplitStats structure to fill.
+ */
+void get_batch_split_stats(BatchSplitStats* stats) {
+    pthread_mutex_lock(&split_mutex);
+    *stats = split_stats;
+    pthread_mutex_unlock(&split_mutex);
+}
+
+/**
+ * Prints the batch splitting statistics of the process, nothing if no batch was split.
+ */
+void print_batch_split_stats(void) {
+    BatchSplitStats stats;
+    get_batch_split_stats(&stats);
+    if (stats.num_splits == 0 && stats.num_failed_rows == 0) {
+        return;
+    }
+    printf("Batch splitting: %zu splits, %zu failed runs retried, %zu texts not classified",
+           stats.num_splits, stats.num_failed_runs, stats.num_failed_rows);
+    if (stats.learned_limit > 0) {
+        printf(", batches above %zu MB are split before they run", stats.learned_limit >> 20);
+    }
+    printf("\n");
+}
@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include <pthread.h>
+
+#include "bi_encoder.h"
+#include "parallel_processor.h"
+#include "postprocessor.h"
+#include "model_cache.h"
+#include "tokenizer.h"
+#include "configs.h"
+#include "paths.h"
+
+#ifdef USE_CUDA
+// Serializes scorer Run calls on the GPU
+static pthread_mutex_t scorer_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/**
+ * Tokenizes the inputs in batches (without any label prompt) and runs an encoder over all batches.
+ *
+ * @param session The encoder session.
+ * @param tokenizer The tokenizer of the encoder.
+ * @param inputs The strings to encode.
+ * @param num_inputs The number of strings.
+ * @param batch_size The number of strings per batch.
+ * @param outputs Output array of embedding tensors for each batch (NULL for failed batches). Rows that could
+ *                not be run are NaN, a batch none of whose rows ran has a single column (see run_inference_adaptive).
+ * @return 0 if successful, -1 if memory for the tensors could not be allocated.
+ */
+static int encode_batches(OrtSession* session, TokenizerHandle tokenizer, const char** inputs, size_t num_inputs,
+                          size_t batch_size, OrtValue** outputs) {
+    size_t num_batches = (num_inputs + batch_size - 1) / batch_size;
+    OrtValue** input_ids_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    OrtValue** attention_mask_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    if (!input_ids_tensors || !attention_mask_tensors) {
+        fprintf(stderr, "Error: Memory allocation for batch tensors failed\n");
+        free(input_ids_tensors);
+        free(attention_mask_tensors);
+        return -1;
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t b = 0; b < num_batches; ++b) {
+        size_t start = b * batch_size;
+        size_t count = (start + batch_size > num_inputs) ? (num_inputs - start) : batch_size;
+        TokenizedInputs tokenized = tokenize_inputs(tokenizer, &inputs[start], count, MAX_LENGTH);
+        if (prepare_input_tensors(&tokenized, &input_ids_tensors[b], &attention_mask_tensors[b]) != 0) {
+            input_ids_tensors[b] = NULL;
+            attention_mask_tensors[b] = NULL;
+        }
+        free_tokenized_inputs(&tokenized);
+    }
+
+    parallel_inference(session, input_ids_tensors, attention_mask_tensors, outputs, num_batches);
+
+    for (size_t b = 0; b < num_batches; ++b) {
+        if (input_ids_tensors[b]) g_ort->ReleaseValue(input_ids_tensors[b]);
+        if (attention_mask_tensors[b]) g_ort->ReleaseValue(attention_mask_tensors[b]);
+    }
+    free(input_ids_tensors);
+    free(attention_mask_tensors);
+    return 0;
+}
+
+/**
+ * Appends the embeddings of one encoded label batch to the label cache. Rows that could not be run (NaN)
+ * are not stored, so they are encoded again by a later request instead of failing for good, and a batch
+ * whose embeddings do not have the size of the label encoder (e.g. a batch none of whose rows ran) is
+ * not stored at all.
+ *
+ * @return The number of labels that could not be stored.
+ */
+static size_t append_encoded_labels(BiEncoder* model, const char** labels, float* embeddings, size_t rows,
+                                    size_t dim) {
+    size_t expected_dim = model->embedding_dim ? model->embedding_dim : model->label_cache.dim;
+    if (dim == 0 || (expected_dim != 0 && dim != expected_dim)) {
+        fprintf(stderr, "Error: Label embeddings have size %zu, the label encoder %zu; they are not cached\n",
+                dim, expected_dim);
+        return rows;
+    }
+
+    // The encoded rows are moved to the front, the labels follow them
+    size_t num_encoded = 0;
+    for (size_t i = 0; i < rows; ++i) {
+        bool failed = false;
+        for (size_t j = 0; j < dim && !failed; ++j) {
+            failed = isnan(embeddings[i * dim + j]);
+        }
+        if (failed) {
+            continue;
+        }
+        if (num_encoded != i) {
+            memmove(&embeddings[num_encoded * dim], &embeddings[i * dim], dim * sizeof(float));
+            labels[num_encoded] = labels[i];
+        }
+        num_encoded++;
+    }
+    if (num_encoded > 0 &&
+        append_label_embeddings(&model->label_cache, labels, embeddings, num_encoded, dim) != 0) {
+        return rows;
+    }
+    return rows - num_encoded;
+}
+
+/**
+ * Encodes the labels of a request that are not in the label cache yet and stores their embeddings.
+ *
+ * @param model The bi-encoder model.
+ * @param request The request with the labels.
+ * @return 0 if successful, -1 if some labels could not be encoded or stored.
+ */
+static int cache_request_labels(BiEncoder* model, const ClassificationRequest* request) {
+    size_t num_label_sets = request->same_labels ? 1 : request->num_texts;
+    size_t total_labels = 0;
+    for (size_t i = 0; i < num_label_sets; ++i) {
+        total_labels += request->num_labels[i];
+    }
+    if (total_labels == 0) {
+        return 0;
+    }
+
+    const char** missing = (const char**)malloc(total_labels * sizeof(char*));
+    if (!missing) {
+        fprintf(stderr, "Error: Memory allocation for missing labels failed\n");
+        return -1;
+    }
+    size_t num_missing = 0;
+    for (size_t i = 0; i < num_label_sets; ++i) {
+        for (size_t j = 0; j < request->num_labels[i]; ++j) {
+            if (lookup_label_embedding(&model->label_cache, request->labels[i][j]) == NULL) {
+                missing[num_missing++] = request->labels[i][j];
+            }
+        }
+    }
+    if (num_missing == 0) {
+        free(missing);
+        return 0;
+    }
+
+    // Every label is encoded once, even if several texts use it
+    qsort(missing, num_missing, sizeof(char*), compare_strings);
+    size_t num_unique = 1;
+    for (size_t i = 1; i < num_missing; ++i) {
+        if (strcmp(missing[i], missing[num_unique - 1]) != 0) {
+            missing[num_unique++] = missing[i];
+        }
+    }
+
+    size_t num_batches = (num_unique + LABEL_BATCH_SIZE - 1) / LABEL_BATCH_SIZE;
+    OrtValue** output_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    if (!output_tensors || encode_batches(model->label_encoder, model->label_tokenizer, missing, num_unique,
+                                          LABEL_BATCH_SIZE, output_tensors) != 0) {
+        free(output_tensors);
+        free(missing);
+        return -1;
+    }
+
+    size_t num_failed = 0;
+    for (size_t b = 0; b < num_batches; ++b) {
+        float* embeddings = NULL;
+        int64_t rows = 0, dim = 0;
+        size_t count = num_unique - b * LABEL_BATCH_SIZE < LABEL_BATCH_SIZE ? num_unique - b * LABEL_BATCH_SIZE
+                                                                            : LABEL_BATCH_SIZE;
+        if (get_output_logits(output_tensors[b], g_ort, &embeddings, &rows, &dim) != 0) {
+            num_failed += count;
+        } else {
+            size_t stored = (size_t)rows < count ? (size_t)rows : count;
+            num_failed += count - stored;
+            num_failed += append_encoded_labels(model, &missing[b * LABEL_BATCH_SIZE], embeddings, stored,
+                                                (size_t)dim);
+        }
+        if (output_tensors[b]) g_ort->ReleaseValue(output_tensors[b]);
+    }
+    printf("Label cache: encoded %zu new labels (%zu labels cached)\n", num_unique - num_failed,
+           model->label_cache.num_entries);
+    if (num_failed > 0) {
+        fprintf(stderr, "Error: %zu labels could not be encoded, the texts using them are not classified\n",
+                num_failed);
+    }
+    int result = num_failed > 0 ? -1 : 0;
+
+    free(output_tensors);
+    free(missing);
+    return result;
+}
+
+/**
+ * Scores one batch of text embeddings against the cached embeddings of their labels.
+ * Texts with fewer labels than the longest label list of the batch are padded with zero embeddings.
+ * Texts with a label that could not be encoded get NaN logits, which are printed as not classified.
+ *
+ * @param model The bi-encoder model.
+ * @param request The request with the labels.
+ * @param start The index of the first text of the batch in the request.
+ * @param text_embeddings The text embeddings of the batch [batch x dim].
+ * @return The logits tensor of the batch [batch x labels], or NULL if an error occurs.
+ */
+static OrtValue* score_batch(BiEncoder* model, const ClassificationRequest* request, size_t start,
+                             OrtValue* text_embeddings) {
+    float* text_data = NULL;
+    int64_t rows = 0, dim = 0;
+    if (get_output_logits(text_embeddings, g_ort, &text_data, &rows, &dim) != 0) {
+        return NULL;
+    }
+    if ((size_t)dim != model->label_cache.dim) {
+        fprintf(stderr, "Error: Text embeddings have size %lld, label embeddings %zu\n",
+                (long long)dim, model->label_cache.dim);
+        return NULL;
+    }
+
+    size_t max_labels = 0;
+    for (size_t i = 0; i < (size_t)rows; ++i) {
+        if (request->num_labels[start + i] > max_labels) {
+            max_labels = request->num_labels[start + i];
+        }
+    }
+    int64_t label_dims[3] = { rows, (int64_t)max_labels, dim };
+    float* label_data = NULL;
+    OrtValue* label_embeddings = create_float_tensor(label_dims, 3, &label_data);
+    if (label_embeddings == NULL) {
+        return NULL;
+    }
+    bool* missing_labels = (bool*)calloc((size_t)rows > 0 ? (size_t)rows : 1, sizeof(bool));
+    if (missing_labels == NULL) {
+        fprintf(stderr, "Error: Memory allocation for missing labels failed\n");
+        g_ort->ReleaseValue(label_embeddings);
+        return NULL;
+    }
+    memset(label_data, 0, (size_t)rows * max_labels * (size_t)dim * sizeof(float));
+    for (size_t i = 0; i < (size_t)rows; ++i) {
+        char** labels = request->same_labels ? request->labels[0] : request->labels[start + i];
+        for (size_t j = 0; j < request->num_labels[start + i]; ++j) {
+            const float* embedding = lookup_label_embedding(&model->label_cache, labels[j]);
+            if (embedding) {
+                memcpy(&label_data[(i * max_labels + j) * dim], embedding, (size_t)dim * sizeof(float));
+            } else {
+                missing_labels[i] = true; // The label could not be encoded
+            }
+        }
+    }
+
+    const char* input_names[] = { "text_embeddings", "label_embeddings" };
+    OrtValue* input_tensors[] = { text_embeddings, label_embeddings };
+    #ifdef USE_CUDA // GPU
+    pthread_mutex_lock(&scorer_mutex);
+    OrtValue* logits = run_session(model->scorer, input_names, input_tensors, 2);
+    pthread_mutex_unlock(&scorer_mutex);
+    #else
+    OrtValue* logits = run_session(model->scorer, input_names, input_tensors, 2);
+    #endif
+    g_ort->ReleaseValue(label_embeddings);
+
+    // Texts scored against a missing label embedding are printed as not classified
+    float* logits_data = NULL;
+    int64_t logits_rows = 0, cols = 0;
+    if (logits && get_output_logits(logits, g_ort, &logits_data, &logits_rows, &cols) == 0) {
+        for (size_t i = 0; i < (size_t)rows && i < (size_t)logits_rows; ++i) {
+            for (size_t j = 0; missing_labels[i] && j < (size_t)cols; ++j) {
+                logits_data[i * cols + j] = NAN;
+            }
+        }
+    }
+    free(missing_labels);
+    return logits;
+}
+
+/**
+ * Loads the text encoder, label encoder and scorer of a bi-encoder (TEXT_ENCODER_PATH, LABEL_ENCODER_PATH
+ * and SCORER_PATH), their tokenizers and the label cache keyed by the hash of the label encoder.
+ *
+ * @param env The ONNX Runtime environment.
+ * @param config The configuration of the three sessions.
+ * @param model Pointer to the BiEncoder structure to fill.
+ * @return 0 if successful, -1 if an error occurs (everything loaded so far is freed).
+ */
+int load_bi_encoder(OrtEnv* env, const SessionConfig* config, BiEncoder* model) {
+    memset(model, 0, sizeof(*model));
+
+    model->tokenizer = create_tokenizer(TOKENIZER_PATH);
+    if (!model->tokenizer) {
+        return -1;
+    }
+    // Bi-encoders with the same backbone for texts and labels share the tokenizer
+    model->label_tokenizer = file_exists(LABEL_TOKENIZER_PATH) ? create_tokenizer(LABEL_TOKENIZER_PATH) : model->tokenizer;
+    if (!model->label_tokenizer) {
+        free_bi_encoder(model);
+        return -1;
+    }
+
+    printf("Text encoder: %s\nLabel encoder: %s\nScorer: %s\n", TEXT_ENCODER_PATH, LABEL_ENCODER_PATH, SCORER_PATH);
+    model->text_encoder = create_ort_session_with_config(env, TEXT_ENCODER_PATH, config);
+    model->label_encoder = model->text_encoder ? create_ort_session_with_config(env, LABEL_ENCODER_PATH, config) : NULL;
+    model->scorer = model->label_encoder ? create_ort_session_with_config(env, SCORER_PATH, config) : NULL;
+    if (!model->scorer) {
+        fprintf(stderr, "Error: Failed to create bi-encoder sessions.\n");
+        free_bi_encoder(model);
+        return -1;
+    }
+    model->embedding_dim = get_session_output_dim(model->label_encoder);
+
+    uint64_t hash = hash_model_file(LABEL_ENCODER_PATH);
+    char* cache_path = hash ? get_cache_file_path(LABEL_ENCODER_PATH, MODEL_CACHE_DIR, hash, ".labels") : NULL;
+    if (!cache_path || open_label_cache(cache_path, hash, &model->label_cache) != 0) {
+        fprintf(stderr, "Error: Failed to open the label cache.\n");
+        free(cache_path);
+        free_bi_encoder(model);
+        return -1;
+    }
+    printf("Label cache: %s (%zu labels cached)\n", cache_path, model->label_cache.num_entries);
+    free(cache_path);
+    return 0;
+}
+
+/**
+ * Classifies all texts of a request with a bi-encoder and prints the results in text order.
+ * Labels missing from the label cache are encoded first, then the texts are encoded (without any
+ * label prompt) and scored against the cached label embeddings.
+ *
+ * @param model The bi-encoder model.
+ * @param request The request with texts, labels and classification type.
+ * @return 0 if successful, -1 if an error occurs.
+ */
+int classify_request_bi_encoder(BiEncoder* model, const ClassificationRequest* request) {
+    int result = cache_request_labels(model, request);
+
+    size_t num_batches = (request->num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+    OrtValue** text_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    OrtValue** output_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    if (!text_tensors || !output_tensors ||
+        encode_batches(model->text_encoder, model->tokenizer, (const char**)request->texts, request->num_texts,
+                       BATCH_SIZE, text_tensors) != 0) {
+        free(text_tensors);
+        free(output_tensors);
+        return -1;
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t b = 0; b < num_batches; ++b) {
+        if (text_tensors[b]) {
+            output_tensors[b] = score_batch(model, request, b * BATCH_SIZE, text_tensors[b]);
+        }
+    }
+
+    // Results in text order, texts of failed batches are written as not classified (NaN logits)
+    const float failed = NAN;
+    for (size_t b = 0; b < num_batches; ++b) {
+        float* logits = NULL;
+        int64_t rows = 0, cols = 0;
+        size_t start = b * BATCH_SIZE;
+        size_t count = (start + BATCH_SIZE > request->num_texts) ? (request->num_texts - start) : BATCH_SIZE;
+        bool valid = get_output_logits(output_tensors[b], g_ort, &logits, &rows, &cols) == 0 && (size_t)rows == count;
+        for (size_t i = start; i < start + count; ++i) {
+            const char* const* labels = (const char* const*)(request->same_labels ? request->labels[0] : request->labels[i]);
+            if (!valid) {
+                write_text_predictions(stdout, (int)i, request->texts[i], &failed, 1, labels, request->num_labels[i],
+                                       THRESHOLD, request->classification_type);
+                result = -1;
+                continue;
+            }
+            size_t num_classes = request->num_labels[i] < (size_t)cols ? request->num_labels[i] : (size_t)cols;
+            write_text_predictions(stdout, (int)i, request->texts[i], &logits[(i - start) * cols], num_classes,
+                                   labels, request->num_labels[i], THRESHOLD, request->classification_type);
+        }
+        if (output_tensors[b]) g_ort->ReleaseValue(output_tensors[b]);
+        if (text_tensors[b]) g_ort->ReleaseValue(text_tensors[b]);
+    }
+
+    free(text_tensors);
+    free(output_tensors);
+    return result;
+}
+
+/**
+ * Frees the sessions, tokenizers and label cache of a bi-encoder.
+ *
+ * @param model The bi-encoder model.
+ */
+void free_bi_encoder(BiEncoder* model) {
+    release_ort_session(model->text_encoder);
+    release_ort_session(model->label_encoder);
+    release_ort_session(model->scorer);
+    if (model->label_tokenizer && model->label_tokenizer != model->tokenizer) {
+        tokenizers_free(model->label_tokenizer);
+    }
+    if (model->tokenizer) {
+        tokenizers_free(model->tokenizer);
+    }
+    close_label_cache(&model->label_cache);
+    memset(model, 0, sizeof(*model));
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "cascade.h"
+#include "parallel_processor.h"
+#include "postprocessor.h"
+#include "model.h"
+#include "configs.h"
+
+/**
+ * Runs one model over a subset of texts and stores a copy of the logits of every text.
+ * Texts that could not be run (NaN logits, see run_inference_adaptive) keep no logits.
+ *
+ * @param model The hosted model to run.
+ * @param texts Array of texts of the subset.
+ * @param labels Labels of the subset (a single set if same_labels is true).
+ * @param num_labels Number of labels for each text of the subset.
+ * @param num_texts Number of texts in the subset.
+ * @param same_labels Whether all texts share the same labels.
+ * @param text_ids Index of every text of the subset in the request.
+ * @param text_logits Per request text: the copied logits (filled for the texts of the subset).
+ * @param text_num_classes Per request text: the number of logits.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+static int run_stage(const HostedModel* model, char** texts, char*** labels, size_t* num_labels, size_t num_texts,
+                     bool same_labels, const size_t* text_ids, float** text_logits, size_t* text_num_classes) {
+    size_t num_batches = (num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+    OrtValue** input_ids_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    OrtValue** attention_mask_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    OrtValue** output_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    if (!input_ids_tensors || !attention_mask_tensors || !output_tensors) {
+        fprintf(stderr, "Error: Memory allocation for batch tensors failed\n");
+        free(input_ids_tensors);
+        free(attention_mask_tensors);
+        free(output_tensors);
+        return -1;
+    }
+
+    parallel_preprocess(texts, labels, num_labels, num_texts, same_labels, model->prompt_first, model->tokenizer,
+                        input_ids_tensors, attention_mask_tensors);
+    parallel_inference(model->session, input_ids_tensors, attention_mask_tensors, output_tensors, num_batches);
+
+    int result = 0;
+    for (size_t b = 0; b < num_batches; ++b) {
+        float* logits = NULL;
+        int64_t rows = 0, cols = 0;
+        if (get_output_logits(output_tensors[b], g_ort, &logits, &rows, &cols) == 0) {
+            for (size_t i = 0; i < (size_t)rows && b * BATCH_SIZE + i < num_texts; ++i) {
+                size_t id = text_ids[b * BATCH_SIZE + i];
+                if (cols > 0 && isnan(logits[i * cols])) {
+                    continue;
+                }
+                text_logits[id] = (float*)malloc(cols * sizeof(float));
+                if (!text_logits[id]) {
+                    result = -1;
+                    continue;
+                }
+                memcpy(text_logits[id], &logits[i * cols], cols * sizeof(float));
+                text_num_classes[id] = (size_t)cols;
+            }
+        }
+        if (output_tensors[b]) g_ort->ReleaseValue(output_tensors[b]);
+        if (input_ids_tensors[b]) g_ort->ReleaseValue(input_ids_tensors[b]);
+        if (attention_mask_tensors[b]) g_ort->ReleaseValue(attention_mask_tensors[b]);
+    }
+
+    free(input_ids_tensors);
+    free(attention_mask_tensors);
+    free(output_tensors);
+    return result;
+}
+
+/**
+ * Classifies a request with a small-to-large model cascade and prints the results in text order.
+ * Every text first goes through the small model. Texts whose prediction is confident (see
+ * is_confident_prediction) are finalized right away, only the remaining ones are re-batched
+ * for the large model.
+ *
+ * @param small_model The cheap model of the first stage.
+ * @param large_model The expensive model of the second stage.
+ * @param request The request with texts, labels and classification type.
+ * @param margin The confidence margin of the small model (see is_confident_prediction).
+ * @param stats Pointer to the CascadeStats structure to fill.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+int classify_request_cascade(const HostedModel* small_model, const HostedModel* large_model,
+                             const ClassificationRequest* request, float margin, CascadeStats* stats) {
+    size_t num_texts = request->num_texts;
+    memset(stats, 0, sizeof(*stats));
+    stats->num_texts = num_texts;
+
+    float** text_logits = (float**)calloc(num_texts, sizeof(float*));
+    size_t* text_num_classes = (size_t*)calloc(num_texts, sizeof(size_t));
+    size_t* text_ids = (size_t*)malloc(num_texts * sizeof(size_t));
+    char** deferred_texts = (char**)malloc(num_texts * sizeof(char*));
+    char*** deferred_labels = (char***)malloc(num_texts * sizeof(char**));
+    size_t* deferred_num_labels = (size_t*)malloc(num_texts * sizeof(size_t));
+    size_t* deferred_ids = (size_t*)malloc(num_texts * sizeof(size_t));
+    int result = 0;
+    if (!text_logits || !text_num_classes || !text_ids || !deferred_texts || !deferred_labels ||
+        !deferred_num_labels || !deferred_ids) {
+        fprintf(stderr, "Error: Memory allocation for cascade failed\n");
+        result = -1;
+        goto cleanup;
+    }
+
+    // Stage 1: small model over all texts
+    double start_time = omp_get_wtime();
+    for (size_t i = 0; i < num_texts; ++i) {
+        text_ids[i] = i;
+    }
+    if (run_stage(small_model, request->texts, request->labels, request->num_labels, num_texts,
+                  request->same_labels, text_ids, text_logits, text_num_classes) != 0) {
+        result = -1;
+        goto cleanup;
+    }
+
+    size_t num_deferred = 0;
+    for (size_t i = 0; i < num_texts; ++i) {
+        size_t text_labels = request->num_labels[i];
+        size_t num_classes = text_num_classes[i] < text_labels ? text_num_classes[i] : text_labels;
+        if (text_logits[i] && is_confident_prediction(text_logits[i], num_classes, THRESHOLD, margin,
+                                                      request->classification_type)) {
+            stats->accepted_small++;
+            continue;
+        }
+        free(text_logits[i]);
+        text_logits[i] = NULL;
+        deferred_texts[num_deferred] = request->texts[i];
+        deferred_labels[num_deferred] = request->same_labels ? request->labels[0] : request->labels[i];
+        deferred_num_labels[num_deferred] = request->num_labels[i];
+        deferred_ids[num_deferred] = i;
+        num_deferred++;
+    }
+    stats->small_time = omp_get_wtime() - start_time;
+
+    // Stage 2: large model over the ambiguous texts only
+    if (num_deferred > 0) {
+        start_time = omp_get_wtime();
+        char*** stage_labels = request->same_labels ? request->labels : deferred_labels;
+        if (run_stage(large_model, deferred_texts, stage_labels, deferred_num_labels, num_deferred,
+                      request->same_labels, deferred_ids, text_logits, text_num_classes) != 0) {
+            result = -1;
+        }
+        for (size_t d = 0; d < num_deferred; ++d) {
+            if (text_logits[deferred_ids[d]]) {
+                stats->accepted_large++; // Texts of failed batches are not accepted by anyone
+            } else {
+                stats->failed++;
+            }
+        }
+        stats->large_time = omp_get_wtime() - start_time;
+    }
+
+    // Results in text order, texts of failed batches are written as not classified (NaN logits)
+    const float failed = NAN;
+    for (size_t i = 0; i < num_texts; ++i) {
+        const char* const* labels = (const char* const*)(request->same_labels ? request->labels[0] : request->labels[i]);
+        const float* logits = text_logits[i] ? text_logits[i] : &failed;
+        size_t num_classes = text_logits[i] ? text_num_classes[i] : 1;
+        write_text_predictions(stdout, (int)i, request->texts[i], logits, num_classes,
+                               labels, request->num_labels[i], THRESHOLD, request->classification_type);
+    }
+
+cleanup:
+    for (size_t i = 0; text_logits && i < num_texts; ++i) {
+        free(text_logits[i]);
+    }
+    free(text_logits);
+    free(text_num_classes);
+    free(text_ids);
+    free(deferred_texts);
+    free(deferred_labels);
+    free(deferred_num_labels);
+    free(deferred_ids);
+    return result;
+}
+
+/**
+ * Prints the per-stage acceptance rates and times of a cascade run.
+ *
+ * @param stats The statistics of the run.
+ * @param small_name The name of the small model.
+ * @param large_name The name of the large model.
+ */
+void print_cascade_stats(const CascadeStats* stats, const char* small_name, const char* large_name) {
+    double total = stats->num_texts ? (double)stats->num_texts : 1.0;
+    printf("Cascade stage 1 (%s): accepted %zu of %zu texts (%.1f%%), %f seconds\n", small_name,
+           stats->accepted_small, stats->num_texts, 100.0 * stats->accepted_small / total, stats->small_time);
+    printf("Cascade stage 2 (%s): accepted %zu of %zu texts (%.1f%%), %f seconds\n", large_name,
+           stats->accepted_large, stats->num_texts, 100.0 * stats->accepted_large / total, stats->large_time);
+    if (stats->failed > 0) {
+        printf("Cascade: %zu texts could not be classified\n", stats->failed);
+    }
+}
@@ -0,0 +1,519 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compressed_io.h"
+#include "configs.h"
+
+/**
+ * Structure to read an input whose first bytes were already read to detect its format.
+ */
+typedef struct {
+    int fd;
+    const unsigned char* prefix;
+    size_t prefix_size;
+    size_t prefix_pos;
+} InputReader;
+
+// Receives the plain data of an input, returns 0 to continue or -1 to stop
+typedef int (*PlainSink)(void* arg, const unsigned char* data, size_t size);
+
+static ssize_t read_input(InputReader* in, unsigned char* buffer, size_t size) {
+    if (in->prefix_pos < in->prefix_size) {
+        size_t count = in->prefix_size - in->prefix_pos < size ? in->prefix_size - in->prefix_pos : size;
+        memcpy(buffer, in->prefix + in->prefix_pos, count);
+        in->prefix_pos += count;
+        return (ssize_t)count;
+    }
+    ssize_t count;
+    do {
+        count = read(in->fd, buffer, size);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0) {
+        fprintf(stderr, "Error: Failed to read compressed input: %s\n", strerror(errno));
+    }
+    return count;
+}
+
+static int write_all(int fd, const unsigned char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+static int write_fd_sink(void* arg, const unsigned char* data, size_t size) {
+    return write_all(*(int*)arg, data, size);
+}
+
+/**
+ * Structure to collect plain data in memory (see decompress_to_buffer).
+ */
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+} PlainBuffer;
+
+static int buffer_sink(void* arg, const unsigned char* data, size_t size) {
+    PlainBuffer* buffer = (PlainBuffer*)arg;
+    if (buffer->size + size + 1 > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : COMPRESSION_CHUNK_SIZE;
+        while (buffer->size + size + 1 > capacity) {
+            capacity *= 2;
+        }
+        char* grown = (char*)realloc(buffer->data, capacity);
+        if (!grown) {
+            fprintf(stderr, "Error: Memory allocation for decompressed input failed\n");
+            return -1;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return 0;
+}
+
+/**
+ * Detects the compression format of data from its first bytes (gzip: 1f 8b, zstd: 28 b5 2f fd).
+ *
+ * @param data The first bytes of the data.
+ * @param size The number of bytes, at most COMPRESSION_MAGIC_SIZE are looked at.
+ * @return The detected format, COMPRESSION_NONE for anything else.
+ */
+CompressionFormat detect_compression(const unsigned char* data, size_t size) {
+    if (size >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    }
+    if (size >= 4 && data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f && data[3] == 0xfd) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+/**
+ * Chooses the compression format of an output from the extension of its path (.gz or .zst).
+ *
+ * @param path The path of the output.
+ * @return The format, COMPRESSION_NONE for other extensions.
+ */
+CompressionFormat compression_from_path(const char* path) {
+    size_t length = strlen(path);
+    if (length > 3 && strcmp(path + length - 3, ".gz") == 0) {
+        return COMPRESSION_GZIP;
+    }
+    if (length > 4 && strcmp(path + length - 4, ".zst") == 0) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+const char* compression_name(CompressionFormat format) {
+    switch (format) {
+        case COMPRESSION_GZIP: return "gzip";
+        case COMPRESSION_ZSTD: return "zstd";
+        default: return "none";
+    }
+}
+
+static int copy_plain(InputReader* in, PlainSink sink, void* arg) {
+    unsigned char* buffer = (unsigned char*)malloc(COMPRESSION_CHUNK_SIZE);
+    if (!buffer) {
+        return -1;
+    }
+    int result = 0;
+    ssize_t count;
+    while ((count = read_input(in, buffer, COMPRESSION_CHUNK_SIZE)) > 0) {
+        if (sink(arg, buffer, (size_t)count) != 0) {
+            result = -1;
+            break;
+        }
+    }
+    if (count < 0) {
+        result = -1;
+    }
+    free(buffer);
+    return result;
+}
+
+#ifdef USE_ZLIB
+static int inflate_gzip(InputReader* in, PlainSink sink, void* arg) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 15 + 32) != Z_OK) { // 32: detect the gzip header
+        fprintf(stderr, "Error: Failed to initialize gzip decompression\n");
+        return -1;
+    }
+    unsigned char* input = (unsigned char*)malloc(COMPRESSION_CHUNK_SIZE);
+    unsigned char* output = (unsigned char*)malloc(COMPRESSION_CHUNK_SIZE);
+    int result = (input && output) ? 0 : -1;
+    bool complete = false;
+    ssize_t count = 0;
+    while (result == 0 && (count = read_input(in, input, COMPRESSION_CHUNK_SIZE)) > 0) {
+        stream.next_in = input;
+        stream.avail_in = (uInt)count;
+        // A full output buffer may leave output pending after the input of the chunk is consumed
+        while (result == 0 && (stream.avail_in > 0 || stream.avail_out == 0)) {
+            stream.next_out = output;
+            stream.avail_out = COMPRESSION_CHUNK_SIZE;
+            int status = inflate(&stream, Z_NO_FLUSH);
+            if (status == Z_BUF_ERROR) {
+                break; // Nothing was pending, the next chunk is needed
+            }
+            if (status != Z_OK && status != Z_STREAM_END) {
+                fprintf(stderr, "Error: Corrupt gzip input: %s\n", stream.msg ? stream.msg : "invalid data");
+                result = -1;
+                break;
+            }
+            complete = status == Z_STREAM_END;
+            if (sink(arg, output, COMPRESSION_CHUNK_SIZE - stream.avail_out) != 0) {
+                result = -1;
+            }
+            if (complete) {
+                inflateReset(&stream); // Concatenated members (e.g. cat a.gz b.gz, pigz)
+            }
+        }
+    }
+    if (count < 0) {
+        result = -1;
+    } else if (result == 0 && !complete) {
+        fprintf(stderr, "Error: The gzip input is truncated\n");
+        result = -1;
+    }
+    inflateEnd(&stream);
+    free(input);
+    free(output);
+    return result;
+}
+
+static int deflate_gzip(int plain_fd, int file_fd) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, OUTPUT_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) { // 16: gzip header
+        fprintf(stderr, "Error: Failed to initialize gzip compression\n");
+        return -1;
+    }
+    unsigned char* input = (unsigned char*)malloc(COMPRESSION_CHUNK_SIZE);
+    unsigned char* output = (unsigned char*)malloc(COMPRESSION_CHUNK_SIZE);
+    InputReader in = { plain_fd, NULL, 0, 0 };
+    int result = (input && output) ? 0 : -1;
+    int flush = Z_NO_FLUSH;
+    while (result == 0 && flush != Z_FINISH) {
+        ssize_t count = read_input(&in, input, COMPRESSION_CHUNK_SIZE);
+        if (count < 0) {
+            result = -1;
+            break;
+        }
+        flush = count == 0 ? Z_FINISH : Z_NO_FLUSH;
+        stream.next_in = input;
+        stream.avail_in = (uInt)count;
+        do {
+            stream.next_out = output;
+            stream.avail_out = COMPRESSION_CHUNK_SIZE;
+            deflate(&stream, flush);
+            if (write_all(file_fd, output, COMPRESSION_CHUNK_SIZE - stream.avail_out) != 0) {
+                fprintf(stderr, "Error: Failed to write compressed output: %s\n", strerror(errno));
+                result = -1;
+            }
+        } while (result == 0 && stream.avail_out == 0);
+    }
+    deflateEnd(&stream);
+    free(input);
+    free(output);
+    return result;
+}
+#endif
+
+#ifdef USE_ZSTD
+static int decompress_zstd(InputReader* in, PlainSink sink, void* arg) {
+    ZSTD_DStream* stream = ZSTD_createDStream();
+    unsigned char* input = (unsigned char*)malloc(COMPRESSION_CHUNK_SIZE);
+    unsigned char* output = (unsigned char*)malloc(COMPRESSION_CHUNK_SIZE);
+    int result = (stream && input && output) ? 0 : -1;
+    if (result == 0) {
+        ZSTD_initDStream(stream);
+    }
+    size_t remaining = 0; // Non-zero while a frame is not finished
+    ssize_t count = 0;
+    while (result == 0 && (count = read_input(in, input, COMPRESSION_CHUNK_SIZE)) > 0) {
+        ZSTD_inBuffer in_buffer = { input, (size_t)count, 0 };
+        ZSTD_outBuffer out_buffer;
+        do {
+            out_buffer = (ZSTD_outBuffer){ output, COMPRESSION_CHUNK_SIZE, 0 };
+            remaining = ZSTD_decompressStream(stream, &out_buffer, &in_buffer);
+            if (ZSTD_isError(remaining)) {
+                fprintf(stderr, "Error: Corrupt zstd input: %s\n", ZSTD_getErrorName(remaining));
+                result = -1;
+                break;
+            }
+            if (sink(arg, output, out_buffer.pos) != 0) {
+                result = -1;
+            }
+        } while (result == 0 && (in_buffer.pos < in_buffer.size || out_buffer.pos == out_buffer.size));
+    }
+    if (count < 0) {
+        result = -1;
+    } else if (result == 0 && remaining != 0) {
+        fprintf(stderr, "Error: The zstd input is truncated\n");
+        result = -1;
+    }
+    ZSTD_freeDStream(stream);
+    free(input);
+    free(output);
+    return result;
+}
+
+static int compress_zstd(int plain_fd, int file_fd) {
+    ZSTD_CCtx* context = ZSTD_createCCtx();
+    unsigned char* input = (unsigned char*)malloc(COMPRESSION_CHUNK_SIZE);
+    unsigned char* output = (unsigned char*)malloc(COMPRESSION_CHUNK_SIZE);
+    InputReader in = { plain_fd, NULL, 0, 0 };
+    int result = (context && input && output) ? 0 : -1;
+    if (result == 0) {
+        ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, OUTPUT_ZSTD_LEVEL);
+    }
+    ZSTD_EndDirective mode = ZSTD_e_continue;
+    while (result == 0 && mode != ZSTD_e_end) {
+        ssize_t count = read_input(&in, input, COMPRESSION_CHUNK_SIZE);
+        if (count < 0) {
+            result = -1;
+            break;
+        }
+        mode = count == 0 ? ZSTD_e_end : ZSTD_e_continue;
+        ZSTD_inBuffer in_buffer = { input, (size_t)count, 0 };
+        size_t pending;
+        do {
+            ZSTD_outBuffer out_buffer = { output, COMPRESSION_CHUNK_SIZE, 0 };
+            pending = ZSTD_compressStream2(context, &out_buffer, &in_buffer, mode);
+            if (ZSTD_isError(pending)) {
+                fprintf(stderr, "Error: zstd compression failed: %s\n", ZSTD_getErrorName(pending));
+                result = -1;
+                break;
+            }
+            if (write_all(file_fd, output, out_buffer.pos) != 0) {
+                fprintf(stderr, "Error: Failed to write compressed output: %s\n", strerror(errno));
+                result = -1;
+            }
+        } while (result == 0 && (mode == ZSTD_e_end ? pending != 0 : in_buffer.pos < in_buffer.size));
+    }
+    ZSTD_freeCCtx(context);
+    free(input);
+    free(output);
+    return result;
+}
+#endif
+
+/**
+ * Streams the plain data of an input of a known format to a sink.
+ */
+static int decompress_input(InputReader* in, CompressionFormat format, PlainSink sink, void* arg) {
+    switch (format) {
+        case COMPRESSION_GZIP:
+            #ifdef USE_ZLIB
+            return inflate_gzip(in, sink, arg);
+            #else
+            break;
+            #endif
+        case COMPRESSION_ZSTD:
+            #ifdef USE_ZSTD
+            return decompress_zstd(in, sink, arg);
+            #else
+            break;
+            #endif
+        default:
+            return copy_plain(in, sink, arg);
+    }
+    fprintf(stderr, "Error: The input is %s-compressed, but GLiClass was built without %s\n",
+            compression_name(format), format == COMPRESSION_GZIP ? "zlib" : "libzstd");
+    return -1;
+}
+
+/**
+ * Decompresses the rest of an input into memory, for inputs that are parsed as a whole.
+ *
+ * @param fd The file descriptor to read from.
+ * @param prefix The bytes already read from fd to detect the format.
+ * @param prefix_size The number of bytes in prefix.
+ * @param format The format of the input.
+ * @param data Output NUL-terminated plain data, freed by the caller.
+ * @param size Output size of the plain data (without the NUL).
+ * @return 0 if successful, -1 if the input is corrupt or truncated, could not be read or the format is not supported.
+ */
+int decompress_to_buffer(int fd, const unsigned char* prefix, size_t prefix_size, CompressionFormat format,
+                         char** data, size_t* size) {
+    InputReader in = { fd, prefix, prefix_size, 0 };
+    PlainBuffer buffer = { NULL, 0, 0 };
+    if (decompress_input(&in, format, buffer_sink, &buffer) != 0 || buffer_sink(&buffer, (const unsigned char*)"", 0) != 0) {
+        free(buffer.data);
+        return -1;
+    }
+    buffer.data[buffer.size] = '\0';
+    *data = buffer.data;
+    *size = buffer.size;
+    return 0;
+}
+
+static size_t read_magic(int fd, unsigned char* magic) {
+    size_t size = 0;
+    while (size < COMPRESSION_MAGIC_SIZE) {
+        ssize_t count = read(fd, magic + size, COMPRESSION_MAGIC_SIZE - size);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break;
+        size += (size_t)count;
+    }
+    return size;
+}
+
+static void* run_decompressing_pipe(void* arg) {
+    CompressedPipe* pipe = (CompressedPipe*)arg;
+    unsigned char magic[COMPRESSION_MAGIC_SIZE];
+    size_t magic_size = read_magic(pipe->file_fd, magic);
+    pipe->format = detect_compression(magic, magic_size);
+    InputReader in = { pipe->file_fd, magic, magic_size, 0 };
+    pipe->result = decompress_input(&in, pipe->format, write_fd_sink, &pipe->thread_fd);
+    close(pipe->thread_fd); // The reader sees the end of the input
+    return NULL;
+}
+
+static void* run_compressing_pipe(void* arg) {
+    CompressedPipe* pipe = (CompressedPipe*)arg;
+    #ifdef USE_ZLIB
+    if (pipe->format == COMPRESSION_GZIP) {
+        pipe->result = deflate_gzip(pipe->thread_fd, pipe->file_fd);
+    }
+    #endif
+    #ifdef USE_ZSTD
+    if (pipe->format == COMPRESSION_ZSTD) {
+        pipe->result = compress_zstd(pipe->thread_fd, pipe->file_fd);
+    }
+    #endif
+    if (pipe->result != 0) {
+        // Drain the pipe so the writers do not block on a full pipe
+        char discard[4096];
+        while (read(pipe->thread_fd, discard, sizeof(discard)) > 0) {}
+    }
+    close(pipe->thread_fd);
+    return NULL;
+}
+
+static int start_pipe(CompressedPipe* pipe, void* (*run)(void*)) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        fprintf(stderr, "Error: Failed to create the pipe of a compressed stream: %s\n", strerror(errno));
+        return -1;
+    }
+    // Decompressing: the thread writes, the program reads. Compressing: the other way round.
+    pipe->plain_fd = pipe->compress ? fds[1] : fds[0];
+    pipe->thread_fd = pipe->compress ? fds[0] : fds[1];
+    pipe->result = -1;
+    if (pthread_create(&pipe->thread, NULL, run, pipe) != 0) {
+        fprintf(stderr, "Error: Failed to start the thread of a compressed stream\n");
+        close(fds[0]);
+        close(fds[1]);
+        pipe->plain_fd = pipe->thread_fd = -1;
+        return -1;
+    }
+    pipe->running = true;
+    return 0;
+}
+
+/**
+ * Opens an input that may be compressed. Regular files that are not compressed are read directly.
+ * Otherwise a background thread detects the format and decompresses the input into a pipe, so
+ * decompression overlaps with the work of the program on the data read so far.
+ *
+ * @param file_fd The file descriptor of the input (e.g. stdin).
+ * @param pipe Pointer to the CompressedPipe structure to fill; read the plain data from pipe->plain_fd.
+ * @return 0 if successful, -1 if the pipe or thread could not be created.
+ */
+int open_decompressing_pipe(int file_fd, CompressedPipe* pipe) {
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->file_fd = file_fd;
+    pipe->plain_fd = file_fd;
+    pipe->thread_fd = -1;
+    pipe->compress = false;
+
+    struct stat file_stat;
+    if (fstat(file_fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode)) {
+        unsigned char magic[COMPRESSION_MAGIC_SIZE];
+        off_t start = lseek(file_fd, 0, SEEK_CUR);
+        size_t magic_size = read_magic(file_fd, magic);
+        if (start >= 0 && lseek(file_fd, start, SEEK_SET) == start &&
+            detect_compression(magic, magic_size) == COMPRESSION_NONE) {
+            return 0;
+        }
+    }
+    return start_pipe(pipe, run_decompressing_pipe);
+}
+
+/**
+ * Opens a compressing output: a background thread compresses what the program writes into
+ * pipe->plain_fd and writes it to file_fd.
+ *
+ * @param file_fd The file descriptor of the compressed output, closed by close_compressed_pipe.
+ * @param format The compression format.
+ * @param pipe Pointer to the CompressedPipe structure to fill.
+ * @return 0 if successful, -1 if the format is not supported by the build or the pipe or thread could not be created.
+ */
+int open_compressing_pipe(int file_fd, CompressionFormat format, CompressedPipe* pipe) {
+    memset(pipe, 0, sizeof(*pipe));
+    pipe->file_fd = file_fd;
+    pipe->plain_fd = -1;
+    pipe->thread_fd = -1;
+    pipe->format = format;
+    pipe->compress = true;
+    bool supported = false;
+    #ifdef USE_ZLIB
+    supported = supported || format == COMPRESSION_GZIP;
+    #endif
+    #ifdef USE_ZSTD
+    supported = supported || format == COMPRESSION_ZSTD;
+    #endif
+    if (!supported) {
+        fprintf(stderr, "Error: %s output is not supported by this build\n", compression_name(format));
+        return -1;
+    }
+    return start_pipe(pipe, run_compressing_pipe);
+}
+
+/**
+ * Waits for the background thread of a pipe and closes it. For an output, all copies of pipe->plain_fd
+ * (e.g. stdout after dup2) must be closed first, the thread finishes the compressed stream when the pipe ends.
+ *
+ * @param pipe The pipe to close.
+ * @return 0 if all data was converted, -1 otherwise.
+ */
+int close_compressed_pipe(CompressedPipe* pipe) {
+    if (!pipe->running) {
+        return 0;
+    }
+    if (!pipe->compress && pipe->plain_fd >= 0) {
+        close(pipe->plain_fd); // A thread still writing gets EPIPE instead of blocking
+        pipe->plain_fd = -1;
+    }
+    pthread_join(pipe->thread, NULL);
+    pipe->running = false;
+    if (pipe->compress && close(pipe->file_fd) != 0) {
+        fprintf(stderr, "Error: Failed to close compressed output: %s\n", strerror(errno));
+        pipe->result = -1;
+    }
+    return pipe->result;
+}
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cost_model.h"
+#include "model.h"
+#include "tokenizer.h"
+#include "configs.h"
+
+#define PROMPT_LABEL_CHARS 9    // strlen("<<LABEL>>") in front of every label of a prompt
+#define PROMPT_SEP_CHARS 7      // strlen("<<SEP>>") between the labels and the text
+
+/**
+ * Structure to store the sums of the measured runs the cost model is fitted to by least squares,
+ * with x1 = rows * seq_length and x2 = rows * seq_length^2.
+ */
+typedef struct {
+    double x1x1, x1x2, x2x2;    /**< Sums of the products of the features. */
+    double x1t, x2t;            /**< Sums of the features times the measured seconds. */
+    double chars, tokens;       /**< Longest prompt characters and sequence lengths of the runs. */
+    size_t count;               /**< Measured runs. */
+} CostSums;
+
+static CostSums cost_sums = { 0 };
+static BatchCostModel cost_model = { 1.0, 1.0 / COST_ATTENTION_CROSSOVER, COST_CHARS_PER_TOKEN, 0 };
+static pthread_mutex_t cost_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Counts the characters of the longest prompt of a batch (text, labels and their tags).
+ *
+ * @param request The request the batch belongs to.
+ * @param start Index of the first text of the batch in the request.
+ * @param count Number of texts in the batch.
+ * @return The characters of the longest prompt.
+ */
+size_t batch_prompt_chars(const ClassificationRequest* request, size_t start, size_t count) {
+    size_t shared_label_chars = 0;
+    if (request->same_labels) {
+        for (size_t j = 0; j < request->num_labels_size; ++j) {
+            shared_label_chars += PROMPT_LABEL_CHARS + strlen(request->labels[0][j]);
+        }
+    }
+    size_t longest = 0;
+    for (size_t i = start; i < start + count; ++i) {
+        size_t chars = PROMPT_SEP_CHARS + strlen(request->texts[i]) + shared_label_chars;
+        if (!request->same_labels) {
+            for (size_t j = 0; j < request->num_labels[i]; ++j) {
+                chars += PROMPT_LABEL_CHARS + strlen(request->labels[i][j]);
+            }
+        }
+        if (chars > longest) {
+            longest = chars;
+        }
+    }
+    return longest;
+}
+
+/**
+ * Estimates the Run time of a batch before it is tokenized: its sequence length is estimated from the
+ * longest prompt, clipped to MAX_LENGTH and padded to its bucket like the tokenizer does.
+ *
+ * @param rows The number of rows of the batch.
+ * @param prompt_chars The characters of the longest prompt of the batch (see batch_prompt_chars).
+ * @return The estimated cost, in seconds once the model is calibrated (relative units before).
+ */
+double estimate_batch_cost(size_t rows, size_t prompt_chars) {
+    BatchCostModel model;
+    get_batch_cost_model(&model);
+    size_t seq_length = (size_t)((double)prompt_chars / model.chars_per_token) + 1;
+    seq_length = bucket_sequence_length(seq_length < MAX_LENGTH ? seq_length : MAX_LENGTH, MAX_LENGTH);
+    double tokens = (double)rows * (double)seq_length;
+    return model.linear * tokens + model.quadratic * tokens * (double)seq_length;
+}
+
+/**
+ * Fits the cost model to the measured runs. The caller holds the mutex.
+ * Both coefficients are fitted by least squares if the runs had different enough shapes, otherwise
+ * only the scale is fitted and the ratio of the coefficients stays at COST_ATTENTION_CROSSOVER.
+ */
+static void fit_cost_model(void) {
+    const CostSums* s = &cost_sums;
+    if (s->tokens > 0.0) {
+        cost_model.chars_per_token = s->chars / s->tokens;
+    }
+    cost_model.num_samples = s->count;
+    if (s->count < COST_MIN_SAMPLES) {
+        return;
+    }
+    double det = s->x1x1 * s->x2x2 - s->x1x2 * s->x1x2;
+    if (det > 1e-9 * s->x1x1 * s->x2x2) {
+        double linear = (s->x1t * s->x2x2 - s->x2t * s->x1x2) / det;
+        double quadratic = (s->x2t * s->x1x1 - s->x1t * s->x1x2) / det;
+        if (linear > 0.0 && quadratic > 0.0) {
+            cost_model.linear = linear;
+            cost_model.quadratic = quadratic;
+            return;
+        }
+    }
+    // x = x1 + x2 / crossover, seconds = scale * x
+    double c = COST_ATTENTION_CROSSOVER;
+    double xx = s->x1x1 + 2.0 * s->x1x2 / c + s->x2x2 / (c * c);
+    double xt = s->x1t + s->x2t / c;
+    if (xx > 0.0 && xt > 0.0) {
+        cost_model.linear = xt / xx;
+        cost_model.quadratic = cost_model.linear / c;
+    }
+}
+
+/**
+ * Adds the measured Run time of a batch to the cost model.
+ *
+ * @param rows The number of rows that ran.
+ * @param seq_length The sequence length that ran.
+ * @param prompt_chars The characters of the longest prompt of the rows (see batch_prompt_chars), 0 if unknown.
+ * @param seconds The measured Run time (see last_run_seconds).
+ */
+void record_batch_run(size_t rows, size_t seq_length, size_t prompt_chars, double seconds) {
+    if (rows == 0 || seq_length == 0) {
+        return;
+    }
+    double x1 = (double)rows * (double)seq_length;
+    double x2 = x1 * (double)seq_length;
+    pthread_mutex_lock(&cost_mutex);
+    cost_sums.x1x1 += x1 * x1;
+    cost_sums.x1x2 += x1 * x2;
+    cost_sums.x2x2 += x2 * x2;
+    cost_sums.x1t += x1 * seconds;
+    cost_sums.x2t += x2 * seconds;
+    if (prompt_chars > 0 && seq_length < MAX_LENGTH) {
+        cost_sums.chars += (double)prompt_chars; // Clipped prompts would underestimate the characters per token
+        cost_sums.tokens += (double)seq_length;
+    }
+    cost_sums.count++;
+    fit_cost_model();
+    pthread_mutex_unlock(&cost_mutex);
+}
+
+typedef struct {
+    double cost;
+    size_t index;
+} BatchCost;
+
+static int compare_batch_costs(const void* a, const void* b) {
+    const BatchCost* x = (const BatchCost*)a;
+    const BatchCost* y = (const BatchCost*)b;
+    if (x->cost != y->cost) {
+        return x->cost > y->cost ? -1 : 1; // Most expensive first
+    }
+    return x->index < y->index ? -1 : (x->index > y->index ? 1 : 0);
+}
+
+/**
+ * Orders the batches of a request longest first by their estimated cost, so the few long batches of a
+ * skewed input start first and the short ones fill up the workers at the end. The model is calibrated
+ * only by batches that already ran, so the first request of a process (the only one of a plain CLI run)
+ * is ordered with the default coefficients; only the ratio of their cost terms matters for the order.
+ *
+ * @param request The request, split into batches of BATCH_SIZE texts.
+ * @param num_batches The number of batches.
+ * @param order Output array of num_batches batch indices in the order they should be started.
+ * @return 0 if successful, -1 if memory allocation failed (order is then the input order).
+ */
+int order_batches_by_cost(const ClassificationRequest* request, size_t num_batches, size_t* order) {
+    for (size_t b = 0; b < num_batches; ++b) {
+        order[b] = b;
+    }
+    BatchCost* costs = (BatchCost*)malloc((num_batches > 0 ? num_batches : 1) * sizeof(BatchCost));
+    if (!costs) {
+        fprintf(stderr, "Error: Memory allocation for batch costs failed\n");
+        return -1;
+    }
+    for (size_t b = 0; b < num_batches; ++b) {
+        size_t start = b * BATCH_SIZE;
+        size_t count = request->num_texts - start < BATCH_SIZE ? request->num_texts - start : BATCH_SIZE;
+        costs[b].cost = estimate_batch_cost(count, batch_prompt_chars(request, start, count));
+        costs[b].index = b;
+    }
+    qsort(costs, num_batches, sizeof(BatchCost), compare_batch_costs);
+    for (size_t b = 0; b < num_batches; ++b) {
+        order[b] = costs[b].index;
+    }
+    free(costs);
+    return 0;
+}
+
+/**
+ * Copies the current batch cost model.
+ *
+ * @param model Pointer to the BatchCostModel structure to fill.
+ */
+void get_batch_cost_model(BatchCostModel* model) {
+    pthread_mutex_lock(&cost_mutex);
+    *model = cost_model;
+    pthread_mutex_unlock(&cost_mutex);
+}
+
+/**
+ * Prints the batch cost model fitted to the measured runs, nothing if too few batches ran.
+ */
+void print_batch_cost_model(void) {
+    BatchCostModel model;
+    get_batch_cost_model(&model);
+    if (model.num_samples < COST_MIN_SAMPLES) {
+        return;
+    }
+    printf("Batch cost model (%zu runs): %.3g s per token + %.3g s per query-key pair, "
+           "%.2f prompt characters per token\n", model.num_samples, model.linear, model.quadratic,
+           model.chars_per_token);
+}
@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <omp.h>
+
+#include "job_journal.h"
+#include "parallel_processor.h"
+#include "model.h"
+#include "configs.h"
+
+#define JOURNAL_MAGIC "GLCJOB01"    // First word of the journal header line
+#define JOURNAL_LINE_SIZE 1024      // Maximum length of a header or record line
+#define JOURNAL_COPY_SIZE (1 << 16) // Size of the chunks predictions are copied to the output in
+
+/*
+ * Journal format (text headers, the predictions are stored verbatim):
+ *   "GLCJOB01 <job id>\n"
+ *   per finished batch: "BATCH <batch> <request> <start> <count> <bytes> <checksum>\n" followed by the predictions
+ */
+
+/**
+ * Computes the 64-bit FNV-1a hash of the predictions of a batch.
+ */
+static uint64_t checksum_bytes(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL; // FNV offset basis
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Writes the whole buffer to the journal.
+ *
+ * @return 0 if successful, -1 otherwise.
+ */
+static int write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * Finds the request and the first text of a batch.
+ */
+static void locate_batch(const JobJournal* journal, const ClassificationRequest* requests, size_t batch,
+                         size_t* request, size_t* start, size_t* count) {
+    size_t r = 0;
+    while (r + 1 < journal->num_requests && journal->first_batch[r + 1] <= batch) {
+        r++;
+    }
+    *request = r;
+    *start = (batch - journal->first_batch[r]) * BATCH_SIZE;
+    *count = requests[r].num_texts - *start < BATCH_SIZE ? requests[r].num_texts - *start : BATCH_SIZE;
+}
+
+/**
+ * Reads the records of an existing journal and keeps the valid prefix.
+ * A record cut short by a crash, or one that does not match the job, ends the valid part of the file.
+ *
+ * @return 0 if successful, -1 if the journal belongs to another job or can not be read.
+ */
+static int replay_job_journal(JobJournal* journal, const char* job_id, const ClassificationRequest* requests) {
+    FILE* file = fdopen(dup(journal->fd), "r");
+    if (!file) {
+        fprintf(stderr, "Error: Failed to read job journal %s\n", journal->path);
+        return -1;
+    }
+    char line[JOURNAL_LINE_SIZE];
+    char expected[JOURNAL_LINE_SIZE];
+    snprintf(expected, sizeof(expected), "%s %s\n", JOURNAL_MAGIC, job_id);
+    if (fgets(line, sizeof(line), file) == NULL) {
+        fclose(file);
+        return 0; // New journal
+    }
+    if (strchr(line, '\n') == NULL && strncmp(line, expected, strlen(line)) == 0) {
+        fclose(file);
+        return ftruncate(journal->fd, 0); // Crashed while writing the header
+    }
+    if (strcmp(line, expected) != 0) {
+        if (strncmp(line, JOURNAL_MAGIC " ", strlen(JOURNAL_MAGIC) + 1) == 0 && strchr(line, '\n')) {
+            fprintf(stderr, "Error: Job journal %s belongs to another job (input, model or settings changed)\n",
+                    journal->path);
+        } else {
+            fprintf(stderr, "Error: %s is not a job journal\n", journal->path);
+        }
+        fclose(file);
+        return -1;
+    }
+    journal->end = ftello(file);
+
+    char* payload = NULL;
+    size_t capacity = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        size_t batch, request, start, count, size;
+        unsigned long long checksum;
+        if (sscanf(line, "BATCH %zu %zu %zu %zu %zu %llx", &batch, &request, &start, &count, &size, &checksum) != 6 ||
+            batch >= journal->num_batches) {
+            break;
+        }
+        size_t expected_request, expected_start, expected_count;
+        locate_batch(journal, requests, batch, &expected_request, &expected_start, &expected_count);
+        if (request != expected_request || start != expected_start || count != expected_count) {
+            break;
+        }
+        if (size > capacity) {
+            char* grown = (char*)realloc(payload, size);
+            if (!grown) {
+                break;
+            }
+            payload = grown;
+            capacity = size;
+        }
+        off_t offset = ftello(file);
+        if (fread(payload, 1, size, file) != size || checksum_bytes(payload, size) != (uint64_t)checksum) {
+            break;
+        }
+        if (journal->offsets[batch] < 0) {
+            journal->offsets[batch] = offset;
+            journal->sizes[batch] = size;
+            journal->num_done++;
+        }
+        journal->end = ftello(file);
+    }
+    free(payload);
+    fclose(file);
+
+    off_t file_size = lseek(journal->fd, 0, SEEK_END);
+    if (file_size > journal->end) {
+        fprintf(stderr, "Warning: Discarding %lld bytes of an unfinished record at the end of %s\n",
+                (long long)(file_size - journal->end), journal->path);
+        if (ftruncate(journal->fd, journal->end) != 0) {
+            fprintf(stderr, "Error: Failed to truncate job journal %s\n", journal->path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Opens the journal of a job, creating it if it does not exist, and reads which batches are already finished.
+ * The journal is locked, so two processes can not run the same job at the same time.
+ *
+ * @param path The path of the journal file.
+ * @param job_id Identifies the job (input, model and settings), a journal of another job is rejected.
+ * @param requests The requests of the job.
+ * @param num_requests The number of requests.
+ * @param journal Pointer to the JobJournal structure to fill.
+ * @return 0 if successful, -1 if an error occurs.
+ */
+int open_job_journal(const char* path, const char* job_id, const ClassificationRequest* requests, size_t num_requests,
+                     JobJournal* journal) {
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+    journal->requests = requests;
+    journal->num_requests = num_requests;
+    journal->path = strdup(path);
+    journal->first_batch = (size_t*)calloc(num_requests ? num_requests : 1, sizeof(size_t));
+    for (size_t r = 0; journal->first_batch && r < num_requests; ++r) {
+        journal->first_batch[r] = journal->num_batches;
+        journal->num_batches += (requests[r].num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+    }
+    journal->offsets = (off_t*)malloc((journal->num_batches ? journal->num_batches : 1) * sizeof(off_t));
+    journal->sizes = (size_t*)calloc(journal->num_batches ? journal->num_batches : 1, sizeof(size_t));
+    if (!journal->path || !journal->first_batch || !journal->offsets || !journal->sizes) {
+        fprintf(stderr, "Error: Memory allocation for the job journal failed\n");
+        close_job_journal(journal);
+        return -1;
+    }
+    for (size_t b = 0; b < journal->num_batches; ++b) {
+        journal->offsets[b] = -1;
+    }
+    pthread_mutex_init(&journal->mutex, NULL);
+
+    journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal->fd < 0) {
+        fprintf(stderr, "Error: Failed to open job journal %s: %s\n", path, strerror(errno));
+        close_job_journal(journal);
+        return -1;
+    }
+    if (flock(journal->fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "Error: Job journal %s is in use by another process\n", path);
+        close_job_journal(journal);
+        return -1;
+    }
+    if (replay_job_journal(journal, job_id, requests) != 0) {
+        close_job_journal(journal);
+        return -1;
+    }
+    if (journal->end == 0) {
+        char header[JOURNAL_LINE_SIZE];
+        int header_size = snprintf(header, sizeof(header), "%s %s\n", JOURNAL_MAGIC, job_id);
+        if (header_size >= (int)sizeof(header) || write_all(journal->fd, header, (size_t)header_size) != 0 ||
+            fsync(journal->fd) != 0) {
+            fprintf(stderr, "Error: Failed to write job journal %s\n", path);
+            close_job_journal(journal);
+            return -1;
+        }
+        journal->end = header_size;
+    }
+    journal->last_sync = omp_get_wtime();
+    return 0;
+}
+
+/**
+ * Flushes the journal to disk.
+ *
+ * @param journal The job journal.
+ * @return 0 if successful, -1 otherwise.
+ */
+int sync_job_journal(JobJournal* journal) {
+    if (fdatasync(journal->fd) != 0) {
+        fprintf(stderr, "Error: Failed to sync job journal %s: %s\n", journal->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Appends the predictions of a finished batch to the journal. The journal is synced to disk at most
+ * every JOURNAL_SYNC_INTERVAL seconds, so a crash loses only the batches finished since the last sync.
+ * Safe to call from several threads.
+ *
+ * @param journal The job journal.
+ * @param batch The index of the batch (over all requests).
+ * @param output The predictions of the batch.
+ * @param size The length of the predictions.
+ * @return 0 if successful, -1 if the journal could not be written.
+ */
+int append_journal_batch(JobJournal* journal, size_t batch, const char* output, size_t size) {
+    size_t request, start, count;
+    locate_batch(journal, journal->requests, batch, &request, &start, &count);
+    char header[JOURNAL_LINE_SIZE];
+    int header_size = snprintf(header, sizeof(header), "BATCH %zu %zu %zu %zu %zu %016llx\n", batch, request, start,
+                               count, size, (unsigned long long)checksum_bytes(output, size));
+
+    pthread_mutex_lock(&journal->mutex);
+    int result = 0;
+    if (write_all(journal->fd, header, (size_t)header_size) != 0 || write_all(journal->fd, output, size) != 0) {
+        // Cut the partial record so that later appends stay readable
+        fprintf(stderr, "Error: Failed to append batch %zu to job journal %s: %s\n", batch, journal->path, strerror(errno));
+        if (ftruncate(journal->fd, journal->end) != 0) {
+            fprintf(stderr, "Error: Failed to truncate job journal %s\n", journal->path);
+        }
+        result = -1;
+    } else {
+        journal->offsets[batch] = journal->end + header_size;
+        journal->sizes[batch] = size;
+        journal->end += header_size + (off_t)size;
+        journal->num_done++;
+    }
+    bool sync = result == 0 && omp_get_wtime() - journal->last_sync >= JOURNAL_SYNC_INTERVAL;
+    if (sync) {
+        journal->last_sync = omp_get_wtime();
+    }
+    pthread_mutex_unlock(&journal->mutex);
+
+    // Other threads keep appending while the data is flushed
+    if (sync && sync_job_journal(journal) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * Writes the predictions of all finished batches in input order, preceded by "Request <index>:" for jobs with
+ * several requests. The output is the same whether the job ran at once or was resumed.
+ *
+ * @param journal The job journal.
+ * @param stream The stream to write the predictions to.
+ * @return 0 if successful, -1 if batches are missing or the journal could not be read.
+ */
+int write_journal_output(const JobJournal* journal, FILE* stream) {
+    char* buffer = (char*)malloc(JOURNAL_COPY_SIZE);
+    if (!buffer) {
+        fprintf(stderr, "Error: Memory allocation for the journal output failed\n");
+        return -1;
+    }
+    int result = 0;
+    for (size_t r = 0; r < journal->num_requests; ++r) {
+        if (journal->num_requests > 1) {
+            fprintf(stream, "Request %zu:\n", r);
+        }
+        size_t last = r + 1 < journal->num_requests ? journal->first_batch[r + 1] : journal->num_batches;
+        for (size_t b = journal->first_batch[r]; b < last; ++b) {
+            if (journal->offsets[b] < 0) {
+                fprintf(stderr, "Error: Batch %zu of request %zu is not finished\n", b - journal->first_batch[r], r);
+                result = -1;
+                continue;
+            }
+            off_t offset = journal->offsets[b];
+            size_t remaining = journal->sizes[b];
+            while (remaining > 0) {
+                size_t chunk = remaining < JOURNAL_COPY_SIZE ? remaining : JOURNAL_COPY_SIZE;
+                ssize_t n = pread(journal->fd, buffer, chunk, offset);
+                if (n <= 0) {
+                    fprintf(stderr, "Error: Failed to read job journal %s\n", journal->path);
+                    free(buffer);
+                    return -1;
+                }
+                fwrite(buffer, 1, (size_t)n, stream);
+                offset += n;
+                remaining -= (size_t)n;
+            }
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+/**
+ * Syncs and closes the journal and frees its index. The journal file is kept for later runs.
+ *
+ * @param journal The job journal.
+ */
+void close_job_journal(JobJournal* journal) {
+    if (journal->fd >= 0) {
+        sync_job_journal(journal);
+        close(journal->fd); // Also releases the lock
+        pthread_mutex_destroy(&journal->mutex);
+    }
+    free(journal->path);
+    free(journal->first_batch);
+    free(journal->offsets);
+    free(journal->sizes);
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = -1;
+}
+
+/**
+ * Classifies the batches of all requests that the journal does not have yet and appends their predictions
+ * to it as soon as each batch is finished. Batches run in parallel with OpenMP.
+ *
+ * @param requests The requests of the job (the ones the journal was opened for).
+ * @param models The model of every request (NULL for requests routed to an unknown model, they are skipped).
+ * @param journal The job journal opened for these requests.
+ * @return 0 if successful, -1 if some batches failed (they run again on the next start).
+ */
+int run_journaled_requests(const ClassificationRequest* requests, HostedModel* const* models, JobJournal* journal) {
+    size_t num_pending = journal->num_batches - journal->num_done;
+    size_t* pending = (size_t*)malloc((num_pending ? num_pending : 1) * sizeof(size_t));
+    if (!pending) {
+        fprintf(stderr, "Error: Memory allocation for pending batches failed\n");
+        return -1;
+    }
+    size_t p = 0;
+    for (size_t b = 0; b < journal->num_batches; ++b) {
+        if (journal->offsets[b] < 0) {
+            pending[p++] = b;
+        }
+    }
+    fprintf(stderr, "Job journal %s: %zu of %zu batches finished earlier, %zu to run\n",
+            journal->path, journal->num_done, journal->num_batches, num_pending);
+
+    size_t num_failed = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(+:num_failed)
+    for (size_t i = 0; i < num_pending; ++i) {
+        size_t request, start, count;
+        locate_batch(journal, requests, pending[i], &request, &start, &count);
+        HostedModel* model = models[request];
+        if (model == NULL) {
+            num_failed++;
+            continue;
+        }
+        OrtValue* output_tensor = run_request_batch(model->session, model->tokenizer, model->prompt_first,
+                                                    &requests[request], start, count);
+        char* output = NULL;
+        size_t output_size = 0;
+        FILE* stream = open_memstream(&output, &output_size);
+        int result = -1;
+        if (stream) {
+            result = write_batch_predictions(stream, output_tensor, &requests[request], start, count, 0);
+            fclose(stream);
+        }
+        if (result != 0 || append_journal_batch(journal, pending[i], output, output_size) != 0) {
+            num_failed++;
+        }
+        free(output);
+        if (output_tensor) g_ort->ReleaseValue(output_tensor);
+    }
+    free(pending);
+
+    int result = sync_job_journal(journal);
+    if (num_failed > 0) {
+        fprintf(stderr, "Error: %zu batches failed, run the job again to retry them\n", num_failed);
+        result = -1;
+    }
+    return result;
+}
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "label_cache.h"
+
+#define LABEL_CACHE_MAGIC "GLCEMB01" // Magic bytes at the start of a label cache file (8 bytes)
+
+/**
+ * Header at the start of a label cache file. It is followed by the entries, each stored as
+ * the label length (uint32), the label bytes zero padded to a multiple of 4 and the embedding (dim floats).
+ */
+typedef struct {
+    char magic[8];          /**< LABEL_CACHE_MAGIC. */
+    uint64_t model_hash;    /**< Hash of the label encoder model. */
+    uint32_t dim;           /**< Size of one embedding. */
+    uint32_t reserved;      /**< Unused, pads the header to 24 bytes. */
+} LabelCacheHeader;
+
+static uint64_t hash_label(const char* label, size_t len) {
+    uint64_t hash = 14695981039346656037ULL; // FNV offset basis
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char)label[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static size_t entry_size(size_t label_len, size_t dim) {
+    return sizeof(uint32_t) + ((label_len + 3) & ~(size_t)3) + dim * sizeof(float);
+}
+
+static bool header_matches(const LabelCacheHeader* header, uint64_t model_hash) {
+    return memcmp(header->magic, LABEL_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+           header->model_hash == model_hash && header->dim > 0;
+}
+
+/**
+ * Finds the slot of a label in the hash table: the slot holding its entry, or the empty slot it belongs to.
+ */
+static size_t find_slot(const LabelEmbeddingCache* cache, const char* label, size_t len) {
+    const char* data = (const char*)cache->mapping.data;
+    size_t mask = cache->num_slots - 1;
+    size_t slot = (size_t)hash_label(label, len) & mask;
+    while (cache->slots[slot] != 0) {
+        size_t offset = cache->slots[slot];
+        uint32_t entry_len;
+        memcpy(&entry_len, data + offset, sizeof(uint32_t));
+        if (entry_len == len && memcmp(data + offset + sizeof(uint32_t), label, len) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * Adds the entry at the given file offset to the hash table, growing the table if it is half full.
+ */
+static int index_entry(LabelEmbeddingCache* cache, size_t offset) {
+    if ((cache->num_entries + 1) * 2 > cache->num_slots) {
+        size_t old_num_slots = cache->num_slots;
+        size_t* old_slots = cache->slots;
+        size_t num_slots = old_num_slots ? old_num_slots * 2 : 256;
+        size_t* slots = (size_t*)calloc(num_slots, sizeof(size_t));
+        if (!slots) {
+            fprintf(stderr, "Error: Memory allocation for label cache index failed\n");
+            return -1;
+        }
+        cache->slots = slots;
+        cache->num_slots = num_slots;
+        cache->num_entries = 0;
+        for (size_t i = 0; i < old_num_slots; ++i) {
+            if (old_slots[i] != 0) {
+                index_entry(cache, old_slots[i]);
+            }
+        }
+        free(old_slots);
+    }
+
+    const char* data = (const char*)cache->mapping.data;
+    uint32_t len;
+    memcpy(&len, data + offset, sizeof(uint32_t));
+    size_t slot = find_slot(cache, data + offset + sizeof(uint32_t), len);
+    if (cache->slots[slot] == 0) {
+        cache->slots[slot] = offset;
+        cache->num_entries++;
+    }
+    return 0;
+}
+
+/**
+ * Indexes the complete entries of the mapping after scanned_end. A torn entry at the end
+ * of the file (an interrupted append) is left out.
+ */
+static void scan_entries(LabelEmbeddingCache* cache) {
+    const char* data = (const char*)cache->mapping.data;
+    size_t offset = cache->scanned_end;
+    while (offset + sizeof(uint32_t) <= cache->mapping.size) {
+        uint32_t len;
+        memcpy(&len, data + offset, sizeof(uint32_t));
+        size_t size = entry_size(len, cache->dim);
+        if (size > cache->mapping.size - offset || index_entry(cache, offset) != 0) {
+            break;
+        }
+        offset += size;
+    }
+    cache->scanned_end = offset;
+}
+
+static void reset_index(LabelEmbeddingCache* cache) {
+    if (cache->slots) {
+        memset(cache->slots, 0, cache->num_slots * sizeof(size_t));
+    }
+    cache->num_entries = 0;
+    cache->scanned_end = sizeof(LabelCacheHeader);
+}
+
+static int write_all(int fd, const void* buffer, size_t len, off_t offset) {
+    const char* p = (const char*)buffer;
+    while (len > 0) {
+        ssize_t written = pwrite(fd, p, len, offset);
+        if (written <= 0) {
+            return -1;
+        }
+        p += written;
+        offset += written;
+        len -= (size_t)written;
+    }
+    return 0;
+}
+
+/**
+ * Opens the label embedding cache stored at the given path and indexes its entries.
+ * A missing file, or a file written for another model, gives an empty cache; the file is
+ * (re)created on the first append.
+ *
+ * @param path The path to the cache file.
+ * @param model_hash The hash of the label encoder model (see hash_model_file).
+ * @param cache Pointer to the LabelEmbeddingCache structure to fill.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+int open_label_cache(const char* path, uint64_t model_hash, LabelEmbeddingCache* cache) {
+    memset(cache, 0, sizeof(*cache));
+    cache->model_hash = model_hash;
+    cache->scanned_end = sizeof(LabelCacheHeader);
+    cache->path = strdup(path);
+    if (!cache->path) {
+        fprintf(stderr, "Error: Memory allocation for label cache path failed\n");
+        return -1;
+    }
+
+    struct stat st;
+    if (stat(path, &st) != 0 || (size_t)st.st_size < sizeof(LabelCacheHeader)) {
+        return 0;
+    }
+    if (map_file_readonly(path, &cache->mapping) != 0) {
+        return 0;
+    }
+    const LabelCacheHeader* header = (const LabelCacheHeader*)cache->mapping.data;
+    if (!header_matches(header, model_hash)) {
+        printf("Label cache %s belongs to another model, it will be rebuilt\n", path);
+        unmap_file(&cache->mapping);
+        return 0;
+    }
+    cache->dim = header->dim;
+    scan_entries(cache);
+    return 0;
+}
+
+/**
+ * Looks up the embedding of a label.
+ * The returned pointer stays valid until the next call to append_label_embeddings or close_label_cache.
+ *
+ * @param cache The label embedding cache.
+ * @param label The label.
+ * @return A pointer to the embedding (dim floats), or NULL if the label is not cached.
+ */
+const float* lookup_label_embedding(const LabelEmbeddingCache* cache, const char* label) {
+    if (cache->num_entries == 0) {
+        return NULL;
+    }
+    size_t len = strlen(label);
+    size_t offset = cache->slots[find_slot(cache, label, len)];
+    if (offset == 0) {
+        return NULL;
+    }
+    return (const float*)((const char*)cache->mapping.data + offset + entry_size(len, 0));
+}
+
+/**
+ * Appends the embeddings of labels to the cache file and indexes them.
+ * The file is locked while it is written, so several processes can share one cache;
+ * labels that are already cached (also by another process) are skipped.
+ *
+ * @param cache The label embedding cache.
+ * @param labels The labels.
+ * @param embeddings The embeddings of the labels (num_labels x dim, row-major).
+ * @param num_labels The number of labels.
+ * @param dim The size of one embedding.
+ * @return 0 if successful, -1 if the file could not be written or the size of the embeddings does not match the cache.
+ */
+int append_label_embeddings(LabelEmbeddingCache* cache, const char* const* labels, const float* embeddings,
+                            size_t num_labels, size_t dim) {
+    if (cache->dim != 0 && cache->dim != dim) {
+        fprintf(stderr, "Error: Label embeddings have size %zu, the cache %s expects %zu\n", dim, cache->path, cache->dim);
+        return -1;
+    }
+
+    int fd = open(cache->path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Failed to open label cache %s\n", cache->path);
+        return -1;
+    }
+    flock(fd, LOCK_EX);
+
+    int result = 0;
+    char* buffer = NULL;
+    struct stat st;
+    LabelCacheHeader header;
+    bool valid = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(header) &&
+                 pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                 header_matches(&header, cache->model_hash) && header.dim == dim;
+
+    // Pick up the entries appended by other processes, or start a new file
+    unmap_file(&cache->mapping);
+    if (valid) {
+        if ((size_t)st.st_size < cache->scanned_end) {
+            reset_index(cache); // Rebuilt by another process
+        }
+        cache->dim = dim;
+        if (map_file_readonly(cache->path, &cache->mapping) != 0) {
+            result = -1;
+            goto cleanup;
+        }
+        scan_entries(cache);
+        if (cache->scanned_end < (size_t)st.st_size && ftruncate(fd, (off_t)cache->scanned_end) != 0) {
+            result = -1;
+            goto cleanup;
+        }
+    } else {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, LABEL_CACHE_MAGIC, sizeof(header.magic));
+        header.model_hash = cache->model_hash;
+        header.dim = (uint32_t)dim;
+        if (ftruncate(fd, 0) != 0 || write_all(fd, &header, sizeof(header), 0) != 0) {
+            fprintf(stderr, "Error: Failed to write label cache %s\n", cache->path);
+            result = -1;
+            goto cleanup;
+        }
+        cache->dim = dim;
+        reset_index(cache);
+    }
+
+    size_t end = cache->scanned_end;
+    for (size_t i = 0; i < num_labels; ++i) {
+        if (lookup_label_embedding(cache, labels[i]) != NULL) {
+            continue;
+        }
+        uint32_t len = (uint32_t)strlen(labels[i]);
+        size_t size = entry_size(len, dim);
+        buffer = (char*)calloc(1, size);
+        if (!buffer) {
+            fprintf(stderr, "Error: Memory allocation for label cache entry failed\n");
+            result = -1;
+            break;
+        }
+        memcpy(buffer, &len, sizeof(uint32_t));
+        memcpy(buffer + sizeof(uint32_t), labels[i], len);
+        memcpy(buffer + entry_size(len, 0), &embeddings[i * dim], dim * sizeof(float));
+        if (write_all(fd, buffer, size, (off_t)end) != 0) {
+            fprintf(stderr, "Error: Failed to write label cache %s\n", cache->path);
+            result = -1;
+            break;
+        }
+        free(buffer);
+        buffer = NULL;
+        end += size;
+    }
+
+    // Index the new entries
+    unmap_file(&cache->mapping);
+    if (map_file_readonly(cache->path, &cache->mapping) == 0) {
+        scan_entries(cache);
+    } else {
+        result = -1;
+    }
+
+cleanup:
+    free(buffer);
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (cache->mapping.data == NULL) {
+        reset_index(cache);
+    }
+    return result;
+}
+
+/**
+ * Unmaps the cache file and frees the index.
+ *
+ * @param cache The label embedding cache.
+ */
+void close_label_cache(LabelEmbeddingCache* cache) {
+    unmap_file(&cache->mapping);
+    free(cache->slots);
+    free(cache->path);
+    cache->slots = NULL;
+    cache->path = NULL;
+    cache->num_slots = 0;
+    cache->num_entries = 0;
+}
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <math.h>
+#include <omp.h>
+
+#include "label_prefilter.h"
+#include "configs.h"
+
+/**
+ * Structure to store the terms of one text with their frequencies (open addressing on the term hash).
+ */
+typedef struct {
+    uint64_t* keys;         /**< Term hashes, 0 for empty slots. */
+    uint32_t* counts;       /**< Frequency of every term. */
+    size_t num_slots;       /**< Number of slots (a power of two). */
+    size_t num_terms;       /**< Number of distinct terms. */
+    size_t length;          /**< Number of terms of the text. */
+} TermTable;
+
+/**
+ * Hashes a term: ASCII letters are lowercased and a plural "s" is dropped from terms longer than 3 bytes,
+ * so "Sports" and "sport" are the same term. The hash is never 0.
+ */
+static uint64_t hash_term(const char* term, size_t len) {
+    if (len > 3 && (term[len - 1] == 's' || term[len - 1] == 'S')) {
+        len--;
+    }
+    uint64_t hash = 14695981039346656037ULL; // FNV offset basis
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char)tolower((unsigned char)term[i])) * 1099511628211ULL;
+    }
+    return hash | 1;
+}
+
+static bool is_term_char(unsigned char c) {
+    return isalnum(c) || c >= 0x80; // Bytes of UTF-8 sequences belong to words
+}
+
+/**
+ * Calls visit for every term of a string (runs of letters, digits and non-ASCII characters).
+ */
+static void for_each_term(const char* text, void (*visit)(uint64_t hash, void* arg), void* arg) {
+    const char* p = text;
+    while (*p) {
+        while (*p && !is_term_char((unsigned char)*p)) p++;
+        const char* start = p;
+        while (*p && is_term_char((unsigned char)*p)) p++;
+        if (p > start) {
+            visit(hash_term(start, (size_t)(p - start)), arg);
+        }
+    }
+}
+
+static void count_term(uint64_t hash, void* arg) {
+    (*(size_t*)arg)++;
+    (void)hash;
+}
+
+static size_t find_term(const TermTable* table, uint64_t hash) {
+    size_t mask = table->num_slots - 1;
+    size_t slot = (size_t)(hash >> 1) & mask;
+    while (table->keys[slot] != 0 && table->keys[slot] != hash) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void add_term(uint64_t hash, void* arg) {
+    TermTable* table = (TermTable*)arg;
+    size_t slot = find_term(table, hash);
+    if (table->keys[slot] == 0) {
+        table->keys[slot] = hash;
+        table->num_terms++;
+    }
+    table->counts[slot]++;
+    table->length++;
+}
+
+static uint32_t term_count(const TermTable* table, uint64_t hash) {
+    size_t slot = find_term(table, hash);
+    return table->keys[slot] == hash ? table->counts[slot] : 0;
+}
+
+/**
+ * Builds the term table of a text (sized for at least max_terms distinct terms).
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+static int build_term_table(const char* text, size_t max_terms, TermTable* table) {
+    memset(table, 0, sizeof(*table));
+    table->num_slots = 16;
+    while (table->num_slots < 2 * max_terms) {
+        table->num_slots *= 2;
+    }
+    table->keys = (uint64_t*)calloc(table->num_slots, sizeof(uint64_t));
+    table->counts = (uint32_t*)calloc(table->num_slots, sizeof(uint32_t));
+    if (!table->keys || !table->counts) {
+        free(table->keys);
+        free(table->counts);
+        memset(table, 0, sizeof(*table));
+        return -1;
+    }
+    if (text) {
+        for_each_term(text, add_term, table);
+    }
+    return 0;
+}
+
+static void free_term_table(TermTable* table) {
+    free(table->keys);
+    free(table->counts);
+    memset(table, 0, sizeof(*table));
+}
+
+/**
+ * Structure to pass the state of the label scoring to the term visitor.
+ */
+typedef struct {
+    const TermTable* text_terms;    /**< Terms of the text. */
+    const TermTable* doc_freq;      /**< Number of texts of the request containing every term. */
+    TermTable seen;                 /**< Terms of the label already scored (a repeated term counts once). */
+    double num_texts;               /**< Number of texts of the request. */
+    double length_norm;             /**< 1 - b + b * |text| / average text length. */
+    double score;                   /**< BM25 score of the label so far. */
+} LabelScore;
+
+static void score_term(uint64_t hash, void* arg) {
+    LabelScore* label = (LabelScore*)arg;
+    size_t slot = find_term(&label->seen, hash);
+    if (label->seen.keys[slot] == hash) {
+        return;
+    }
+    label->seen.keys[slot] = hash;
+    double tf = term_count(label->text_terms, hash);
+    if (tf == 0) {
+        return;
+    }
+    double df = term_count(label->doc_freq, hash);
+    double idf = log(1.0 + (label->num_texts - df + 0.5) / (df + 0.5));
+    label->score += idf * tf * (PREFILTER_BM25_K1 + 1.0) / (tf + PREFILTER_BM25_K1 * label->length_norm);
+}
+
+static void count_document_term(uint64_t hash, void* arg) {
+    TermTable* doc_freq = (TermTable*)arg;
+    size_t slot = find_term(doc_freq, hash);
+    if (doc_freq->keys[slot] == 0) {
+        doc_freq->keys[slot] = hash;
+        doc_freq->num_terms++;
+    }
+    doc_freq->counts[slot]++;
+}
+
+// Ranking of the labels of one text: scores are compared through an index array
+typedef struct {
+    size_t index;
+    double score;
+} RankedLabel;
+
+static int compare_ranked_labels(const void* a, const void* b) {
+    const RankedLabel* x = (const RankedLabel*)a;
+    const RankedLabel* y = (const RankedLabel*)b;
+    if (x->score != y->score) {
+        return (x->score < y->score) - (x->score > y->score);
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/**
+ * Keeps the top_n labels of a text by their BM25 score against the text and frees the others.
+ * The kept labels stay in their original order; ties (e.g. labels without any overlap) keep the earlier label.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated (the labels are left unchanged).
+ */
+static int prefilter_text_labels(char** labels, size_t* num_labels, size_t top_n, const TermTable* text_terms,
+                                 const TermTable* doc_freq, double num_texts, double average_length) {
+    size_t count = *num_labels;
+    RankedLabel* ranked = (RankedLabel*)malloc(count * sizeof(RankedLabel));
+    bool* keep = (bool*)calloc(count, sizeof(bool));
+    LabelScore label;
+    memset(&label, 0, sizeof(label));
+    if (!ranked || !keep || build_term_table(NULL, 64, &label.seen) != 0) {
+        free(ranked);
+        free(keep);
+        return -1;
+    }
+    label.text_terms = text_terms;
+    label.doc_freq = doc_freq;
+    label.num_texts = num_texts;
+    label.length_norm = 1.0 - PREFILTER_BM25_B + PREFILTER_BM25_B * text_terms->length / (average_length > 0 ? average_length : 1.0);
+
+    for (size_t j = 0; j < count; ++j) {
+        size_t num_terms = 0;
+        for_each_term(labels[j], count_term, &num_terms);
+        if (num_terms * 2 > label.seen.num_slots) {
+            free_term_table(&label.seen);
+            if (build_term_table(NULL, num_terms, &label.seen) != 0) {
+                free(ranked);
+                free(keep);
+                return -1;
+            }
+        } else {
+            memset(label.seen.keys, 0, label.seen.num_slots * sizeof(uint64_t));
+        }
+        label.score = 0.0;
+        for_each_term(labels[j], score_term, &label);
+        ranked[j].index = j;
+        ranked[j].score = label.score;
+    }
+    free_term_table(&label.seen);
+
+    qsort(ranked, count, sizeof(RankedLabel), compare_ranked_labels);
+    for (size_t j = 0; j < top_n; ++j) {
+        keep[ranked[j].index] = true;
+    }
+    size_t kept = 0;
+    for (size_t j = 0; j < count; ++j) {
+        if (keep[j]) {
+            labels[kept++] = labels[j];
+        } else {
+            free(labels[j]);
+        }
+    }
+    *num_labels = kept;
+    free(ranked);
+    free(keep);
+    return 0;
+}
+
+/**
+ * Ranks the labels of every text of a request by their lexical overlap with the text (BM25, with the
+ * texts of the request as the collection) and keeps the top_n of them, so the prompt the model sees
+ * only holds the plausible labels. Only requests with per-text labels (same_labels false) are filtered;
+ * a shared label set and taxonomies are left unchanged.
+ *
+ * @param request The request to filter in place.
+ * @param top_n The number of labels to keep per text.
+ * @param stats Pointer to the PrefilterStats structure to fill.
+ * @return 0 if successful, -1 if memory could not be allocated (texts not processed yet keep all labels).
+ */
+int prefilter_request_labels(ClassificationRequest* request, size_t top_n, PrefilterStats* stats) {
+    double start_time = omp_get_wtime();
+    memset(stats, 0, sizeof(*stats));
+    if (request->same_labels || request->taxonomy || !request->labels || top_n == 0) {
+        return 0;
+    }
+    size_t num_texts = request->num_texts;
+    TermTable* text_terms = (TermTable*)calloc(num_texts, sizeof(TermTable));
+    TermTable doc_freq;
+    memset(&doc_freq, 0, sizeof(doc_freq));
+    if (!text_terms) {
+        fprintf(stderr, "Error: Memory allocation for the label prefilter failed\n");
+        return -1;
+    }
+
+    // Terms of every text, then the number of texts containing each term
+    int result = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(|:result)
+    for (size_t i = 0; i < num_texts; ++i) {
+        size_t num_terms = 0;
+        const char* text = request->texts[i] ? request->texts[i] : "";
+        for_each_term(text, count_term, &num_terms);
+        if (build_term_table(text, num_terms, &text_terms[i]) != 0) {
+            result |= 1;
+        }
+    }
+    size_t total_terms = 0, total_length = 0;
+    for (size_t i = 0; i < num_texts; ++i) {
+        total_terms += text_terms[i].num_terms;
+        total_length += text_terms[i].length;
+    }
+    if (result != 0 || build_term_table(NULL, total_terms, &doc_freq) != 0) {
+        fprintf(stderr, "Error: Memory allocation for the label prefilter failed\n");
+        result = -1;
+        goto cleanup;
+    }
+    for (size_t i = 0; i < num_texts; ++i) {
+        for (size_t s = 0; s < text_terms[i].num_slots; ++s) {
+            if (text_terms[i].keys[s] != 0) {
+                count_document_term(text_terms[i].keys[s], &doc_freq);
+            }
+        }
+    }
+
+    double average_length = num_texts ? (double)total_length / num_texts : 0.0;
+    size_t labels_before = 0, labels_after = 0, filtered_texts = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(+:labels_before, labels_after, filtered_texts) reduction(|:result)
+    for (size_t i = 0; i < num_texts; ++i) {
+        labels_before += request->num_labels[i];
+        if (request->num_labels[i] > top_n && request->labels[i]) {
+            if (prefilter_text_labels(request->labels[i], &request->num_labels[i], top_n, &text_terms[i],
+                                      &doc_freq, (double)num_texts, average_length) != 0) {
+                result |= 1;
+            }
+            filtered_texts++;
+        }
+        labels_after += request->num_labels[i];
+    }
+    stats->num_texts = filtered_texts;
+    stats->labels_before = labels_before;
+    stats->labels_after = labels_after;
+    if (result != 0) {
+        fprintf(stderr, "Error: Memory allocation for the label prefilter failed, some texts keep all labels\n");
+        result = -1;
+    }
+
+cleanup:
+    for (size_t i = 0; i < num_texts; ++i) {
+        free_term_table(&text_terms[i]);
+    }
+    free(text_terms);
+    free_term_table(&doc_freq);
+    stats->time = omp_get_wtime() - start_time;
+    return result;
+}
+
+/**
+ * Prints the statistics of a label prefilter pass.
+ *
+ * @param stats The statistics to print.
+ */
+void print_prefilter_stats(const PrefilterStats* stats) {
+    printf("Label prefilter: %zu texts, %zu labels reduced to %zu in %f seconds\n",
+           stats->num_texts, stats->labels_before, stats->labels_after, stats->time);
+}
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mapped_file.h"
+
+/**
+ * Maps a whole file into memory read-only. The mapping is shared, so processes mapping the same file
+ * use the same page cache pages instead of holding private copies.
+ *
+ * @param path The path to the file.
+ * @param mapped Pointer to the MappedFile structure to fill.
+ * @return 0 if successful, -1 if the file could not be opened or mapped.
+ */
+int map_file_readonly(const char* path, MappedFile* mapped) {
+    mapped->data = NULL;
+    mapped->size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Failed to open file %s\n", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Error: Failed to get the size of file %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // The mapping stays valid after the descriptor is closed
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: Failed to map file %s\n", path);
+        return -1;
+    }
+
+    mapped->data = data;
+    mapped->size = (size_t)st.st_size;
+    return 0;
+}
+
+/**
+ * Unmaps a file mapped with map_file_readonly.
+ *
+ * @param mapped Pointer to the MappedFile structure to unmap.
+ */
+void unmap_file(MappedFile* mapped) {
+    if (mapped->data) {
+        munmap(mapped->data, mapped->size);
+    }
+    mapped->data = NULL;
+    mapped->size = 0;
+}
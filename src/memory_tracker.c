@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <omp.h>
+
+#include "memory_tracker.h"
+#include "model.h"
+#include "configs.h"
+
+#define TRACKED_HEADER_SIZE 64 // Bytes in front of a tracked tensor holding its size, keeps the 64 byte alignment of ONNX Runtime
+
+/**
+ * Structure to store the allocations of the batch running on the calling thread.
+ */
+typedef struct {
+    bool active;
+    int64_t live;
+    int64_t peak;
+    size_t rows;
+    size_t seq_length;
+} BatchScope;
+
+/**
+ * Structure to store the peak memory of the batches of one shape.
+ */
+typedef struct {
+    size_t rows;
+    size_t seq_length;
+    size_t num_batches;
+    int64_t peak;           /**< Largest peak of one batch. */
+    int64_t total_peak;     /**< Sum of the peaks, for the mean. */
+} ShapeStats;
+
+/**
+ * Structure to store one sample of the memory usage over time.
+ */
+typedef struct {
+    double time;
+    long rss_kb;
+    int64_t live;
+} MemorySample;
+
+static bool tracking_enabled = false;
+static pthread_mutex_t tracker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static MemorySnapshot totals;
+static double start_time = 0.0;
+static ShapeStats* shapes = NULL;
+static size_t num_shapes = 0;
+static MemorySample samples[MEMORY_MAX_SAMPLES];
+static size_t num_samples = 0;
+static size_t sample_stride = 1;    // Sampler ticks per stored sample, doubled whenever the samples are full
+static volatile sig_atomic_t snapshot_requested = 0;
+static _Thread_local BatchScope batch_scope = { false, 0, 0, 0, 0 };
+
+static const char* stage_names[NUM_MEMORY_STAGES] = { "requests", "prompts", "tokens", "tensors" };
+
+/**
+ * Structure of the allocator of the input tensors: wraps the default allocator of ONNX Runtime
+ * and counts every tensor as MEMORY_TENSORS until ONNX Runtime frees it.
+ */
+typedef struct {
+    OrtAllocator base;      /**< Must be the first member, ONNX Runtime calls it with a pointer to base. */
+    OrtAllocator* inner;
+} TrackedAllocator;
+
+static TrackedAllocator tracked_allocator;
+static pthread_once_t tracked_allocator_once = PTHREAD_ONCE_INIT;
+
+static void* ORT_API_CALL tracked_alloc(OrtAllocator* allocator, size_t size) {
+    OrtAllocator* inner = ((TrackedAllocator*)allocator)->inner;
+    char* block = (char*)inner->Alloc(inner, size + TRACKED_HEADER_SIZE);
+    if (!block) {
+        return NULL;
+    }
+    memcpy(block, &size, sizeof(size));
+    track_allocation(MEMORY_TENSORS, size);
+    return block + TRACKED_HEADER_SIZE;
+}
+
+static void ORT_API_CALL tracked_free(OrtAllocator* allocator, void* p) {
+    if (!p) {
+        return;
+    }
+    OrtAllocator* inner = ((TrackedAllocator*)allocator)->inner;
+    char* block = (char*)p - TRACKED_HEADER_SIZE;
+    size_t size = 0;
+    memcpy(&size, block, sizeof(size));
+    track_release(MEMORY_TENSORS, size);
+    inner->Free(inner, block);
+}
+
+static const OrtMemoryInfo* ORT_API_CALL tracked_info(const OrtAllocator* allocator) {
+    const OrtAllocator* inner = ((const TrackedAllocator*)allocator)->inner;
+    return inner->Info(inner);
+}
+
+static void init_tracked_allocator(void) {
+    OrtStatus* status = g_ort->GetAllocatorWithDefaultOptions(&tracked_allocator.inner);
+    if (status != NULL) {
+        fprintf(stderr, "Error: Failed to get allocator: %s\n", g_ort->GetErrorMessage(status));
+        g_ort->ReleaseStatus(status);
+        tracked_allocator.inner = NULL;
+        return;
+    }
+    tracked_allocator.base.version = ORT_API_VERSION;
+    tracked_allocator.base.Alloc = tracked_alloc;
+    tracked_allocator.base.Free = tracked_free;
+    tracked_allocator.base.Info = tracked_info;
+}
+
+/**
+ * Returns the allocator of the input tensors: the default allocator of ONNX Runtime, wrapped so the
+ * tensors are counted while they are alive if memory tracking is enabled.
+ *
+ * @return The allocator, or NULL if ONNX Runtime has no default allocator.
+ */
+OrtAllocator* get_tracked_allocator(void) {
+    if (!tracking_enabled) {
+        OrtAllocator* allocator = NULL;
+        OrtStatus* status = g_ort->GetAllocatorWithDefaultOptions(&allocator);
+        if (status != NULL) {
+            fprintf(stderr, "Error: Failed to get allocator: %s\n", g_ort->GetErrorMessage(status));
+            g_ort->ReleaseStatus(status);
+            return NULL;
+        }
+        return allocator;
+    }
+    pthread_once(&tracked_allocator_once, init_tracked_allocator);
+    return tracked_allocator.inner ? &tracked_allocator.base : NULL;
+}
+
+static long read_rss_kb(void) {
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file) {
+        return 0;
+    }
+    long size = 0, resident = 0;
+    if (fscanf(file, "%ld %ld", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(file);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void handle_snapshot_signal(int signal_number) {
+    (void)signal_number;
+    snapshot_requested = 1;
+}
+
+/**
+ * Samples the RSS of the process every MEMORY_SAMPLE_INTERVAL_MS. When the samples are full every other one
+ * is dropped and the interval doubles, so they always cover the whole run. Prints a snapshot on SIGUSR1.
+ */
+static void* memory_sampler(void* arg) {
+    (void)arg;
+    for (size_t tick = 0;; ++tick) {
+        if (tick % sample_stride == 0) {
+            long rss_kb = read_rss_kb();
+            pthread_mutex_lock(&tracker_mutex);
+            if (num_samples == MEMORY_MAX_SAMPLES) {
+                for (size_t i = 0; i < MEMORY_MAX_SAMPLES / 2; ++i) {
+                    samples[i] = samples[2 * i];
+                }
+                num_samples = MEMORY_MAX_SAMPLES / 2;
+                sample_stride *= 2;
+            }
+            samples[num_samples].time = omp_get_wtime() - start_time;
+            samples[num_samples].rss_kb = rss_kb;
+            samples[num_samples].live = totals.live;
+            num_samples++;
+            pthread_mutex_unlock(&tracker_mutex);
+        }
+        if (snapshot_requested) {
+            snapshot_requested = 0;
+            print_memory_stats(stderr);
+        }
+        usleep(MEMORY_SAMPLE_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+/**
+ * Enables the allocation tracking (--memory-stats) and starts sampling the RSS of the process.
+ * Must be called before the first tracked buffer is allocated.
+ */
+void enable_memory_tracking(void) {
+    if (tracking_enabled) {
+        return;
+    }
+    memset(&totals, 0, sizeof(totals));
+    start_time = omp_get_wtime();
+    tracking_enabled = true;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_snapshot_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, memory_sampler, NULL) != 0) {
+        fprintf(stderr, "Error: Failed to start the memory sampler, the RSS is only reported at exit\n");
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * @return true if allocations are tracked.
+ */
+bool memory_tracking_enabled(void) {
+    return tracking_enabled;
+}
+
+static void update_stage(MemoryStage stage, int64_t bytes) {
+    pthread_mutex_lock(&tracker_mutex);
+    MemoryStageStats* stats = &totals.stages[stage];
+    if (bytes > 0) {
+        stats->num_allocations++;
+        stats->allocated += (size_t)bytes;
+    }
+    stats->live += bytes;
+    if (stats->live > stats->peak) {
+        stats->peak = stats->live;
+    }
+    totals.live += bytes;
+    if (totals.live > totals.peak) {
+        totals.peak = totals.live;
+    }
+    pthread_mutex_unlock(&tracker_mutex);
+
+    if (batch_scope.active && stage != MEMORY_REQUESTS) {
+        batch_scope.live += bytes;
+        if (batch_scope.live > batch_scope.peak) {
+            batch_scope.peak = batch_scope.live;
+        }
+    }
+}
+
+/**
+ * Counts an allocation of a stage. Does nothing unless tracking is enabled.
+ *
+ * @param stage The stage the buffer belongs to.
+ * @param bytes The size of the buffer.
+ */
+void track_allocation(MemoryStage stage, size_t bytes) {
+    if (tracking_enabled) {
+        update_stage(stage, (int64_t)bytes);
+    }
+}
+
+/**
+ * Counts the release of a buffer counted with track_allocation.
+ *
+ * @param stage The stage the buffer belongs to.
+ * @param bytes The size of the buffer.
+ */
+void track_release(MemoryStage stage, size_t bytes) {
+    if (tracking_enabled) {
+        update_stage(stage, -(int64_t)bytes);
+    }
+}
+
+/**
+ * Starts the batch scope of the calling thread: the prompts, tokens and tensors allocated until
+ * memory_batch_end belong to the batch and must be released before it ends.
+ */
+void memory_batch_begin(void) {
+    if (tracking_enabled) {
+        batch_scope = (BatchScope){ true, 0, 0, 0, 0 };
+    }
+}
+
+/**
+ * Sets the shape of the batch of the calling thread, its peak is reported per shape.
+ *
+ * @param rows The number of rows of the batch.
+ * @param seq_length The padded sequence length of the batch.
+ */
+void memory_batch_shape(size_t rows, size_t seq_length) {
+    if (batch_scope.active) {
+        batch_scope.rows = rows;
+        batch_scope.seq_length = seq_length;
+    }
+}
+
+/**
+ * Ends the batch scope of the calling thread: records the peak of the batch for its shape and
+ * counts the batch as leaked if some of its buffers are still alive.
+ */
+void memory_batch_end(void) {
+    if (!batch_scope.active) {
+        return;
+    }
+    batch_scope.active = false;
+    pthread_mutex_lock(&tracker_mutex);
+    totals.num_batches++;
+    if (batch_scope.live != 0) {
+        totals.leaked_batches++;
+        totals.leaked_bytes += batch_scope.live;
+    }
+    ShapeStats* shape = NULL;
+    for (size_t i = 0; i < num_shapes && !shape; ++i) {
+        if (shapes[i].rows == batch_scope.rows && shapes[i].seq_length == batch_scope.seq_length) {
+            shape = &shapes[i];
+        }
+    }
+    if (!shape) {
+        ShapeStats* grown = (ShapeStats*)realloc(shapes, (num_shapes + 1) * sizeof(ShapeStats));
+        if (grown) {
+            shapes = grown;
+            shape = &shapes[num_shapes++];
+            *shape = (ShapeStats){ batch_scope.rows, batch_scope.seq_length, 0, 0, 0 };
+        }
+    }
+    if (shape) {
+        shape->num_batches++;
+        shape->total_peak += batch_scope.peak;
+        if (batch_scope.peak > shape->peak) {
+            shape->peak = batch_scope.peak;
+        }
+    }
+    pthread_mutex_unlock(&tracker_mutex);
+}
+
+/**
+ * Takes a snapshot of the tracked allocations and the RSS of the process.
+ *
+ * @param snapshot Pointer to the MemorySnapshot structure to fill.
+ */
+void get_memory_snapshot(MemorySnapshot* snapshot) {
+    long rss_kb = read_rss_kb();
+    pthread_mutex_lock(&tracker_mutex);
+    *snapshot = totals;
+    pthread_mutex_unlock(&tracker_mutex);
+    snapshot->rss_kb = rss_kb;
+    struct rusage usage;
+    snapshot->peak_rss_kb = getrusage(RUSAGE_SELF, &usage) == 0 && usage.ru_maxrss > rss_kb ? usage.ru_maxrss : rss_kb;
+    snapshot->time = tracking_enabled ? omp_get_wtime() - start_time : 0.0;
+}
+
+static int compare_shapes(const void* a, const void* b) {
+    const ShapeStats* x = (const ShapeStats*)a;
+    const ShapeStats* y = (const ShapeStats*)b;
+    if (x->seq_length != y->seq_length) {
+        return (x->seq_length > y->seq_length) - (x->seq_length < y->seq_length);
+    }
+    return (x->rows > y->rows) - (x->rows < y->rows);
+}
+
+/**
+ * Prints the tracked memory: bytes allocated and peak live bytes per stage and per batch shape,
+ * the RSS of the process over time and the batches whose buffers outlived them.
+ * The RSS not covered by tracked buffers is the model, the ONNX Runtime arena and the allocator caches.
+ *
+ * @param stream The stream to print to.
+ */
+void print_memory_stats(FILE* stream) {
+    if (!tracking_enabled) {
+        return;
+    }
+    MemorySnapshot snapshot;
+    get_memory_snapshot(&snapshot);
+    const double mib = 1024.0 * 1024.0;
+
+    fprintf(stream, "\nMemory per stage (%.1f seconds):\n", snapshot.time);
+    fprintf(stream, "%-10s %12s %16s %12s %12s\n", "stage", "allocations", "allocated(MiB)", "peak(MiB)", "live(MiB)");
+    for (int s = 0; s < NUM_MEMORY_STAGES; ++s) {
+        const MemoryStageStats* stage = &snapshot.stages[s];
+        fprintf(stream, "%-10s %12zu %16.2f %12.2f %12.2f\n", stage_names[s], stage->num_allocations,
+                stage->allocated / mib, stage->peak / mib, stage->live / mib);
+    }
+    fprintf(stream, "%-10s %12s %16s %12.2f %12.2f\n", "total", "", "", snapshot.peak / mib, snapshot.live / mib);
+
+    pthread_mutex_lock(&tracker_mutex);
+    qsort(shapes, num_shapes, sizeof(ShapeStats), compare_shapes);
+    if (num_shapes > 0) {
+        fprintf(stream, "\nMemory per batch shape (prompts, tokens and tensors of one batch):\n");
+        fprintf(stream, "%-14s %10s %12s %16s\n", "shape", "batches", "peak(MiB)", "mean peak(MiB)");
+        for (size_t i = 0; i < num_shapes; ++i) {
+            char shape[48];
+            snprintf(shape, sizeof(shape), "%zu x %zu", shapes[i].rows, shapes[i].seq_length);
+            fprintf(stream, "%-14s %10zu %12.2f %16.2f\n", shape, shapes[i].num_batches, shapes[i].peak / mib,
+                    shapes[i].total_peak / mib / shapes[i].num_batches);
+        }
+    }
+    if (num_samples > 0) {
+        fprintf(stream, "\nRSS over time:\n");
+        fprintf(stream, "%10s %12s %14s\n", "time(s)", "RSS(MiB)", "tracked(MiB)");
+        for (size_t i = 0; i < num_samples; ++i) {
+            fprintf(stream, "%10.2f %12.1f %14.2f\n", samples[i].time, samples[i].rss_kb / 1024.0, samples[i].live / mib);
+        }
+    }
+    pthread_mutex_unlock(&tracker_mutex);
+
+    double other = snapshot.rss_kb / 1024.0 - snapshot.live / mib;
+    fprintf(stream, "\nRSS: %.1f MiB (peak %.1f MiB), of which %.1f MiB are not tracked buffers "
+                    "(model, ONNX Runtime arena, allocator caches)\n",
+            snapshot.rss_kb / 1024.0, snapshot.peak_rss_kb / 1024.0, other > 0 ? other : 0.0);
+    if (snapshot.leaked_batches > 0) {
+        fprintf(stream, "Leak check: %zu of %zu batches left %lld bytes alive after they finished\n",
+                snapshot.leaked_batches, snapshot.num_batches, (long long)snapshot.leaked_bytes);
+    } else {
+        fprintf(stream, "Leak check: all %zu batches released their buffers\n", snapshot.num_batches);
+    }
+}
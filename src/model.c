@@ -1,35 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <omp.h>
 #include "onnxruntime_c_api.h"
 #include "tokenizer.h"
+#include "preprocessor.h"
 #include "model.h"
+#include "model_cache.h"
+#include "mapped_file.h"
+#include "stage_counters.h"
+#include "memory_tracker.h"
+#include "configs.h"
+#include "paths.h"
+#include "thread_budget.h"
 
-////////////////////////////////////////////////////////// TO TENSORS //////////////////////////////////////////////////////
-/**
- * Flattens a 2D array of integers into a 1D array of int64_t for use in tensor creation.
- * 
- * @param data A 2D array of integers.
- * @param rows The number of rows in the 2D array.
- * @param cols The number of columns in the 2D array.
- * @return A pointer to a dynamically allocated 1D int64_t array.
- *         The caller is responsible for freeing the allocated memory.
- */
-int64_t* flatten_int_array(int** data, size_t rows, size_t cols) {
-    int64_t* flat_data = (int64_t*)malloc(rows * cols * sizeof(int64_t));
-    if (!flat_data) {
-        fprintf(stderr, "Error: Memory allocation for flat_data failed\n");
-        return NULL;
-    }
-    for (size_t i = 0; i < rows; ++i) {
-        for (size_t j = 0; j < cols; ++j) {
-            flat_data[i * cols + j] = (int64_t)data[i][j];
-        }
-    }
-    return flat_data;
-}
+const OrtApi* g_ort = NULL;         // Global pointer to ONNX Runtime API for performing model inference
+static _Thread_local bool run_out_of_memory = false; // The last Run of this thread failed to allocate memory
+static _Thread_local double run_seconds = 0.0;        // Duration of the last Run of this thread, without waiting for a slot
 
+////////////////////////////////////////////////////////// TO TENSORS //////////////////////////////////////////////////////
 /**
- * Creates a tensor from flattened data.
+ * Creates a tensor from flattened data. The tensor does not own the data, it must outlive the tensor.
  * 
  * @param data A 1D array of int64_t representing the flattened tensor data.
  * @param rows The number of rows in the tensor.
@@ -70,8 +63,47 @@ OrtValue* create_tensor(int64_t* data, size_t rows, size_t cols) {
     return tensor;
 }
 
+/**
+ * Creates an int64 tensor owned by ONNX Runtime and flattens a 2D array of integers into it.
+ * The tensor memory comes from the tracked allocator, so it is counted as MEMORY_TENSORS until released.
+ *
+ * @param data A 2D array of integers.
+ * @param rows The number of rows in the 2D array.
+ * @param cols The number of columns in the 2D array.
+ * @return A pointer to an OrtValue representing the tensor, or NULL if tensor creation fails.
+ */
+static OrtValue* create_int64_tensor(int** data, size_t rows, size_t cols) {
+    OrtAllocator* allocator = get_tracked_allocator();
+    if (allocator == NULL) {
+        return NULL;
+    }
+    int64_t dims[2] = { (int64_t)rows, (int64_t)cols };
+    OrtValue* tensor = NULL;
+    OrtStatus* status = g_ort->CreateTensorAsOrtValue(allocator, dims, 2, ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64, &tensor);
+    if (status != NULL) {
+        fprintf(stderr, "Error: Failed to create tensor: %s\n", g_ort->GetErrorMessage(status));
+        g_ort->ReleaseStatus(status);
+        return NULL;
+    }
+    int64_t* flat_data = NULL;
+    status = g_ort->GetTensorMutableData(tensor, (void**)&flat_data);
+    if (status != NULL) {
+        fprintf(stderr, "Error: Failed to get tensor data: %s\n", g_ort->GetErrorMessage(status));
+        g_ort->ReleaseStatus(status);
+        g_ort->ReleaseValue(tensor);
+        return NULL;
+    }
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < cols; ++j) {
+            flat_data[i * cols + j] = (int64_t)data[i][j];
+        }
+    }
+    return tensor;
+}
+
 /**
  * Prepares input tensors for the ONNX model using tokenized input data.
+ * The tensors own their data, releasing them with g_ort->ReleaseValue frees everything.
  * 
  * @param tokenized A pointer to the TokenizedInputs structure containing the tokenized data.
  * @param input_ids_tensor A pointer to the OrtValue that will store the input IDs tensor.
@@ -79,29 +111,19 @@ OrtValue* create_tensor(int64_t* data, size_t rows, size_t cols) {
  * @return 0 if successful, -1 if an error occurs during tensor preparation.
  */
 int prepare_input_tensors(TokenizedInputs* tokenized, OrtValue** input_ids_tensor, OrtValue** attention_mask_tensor) {
+    memory_batch_shape(tokenized->batch_size, tokenized->seq_length);
+
     // preparing input_ids
-    int64_t* input_ids_data = flatten_int_array(tokenized->input_ids, tokenized->batch_size, tokenized->seq_length);
-    if (input_ids_data == NULL) {
-        return -1;
-    }
-    *input_ids_tensor = create_tensor(input_ids_data, tokenized->batch_size, tokenized->seq_length);
+    *input_ids_tensor = create_int64_tensor(tokenized->input_ids, tokenized->batch_size, tokenized->seq_length);
     if (*input_ids_tensor == NULL) {
-        free(input_ids_data);
         return -1;
     }
 
     // preparing attention_mask
-    int64_t* attention_mask_data = flatten_int_array(tokenized->attention_mask, tokenized->batch_size, tokenized->seq_length);
-    if (attention_mask_data == NULL) {
-        free(input_ids_data);
-        g_ort->ReleaseValue(*input_ids_tensor);
-        return -1;
-    }
-    *attention_mask_tensor = create_tensor(attention_mask_data, tokenized->batch_size, tokenized->seq_length);
+    *attention_mask_tensor = create_int64_tensor(tokenized->attention_mask, tokenized->batch_size, tokenized->seq_length);
     if (*attention_mask_tensor == NULL) {
-        free(input_ids_data);
-        free(attention_mask_data);
         g_ort->ReleaseValue(*input_ids_tensor);
+        *input_ids_tensor = NULL;
         return -1;
     }
     return 0;
@@ -110,20 +132,191 @@ int prepare_input_tensors(TokenizedInputs* tokenized, OrtValue** input_ids_tenso
 
 
 
-////////////////////////////////////////////////////// ONNX ////////////////////////////////////////////////////////////////////////
 /**
- * Runs inference using the ONNX model session and input tensors.
+ * Creates a float tensor whose memory is owned by ONNX Runtime and returns a pointer to its data to fill.
  * 
+ * @param dims The dimensions of the tensor.
+ * @param num_dims The number of dimensions.
+ * @param data A pointer that will store the address of the tensor data (uninitialized).
+ * @return A pointer to an OrtValue representing the tensor, or NULL if tensor creation fails.
+ *         The caller is responsible for releasing the tensor via g_ort->ReleaseValue.
+ */
+OrtValue* create_float_tensor(const int64_t* dims, size_t num_dims, float** data) {
+    OrtAllocator* allocator = NULL;
+    OrtStatus* status = g_ort->GetAllocatorWithDefaultOptions(&allocator);
+    if (status != NULL) {
+        const char* msg = g_ort->GetErrorMessage(status);
+        fprintf(stderr, "Error: Failed to get allocator: %s\n", msg);
+        g_ort->ReleaseStatus(status);
+        return NULL;
+    }
+
+    OrtValue* tensor = NULL;
+    status = g_ort->CreateTensorAsOrtValue(allocator, dims, num_dims, ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT, &tensor);
+    if (status != NULL) {
+        const char* msg = g_ort->GetErrorMessage(status);
+        fprintf(stderr, "Error: Failed to create tensor: %s\n", msg);
+        g_ort->ReleaseStatus(status);
+        return NULL;
+    }
+
+    status = g_ort->GetTensorMutableData(tensor, (void**)data);
+    if (status != NULL) {
+        const char* msg = g_ort->GetErrorMessage(status);
+        fprintf(stderr, "Error: Failed to get tensor data: %s\n", msg);
+        g_ort->ReleaseStatus(status);
+        g_ort->ReleaseValue(tensor);
+        return NULL;
+    }
+    return tensor;
+}
+
+/**
+ * Creates a float tensor over a buffer of the caller. The tensor does not own the data, it must outlive the tensor.
+ *
+ * @param data A row-major buffer of rows x cols floats.
+ * @param rows The number of rows in the tensor.
+ * @param cols The number of columns in the tensor.
+ * @return A pointer to an OrtValue representing the tensor, or NULL if tensor creation fails.
+ */
+OrtValue* create_float_tensor_with_data(float* data, size_t rows, size_t cols) {
+    OrtMemoryInfo* memory_info = NULL;
+    OrtStatus* status = g_ort->CreateCpuMemoryInfo(OrtArenaAllocator, OrtMemTypeDefault, &memory_info);
+    if (status != NULL) {
+        fprintf(stderr, "Error: Failed to create MemoryInfo: %s\n", g_ort->GetErrorMessage(status));
+        g_ort->ReleaseStatus(status);
+        return NULL;
+    }
+    int64_t dims[2] = { (int64_t)rows, (int64_t)cols };
+    OrtValue* tensor = NULL;
+    status = g_ort->CreateTensorWithDataAsOrtValue(memory_info, data, rows * cols * sizeof(float), dims, 2,
+                                                   ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT, &tensor);
+    g_ort->ReleaseMemoryInfo(memory_info);
+    if (status != NULL) {
+        fprintf(stderr, "Error: Failed to create tensor: %s\n", g_ort->GetErrorMessage(status));
+        g_ort->ReleaseStatus(status);
+        return NULL;
+    }
+    return tensor;
+}
+
+/**
+ * Creates a zero-filled int64 tensor owned by ONNX Runtime and returns a pointer to its data to fill.
+ * The tensor memory comes from the tracked allocator, so it is counted as MEMORY_TENSORS until released.
+ *
+ * @param rows The number of rows in the tensor.
+ * @param cols The number of columns in the tensor.
+ * @param data A pointer that will store the address of the tensor data (rows x cols zeros).
+ * @return A pointer to an OrtValue representing the tensor, or NULL if tensor creation fails.
+ *         The caller is responsible for releasing the tensor via g_ort->ReleaseValue.
+ */
+OrtValue* create_int64_tensor_zeros(size_t rows, size_t cols, int64_t** data) {
+    OrtAllocator* allocator = get_tracked_allocator();
+    if (allocator == NULL) {
+        return NULL;
+    }
+    int64_t dims[2] = { (int64_t)rows, (int64_t)cols };
+    OrtValue* tensor = NULL;
+    OrtStatus* status = g_ort->CreateTensorAsOrtValue(allocator, dims, 2, ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64, &tensor);
+    if (status != NULL) {
+        fprintf(stderr, "Error: Failed to create tensor: %s\n", g_ort->GetErrorMessage(status));
+        g_ort->ReleaseStatus(status);
+        return NULL;
+    }
+    status = g_ort->GetTensorMutableData(tensor, (void**)data);
+    if (status != NULL) {
+        fprintf(stderr, "Error: Failed to get tensor data: %s\n", g_ort->GetErrorMessage(status));
+        g_ort->ReleaseStatus(status);
+        g_ort->ReleaseValue(tensor);
+        return NULL;
+    }
+    memset(*data, 0, rows * cols * sizeof(int64_t));
+    return tensor;
+}
+
+////////////////////////////////////////////////////// ONNX ////////////////////////////////////////////////////////////////////////
+/**
+ * Tells how long the last Run of the calling thread took, from the moment it got its Run slot
+ * (see acquire_run_slot) until the Run returned.
+ *
+ * @return The duration in seconds.
+ */
+double last_run_seconds(void) {
+    return run_seconds;
+}
+
+/**
+ * Reads the size of the last dimension of the first output of a session from the model graph.
+ *
  * @param session A pointer to the ONNX model session.
- * @param input_ids_tensor A pointer to the OrtValue representing the input IDs tensor.
- * @param attention_mask_tensor A pointer to the OrtValue representing the attention mask tensor.
- * @return A pointer to an OrtValue containing the model's output, or NULL if inference fails.
+ * @return The size, or 0 if the dimension is symbolic or can not be read.
  */
-OrtValue* run_inference(OrtSession* session, OrtValue* input_ids_tensor, OrtValue* attention_mask_tensor) {
+size_t get_session_output_dim(OrtSession* session) {
+    OrtTypeInfo* type_info = NULL;
+    OrtStatus* status = g_ort->SessionGetOutputTypeInfo(session, 0, &type_info);
+    if (status != NULL) {
+        g_ort->ReleaseStatus(status);
+        return 0;
+    }
+    const OrtTensorTypeAndShapeInfo* tensor_info = NULL;
+    int64_t dims[8] = { 0 };
+    size_t num_dims = 0;
+    status = g_ort->CastTypeInfoToTensorInfo(type_info, &tensor_info);
+    if (status == NULL && tensor_info != NULL) {
+        status = g_ort->GetDimensionsCount(tensor_info, &num_dims);
+    }
+    if (status == NULL && num_dims > 0 && num_dims <= 8) {
+        status = g_ort->GetDimensions(tensor_info, dims, num_dims);
+    }
+    g_ort->ReleaseTypeInfo(type_info);
+    if (status != NULL) {
+        g_ort->ReleaseStatus(status);
+        return 0;
+    }
+    return num_dims > 0 && num_dims <= 8 && dims[num_dims - 1] > 0 ? (size_t)dims[num_dims - 1] : 0;
+}
+
+/**
+ * Checks whether a failed Run ran out of memory. ONNX Runtime has no error code for it, so the message
+ * is matched against the allocation failures of the CPU arena, the C++ runtime and CUDA.
+ */
+static bool is_out_of_memory_error(const char* msg) {
+    static const char* const patterns[] = { "Failed to allocate", "bad_alloc", "out of memory", "Available memory of" };
+    for (size_t i = 0; msg && i < sizeof(patterns) / sizeof(patterns[0]); ++i) {
+        if (strstr(msg, patterns[i]) != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Tells whether the last Run of the calling thread failed because memory could not be allocated.
+ *
+ * @return true if the last Run ran out of memory, false if it succeeded or failed for another reason.
+ */
+bool last_run_out_of_memory(void) {
+    return run_out_of_memory;
+}
+
+/**
+ * Runs a session on named input tensors. The first output is allocated by ONNX Runtime, or written
+ * into a tensor the caller created if *output_tensor is not NULL.
+ *
+ * @param session A pointer to the ONNX model session.
+ * @param input_names The names of the model inputs.
+ * @param input_tensors The input tensors, one per name.
+ * @param num_inputs The number of inputs.
+ * @param output_tensor A pointer to the output tensor: NULL to receive the tensor allocated by ONNX Runtime,
+ *                      or a tensor of the exact output shape to fill.
+ * @return 0 if successful, -1 if inference fails (an allocated output is released).
+ */
+static int run_session_outputs(OrtSession* session, const char* const* input_names, OrtValue* const* input_tensors,
+                               size_t num_inputs, OrtValue** output_tensor) {
     OrtStatus* status = NULL;
     OrtRunOptions* run_options = NULL;
-    OrtValue* output_tensor = NULL;
     OrtAllocator* allocator = NULL;
+    bool preallocated = *output_tensor != NULL;
     char* output_name = NULL;
     
     // Create options to run inference
@@ -132,7 +325,7 @@ OrtValue* run_inference(OrtSession* session, OrtValue* input_ids_tensor, OrtValu
         const char* msg = g_ort->GetErrorMessage(status);
         fprintf(stderr, "Error: Failed to create run options: %s\n", msg);
         g_ort->ReleaseStatus(status);
-        return NULL;
+        return -1;
     }
 
     // Get the default allocator
@@ -142,7 +335,7 @@ OrtValue* run_inference(OrtSession* session, OrtValue* input_ids_tensor, OrtValu
         fprintf(stderr, "Error: Failed to get allocator: %s\n", msg);
         g_ort->ReleaseStatus(status);
         g_ort->ReleaseRunOptions(run_options);
-        return NULL;
+        return -1;
     }
 
     // Get the number of output nodes
@@ -152,7 +345,7 @@ OrtValue* run_inference(OrtSession* session, OrtValue* input_ids_tensor, OrtValu
         fprintf(stderr, "Error: Failed to get output nodes count or no output nodes found\n");
         if (status) g_ort->ReleaseStatus(status);
         g_ort->ReleaseRunOptions(run_options);
-        return NULL;
+        return -1;
     }
 
     // Get the name of the output node
@@ -161,25 +354,28 @@ OrtValue* run_inference(OrtSession* session, OrtValue* input_ids_tensor, OrtValu
         fprintf(stderr, "Error: Failed to get output name\n");
         g_ort->ReleaseStatus(status);
         g_ort->ReleaseRunOptions(run_options);
-        return NULL;
+        return -1;
     }
 
-    // Set up input parameters
-    const char* input_names[] = { "input_ids", "attention_mask" };
+    // Set up output parameters
     const char* output_names[] = { output_name };
-    OrtValue* input_tensors[] = { input_ids_tensor, attention_mask_tensor };
 
-    // Run inference
+    // Run inference, at most one Run per batch worker at once
+    run_out_of_memory = false;
+    acquire_run_slot();
+    double run_start = omp_get_wtime();
     status = g_ort->Run(
         session,
         run_options,
         input_names,
         (const OrtValue* const*)input_tensors,
-        2,  // number of input tensors
+        num_inputs,
         (const char* const*)output_names,
         1,  // number of output tensors
-        &output_tensor
+        output_tensor
     );
+    run_seconds = omp_get_wtime() - run_start;
+    release_run_slot();
 
     // Free the memory of the output name
     if (output_name) {
@@ -193,28 +389,445 @@ OrtValue* run_inference(OrtSession* session, OrtValue* input_ids_tensor, OrtValu
     if (status != NULL) {
         const char* msg = g_ort->GetErrorMessage(status);
         fprintf(stderr, "Error during inference: %s\n", msg);
+        run_out_of_memory = is_out_of_memory_error(msg);
         g_ort->ReleaseStatus(status);
-        if (output_tensor) {
-            g_ort->ReleaseValue(output_tensor);
+        if (*output_tensor && !preallocated) {
+            g_ort->ReleaseValue(*output_tensor);
+            *output_tensor = NULL;
         }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Runs a session on named input tensors and returns its first output.
+ * 
+ * @param session A pointer to the ONNX model session.
+ * @param input_names The names of the model inputs.
+ * @param input_tensors The input tensors, one per name.
+ * @param num_inputs The number of inputs.
+ * @return A pointer to an OrtValue containing the first output of the model, or NULL if inference fails.
+ *         The caller is responsible for releasing it via g_ort->ReleaseValue.
+ */
+OrtValue* run_session(OrtSession* session, const char* const* input_names, OrtValue* const* input_tensors, size_t num_inputs) {
+    OrtValue* output_tensor = NULL;
+    if (run_session_outputs(session, input_names, input_tensors, num_inputs, &output_tensor) != 0) {
         return NULL;
     }
-    
-    // Return the result
-    // IMPORTANT: The caller is responsible for releasing the output_tensor
-    // via g_ort->ReleaseValue(output_tensor)
     return output_tensor;
 }
 
+/**
+ * Runs inference using the ONNX model session and input tensors.
+ * 
+ * @param session A pointer to the ONNX model session.
+ * @param input_ids_tensor A pointer to the OrtValue representing the input IDs tensor.
+ * @param attention_mask_tensor A pointer to the OrtValue representing the attention mask tensor.
+ * @return A pointer to an OrtValue containing the model's output, or NULL if inference fails.
+ */
+OrtValue* run_inference(OrtSession* session, OrtValue* input_ids_tensor, OrtValue* attention_mask_tensor) {
+    const char* input_names[] = { "input_ids", "attention_mask" };
+    OrtValue* input_tensors[] = { input_ids_tensor, attention_mask_tensor };
+    StageSample sample;
+    stage_begin(&sample);
+    OrtValue* output_tensor = run_session(session, input_names, input_tensors, 2);
+    stage_end(STAGE_INFERENCE, &sample);
+    return output_tensor;
+}
+
+/**
+ * Runs inference and writes the logits into a tensor the caller created over its own buffer
+ * (see create_float_tensor_with_data), so they are not copied out of an ONNX Runtime tensor.
+ *
+ * @param session A pointer to the ONNX model session.
+ * @param input_ids_tensor A pointer to the OrtValue representing the input IDs tensor.
+ * @param attention_mask_tensor A pointer to the OrtValue representing the attention mask tensor.
+ * @param output_tensor The tensor to fill, its shape must match the output of the batch.
+ * @return 0 if successful, -1 if inference fails (e.g. the shape does not match).
+ */
+int run_inference_into(OrtSession* session, OrtValue* input_ids_tensor, OrtValue* attention_mask_tensor,
+                       OrtValue* output_tensor) {
+    const char* input_names[] = { "input_ids", "attention_mask" };
+    OrtValue* input_tensors[] = { input_ids_tensor, attention_mask_tensor };
+    StageSample sample;
+    stage_begin(&sample);
+    int result = run_session_outputs(session, input_names, input_tensors, 2, &output_tensor);
+    stage_end(STAGE_INFERENCE, &sample);
+    return result;
+}
+
+/**
+ * Tokenizes the prompt the warmup batches are built from: a dummy text with one label, as prepare_input
+ * builds the prompts of real batches, so the label and separator tokens reach the classification head.
+ *
+ * @param tokenizer The tokenizer of the model.
+ * @param prompt_first Whether the label prompt is placed before the text.
+ * @param num_ids Pointer to the number of token ids of the prompt.
+ * @return The token ids of the prompt, or NULL if an error occurs. The caller frees them.
+ */
+static int64_t* tokenize_warmup_prompt(TokenizerHandle tokenizer, bool prompt_first, size_t* num_ids) {
+    const char* labels[] = { "warmup" };
+    char* prompt = prepare_input("Warmup text", labels, 1, prompt_first);
+    if (!prompt) {
+        return NULL;
+    }
+    const char* inputs[] = { prompt };
+    TokenizedInputs tokenized = tokenize_inputs(tokenizer, inputs, 1, MAX_LENGTH);
+    int64_t* ids = (int64_t*)malloc((tokenized.seq_length ? tokenized.seq_length : 1) * sizeof(int64_t));
+    *num_ids = 0;
+    for (size_t j = 0; ids && j < tokenized.seq_length; ++j) {
+        if (tokenized.attention_mask[0][j] != 0) {
+            ids[(*num_ids)++] = tokenized.input_ids[0][j];
+        }
+    }
+    if (!ids) {
+        fprintf(stderr, "Error: Memory allocation for warmup inputs failed\n");
+    }
+    free_tokenized_inputs(&tokenized);
+    free(prompt);
+    return ids;
+}
+
+/**
+ * Runs the session once on a [rows x seq_length] batch whose rows all hold the warmup prompt, padded
+ * (or cut) to seq_length.
+ *
+ * @return 0 if the shape ran successfully, -1 otherwise.
+ */
+static int warmup_shape(OrtSession* session, const int64_t* prompt_ids, size_t num_prompt_ids, size_t rows,
+                        size_t seq_length) {
+    int64_t* input_ids_data = (int64_t*)calloc(rows * seq_length, sizeof(int64_t));
+    int64_t* attention_mask_data = (int64_t*)calloc(rows * seq_length, sizeof(int64_t));
+    if (!input_ids_data || !attention_mask_data) {
+        fprintf(stderr, "Error: Memory allocation for warmup inputs failed\n");
+        free(input_ids_data);
+        free(attention_mask_data);
+        return -1;
+    }
+    size_t length = num_prompt_ids < seq_length ? num_prompt_ids : seq_length;
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < length; ++j) {
+            input_ids_data[i * seq_length + j] = prompt_ids[j];
+            attention_mask_data[i * seq_length + j] = 1;
+        }
+    }
+
+    int result = 0;
+    OrtValue* input_ids_tensor = create_tensor(input_ids_data, rows, seq_length);
+    OrtValue* attention_mask_tensor = create_tensor(attention_mask_data, rows, seq_length);
+    OrtValue* output_tensor = NULL;
+    double start_time = omp_get_wtime();
+    if (input_ids_tensor && attention_mask_tensor) {
+        output_tensor = run_inference(session, input_ids_tensor, attention_mask_tensor);
+    }
+    if (output_tensor) {
+        printf("\tWarmup [%zu x %zu]: %f seconds\n", rows, seq_length, omp_get_wtime() - start_time);
+        g_ort->ReleaseValue(output_tensor);
+    } else {
+        fprintf(stderr, "Error: Warmup failed for shape [%zu x %zu]\n", rows, seq_length);
+        result = -1;
+    }
+
+    if (input_ids_tensor) g_ort->ReleaseValue(input_ids_tensor);
+    if (attention_mask_tensor) g_ort->ReleaseValue(attention_mask_tensor);
+    free(input_ids_data);
+    free(attention_mask_data);
+    return result;
+}
+
+/**
+ * Runs the session once for every (rows, bucket) shape so that ONNX Runtime allocates and plans
+ * memory for the shapes bucketed batches will have before the first real request arrives.
+ * Besides full batches, the row counts of the last, partial batch of every request should be given.
+ * The rows hold a tokenized prompt with a label, like real batches.
+ *
+ * @param session A pointer to the ONNX model session.
+ * @param tokenizer The tokenizer of the model.
+ * @param prompt_first Whether the label prompt is placed before the text.
+ * @param buckets The sequence length buckets batches are padded to.
+ * @param row_counts The numbers of rows of the warmup batches, duplicates are run once.
+ * @param num_row_counts The number of row counts.
+ * @param max_length The maximum sequence length, larger buckets are clipped to it.
+ * @return 0 if all shapes ran successfully, -1 otherwise.
+ */
+int warmup_session(OrtSession* session, TokenizerHandle tokenizer, bool prompt_first, const SequenceBuckets* buckets,
+                   const size_t* row_counts, size_t num_row_counts, size_t max_length) {
+    size_t num_prompt_ids = 0;
+    int64_t* prompt_ids = tokenize_warmup_prompt(tokenizer, prompt_first, &num_prompt_ids);
+    if (!prompt_ids) {
+        return -1;
+    }
+    int result = 0;
+    for (size_t r = 0; r < num_row_counts; ++r) {
+        bool seen = row_counts[r] == 0;
+        for (size_t k = 0; k < r && !seen; ++k) {
+            seen = row_counts[k] == row_counts[r];
+        }
+        if (seen) {
+            continue;
+        }
+        for (size_t b = 0; b < buckets->count; ++b) {
+            size_t seq_length = buckets->lengths[b] < max_length ? buckets->lengths[b] : max_length;
+            if (b > 0 && seq_length == (buckets->lengths[b - 1] < max_length ? buckets->lengths[b - 1] : max_length)) {
+                continue; // Several buckets clipped to max_length
+            }
+            if (warmup_shape(session, prompt_ids, num_prompt_ids, row_counts[r], seq_length) != 0) {
+                result = -1;
+            }
+        }
+    }
+    free(prompt_ids);
+    return result;
+}
+
+/**
+ * Structure to store the file mappings a session reads its weights from. They are unmapped
+ * when the session is released with release_ort_session.
+ */
+typedef struct {
+    OrtSession* session;
+    MappedFile model_file;      /**< Mapped ORT format model used in place by the session. */
+    MappedFile external_data;   /**< Mapped external initializers of an ONNX model. */
+} SessionMapping;
+
+static SessionMapping* session_mappings = NULL;
+static size_t num_session_mappings = 0;
+static pthread_mutex_t session_mappings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Remembers the mappings that must outlive a session.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+static int register_session_mapping(OrtSession* session, MappedFile model_file, MappedFile external_data) {
+    pthread_mutex_lock(&session_mappings_mutex);
+    SessionMapping* grown = (SessionMapping*)realloc(session_mappings, (num_session_mappings + 1) * sizeof(SessionMapping));
+    if (!grown) {
+        pthread_mutex_unlock(&session_mappings_mutex);
+        fprintf(stderr, "Error: Memory allocation for session mappings failed\n");
+        return -1;
+    }
+    session_mappings = grown;
+    session_mappings[num_session_mappings].session = session;
+    session_mappings[num_session_mappings].model_file = model_file;
+    session_mappings[num_session_mappings].external_data = external_data;
+    num_session_mappings++;
+    pthread_mutex_unlock(&session_mappings_mutex);
+    return 0;
+}
+
+/**
+ * Creates a session from a read-only shared memory mapping of the model file instead of reading it into
+ * private memory. For ORT format models the session uses the mapped bytes directly for the graph and the
+ * initializers, and for ONNX models with external data the initializers are served from a mapping of the
+ * data file, so co-located workers share the page cache instead of holding separate copies of the weights.
+ * ONNX models without external data are parsed from the mapping, which is released right after loading.
+ * The mapping entries are added to a copy of the session options, so a fallback session created with the
+ * same options (e.g. the rebuild of an unusable cache file) does not point at released buffers.
+ *
+ * @param env A pointer to the ONNX Runtime environment.
+ * @param model_path The file path to the ONNX or ORT format model.
+ * @param session_options The session options to create the session with (left unchanged).
+ * @param prepacked_weights The container to share prepacked weights with other sessions, or NULL.
+ * @return A pointer to the OrtSession if successful, or NULL if an error occurs.
+ */
+static OrtSession* load_session_mapped(OrtEnv* env, const char* model_path, const OrtSessionOptions* session_options,
+                                       OrtPrepackedWeightsContainer* prepacked_weights) {
+    MappedFile model_file = { NULL, 0 };
+    MappedFile external_data = { NULL, 0 };
+    if (map_file_readonly(model_path, &model_file) != 0) {
+        return NULL;
+    }
+
+    OrtSessionOptions* mapped_options = NULL;
+    OrtStatus* status = g_ort->CloneSessionOptions(session_options, &mapped_options);
+    if (status != NULL) {
+        const char* msg = g_ort->GetErrorMessage(status);
+        fprintf(stderr, "Error: Failed to copy the session options: %s\n", msg);
+        g_ort->ReleaseStatus(status);
+        unmap_file(&model_file);
+        return NULL;
+    }
+    bool ort_format = is_ort_format_model(model_path);
+    if (ort_format) {
+        status = g_ort->AddSessionConfigEntry(mapped_options, "session.use_ort_model_bytes_directly", "1");
+        if (status == NULL) {
+            status = g_ort->AddSessionConfigEntry(mapped_options, "session.use_ort_model_bytes_for_initializers", "1");
+        }
+    } else {
+        char* data_path = find_external_data_path(model_path);
+        if (data_path && map_file_readonly(data_path, &external_data) == 0) {
+            // ONNX Runtime matches the buffer by the location stored in the model, which is the file name
+            const char* data_name = strrchr(data_path, '/');
+            data_name = data_name ? data_name + 1 : data_path;
+            char* buffers[] = { (char*)external_data.data };
+            size_t lengths[] = { external_data.size };
+            status = g_ort->AddExternalInitializersFromFilesInMemory(mapped_options, &data_name, buffers, lengths, 1);
+        }
+        free(data_path);
+    }
+    if (status != NULL) {
+        const char* msg = g_ort->GetErrorMessage(status);
+        fprintf(stderr, "Error: Failed to configure mapped model loading: %s\n", msg);
+        g_ort->ReleaseStatus(status);
+        g_ort->ReleaseSessionOptions(mapped_options);
+        unmap_file(&model_file);
+        unmap_file(&external_data);
+        return NULL;
+    }
+
+    OrtSession* session = NULL;
+    if (prepacked_weights) {
+        status = g_ort->CreateSessionFromArrayWithPrepackedWeightsContainer(env, model_file.data, model_file.size,
+                                                                            mapped_options, prepacked_weights, &session);
+    } else {
+        status = g_ort->CreateSessionFromArray(env, model_file.data, model_file.size, mapped_options, &session);
+    }
+    g_ort->ReleaseSessionOptions(mapped_options);
+    if (status != NULL) {
+        const char* msg = g_ort->GetErrorMessage(status);
+        fprintf(stderr, "Error: Failed to create session from mapped %s: %s\n", model_path, msg);
+        g_ort->ReleaseStatus(status);
+        unmap_file(&model_file);
+        unmap_file(&external_data);
+        return NULL;
+    }
+
+    if (!ort_format) {
+        // The ONNX protobuf was parsed into session-owned memory
+        unmap_file(&model_file);
+    }
+    if ((model_file.data || external_data.data) &&
+        register_session_mapping(session, model_file, external_data) != 0) {
+        g_ort->ReleaseSession(session);
+        unmap_file(&model_file);
+        unmap_file(&external_data);
+        return NULL;
+    }
+    printf("\tModel loaded from memory mapping: %s\n", model_path);
+    return session;
+}
+
+/**
+ * Loads a model file into a new session using already configured session options.
+ *
+ * @param env A pointer to the ONNX Runtime environment.
+ * @param model_path The file path to the ONNX or ORT format model.
+ * @param session_options The session options to create the session with.
+ * @param config The session configuration (use_mmap selects loading from a memory mapping, prepacked_weights
+ *               the container shared with the other sessions of the model).
+ * @return A pointer to the OrtSession if successful, or NULL if an error occurs.
+ */
+static OrtSession* load_session(OrtEnv* env, const char* model_path, OrtSessionOptions* session_options,
+                                const SessionConfig* config) {
+    if (config->use_mmap) {
+        return load_session_mapped(env, model_path, session_options, config->prepacked_weights);
+    }
+    OrtSession* session = NULL;
+    OrtStatus* status = NULL;
+    if (config->prepacked_weights) {
+        status = g_ort->CreateSessionWithPrepackedWeightsContainer(env, model_path, session_options,
+                                                                   config->prepacked_weights, &session);
+    } else {
+        status = g_ort->CreateSession(env, model_path, session_options, &session);
+    }
+    if (status != NULL) {
+        const char* msg = g_ort->GetErrorMessage(status);
+        fprintf(stderr, "Error: Failed to create session from %s: %s\n", model_path, msg);
+        g_ort->ReleaseStatus(status);
+        return NULL;
+    }
+    return session;
+}
+
+/**
+ * Loads the model, reusing the optimized graph from the model cache when possible.
+ * On a cache miss the graph optimized by ONNX Runtime is serialized in the ORT format to a temporary
+ * file and renamed into the cache only after the session was created, so concurrent starts never
+ * observe a partially written cache file. A cache file that fails to load is removed and rebuilt.
+ *
+ * @param env A pointer to the ONNX Runtime environment.
+ * @param model_path The file path to the original ONNX model.
+ * @param session_options The session options to create the session with.
+ * @param config The session configuration.
+ * @return A pointer to the OrtSession if successful, or NULL if an error occurs.
+ */
+static OrtSession* load_session_with_cache(OrtEnv* env, const char* model_path, OrtSessionOptions* session_options,
+                                           const SessionConfig* config) {
+    if (is_ort_format_model(model_path)) {
+        // ORT format models are already optimized
+        return load_session(env, model_path, session_options, config);
+    }
+
+    char* cached_path = get_cached_model_path(model_path, MODEL_CACHE_DIR);
+    if (cached_path == NULL) {
+        fprintf(stderr, "Warning: Optimized model cache is unavailable, loading %s directly\n", model_path);
+        return load_session(env, model_path, session_options, config);
+    }
+
+    OrtSession* session = NULL;
+    if (file_exists(cached_path)) {
+        printf("\tLoading optimized model from cache: %s\n", cached_path);
+        session = load_session(env, cached_path, session_options, config);
+        if (session != NULL) {
+            free(cached_path);
+            return session;
+        }
+        fprintf(stderr, "Warning: Cached model %s is unusable, rebuilding it\n", cached_path);
+        remove(cached_path);
+    }
+
+    // Temporary file keeps the .ort extension so that ONNX Runtime serializes it in the ORT format
+    size_t tmp_len = strlen(cached_path) + 32;
+    char* tmp_path = (char*)malloc(tmp_len);
+    if (!tmp_path) {
+        fprintf(stderr, "Error: Memory allocation for temporary cache path failed\n");
+        free(cached_path);
+        return load_session(env, model_path, session_options, config);
+    }
+    snprintf(tmp_path, tmp_len, "%.*s.%ld.tmp.ort", (int)(strlen(cached_path) - 4), cached_path, (long)getpid());
+
+    OrtStatus* status = g_ort->SetOptimizedModelFilePath(session_options, tmp_path);
+    if (status == NULL) {
+        status = g_ort->AddSessionConfigEntry(session_options, "session.save_model_format", "ORT");
+    }
+    if (status != NULL) {
+        const char* msg = g_ort->GetErrorMessage(status);
+        fprintf(stderr, "Warning: Failed to enable optimized model saving: %s\n", msg);
+        g_ort->ReleaseStatus(status);
+    } else {
+        printf("\tOptimizing model, the result will be cached to: %s\n", cached_path);
+    }
+
+    session = load_session(env, model_path, session_options, config);
+    if (session != NULL && file_exists(tmp_path)) {
+        if (rename(tmp_path, cached_path) != 0) {
+            fprintf(stderr, "Warning: Failed to move optimized model to %s\n", cached_path);
+            remove(tmp_path);
+        }
+    } else {
+        remove(tmp_path);
+    }
+
+    free(tmp_path);
+    free(cached_path);
+    return session;
+}
+
 /**
  * Creates and initializes an ONNX Runtime session from a model file.
+ * Graph optimizations (GRAPH_OPTIMIZATION_LEVEL) are applied on both CPU and GPU. On CPU builds with
+ * USE_MODEL_CACHE enabled the optimized graph is cached in MODEL_CACHE_DIR and reused on later starts.
  * 
  * @param env A pointer to the ONNX Runtime environment.
  * @param model_path The file path to the ONNX model.
- * @param num_threads The number of threads to use for inference (CPU only).
+ * @param config The session configuration (see SessionConfig).
  * @return A pointer to the OrtSession if successful, or NULL if an error occurs.
+ *         The session must be released with release_ort_session.
  */
-OrtSession* create_ort_session(OrtEnv* env, const char* model_path, int num_threads) {
+OrtSession* create_ort_session_with_config(OrtEnv* env, const char* model_path, const SessionConfig* config) {
+    int num_threads = config->num_threads;
     OrtSessionOptions* session_options = NULL;
     OrtSession* session = NULL;
     OrtStatus* status = NULL;
@@ -228,21 +841,56 @@ OrtSession* create_ort_session(OrtEnv* env, const char* model_path, int num_thre
         return NULL;
     }
 
-    // Set the number of threads for intra-op operations
-    status = g_ort->SetIntraOpNumThreads(session_options, num_threads);
-    if (status != NULL) {
-        const char* msg = g_ort->GetErrorMessage(status);
-        fprintf(stderr, "Error: Failed to set intra-op threads: %s\n", msg);
-        g_ort->ReleaseStatus(status);
-        g_ort->ReleaseSessionOptions(session_options);
-        return NULL;
+    if (num_threads > 0) {
+        // Set the number of threads for intra-op operations
+        status = g_ort->SetIntraOpNumThreads(session_options, num_threads);
+        if (status != NULL) {
+            const char* msg = g_ort->GetErrorMessage(status);
+            fprintf(stderr, "Error: Failed to set intra-op threads: %s\n", msg);
+            g_ort->ReleaseStatus(status);
+            g_ort->ReleaseSessionOptions(session_options);
+            return NULL;
+        }
+
+        // Set the number of threads for inter-op operations
+        status = g_ort->SetInterOpNumThreads(session_options, num_threads);
+        if (status != NULL) {
+            const char* msg = g_ort->GetErrorMessage(status);
+            fprintf(stderr, "Error: Failed to set inter-op threads: %s\n", msg);
+            g_ort->ReleaseStatus(status);
+            g_ort->ReleaseSessionOptions(session_options);
+            return NULL;
+        }
+
+        if (config->intra_op_affinities) {
+            // Pin the intra-op threads (the calling thread is not part of the list)
+            status = g_ort->AddSessionConfigEntry(session_options, "session.intra_op_thread_affinities",
+                                                  config->intra_op_affinities);
+            if (status != NULL) {
+                const char* msg = g_ort->GetErrorMessage(status);
+                fprintf(stderr, "Error: Failed to set intra-op thread affinities: %s\n", msg);
+                g_ort->ReleaseStatus(status);
+                g_ort->ReleaseSessionOptions(session_options);
+                return NULL;
+            }
+        }
+    } else {
+        // Use the thread pools of the environment (see initialize_ort_environment_with_global_thread_pools)
+        status = g_ort->DisablePerSessionThreads(session_options);
+        if (status != NULL) {
+            const char* msg = g_ort->GetErrorMessage(status);
+            fprintf(stderr, "Error: Failed to disable per-session threads: %s\n", msg);
+            g_ort->ReleaseStatus(status);
+            g_ort->ReleaseSessionOptions(session_options);
+            return NULL;
+        }
     }
 
-    // Set the number of threads for inter-op operations
-    status = g_ort->SetInterOpNumThreads(session_options, num_threads);
+    // Set the graph optimization level (for CPU and GPU)
+    status = g_ort->SetSessionGraphOptimizationLevel(session_options, GRAPH_OPTIMIZATION_LEVEL);
     if (status != NULL) {
         const char* msg = g_ort->GetErrorMessage(status);
-        fprintf(stderr, "Error: Failed to set inter-op threads: %s\n", msg);
+        fprintf(stderr, "Error: Failed to set graph optimization level: %s\n", msg);
         g_ort->ReleaseStatus(status);
         g_ort->ReleaseSessionOptions(session_options);
         return NULL;
@@ -258,28 +906,62 @@ OrtSession* create_ort_session(OrtEnv* env, const char* model_path, int num_thre
         g_ort->ReleaseSessionOptions(session_options);
         return NULL;
     }
-    g_ort->SetSessionGraphOptimizationLevel(session_options, ORT_ENABLE_ALL);
     printf("\tCUDA Execution Provider added successfully.\n");
     #else
     printf("\tUsing CPU Execution Provider.\n");
     #endif
-    
 
     // Load the model and create a session
-    status = g_ort->CreateSession(env, model_path, session_options, &session);
-    if (status != NULL) {
-        const char* msg = g_ort->GetErrorMessage(status);
-        fprintf(stderr, "Error: Failed to create session: %s\n", msg);
-        g_ort->ReleaseStatus(status);
-        g_ort->ReleaseSessionOptions(session_options);
-        return NULL;
-    }
+    #if USE_MODEL_CACHE && !defined(USE_CUDA)
+    session = load_session_with_cache(env, model_path, session_options, config);
+    #else
+    session = load_session(env, model_path, session_options, config);
+    #endif
 
     g_ort->ReleaseSessionOptions(session_options);
 
     return session;
 }
 
+/**
+ * Creates and initializes an ONNX Runtime session from a model file with the default configuration.
+ * 
+ * @param env A pointer to the ONNX Runtime environment.
+ * @param model_path The file path to the ONNX model.
+ * @param num_threads The number of threads to use for inference (CPU only). 0 makes the session use the global
+ *                    thread pools of an environment created with initialize_ort_environment_with_global_thread_pools.
+ * @return A pointer to the OrtSession if successful, or NULL if an error occurs.
+ *         The session must be released with release_ort_session.
+ */
+OrtSession* create_ort_session(OrtEnv* env, const char* model_path, int num_threads) {
+    SessionConfig config = { num_threads, false, NULL, NULL };
+    return create_ort_session_with_config(env, model_path, &config);
+}
+
+/**
+ * Releases a session together with the file mappings it reads its weights from.
+ *
+ * @param session A pointer to the session to release (NULL is ignored).
+ */
+void release_ort_session(OrtSession* session) {
+    if (session == NULL) {
+        return;
+    }
+    g_ort->ReleaseSession(session);
+
+    pthread_mutex_lock(&session_mappings_mutex);
+    for (size_t i = 0; i < num_session_mappings; ++i) {
+        if (session_mappings[i].session == session) {
+            unmap_file(&session_mappings[i].model_file);
+            unmap_file(&session_mappings[i].external_data);
+            session_mappings[i] = session_mappings[num_session_mappings - 1];
+            num_session_mappings--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&session_mappings_mutex);
+}
+
 /**
  * Initializes the ONNX Runtime environment.
  * 
@@ -297,6 +979,43 @@ OrtEnv* initialize_ort_environment() {
     return env;
 }
 
+/**
+ * Initializes an ONNX Runtime environment whose intra-op and inter-op thread pools are shared
+ * by all sessions created with num_threads = 0, so several hosted models do not oversubscribe the cores.
+ *
+ * @param intra_op_threads The number of threads in the global intra-op pool.
+ * @param inter_op_threads The number of threads in the global inter-op pool.
+ * @return A pointer to the OrtEnv, or NULL if environment creation fails.
+ */
+OrtEnv* initialize_ort_environment_with_global_thread_pools(int intra_op_threads, int inter_op_threads) {
+    OrtThreadingOptions* threading_options = NULL;
+    OrtStatus* status = g_ort->CreateThreadingOptions(&threading_options);
+    if (status == NULL) {
+        status = g_ort->SetGlobalIntraOpNumThreads(threading_options, intra_op_threads);
+    }
+    if (status == NULL) {
+        status = g_ort->SetGlobalInterOpNumThreads(threading_options, inter_op_threads);
+    }
+    if (status != NULL) {
+        const char* msg = g_ort->GetErrorMessage(status);
+        fprintf(stderr, "Error: Failed to set up global thread pools: %s\n", msg);
+        g_ort->ReleaseStatus(status);
+        if (threading_options) g_ort->ReleaseThreadingOptions(threading_options);
+        return NULL;
+    }
+
+    OrtEnv* env = NULL;
+    status = g_ort->CreateEnvWithGlobalThreadPools(ORT_LOGGING_LEVEL_WARNING, "GLiClass", threading_options, &env);
+    g_ort->ReleaseThreadingOptions(threading_options);
+    if (status != NULL) {
+        const char* msg = g_ort->GetErrorMessage(status);
+        fprintf(stderr, "Error: Failed to create env for ONNX Runtime: %s\n", msg);
+        g_ort->ReleaseStatus(status);
+        return NULL;
+    }
+    return env;
+}
+
 /**
  * Initializes the ONNX Runtime API.
  */
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "onnxruntime_c_api.h"
+#include "model_cache.h"
+
+#define HASH_CHUNK_SIZE (1 << 20) // Size of the chunks the model file is hashed in (1 MiB)
+
+/**
+ * Computes a 64-bit FNV-1a style hash of the whole model file.
+ * The file is consumed in 8-byte words to keep hashing of multi-gigabyte models fast.
+ *
+ * @param model_path The path to the model file.
+ * @return The hash of the file content, or 0 if the file could not be read.
+ */
+uint64_t hash_model_file(const char* model_path) {
+    FILE* file = fopen(model_path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Failed to open model file %s for hashing\n", model_path);
+        return 0;
+    }
+
+    unsigned char* buffer = (unsigned char*)malloc(HASH_CHUNK_SIZE);
+    if (!buffer) {
+        fprintf(stderr, "Error: Memory allocation for hash buffer failed\n");
+        fclose(file);
+        return 0;
+    }
+
+    uint64_t hash = 14695981039346656037ULL; // FNV offset basis
+    const uint64_t prime = 1099511628211ULL; // FNV prime
+    size_t read_len = 0;
+    while ((read_len = fread(buffer, 1, HASH_CHUNK_SIZE, file)) > 0) {
+        size_t num_words = read_len / sizeof(uint64_t);
+        for (size_t i = 0; i < num_words; ++i) {
+            uint64_t word;
+            memcpy(&word, buffer + i * sizeof(uint64_t), sizeof(uint64_t));
+            hash = (hash ^ word) * prime;
+        }
+        // Tail bytes of the last chunk
+        for (size_t i = num_words * sizeof(uint64_t); i < read_len; ++i) {
+            hash = (hash ^ buffer[i]) * prime;
+        }
+    }
+
+    free(buffer);
+    fclose(file);
+    return hash == 0 ? 1 : hash;
+}
+
+/**
+ * Builds the path of a cache file derived from a model: "<cache_dir>/<model name>-<hash><suffix>".
+ * The cache directory is created if it does not exist yet.
+ *
+ * @param model_path The path to the original model.
+ * @param cache_dir The directory where cache files are stored.
+ * @param hash The hash of the model content (see hash_model_file).
+ * @param suffix The suffix appended after the hash, including the extension.
+ * @return A dynamically allocated path string, or NULL if an error occurs.
+ *         The caller is responsible for freeing the memory.
+ */
+char* get_cache_file_path(const char* model_path, const char* cache_dir, uint64_t hash, const char* suffix) {
+    if (mkdir(cache_dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Failed to create cache directory %s\n", cache_dir);
+        return NULL;
+    }
+
+    // Model file name without directory and extension
+    const char* base_name = strrchr(model_path, '/');
+    base_name = base_name ? base_name + 1 : model_path;
+    size_t base_len = strlen(base_name);
+    const char* ext = strrchr(base_name, '.');
+    if (ext) {
+        base_len = (size_t)(ext - base_name);
+    }
+
+    size_t path_len = strlen(cache_dir) + base_len + strlen(suffix) + 32;
+    char* cached_path = (char*)malloc(path_len);
+    if (!cached_path) {
+        fprintf(stderr, "Error: Memory allocation for cache file path failed\n");
+        return NULL;
+    }
+    snprintf(cached_path, path_len, "%s/%.*s-%016llx%s",
+             cache_dir, (int)base_len, base_name, (unsigned long long)hash, suffix);
+    return cached_path;
+}
+
+/**
+ * Mixes bytes into a 64-bit FNV-1a hash.
+ */
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t len) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Mixes the identity of a file (device, inode, size and modification time) into a hash.
+ *
+ * @return 0 if successful, -1 if the file could not be stat'ed.
+ */
+static int hash_file_identity(const char* path, uint64_t* hash) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    uint64_t fields[5] = { (uint64_t)st.st_dev, (uint64_t)st.st_ino, (uint64_t)st.st_size,
+                           (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec };
+    *hash = hash_bytes(*hash, fields, sizeof(fields));
+    return 0;
+}
+
+/**
+ * Finds the external data file of an ONNX model ("<model>.onnx_data" or "<model>.onnx.data").
+ *
+ * @param model_path The path to the ONNX model.
+ * @return A dynamically allocated path of the external data file, or NULL if the model has none.
+ */
+char* find_external_data_path(const char* model_path) {
+    const char* suffixes[] = { "_data", ".data" };
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); ++i) {
+        size_t len = strlen(model_path) + strlen(suffixes[i]) + 1;
+        char* path = (char*)malloc(len);
+        if (!path) {
+            return NULL;
+        }
+        snprintf(path, len, "%s%s", model_path, suffixes[i]);
+        if (file_exists(path)) {
+            return path;
+        }
+        free(path);
+    }
+    return NULL;
+}
+
+/**
+ * Computes a key that changes whenever a model is replaced, without reading it: the size, modification
+ * time and inode of the model file and of its external data file (see find_external_data_path).
+ * Unlike hash_model_file this costs a few stat calls, also for multi-gigabyte models.
+ *
+ * @param model_path The path to the model file.
+ * @return The key of the model files, or 0 if the model file does not exist.
+ */
+uint64_t model_file_key(const char* model_path) {
+    uint64_t key = 14695981039346656037ULL; // FNV offset basis
+    if (hash_file_identity(model_path, &key) != 0) {
+        fprintf(stderr, "Error: Failed to stat model file %s\n", model_path);
+        return 0;
+    }
+    char* external_data_path = find_external_data_path(model_path);
+    if (external_data_path) {
+        hash_file_identity(external_data_path, &key);
+        free(external_data_path);
+    }
+    return key == 0 ? 1 : key;
+}
+
+/**
+ * Mixes the CPU features of the host into a hash (the "flags" or "Features" line of /proc/cpuinfo).
+ * Optimized models may use kernels of the CPU they were optimized on, so they are not shared between CPUs.
+ */
+static uint64_t hash_cpu_features(uint64_t hash) {
+    FILE* file = fopen("/proc/cpuinfo", "r");
+    if (!file) {
+        return hash;
+    }
+    char line[8192];
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "flags", 5) == 0 || strncmp(line, "Features", 8) == 0) {
+            hash = hash_bytes(hash, line, strlen(line));
+            break;
+        }
+    }
+    fclose(file);
+    return hash;
+}
+
+/**
+ * Builds the path of the optimized model cache file for a model.
+ * The file name is keyed by the model files (see model_file_key), the CPU features and the ONNX Runtime
+ * version, so a new checkpoint, new external weights, another CPU or a runtime upgrade never pick up a
+ * stale optimized graph. The model is not read, so the key costs nothing on a cold start.
+ * The cache directory is created if it does not exist yet.
+ *
+ * @param model_path The path to the original ONNX model.
+ * @param cache_dir The directory where optimized models are stored.
+ * @return A dynamically allocated path string, or NULL if an error occurs.
+ *         The caller is responsible for freeing the memory.
+ */
+char* get_cached_model_path(const char* model_path, const char* cache_dir) {
+    uint64_t key = model_file_key(model_path);
+    if (key == 0) {
+        return NULL;
+    }
+    const char* ort_version = OrtGetApiBase()->GetVersionString();
+    key = hash_cpu_features(hash_bytes(key, ort_version, strlen(ort_version)));
+
+    char suffix[64];
+    snprintf(suffix, sizeof(suffix), "-ort%s.ort", ort_version);
+    return get_cache_file_path(model_path, cache_dir, key == 0 ? 1 : key, suffix);
+}
+
+/**
+ * Checks whether a model file is stored in the ORT format (by its .ort extension).
+ *
+ * @param model_path The path to the model file.
+ * @return true if the model is an ORT format model, false otherwise.
+ */
+bool is_ort_format_model(const char* model_path) {
+    size_t len = strlen(model_path);
+    return len > 4 && strcmp(model_path + len - 4, ".ort") == 0;
+}
+
+/**
+ * Checks whether a regular file exists at the given path.
+ *
+ * @param path The path to check.
+ * @return true if the file exists, false otherwise.
+ */
+bool file_exists(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
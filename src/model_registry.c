@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "cJSON.h"
+
+#include "model_registry.h"
+#include "model.h"
+#include "tokenizer.h"
+#include "read_data.h"
+
+/**
+ * Loads all models listed in a registry configuration file. All sessions are created with the
+ * global thread pools of the environment, which must come from initialize_ort_environment_with_global_thread_pools.
+ *
+ * The configuration has the following format:
+ * {"models": [{"name": "small", "model_path": "...", "tokenizer_path": "...", "prompt_first": false}, ...]}
+ *
+ * @param config_path The path to the registry JSON file.
+ * @param env A pointer to the ONNX Runtime environment with global thread pools.
+ * @param use_mmap Whether the sessions are created from memory mappings of the model files.
+ * @param registry Pointer to the ModelRegistry structure to fill.
+ * @return 0 if all models were loaded, or 1 if an error occurs (the registry is freed in this case).
+ */
+int load_model_registry(const char* config_path, OrtEnv* env, bool use_mmap, ModelRegistry* registry) {
+    registry->models = NULL;
+    registry->num_models = 0;
+
+    char* json_string = read_file(config_path);
+    if (!json_string) {
+        return 1;
+    }
+    cJSON* json = cJSON_Parse(json_string);
+    free(json_string);
+    if (!json) {
+        fprintf(stderr, "Failed to parse JSON: %s\n", cJSON_GetErrorPtr());
+        return 1;
+    }
+
+    cJSON* models_json = cJSON_GetObjectItemCaseSensitive(json, "models");
+    if (!cJSON_IsArray(models_json) || cJSON_GetArraySize(models_json) == 0) {
+        fprintf(stderr, "Error: %s has no \"models\" array\n", config_path);
+        cJSON_Delete(json);
+        return 1;
+    }
+
+    SessionConfig session_config = { 0, use_mmap, NULL, NULL }; // Global thread pools of the environment
+    size_t count = cJSON_GetArraySize(models_json);
+    registry->models = (HostedModel*)calloc(count, sizeof(HostedModel));
+    if (!registry->models) {
+        fprintf(stderr, "Error: Memory allocation for hosted models failed\n");
+        cJSON_Delete(json);
+        return 1;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        cJSON* model_json = cJSON_GetArrayItem(models_json, i);
+        cJSON* name = cJSON_GetObjectItemCaseSensitive(model_json, "name");
+        cJSON* model_path = cJSON_GetObjectItemCaseSensitive(model_json, "model_path");
+        cJSON* tokenizer_path = cJSON_GetObjectItemCaseSensitive(model_json, "tokenizer_path");
+        cJSON* prompt_first = cJSON_GetObjectItemCaseSensitive(model_json, "prompt_first");
+        if (!cJSON_IsString(name) || !cJSON_IsString(model_path) || !cJSON_IsString(tokenizer_path)) {
+            fprintf(stderr, "Error: model %zu needs \"name\", \"model_path\" and \"tokenizer_path\"\n", i);
+            cJSON_Delete(json);
+            free_model_registry(registry);
+            return 1;
+        }
+        if (find_model(registry, name->valuestring) != NULL) {
+            fprintf(stderr, "Error: model name %s is used twice\n", name->valuestring);
+            cJSON_Delete(json);
+            free_model_registry(registry);
+            return 1;
+        }
+
+        HostedModel* model = &registry->models[i];
+        registry->num_models = i + 1;
+        model->name = strdup(name->valuestring);
+        model->model_path = strdup(model_path->valuestring);
+        model->tokenizer_path = strdup(tokenizer_path->valuestring);
+        model->prompt_first = cJSON_IsBool(prompt_first) && cJSON_IsTrue(prompt_first);
+
+        printf("Loading model %s: %s\n", model->name, model->model_path);
+        model->tokenizer = create_tokenizer(model->tokenizer_path);
+        model->session = model->tokenizer ? create_ort_session_with_config(env, model->model_path, &session_config) : NULL;
+        if (!model->tokenizer || !model->session) {
+            fprintf(stderr, "Error: Failed to load model %s\n", model->name);
+            cJSON_Delete(json);
+            free_model_registry(registry);
+            return 1;
+        }
+    }
+
+    cJSON_Delete(json);
+    return 0;
+}
+
+/**
+ * Finds a hosted model by name.
+ *
+ * @param registry The registry to search.
+ * @param name The name of the model, or NULL for the default (first) model.
+ * @return A pointer to the hosted model, or NULL if there is no model with this name.
+ */
+HostedModel* find_model(const ModelRegistry* registry, const char* name) {
+    if (registry->num_models == 0) {
+        return NULL;
+    }
+    if (name == NULL) {
+        return &registry->models[0];
+    }
+    for (size_t i = 0; i < registry->num_models; ++i) {
+        if (registry->models[i].name && strcmp(registry->models[i].name, name) == 0) {
+            return &registry->models[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Releases the sessions and tokenizers of all hosted models and frees the registry.
+ *
+ * @param registry Pointer to the ModelRegistry structure to free.
+ */
+void free_model_registry(ModelRegistry* registry) {
+    for (size_t i = 0; i < registry->num_models; ++i) {
+        HostedModel* model = &registry->models[i];
+        release_ort_session(model->session);
+        if (model->tokenizer) tokenizers_free(model->tokenizer);
+        free(model->name);
+        free(model->model_path);
+        free(model->tokenizer_path);
+    }
+    free(registry->models);
+    registry->models = NULL;
+    registry->num_models = 0;
+}
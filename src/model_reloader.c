@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include "model_reloader.h"
+#include "model.h"
+#include "model_cache.h"
+#include "tokenizer.h"
+#include "configs.h"
+
+static ModelReloader* signal_reloader = NULL; // Reloader woken up by SIGHUP
+
+static void handle_reload_signal(int signal_number) {
+    (void)signal_number;
+    if (signal_reloader) {
+        sem_post(&signal_reloader->requests); // Async-signal-safe
+    }
+}
+
+static void free_loaded_model(LoadedModel* model) {
+    release_ort_session(model->session);
+    if (model->tokenizer) {
+        tokenizers_free(model->tokenizer);
+    }
+    free(model);
+}
+
+/**
+ * Reads the identity of a file, zeroed if it does not exist.
+ */
+static void read_file_identity(const char* path, FileIdentity* identity) {
+    memset(identity, 0, sizeof(*identity));
+    struct stat info;
+    if (path && stat(path, &info) == 0) {
+        identity->device = info.st_dev;
+        identity->inode = info.st_ino;
+        identity->size = info.st_size;
+        identity->mtime = info.st_mtim;
+    }
+}
+
+/**
+ * Records the identities of the model file and its external data file, the files a session created with
+ * --mmap maps for as long as it lives.
+ */
+static void read_model_identity(const char* model_path, LoadedModel* model) {
+    read_file_identity(model_path, &model->model_file);
+    char* data_path = find_external_data_path(model_path);
+    read_file_identity(data_path, &model->external_data);
+    free(data_path);
+}
+
+/**
+ * Checks whether a mapped file was written in place: same inode, other size or modification time.
+ * Pages of a mapping whose file is truncated or rewritten fault (SIGBUS) in the running batches.
+ */
+static bool written_in_place(const FileIdentity* mapped, const FileIdentity* current) {
+    if (mapped->device == 0 || mapped->device != current->device || mapped->inode != current->inode) {
+        return false;
+    }
+    return mapped->size != current->size || mapped->mtime.tv_sec != current->mtime.tv_sec ||
+           mapped->mtime.tv_nsec != current->mtime.tv_nsec;
+}
+
+/**
+ * Drops one reference of a generation. The caller holds the mutex.
+ *
+ * @return true if it was the last reference, the caller frees the generation after unlocking.
+ */
+static bool drop_reference(ModelReloader* reloader, LoadedModel* model) {
+    model->refs--;
+    if (model->refs > 0) {
+        return false;
+    }
+    reloader->stats.num_released++;
+    return true;
+}
+
+/**
+ * Loads the model and tokenizer files again, warms up the new session and swaps it in for new batches.
+ * Batches running on the old generation finish on it, it is released by the last of them.
+ * If loading fails the old generation stays current.
+ * With --mmap a model written in place while the old generation maps it is rejected, new model files have
+ * to be renamed over the old ones.
+ */
+static void reload_model(ModelReloader* reloader) {
+    double start_time = omp_get_wtime();
+    fprintf(stderr, "Reloading model %s and tokenizer %s\n", reloader->model_path, reloader->tokenizer_path);
+
+    LoadedModel* model = (LoadedModel*)calloc(1, sizeof(LoadedModel));
+    bool rejected = false;
+    if (model && reloader->use_mmap) {
+        read_model_identity(reloader->model_path, model);
+        pthread_mutex_lock(&reloader->mutex); // current is only replaced by this thread, its files are fixed
+        const LoadedModel* mapped = reloader->current;
+        rejected = written_in_place(&mapped->model_file, &model->model_file) ||
+                   written_in_place(&mapped->external_data, &model->external_data);
+        pthread_mutex_unlock(&reloader->mutex);
+        if (rejected) {
+            fprintf(stderr, "Error: Model %s was written in place while it is mapped, "
+                    "replace it by renaming a new file over it\n", reloader->model_path);
+        }
+    }
+    TokenizerHandle tokenizer = model && !rejected ? create_tokenizer(reloader->tokenizer_path) : NULL;
+    SessionConfig config = { 0, reloader->use_mmap, NULL, NULL }; // Global thread pools of the environment
+    OrtSession* session = tokenizer ? create_ort_session_with_config(reloader->env, reloader->model_path, &config) : NULL;
+    size_t warmup_rows = BATCH_SIZE; // Micro-batches of the stream have any size up to BATCH_SIZE
+    if (session && warmup_session(session, tokenizer, reloader->prompt_first, &reloader->buckets, &warmup_rows, 1,
+                                  MAX_LENGTH) != 0) {
+        release_ort_session(session);
+        session = NULL;
+    }
+    if (!session) {
+        if (tokenizer) tokenizers_free(tokenizer);
+        free(model);
+        pthread_mutex_lock(&reloader->mutex);
+        reloader->stats.num_failed++;
+        size_t generation = reloader->current->generation;
+        pthread_mutex_unlock(&reloader->mutex);
+        fprintf(stderr, "Error: Reload failed, batches keep running on generation %zu\n", generation);
+        return;
+    }
+    model->session = session;
+    model->tokenizer = tokenizer;
+    model->refs = 1;
+
+    pthread_mutex_lock(&reloader->mutex);
+    LoadedModel* old = reloader->current;
+    model->generation = old->generation + 1;
+    reloader->current = model;
+    bool release_old = drop_reference(reloader, old);
+    size_t old_generation = old->generation; // Read under the mutex, the last batch of old may release it
+    reloader->stats.num_reloads++;
+    reloader->stats.last_reload_time = omp_get_wtime() - start_time;
+    pthread_mutex_unlock(&reloader->mutex);
+
+    fprintf(stderr, "DONE: reload (generation %zu) in %f seconds; generation %zu %s\n", model->generation,
+            omp_get_wtime() - start_time, old_generation,
+            release_old ? "released" : "is released when its running batches finished");
+    if (release_old) {
+        free_loaded_model(old);
+    }
+}
+
+/**
+ * Body of the reloader thread: waits for reload requests and handles them one at a time.
+ * Requests arriving while a reload runs cause one more reload after it.
+ */
+static void* reloader_thread(void* arg) {
+    ModelReloader* reloader = (ModelReloader*)arg;
+    for (;;) {
+        while (sem_wait(&reloader->requests) != 0 && errno == EINTR) {
+        }
+        pthread_mutex_lock(&reloader->mutex);
+        bool stopping = reloader->stopping;
+        pthread_mutex_unlock(&reloader->mutex);
+        if (stopping) {
+            break;
+        }
+        while (sem_trywait(&reloader->requests) == 0) {
+            // Requests that queued up so far are served by this reload
+        }
+        reload_model(reloader);
+    }
+    return NULL;
+}
+
+/**
+ * Takes over the model of a long running process and starts the thread that reloads it on SIGHUP or
+ * request_model_reload. New sessions are created in the environment with its global thread pools and
+ * run every bucket shape once before they are swapped in.
+ *
+ * @param reloader Pointer to the ModelReloader structure to initialize.
+ * @param env The environment the sessions are created in (global thread pools).
+ * @param model_path The model file, read again on every reload.
+ * @param tokenizer_path The tokenizer file, read again on every reload.
+ * @param prompt_first Whether the label prompt is placed before the text (for the warmup of new sessions).
+ * @param use_mmap Whether new sessions are created from a shared memory mapping of the model file.
+ * @param buckets The shapes a new session is warmed up with (DEFAULT_SEQ_BUCKETS if empty or NULL).
+ * @param session The current session, owned by the reloader until stop_model_reloader.
+ * @param tokenizer The current tokenizer, owned by the reloader until stop_model_reloader.
+ * @return 0 if successful, -1 if the reloader thread could not be started.
+ */
+int start_model_reloader(ModelReloader* reloader, OrtEnv* env, const char* model_path, const char* tokenizer_path,
+                         bool prompt_first, bool use_mmap, const SequenceBuckets* buckets, OrtSession* session, TokenizerHandle tokenizer) {
+    memset(reloader, 0, sizeof(*reloader));
+    reloader->current = (LoadedModel*)calloc(1, sizeof(LoadedModel));
+    if (!reloader->current) {
+        fprintf(stderr, "Error: Memory allocation for the model reloader failed\n");
+        return -1;
+    }
+    reloader->current->session = session;
+    reloader->current->tokenizer = tokenizer;
+    reloader->current->refs = 1;
+    if (use_mmap) {
+        read_model_identity(model_path, reloader->current);
+    }
+    reloader->env = env;
+    reloader->model_path = model_path;
+    reloader->tokenizer_path = tokenizer_path;
+    reloader->prompt_first = prompt_first;
+    reloader->use_mmap = use_mmap;
+    if (buckets && buckets->count > 0) {
+        reloader->buckets = *buckets;
+    } else {
+        parse_sequence_buckets(DEFAULT_SEQ_BUCKETS, &reloader->buckets);
+    }
+    pthread_mutex_init(&reloader->mutex, NULL);
+    sem_init(&reloader->requests, 0, 0);
+    if (pthread_create(&reloader->thread, NULL, reloader_thread, reloader) != 0) {
+        fprintf(stderr, "Error: Failed to start the model reloader\n");
+        sem_destroy(&reloader->requests);
+        pthread_mutex_destroy(&reloader->mutex);
+        free(reloader->current);
+        reloader->current = NULL;
+        return -1;
+    }
+    reloader->running = true;
+
+    signal_reloader = reloader;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_reload_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGHUP, &action, NULL);
+    return 0;
+}
+
+/**
+ * Takes a reference to the current generation for one batch. The batch runs on it even if a reload
+ * swaps in a new generation meanwhile.
+ *
+ * @param reloader The reloader.
+ * @return The generation, to be handed back with release_model when the batch finished.
+ */
+LoadedModel* acquire_model(ModelReloader* reloader) {
+    pthread_mutex_lock(&reloader->mutex);
+    LoadedModel* model = reloader->current;
+    model->refs++;
+    pthread_mutex_unlock(&reloader->mutex);
+    return model;
+}
+
+/**
+ * Hands back the reference of a batch. A replaced generation is released with its last batch, so all
+ * tensors of the batch must be released before.
+ *
+ * @param reloader The reloader.
+ * @param model The generation returned by acquire_model.
+ */
+void release_model(ModelReloader* reloader, LoadedModel* model) {
+    pthread_mutex_lock(&reloader->mutex);
+    bool release = drop_reference(reloader, model);
+    pthread_mutex_unlock(&reloader->mutex);
+    if (release) {
+        fprintf(stderr, "DONE: release of drained generation %zu\n", model->generation);
+        free_loaded_model(model);
+    }
+}
+
+/**
+ * Requests a reload, e.g. for a control message. Returns immediately, the reload runs in the background.
+ *
+ * @param reloader The reloader.
+ */
+void request_model_reload(ModelReloader* reloader) {
+    sem_post(&reloader->requests);
+}
+
+/**
+ * Stops the reloader thread (waiting for a running reload) and hands the current generation back.
+ * All batches must have finished.
+ *
+ * @param reloader The reloader.
+ * @param session Output current session, owned by the caller again.
+ * @param tokenizer Output current tokenizer, owned by the caller again.
+ */
+void stop_model_reloader(ModelReloader* reloader, OrtSession** session, TokenizerHandle* tokenizer) {
+    if (!reloader->running) {
+        return;
+    }
+    signal(SIGHUP, SIG_DFL);
+    signal_reloader = NULL;
+    pthread_mutex_lock(&reloader->mutex);
+    reloader->stopping = true;
+    pthread_mutex_unlock(&reloader->mutex);
+    sem_post(&reloader->requests);
+    pthread_join(reloader->thread, NULL);
+    reloader->running = false;
+
+    *session = reloader->current->session;
+    *tokenizer = reloader->current->tokenizer;
+    free(reloader->current);
+    reloader->current = NULL;
+    sem_destroy(&reloader->requests);
+    pthread_mutex_destroy(&reloader->mutex);
+}
+
+/**
+ * Prints the statistics of the reloads.
+ *
+ * @param stream The stream to print to.
+ * @param stats The statistics to print.
+ */
+void print_reload_stats(FILE* stream, const ReloadStats* stats) {
+    if (stats->num_reloads == 0 && stats->num_failed == 0) {
+        return;
+    }
+    fprintf(stream, "Reloads: %zu (%zu failed, %zu old generations released), last reload %f seconds\n",
+            stats->num_reloads, stats->num_failed, stats->num_released, stats->last_reload_time);
+}
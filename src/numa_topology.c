@@ -0,0 +1,246 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "numa_topology.h"
+
+#define NODE_SYSFS_DIR "/sys/devices/system/node" // Directory with one node<id> entry per NUMA node
+#define MPOL_PREFERRED_MODE 1                      // MPOL_PREFERRED of set_mempolicy(2)
+
+static int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Parses a Linux CPU list (e.g. "0-15,32-47") into an array of CPU numbers.
+ *
+ * @param list The CPU list.
+ * @param cpus Pointer that will store the dynamically allocated array of CPU numbers.
+ * @param num_cpus Pointer that will store the number of CPUs.
+ * @return 0 if successful, -1 if the list is invalid or memory could not be allocated.
+ *         The caller is responsible for freeing the array.
+ */
+int parse_cpu_list(const char* list, int** cpus, size_t* num_cpus) {
+    *cpus = NULL;
+    *num_cpus = 0;
+    size_t capacity = 0;
+    const char* p = list;
+    while (*p && *p != '\n') {
+        char* end = NULL;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            free(*cpus);
+            *cpus = NULL;
+            *num_cpus = 0;
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                free(*cpus);
+                *cpus = NULL;
+                *num_cpus = 0;
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            if (*num_cpus == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                int* grown = (int*)realloc(*cpus, capacity * sizeof(int));
+                if (!grown) {
+                    free(*cpus);
+                    *cpus = NULL;
+                    *num_cpus = 0;
+                    return -1;
+                }
+                *cpus = grown;
+            }
+            (*cpus)[(*num_cpus)++] = (int)cpu;
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return 0;
+}
+
+/**
+ * Keeps only the CPUs the process is allowed to run on (e.g. inside a cpuset).
+ */
+static void filter_allowed_cpus(NumaNode* node, const cpu_set_t* allowed) {
+    size_t kept = 0;
+    for (size_t i = 0; i < node->num_cpus; ++i) {
+        if (node->cpus[i] < CPU_SETSIZE && CPU_ISSET(node->cpus[i], allowed)) {
+            node->cpus[kept++] = node->cpus[i];
+        }
+    }
+    node->num_cpus = kept;
+}
+
+/**
+ * Detects the NUMA nodes of the host from sysfs and the CPUs of each node the process may use.
+ * Hosts without NUMA information are reported as a single node with all usable CPUs.
+ *
+ * @param topology Pointer to the NumaTopology structure to fill.
+ * @return 0 if successful, -1 if no usable CPU was found or memory could not be allocated.
+ */
+int detect_numa_topology(NumaTopology* topology) {
+    topology->nodes = NULL;
+    topology->num_nodes = 0;
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "Error: Failed to get the CPU affinity of the process\n");
+        return -1;
+    }
+
+    DIR* dir = opendir(NODE_SYSFS_DIR);
+    struct dirent* entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        int id;
+        char tail;
+        if (sscanf(entry->d_name, "node%d%c", &id, &tail) != 1) {
+            continue;
+        }
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%s/cpulist", NODE_SYSFS_DIR, entry->d_name);
+        FILE* file = fopen(path, "r");
+        char list[4096] = { 0 };
+        if (!file) {
+            continue;
+        }
+        if (!fgets(list, sizeof(list), file)) {
+            list[0] = '\0';
+        }
+        fclose(file);
+
+        NumaNode node = { id, NULL, 0 };
+        if (parse_cpu_list(list, &node.cpus, &node.num_cpus) != 0) {
+            continue;
+        }
+        filter_allowed_cpus(&node, &allowed);
+        if (node.num_cpus == 0) {
+            free(node.cpus); // Memory-only node or outside of the cpuset
+            continue;
+        }
+        NumaNode* grown = (NumaNode*)realloc(topology->nodes, (topology->num_nodes + 1) * sizeof(NumaNode));
+        if (!grown) {
+            free(node.cpus);
+            closedir(dir);
+            free_numa_topology(topology);
+            return -1;
+        }
+        topology->nodes = grown;
+        topology->nodes[topology->num_nodes++] = node;
+    }
+    if (dir) {
+        closedir(dir);
+    }
+
+    if (topology->num_nodes == 0) {
+        // No NUMA information: one node with every usable CPU
+        NumaNode node = { 0, (int*)malloc(CPU_COUNT(&allowed) * sizeof(int)), 0 };
+        topology->nodes = (NumaNode*)malloc(sizeof(NumaNode));
+        if (!node.cpus || !topology->nodes) {
+            free(node.cpus);
+            free(topology->nodes);
+            topology->nodes = NULL;
+            return -1;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                node.cpus[node.num_cpus++] = cpu;
+            }
+        }
+        topology->nodes[0] = node;
+        topology->num_nodes = 1;
+    }
+
+    // Nodes in ascending order of their id
+    for (size_t i = 1; i < topology->num_nodes; ++i) {
+        for (size_t j = i; j > 0 && topology->nodes[j - 1].id > topology->nodes[j].id; --j) {
+            NumaNode tmp = topology->nodes[j];
+            topology->nodes[j] = topology->nodes[j - 1];
+            topology->nodes[j - 1] = tmp;
+        }
+    }
+    for (size_t i = 0; i < topology->num_nodes; ++i) {
+        qsort(topology->nodes[i].cpus, topology->nodes[i].num_cpus, sizeof(int), compare_ints);
+    }
+    return 0;
+}
+
+/**
+ * Prints the nodes of the topology with their CPUs.
+ *
+ * @param topology The NUMA topology.
+ */
+void print_numa_topology(const NumaTopology* topology) {
+    printf("NUMA nodes: %zu\n", topology->num_nodes);
+    for (size_t i = 0; i < topology->num_nodes; ++i) {
+        const NumaNode* node = &topology->nodes[i];
+        printf("  node %d: %zu CPUs (%d-%d)\n", node->id, node->num_cpus, node->cpus[0], node->cpus[node->num_cpus - 1]);
+    }
+}
+
+/**
+ * Frees the nodes of the topology.
+ *
+ * @param topology The NUMA topology.
+ */
+void free_numa_topology(NumaTopology* topology) {
+    for (size_t i = 0; topology->nodes && i < topology->num_nodes; ++i) {
+        free(topology->nodes[i].cpus);
+    }
+    free(topology->nodes);
+    topology->nodes = NULL;
+    topology->num_nodes = 0;
+}
+
+/**
+ * Pins the calling thread to a set of CPUs.
+ *
+ * @param cpus The CPU numbers.
+ * @param num_cpus The number of CPUs.
+ * @return 0 if successful, -1 otherwise.
+ */
+int pin_thread_to_cpus(const int* cpus, size_t num_cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < num_cpus; ++i) {
+        CPU_SET(cpus[i], &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        fprintf(stderr, "Warning: Failed to pin thread to %zu CPUs\n", num_cpus);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Makes the calling thread (and the threads it creates later) allocate memory on a NUMA node.
+ * The preferred policy falls back to other nodes when the node runs out of memory.
+ *
+ * @param node The node number.
+ * @return 0 if successful, -1 otherwise (e.g. on kernels without NUMA support).
+ */
+int prefer_memory_node(int node) {
+    unsigned long mask[16] = { 0 };
+    size_t bits = sizeof(unsigned long) * 8;
+    if (node < 0 || (size_t)node >= bits * 16) {
+        return -1;
+    }
+    mask[node / bits] = 1UL << (node % bits);
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED_MODE, mask, bits * 16 + 1) != 0) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "options.h"
+#include "read_data.h"
+#include "paths.h"
+#include "configs.h"
+
+/**
+ * Resolves a model variant name to the path of the ONNX model.
+ *
+ * @param variant "fp32" for MODEL_PATH, "int8" for QUANTIZED_MODEL_PATH, anything else is treated as a path to a model file.
+ * @return The path to the selected model.
+ */
+const char* resolve_model_variant(const char* variant) {
+    if (strcmp(variant, "fp32") == 0) {
+        return MODEL_PATH;
+    }
+    if (strcmp(variant, "int8") == 0) {
+        return QUANTIZED_MODEL_PATH;
+    }
+    return variant;
+}
+
+/**
+ * Prints the usage of the program.
+ *
+ * @param program The name of the executable (argv[0]).
+ */
+void print_usage(const char* program) {
+    printf("Usage: %s /path/to/your_data.json [prompt_first: true/false] [options]\n", program);
+    printf("       %s - [prompt_first: true/false] --stream [options]   (records from stdin)\n", program);
+    printf("       %s --worker host:port [options]   (worker of a coordinator started with --coordinate)\n", program);
+    printf("NOTE: use this option only if you sure that all required model parts are initialized correctly\n\n");
+    printf("Options:\n");
+    printf("  --model fp32|int8|/path/to/model.onnx   Model variant to run (default: fp32, %s)\n", MODEL_PATH);
+    printf("  --mmap                                  Load the model from a shared read-only memory mapping\n");
+    printf("  --buckets 64,128,256,...                Pad the sequence length of every batch up to one of these lengths\n");
+    printf("  --warmup                                Run every bucket shape once at startup (default buckets: %s)\n", DEFAULT_SEQ_BUCKETS);
+    printf("  --models /path/to/models.json           Host several named models on shared thread pools,\n");
+    printf("                                          requests are routed by their \"model\" field\n");
+    printf("  --cascade small,large                   Run every text through the small model first and only send\n");
+    printf("                                          uncertain ones to the large model (needs --models)\n");
+    printf("  --cascade-margin M                      Confidence margin of the small model (default: %.2f)\n", CASCADE_MARGIN);
+    printf("  --bi-encoder                            Run the bi-encoder model (%s, %s, %s)\n", TEXT_ENCODER_PATH, LABEL_ENCODER_PATH, SCORER_PATH);
+    printf("                                          and reuse cached label embeddings\n");
+    printf("  --schedule                              Run the batches of all requests by priority class and deadline\n");
+    printf("  --numa round-robin|load                 Run one session per NUMA node with pinned threads and memory,\n");
+    printf("                                          batches go to the groups in turn or to the first idle one\n");
+    printf("  --numa-groups N                         Worker groups per NUMA node sharing prepacked weights (default: 1)\n");
+    printf("  --coordinate N                          Split the input into shards of %d texts for N local worker processes\n", SHARD_SIZE);
+    printf("                                          (more workers can join with --worker) and merge their results\n");
+    printf("  --bind host:port                        Address the coordinator listens on (default: %s)\n", SHARD_BIND_ADDRESS);
+    printf("  --journal /path/to/job.journal          Record finished batches, a restarted run only classifies the missing ones\n");
+    printf("  --stream                                Read {\"text\", \"labels\"} records line by line from stdin (data path -)\n");
+    printf("                                          and write the predictions to stdout in arrival order\n");
+    printf("  --max-wait MS                           Longest wait of a streamed record for its batch to fill up (default: %.0f)\n", STREAM_MAX_WAIT_MS);
+    printf("  --threads N                             Core budget shared by batch workers, ONNX Runtime and the tokenizer\n");
+    printf("                                          (default: all CPUs the process may run on)\n");
+    printf("  --batch-workers W                       Batches run at once within the budget (default: one per %d cores)\n", NUM_THREADS);
+    printf("  --rerank                                The input is {\"query\", \"passages\"}: score every passage against the query\n");
+    printf("  --top-k K                               Passages returned by --rerank (default: \"top_k\" of the input or %d)\n", RERANK_TOP_K);
+    printf("  --min-score S                           Leave out passages scoring below S (default: \"min_score\" of the input or 0)\n");
+    printf("  --early-stop                            Stop scoring passages once K of them reached the minimum score\n");
+    printf("  --output /path/to/results[.gz|.zst]     Write the output to a file, compressed on a background thread for .gz and .zst\n");
+    printf("                                          (compressed inputs are detected and decompressed automatically)\n");
+    printf("  --max-batch-memory MB                   Split batches whose estimated inference memory exceeds MB before they run\n");
+    printf("                                          (batches whose Run fails are always split and retried)\n");
+    printf("  --perf-counters                         Report perf_event_open counters (cycles, instructions, IPC, cache and\n");
+    printf("                                          branch misses, context switches) per pipeline stage and thread at exit\n");
+    printf("  --memory-stats                          Track allocations: bytes and peak live bytes per stage and batch shape,\n");
+    printf("                                          RSS over time and buffers outliving their batch (SIGUSR1 prints a snapshot)\n");
+    printf("  --prefilter N                           Keep only the N labels of every text that overlap it most (BM25),\n");
+    printf("                                          for requests with per-text labels\n");
+    printf("  --packed                                Pack several short prompts into every row of a model exported with\n");
+    printf("                                          convert_to_onnx.py --packed (default model: %s)\n", PACKED_MODEL_PATH);
+    printf("  --pack-length N                         Tokens of one packed row (default: %d, at most %d)\n\n", PACKED_ROW_LENGTH, MAX_LENGTH);
+    printf("Recomended option\n");
+    printf("Usage: ./run_GLiClass.sh knowledgator/gliclass-small-v1.0 /path/to/your_data.json\n");
+    printf("This option will automaticly set up prompt_first for you\n");
+}
+
+/**
+ * Parses the command line arguments into the AppOptions structure.
+ * Unset options keep their default values.
+ *
+ * @param argc The number of command-line arguments.
+ * @param argv An array of command-line arguments.
+ * @param options Pointer to the AppOptions structure to fill.
+ * @return 0 if successful, or 1 if the arguments are invalid (the usage is printed in this case).
+ */
+int parse_options(int argc, char* argv[], AppOptions* options) {
+    // Defaults
+    options->data_path = NULL;
+    options->prompt_first = false;
+    options->model_path = MODEL_PATH;
+    options->use_mmap = false;
+    options->buckets.count = 0;
+    options->warmup = false;
+    options->models_path = NULL;
+    options->cascade_small = NULL;
+    options->cascade_large = NULL;
+    options->cascade_margin = CASCADE_MARGIN;
+    options->bi_encoder = false;
+    options->schedule = false;
+    options->numa = false;
+    options->dispatch = DISPATCH_ROUND_ROBIN;
+    options->groups_per_node = 1;
+    options->coordinate = false;
+    options->num_local_workers = 0;
+    options->bind_address = SHARD_BIND_ADDRESS;
+    options->journal_path = NULL;
+    options->stream = false;
+    options->max_wait_ms = STREAM_MAX_WAIT_MS;
+    options->threads = 0;
+    options->batch_workers = 0;
+    options->rerank = false;
+    options->top_k = 0;
+    options->min_score = -1.0f;
+    options->early_stop = false;
+    options->output_path = NULL;
+    options->max_batch_memory = 0;
+    options->perf_counters = false;
+    options->memory_stats = false;
+    options->prefilter_top_n = 0;
+    options->packed = false;
+    options->pack_length = PACKED_ROW_LENGTH;
+    options->worker_address = NULL;
+
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "--worker") == 0) {
+        // Workers receive the texts and prompt_first with every shard
+        options->worker_address = argv[2];
+    } else {
+        options->data_path = argv[1];
+        options->prompt_first = string_to_bool(argv[2]);
+    }
+
+    bool model_given = false;
+    for (int i = 3; i < argc; ++i) {
+        if (strcmp(argv[i], "--model") == 0 && i + 1 < argc) {
+            options->model_path = resolve_model_variant(argv[++i]);
+            model_given = true;
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            options->use_mmap = true;
+        } else if (strcmp(argv[i], "--buckets") == 0 && i + 1 < argc) {
+            if (parse_sequence_buckets(argv[++i], &options->buckets) != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--warmup") == 0) {
+            options->warmup = true;
+        } else if (strcmp(argv[i], "--models") == 0 && i + 1 < argc) {
+            options->models_path = argv[++i];
+        } else if (strcmp(argv[i], "--cascade") == 0 && i + 1 < argc) {
+            char* separator = strchr(argv[++i], ',');
+            if (separator == NULL || separator == argv[i] || separator[1] == '\0') {
+                fprintf(stderr, "Error: --cascade expects two model names: small,large\n");
+                return 1;
+            }
+            *separator = '\0';
+            options->cascade_small = argv[i];
+            options->cascade_large = separator + 1;
+        } else if (strcmp(argv[i], "--cascade-margin") == 0 && i + 1 < argc) {
+            options->cascade_margin = strtof(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--bi-encoder") == 0) {
+            options->bi_encoder = true;
+        } else if (strcmp(argv[i], "--schedule") == 0) {
+            options->schedule = true;
+        } else if (strcmp(argv[i], "--numa") == 0 && i + 1 < argc) {
+            if (parse_dispatch_policy(argv[++i], &options->dispatch) != 0) {
+                return 1;
+            }
+            options->numa = true;
+        } else if (strcmp(argv[i], "--numa-groups") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value <= 0) {
+                fprintf(stderr, "Error: --numa-groups expects a positive number\n");
+                return 1;
+            }
+            options->groups_per_node = (size_t)value;
+        } else if (strcmp(argv[i], "--coordinate") == 0 && i + 1 < argc) {
+            char* end = NULL;
+            long value = strtol(argv[++i], &end, 10);
+            if (end == argv[i] || value < 0) {
+                fprintf(stderr, "Error: --coordinate expects the number of local workers\n");
+                return 1;
+            }
+            options->coordinate = true;
+            options->num_local_workers = (size_t)value;
+        } else if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc) {
+            options->bind_address = argv[++i];
+        } else if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc) {
+            options->journal_path = argv[++i];
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            options->stream = true;
+        } else if (strcmp(argv[i], "--max-wait") == 0 && i + 1 < argc) {
+            options->max_wait_ms = strtod(argv[++i], NULL);
+            if (options->max_wait_ms < 0) {
+                fprintf(stderr, "Error: --max-wait expects a non-negative number of milliseconds\n");
+                return 1;
+            }
+        } else if ((strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "--batch-workers") == 0) && i + 1 < argc) {
+            const char* name = argv[i];
+            long value = strtol(argv[++i], NULL, 10);
+            if (value <= 0) {
+                fprintf(stderr, "Error: %s expects a positive number\n", name);
+                return 1;
+            }
+            if (strcmp(name, "--threads") == 0) {
+                options->threads = (int)value;
+            } else {
+                options->batch_workers = (int)value;
+            }
+        } else if (strcmp(argv[i], "--rerank") == 0) {
+            options->rerank = true;
+        } else if (strcmp(argv[i], "--top-k") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value <= 0) {
+                fprintf(stderr, "Error: --top-k expects a positive number\n");
+                return 1;
+            }
+            options->top_k = (size_t)value;
+        } else if (strcmp(argv[i], "--min-score") == 0 && i + 1 < argc) {
+            options->min_score = strtof(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--early-stop") == 0) {
+            options->early_stop = true;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            options->output_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-batch-memory") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value <= 0) {
+                fprintf(stderr, "Error: --max-batch-memory expects a positive number of megabytes\n");
+                return 1;
+            }
+            options->max_batch_memory = (size_t)value << 20;
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            options->perf_counters = true;
+        } else if (strcmp(argv[i], "--memory-stats") == 0) {
+            options->memory_stats = true;
+        } else if (strcmp(argv[i], "--prefilter") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value <= 0) {
+                fprintf(stderr, "Error: --prefilter expects a positive number of labels\n");
+                return 1;
+            }
+            options->prefilter_top_n = (size_t)value;
+        } else if (strcmp(argv[i], "--packed") == 0) {
+            options->packed = true;
+        } else if (strcmp(argv[i], "--pack-length") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], NULL, 10);
+            if (value <= 0 || value > MAX_LENGTH) {
+                fprintf(stderr, "Error: --pack-length expects a number of tokens between 1 and %d\n", MAX_LENGTH);
+                return 1;
+            }
+            options->pack_length = (size_t)value;
+        } else {
+            fprintf(stderr, "Error: Unknown or incomplete option %s\n\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (options->cascade_small && !options->models_path) {
+        fprintf(stderr, "Error: --cascade needs the models registry given with --models\n");
+        return 1;
+    }
+
+    if (options->bi_encoder && options->models_path) {
+        fprintf(stderr, "Error: --bi-encoder can not be combined with --models\n");
+        return 1;
+    }
+
+    if (options->schedule && (options->bi_encoder || options->cascade_small)) {
+        fprintf(stderr, "Error: --schedule can not be combined with --bi-encoder or --cascade\n");
+        return 1;
+    }
+
+    if (options->numa && (options->models_path || options->bi_encoder || options->schedule)) {
+        fprintf(stderr, "Error: --numa can not be combined with --models, --bi-encoder or --schedule\n");
+        return 1;
+    }
+
+    if ((options->coordinate || options->worker_address) &&
+        (options->models_path || options->bi_encoder || options->schedule || options->numa)) {
+        fprintf(stderr, "Error: --coordinate and --worker can not be combined with --models, --bi-encoder, --schedule or --numa\n");
+        return 1;
+    }
+
+    if (options->journal_path && (options->bi_encoder || options->cascade_small || options->schedule ||
+                                  options->numa || options->coordinate || options->worker_address)) {
+        fprintf(stderr, "Error: --journal can not be combined with --bi-encoder, --cascade, --schedule, --numa, --coordinate or --worker\n");
+        return 1;
+    }
+
+    if (options->rerank && (options->models_path || options->bi_encoder || options->schedule || options->numa ||
+                            options->coordinate || options->worker_address || options->journal_path)) {
+        fprintf(stderr, "Error: --rerank can not be combined with --models, --bi-encoder, --schedule, --numa, --coordinate, --worker or --journal\n");
+        return 1;
+    }
+
+    if ((options->top_k || options->min_score >= 0.0f || options->early_stop) && !options->rerank) {
+        fprintf(stderr, "Error: --top-k, --min-score and --early-stop need --rerank\n");
+        return 1;
+    }
+
+    if (options->stream != (options->data_path && strcmp(options->data_path, "-") == 0)) {
+        fprintf(stderr, "Error: --stream reads from stdin, give \"-\" as the data path (and only with --stream)\n");
+        return 1;
+    }
+
+    if (options->stream && (options->models_path || options->bi_encoder || options->schedule || options->numa ||
+                            options->coordinate || options->journal_path || options->rerank)) {
+        fprintf(stderr, "Error: --stream can not be combined with --models, --bi-encoder, --schedule, --numa, --coordinate, --journal or --rerank\n");
+        return 1;
+    }
+
+    if (options->packed && (options->models_path || options->bi_encoder || options->schedule || options->numa ||
+                            options->coordinate || options->worker_address || options->journal_path ||
+                            options->rerank || options->stream || options->warmup)) {
+        fprintf(stderr, "Error: --packed can not be combined with --models, --bi-encoder, --schedule, --numa, --coordinate, --worker, --journal, --rerank, --stream or --warmup\n");
+        return 1;
+    }
+    if (options->packed && !model_given) {
+        options->model_path = PACKED_MODEL_PATH; // The packed model takes other inputs than MODEL_PATH
+    }
+
+    // Warmup only helps when batches have known shapes
+    if (options->warmup && options->buckets.count == 0) {
+        parse_sequence_buckets(DEFAULT_SEQ_BUCKETS, &options->buckets);
+    }
+    return 0;
+}
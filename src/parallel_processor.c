@@ -2,8 +2,71 @@
 #include "preprocessor.h"
 #include "postprocessor.h"
 #include "model.h"
+#include "batch_splitter.h"
+#include "stage_counters.h"
+#include "memory_tracker.h"
+#include "startup.h"
+#include "cost_model.h"
 #include "configs.h"
+#include <stdlib.h>
+#include <string.h>
 #include <omp.h>
+#include <pthread.h>
+
+// Serializes Run calls on the GPU
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Preprocesses a single batch of texts and labels into model input tensors.
+ *
+ * Prepares the input strings (text with label prompt), tokenizes them and creates
+ * the input ID and attention mask tensors for the batch.
+ *
+ * @param batch_texts Array of texts in the batch.
+ * @param batch_labels Array of label arrays for each text. If same_labels is true, this is a single set of labels.
+ * @param batch_num_labels Array containing the number of labels for each text in the batch.
+ * @param batch_size Number of texts in the batch.
+ * @param same_labels Flag indicating if all texts share the same set of labels.
+ * @param prompt_first Flag indicating if the prompt should be placed before the input text.
+ * @param tokenizer_handler Handle for the tokenizer used to tokenize the input texts.
+ * @param input_ids_tensor Output input ID tensor for the batch.
+ * @param attention_mask_tensor Output attention mask tensor for the batch.
+ * @return 0 if successful, -1 if an error occurs (both tensors are set to NULL in this case).
+ */
+int preprocess_batch(const char** batch_texts, const char*** batch_labels, size_t* batch_num_labels, size_t batch_size,
+                     bool same_labels, bool prompt_first, TokenizerHandle tokenizer_handler,
+                     OrtValue** input_ids_tensor, OrtValue** attention_mask_tensor) {
+    *input_ids_tensor = NULL;
+    *attention_mask_tensor = NULL;
+
+    // Prepare tokens
+    StageSample sample;
+    stage_begin(&sample);
+    const char** prepared_inputs = prepare_inputs(batch_texts, batch_labels, batch_size,
+                                                batch_num_labels, same_labels, prompt_first);
+    stage_end(STAGE_PROMPT, &sample);
+    if (prepared_inputs == NULL) {
+        return -1;
+    }
+    stage_begin(&sample);
+    TokenizedInputs tokenized = tokenize_inputs(tokenizer_handler, prepared_inputs,
+                                              batch_size, MAX_LENGTH);
+    stage_end(STAGE_TOKENIZE, &sample);
+
+    // Prepare input tensors
+    stage_begin(&sample);
+    int result = prepare_input_tensors(&tokenized, input_ids_tensor, attention_mask_tensor);
+    stage_end(STAGE_TENSORS, &sample);
+    if (result != 0) {
+        *input_ids_tensor = NULL;
+        *attention_mask_tensor = NULL;
+    }
+
+    // Clean up memory
+    free_prepared_inputs((char**)prepared_inputs, batch_size);
+    free_tokenized_inputs(&tokenized);
+    return result;
+}
 
 /**
  * @brief Preprocesses a batch of texts and labels in parallel.
@@ -34,19 +97,9 @@ void parallel_preprocess(char** texts, char*** labels, size_t* num_labels, size_
         const char*** batch_labels = (const char***)(same_labels ? (void*)labels : (void*)&labels[i]);
         size_t* batch_num_labels = (same_labels) ? num_labels : &num_labels[i];
 
-        // Prepare tokens
-        const char** prepared_inputs = prepare_inputs(batch_texts, batch_labels, current_batch_size, 
-                                                    batch_num_labels, same_labels, prompt_first);
-        TokenizedInputs tokenized = tokenize_inputs(tokenizer_handler, prepared_inputs, 
-                                                  current_batch_size, MAX_LENGTH);
-
-        // Prepare input tensors
-        prepare_input_tensors(&tokenized, &input_ids_tensors[i / BATCH_SIZE], 
-                            &attention_mask_tensors[i / BATCH_SIZE]);
-
-        // Clean up memory
-        free_prepared_inputs((char**)prepared_inputs, current_batch_size);
-        free_tokenized_inputs(&tokenized);
+        preprocess_batch(batch_texts, batch_labels, batch_num_labels, current_batch_size,
+                         same_labels, prompt_first, tokenizer_handler,
+                         &input_ids_tensors[i / BATCH_SIZE], &attention_mask_tensors[i / BATCH_SIZE]);
     }
 }
 
@@ -87,4 +140,257 @@ void parallel_postprocess(OrtValue** output_tensors, size_t num_batches, size_t
         // Free output tensor after processing
         g_ort->ReleaseValue(output_tensors[i]);
     }
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Runs inference for all batches in parallel.
+ *
+ * On GPU builds the Run calls are serialized with a mutex, on CPU they run concurrently.
+ * Batches that do not fit are split and retried (see run_inference_adaptive). Rows that could not be run
+ * even alone are NaN, callers must check them with isnan before using their logits.
+ *
+ * @param session The ONNX Runtime session to run.
+ * @param input_ids_tensors Array of input ID tensors for each batch.
+ * @param attention_mask_tensors Array of attention mask tensors for each batch.
+ * @param output_tensors Output array of logits tensors for each batch (NULL for failed batches).
+ * @param num_batches Number of batches.
+ */
+void parallel_inference(OrtSession* session, OrtValue** input_ids_tensors, OrtValue** attention_mask_tensors,
+                        OrtValue** output_tensors, size_t num_batches) {
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < num_batches; i++) {
+        #ifdef USE_CUDA // GPU
+        pthread_mutex_lock(&queue_mutex);
+        output_tensors[i] = run_inference_adaptive(session, input_ids_tensors[i], attention_mask_tensors[i], i * BATCH_SIZE, 0);
+        pthread_mutex_unlock(&queue_mutex);
+        #else
+        output_tensors[i] = run_inference_adaptive(session, input_ids_tensors[i], attention_mask_tensors[i], i * BATCH_SIZE, 0);
+        #endif
+    }
+}
+
+/**
+ * Runs one batch of a request through preprocessing and inference. If session is NULL, the batch is
+ * tokenized first and then waits for the session of the startup loader.
+ */
+static OrtValue* run_batch(OrtSession* session, StartupLoader* startup, TokenizerHandle tokenizer_handler,
+                           bool prompt_first, const ClassificationRequest* request, size_t start, size_t count) {
+    const char** batch_texts = (const char**)&request->texts[start];
+    const char*** batch_labels = (const char***)(request->same_labels ? (void*)request->labels
+                                                                      : (void*)&request->labels[start]);
+    OrtValue* input_ids_tensor = NULL;
+    OrtValue* attention_mask_tensor = NULL;
+    OrtValue* output_tensor = NULL;
+    memory_batch_begin();
+    if (preprocess_batch(batch_texts, batch_labels, &request->num_labels[start], count,
+                         request->same_labels, prompt_first, tokenizer_handler,
+                         &input_ids_tensor, &attention_mask_tensor) == 0) {
+        if (session == NULL) {
+            session = wait_startup_session(startup);
+        }
+        if (session) {
+            // Every Run of the batch calibrates the cost model (see run_inference_adaptive)
+            size_t prompt_chars = batch_prompt_chars(request, start, count);
+            #ifdef USE_CUDA // GPU
+            pthread_mutex_lock(&queue_mutex);
+            output_tensor = run_inference_adaptive(session, input_ids_tensor, attention_mask_tensor, start, prompt_chars);
+            pthread_mutex_unlock(&queue_mutex);
+            #else
+            output_tensor = run_inference_adaptive(session, input_ids_tensor, attention_mask_tensor, start, prompt_chars);
+            #endif
+        }
+    }
+    if (input_ids_tensor) g_ort->ReleaseValue(input_ids_tensor);
+    if (attention_mask_tensor) g_ort->ReleaseValue(attention_mask_tensor);
+    memory_batch_end(); // Prompts, tokens and input tensors of the batch must be released by now
+    if (output_tensor) {
+        note_first_result();
+    }
+    return output_tensor;
+}
+
+/**
+ * @brief Runs one batch of a request through preprocessing and inference.
+ *
+ * On GPU builds the Run call is serialized with the other batches. A batch that does not fit is split
+ * and retried (see run_inference_adaptive).
+ *
+ * @param session The ONNX Runtime session of the model.
+ * @param tokenizer_handler Handle for the tokenizer of the model.
+ * @param prompt_first Flag indicating if the prompt should be placed before the input text.
+ * @param request The request the batch belongs to.
+ * @param start Index of the first text of the batch in the request.
+ * @param count Number of texts in the batch.
+ * @return The logits tensor of the batch, or NULL if an error occurs. The caller releases it.
+ */
+OrtValue* run_request_batch(OrtSession* session, TokenizerHandle tokenizer_handler, bool prompt_first,
+                            const ClassificationRequest* request, size_t start, size_t count) {
+    return run_batch(session, NULL, tokenizer_handler, prompt_first, request, start, count);
+}
+
+/**
+ * @brief Runs one batch of a request with shared labels and writes its logits into a buffer of the caller.
+ *
+ * The model writes straight into the rows of the batch, nothing is copied out of an ONNX Runtime tensor.
+ * If that Run fails, the batch is run again through run_request_batch (which splits batches that do
+ * not fit) and its logits are copied.
+ *
+ * @param session The ONNX Runtime session of the model.
+ * @param tokenizer_handler Handle for the tokenizer of the model.
+ * @param prompt_first Flag indicating if the prompt should be placed before the input text.
+ * @param request The request the batch belongs to, its labels must be shared (same_labels).
+ * @param start Index of the first text of the batch in the request.
+ * @param count Number of texts in the batch.
+ * @param logits Buffer of num_texts x num_labels_size logits of the whole request (row-major).
+ * @return 0 if successful, -1 if the batch could not be run.
+ */
+int run_request_batch_into(OrtSession* session, TokenizerHandle tokenizer_handler, bool prompt_first,
+                           const ClassificationRequest* request, size_t start, size_t count, float* logits) {
+    if (!request->same_labels) {
+        fprintf(stderr, "Error: Batches are only written into a buffer if all texts share the same labels\n");
+        return -1;
+    }
+    size_t num_classes = request->num_labels_size;
+    float* batch_logits = logits + start * num_classes;
+    OrtValue* input_ids_tensor = NULL;
+    OrtValue* attention_mask_tensor = NULL;
+    OrtValue* output_tensor = create_float_tensor_with_data(batch_logits, count, num_classes);
+    int result = -1;
+    memory_batch_begin();
+    if (output_tensor && preprocess_batch((const char**)&request->texts[start], (const char***)request->labels,
+                                          &request->num_labels[start], count, true, prompt_first, tokenizer_handler,
+                                          &input_ids_tensor, &attention_mask_tensor) == 0) {
+        #ifdef USE_CUDA // GPU
+        pthread_mutex_lock(&queue_mutex);
+        result = run_inference_into(session, input_ids_tensor, attention_mask_tensor, output_tensor);
+        pthread_mutex_unlock(&queue_mutex);
+        #else
+        result = run_inference_into(session, input_ids_tensor, attention_mask_tensor, output_tensor);
+        #endif
+    }
+    if (input_ids_tensor) g_ort->ReleaseValue(input_ids_tensor);
+    if (attention_mask_tensor) g_ort->ReleaseValue(attention_mask_tensor);
+    if (output_tensor) g_ort->ReleaseValue(output_tensor);
+    memory_batch_end();
+    if (result == 0) {
+        return 0;
+    }
+
+    OrtValue* fallback_tensor = run_request_batch(session, tokenizer_handler, prompt_first, request, start, count);
+    float* fallback_logits = NULL;
+    int64_t rows = 0, cols = 0;
+    if (get_output_logits(fallback_tensor, g_ort, &fallback_logits, &rows, &cols) == 0 &&
+        (size_t)rows == count && (size_t)cols == num_classes) {
+        memcpy(batch_logits, fallback_logits, count * num_classes * sizeof(float));
+        result = 0;
+    }
+    if (fallback_tensor) g_ort->ReleaseValue(fallback_tensor);
+    return result;
+}
+
+/**
+ * @brief Writes the predictions of one batch of a request to a stream.
+ *
+ * Texts are numbered by their index in the request, so the output of batches written in any
+ * order can be concatenated in batch order.
+ *
+ * @param stream The stream to write the predictions to.
+ * @param output_tensor The logits tensor of the batch.
+ * @param request The request the batch belongs to.
+ * @param start Index of the first text of the batch in the request.
+ * @param count Number of texts in the batch.
+ * @param index_offset Number added to the printed text indices (e.g. the position of a shard in the original request).
+ * @return 0 if successful, -1 if the tensor is missing or does not match the batch.
+ */
+int write_batch_predictions(FILE* stream, OrtValue* output_tensor, const ClassificationRequest* request,
+                            size_t start, size_t count, size_t index_offset) {
+    float* logits = NULL;
+    int64_t rows = 0, cols = 0;
+    if (get_output_logits(output_tensor, g_ort, &logits, &rows, &cols) != 0 || (size_t)rows != count) {
+        return -1;
+    }
+    StageSample sample;
+    stage_begin(&sample);
+    for (size_t i = 0; i < count; ++i) {
+        size_t text = start + i;
+        const char* const* labels = (const char* const*)(request->same_labels ? request->labels[0] : request->labels[text]);
+        size_t num_classes = request->num_labels[text] < (size_t)cols ? request->num_labels[text] : (size_t)cols;
+        write_text_predictions(stream, (int)(index_offset + text), request->texts[text], &logits[i * cols], num_classes,
+                               labels, request->num_labels[text], THRESHOLD, request->classification_type);
+    }
+    stage_end(STAGE_POSTPROCESS, &sample);
+    return 0;
+}
+
+/**
+ * Classifies all texts of a request with the session, or with the session of the startup loader if session is NULL.
+ */
+static int classify_batches(OrtSession* session, StartupLoader* startup, TokenizerHandle tokenizer_handler,
+                            bool prompt_first, const ClassificationRequest* request) {
+    size_t num_batches = (request->num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+    OrtValue** output_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    size_t* order = (size_t*)malloc((num_batches > 0 ? num_batches : 1) * sizeof(size_t));
+    if (!output_tensors || !order) {
+        fprintf(stderr, "Error: Memory allocation for batch tensors failed\n");
+        free(output_tensors);
+        free(order);
+        return -1;
+    }
+    // Longest batches first, so no long batch is left running alone at the end
+    order_batches_by_cost(request, num_batches, order);
+
+    // Preprocessing and inference stage - processing batches
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t k = 0; k < num_batches; k++) {
+        size_t i = order[k];
+        size_t start = i * BATCH_SIZE;
+        size_t count = (start + BATCH_SIZE > request->num_texts) ? (request->num_texts - start) : BATCH_SIZE;
+        output_tensors[i] = run_batch(session, startup, tokenizer_handler, prompt_first, request, start, count);
+    }
+
+    // Postprocess stage - processing batches (releases the output tensors)
+    parallel_postprocess(output_tensors, num_batches, request->num_texts,
+                         request->texts, request->labels, request->num_labels,
+                         request->same_labels, request->num_labels_size, request->classification_type);
+
+    free(output_tensors);
+    free(order);
+    return 0;
+}
+
+/**
+ * @brief Classifies all texts of a request and prints the results.
+ *
+ * Every batch is preprocessed and run by one worker (see run_request_batch), so the prompts, tokens and
+ * input tensors of a batch are released right after its Run instead of living until all batches ran.
+ * Only the logits of the batches are kept for the postprocessing. Batches start longest first by the
+ * estimate of the batch cost model (see order_batches_by_cost), the predictions keep the input order.
+ *
+ * @param session The ONNX Runtime session of the model.
+ * @param tokenizer_handler Handle for the tokenizer of the model.
+ * @param prompt_first Flag indicating if the prompt should be placed before the input text.
+ * @param request The request with texts, labels and classification type.
+ * @return 0 if successful, -1 if memory for the tensors could not be allocated.
+ */
+int classify_request(OrtSession* session, TokenizerHandle tokenizer_handler, bool prompt_first,
+                     const ClassificationRequest* request) {
+    return classify_batches(session, NULL, tokenizer_handler, prompt_first, request);
+}
+
+/**
+ * @brief Classifies all texts of a request while the session is still being created.
+ *
+ * Every batch worker tokenizes its first batch right away and waits for the session only before its Run,
+ * so the tokenization of the first batches overlaps with the end of the session creation.
+ * Batches fail if the session could not be created.
+ *
+ * @param startup The startup loader creating the session.
+ * @param tokenizer_handler Handle for the tokenizer of the model.
+ * @param prompt_first Flag indicating if the prompt should be placed before the input text.
+ * @param request The request with texts, labels and classification type.
+ * @return 0 if successful, -1 if memory for the tensors could not be allocated.
+ */
+int classify_request_during_startup(StartupLoader* startup, TokenizerHandle tokenizer_handler, bool prompt_first,
+                                    const ClassificationRequest* request) {
+    return classify_batches(NULL, startup, tokenizer_handler, prompt_first, request);
+}
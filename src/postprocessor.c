@@ -1,9 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <math.h>
 #include "onnxruntime_c_api.h"
 #include "postprocessor.h"
+#include "stage_counters.h"
 
 /**
  * Sigmoid function to map logits to probabilities.
@@ -16,141 +18,200 @@ float sigmoid(float x) {
 }
 
 /**
- * Processes the output tensor (logits) and prints the predicted labels and scores based on the given classification type (multi-label or single-label).
+ * Gets a pointer to the logits stored in the output tensor together with its shape.
+ * The logits are not copied, they stay valid while the output tensor is alive.
  * 
  * @param output_tensor A pointer to the OrtValue containing the output logits from the ONNX model.
  * @param g_ort A pointer to the ONNX Runtime API.
- * @param same_labels Boolean indicating if all texts share the same set of labels.
- * @param labels A 2D array of strings containing the labels for each class.
- * @param num_labels A dynamic array indicating the number of labels for each text.
- * @param num_labels_size The number of labels if all texts share the same set.
- * @param threshold The probability threshold for multi-label classification.
- * @param num_texts The number of texts in the batch.
- * @param texts A dynamic array containing the input texts.
- * @param classification_type A string specifying the type of classification ("multi-label" or "single-label").
+ * @param logits A pointer that will store the address of the logits (batch_size x num_classes, row-major).
+ * @param batch_size A pointer that will store the number of rows (texts) in the tensor.
+ * @param num_classes A pointer that will store the number of columns (labels) in the tensor.
+ * @return 0 if successful, -1 if an error occurs.
  */
-void process_output_tensor(OrtValue* output_tensor, const OrtApi* g_ort, bool same_labels, const char** const* labels,
-                            const size_t* num_labels, size_t num_labels_size, float threshold, size_t num_texts, const char** texts,
-                            const char* classification_type) {
+int get_output_logits(OrtValue* output_tensor, const OrtApi* g_ort, float** logits, int64_t* batch_size, int64_t* num_classes) {
     OrtStatus* status = NULL;
 
+    if (output_tensor == NULL) {
+        fprintf(stderr, "Error: Output tensor is missing.\n");
+        return -1;
+    }
+
     // Get information about the type and shape of the tensor
     OrtTensorTypeAndShapeInfo* type_info = NULL;
     status = g_ort->GetTensorTypeAndShape(output_tensor, &type_info);
     if (status != NULL) {
         fprintf(stderr, "Error: Unable to obtain information about the tensor type and shape.\n");
         if (status) g_ort->ReleaseStatus(status);
-        return;
+        return -1;
     }
 
     // Get the number of dimensions
     size_t num_dims = 0;
     status = g_ort->GetDimensionsCount(type_info, &num_dims);
-    if (status != NULL) {
+    if (status != NULL || num_dims != 2) {
         fprintf(stderr, "Error: Failed to get the number of dimensions of the tensor.\n");
         g_ort->ReleaseTensorTypeAndShapeInfo(type_info);
         if (status) g_ort->ReleaseStatus(status);
-        return;
+        return -1;
     }
 
     // Get the dimensions of the measurements
-    int64_t* dims = (int64_t*)malloc(num_dims * sizeof(int64_t));
+    int64_t dims[2] = { 0, 0 };
     status = g_ort->GetDimensions(type_info, dims, num_dims);
+    g_ort->ReleaseTensorTypeAndShapeInfo(type_info);
     if (status != NULL) {
         fprintf(stderr, "Error: Failed to get tensor dimension sizes.\n");
-        free(dims);
-        g_ort->ReleaseTensorTypeAndShapeInfo(type_info);
-        if (status) g_ort->ReleaseStatus(status);
-        return;
-    }
-
-    // Calculate the total number of elements
-    size_t total_elements = 1;
-    for (size_t i = 0; i < num_dims; ++i) {
-        total_elements *= dims[i];
+        g_ort->ReleaseStatus(status);
+        return -1;
     }
 
     // Get a pointer to the tensor data
-    float* output_data = NULL;
-    status = g_ort->GetTensorMutableData(output_tensor, (void**)&output_data);
+    status = g_ort->GetTensorMutableData(output_tensor, (void**)logits);
     if (status != NULL) {
         fprintf(stderr, "Error: Failed to get tensor data.\n");
-        free(dims);
-        g_ort->ReleaseTensorTypeAndShapeInfo(type_info);
-        if (status) g_ort->ReleaseStatus(status);
-        return;
+        g_ort->ReleaseStatus(status);
+        return -1;
     }
 
+    *batch_size = dims[0];
+    *num_classes = dims[1];
+    return 0;
+}
 
-    // Process logits
-    int batch_size = dims[0];
-    int num_classes = dims[1];
-    if (strcmp(classification_type, "multi-label") == 0) {    
-        for (int i = 0; i < batch_size; i++) {
-            printf("Text_%d: %s:\n",i, texts[i]);
-            for (int j = 0; j < num_classes; j++) {
-                float logit = output_data[i * num_classes + j];
-                float prob = sigmoid(logit);  // sigmoid function
-                
-                if (prob > threshold) {
-                    const char* label = NULL;
-                    if (same_labels) {
-                        if (j < num_labels_size) {
-                            label = labels[0][j];
-                        }
-                    } else {
-                        if (i < num_texts   && j < num_labels[i]) {
-                            label = labels[i][j];
-                        }
-                    }
-                
-                    if (label) {
-                        printf("  Text_%d Label: %s, Score: %.6f\n",i, label, prob);
-                    } else {
-                        printf("  Text_%d Label: [Unknown], Score: %.6f\n",i, prob);
-                    }
+/**
+ * Writes the predicted labels and scores of one text based on the given classification type (multi-label or single-label).
+ * Texts with NaN logits could not be run and are written as not classified.
+ * 
+ * @param stream The stream to write the predictions to (e.g. stdout).
+ * @param text_index The index of the text printed in the output.
+ * @param text The input text.
+ * @param logits The logits of the text (one per class).
+ * @param num_classes The number of logits.
+ * @param labels The labels of the text (may be NULL if unknown).
+ * @param num_labels The number of labels of the text.
+ * @param threshold The probability threshold for multi-label classification.
+ * @param classification_type A string specifying the type of classification ("multi-label" or "single-label").
+ */
+void write_text_predictions(FILE* stream, int text_index, const char* text, const float* logits, size_t num_classes,
+                            const char* const* labels, size_t num_labels, float threshold, const char* classification_type) {
+    if (num_classes > 0 && isnan(logits[0])) {
+        // The text could not be run (see run_inference_adaptive)
+        fprintf(stream, "Text_%d: %s:\n  Text_%d Not classified\n\n", text_index, text, text_index);
+        return;
+    }
+    if (strcmp(classification_type, "multi-label") == 0) {
+        fprintf(stream, "Text_%d: %s:\n", text_index, text);
+        for (size_t j = 0; j < num_classes; j++) {
+            float prob = sigmoid(logits[j]);  // sigmoid function
+            if (prob > threshold) {
+                const char* label = (labels && j < num_labels) ? labels[j] : NULL;
+                if (label) {
+                    fprintf(stream, "  Text_%d Label: %s, Score: %.6f\n", text_index, label, prob);
+                } else {
+                    fprintf(stream, "  Text_%d Label: [Unknown], Score: %.6f\n", text_index, prob);
                 }
             }
-            printf("\n");
         }
-    } else if (strcmp(classification_type, "single-label") == 0){
-        for (int i = 0; i < batch_size; i++) {
-            printf("Text_%d: %s:\n",i, texts[i]);
-            float max_prob = 0.0f;
-            int max_idx = -1;
-            for (int j = 0; j < num_classes; j++) {
-                float logit = output_data[i * num_classes + j];
-                float prob = sigmoid(logit);  // sigmoid function
-                if (prob > max_prob) {
-                    max_prob = prob;
-                    max_idx = j;
-                }
+        fprintf(stream, "\n");
+    } else if (strcmp(classification_type, "single-label") == 0) {
+        fprintf(stream, "Text_%d: %s:\n", text_index, text);
+        float max_prob = 0.0f;
+        int max_idx = -1;
+        for (size_t j = 0; j < num_classes; j++) {
+            float prob = sigmoid(logits[j]);  // sigmoid function
+            if (prob > max_prob) {
+                max_prob = prob;
+                max_idx = (int)j;
             }
-            
-            const char* label = NULL;
-            if (same_labels) {
-                if (max_idx < num_labels_size) {
-                    label = labels[0][max_idx];
-                }
-            } else {
-                if (i < num_texts && max_idx < num_labels[i]) {
-                    label = labels[i][max_idx];
-                }
-            }
-            
-            if (label) {
-                printf("  Text_%d Label: %s, Score: %.6f\n",i, label, max_prob);
-            } else {
-                printf("  Text_%d Label: [Unknown], Score: %.6f\n",i, max_prob);
-            }
-            printf("\n");
         }
-    }else{
+
+        const char* label = (labels && max_idx >= 0 && (size_t)max_idx < num_labels) ? labels[max_idx] : NULL;
+        if (label) {
+            fprintf(stream, "  Text_%d Label: %s, Score: %.6f\n", text_index, label, max_prob);
+        } else {
+            fprintf(stream, "  Text_%d Label: [Unknown], Score: %.6f\n", text_index, max_prob);
+        }
+        fprintf(stream, "\n");
+    }
+}
+
+/**
+ * Processes the output tensor (logits) and prints the predicted labels and scores based on the given classification type (multi-label or single-label).
+ * 
+ * @param output_tensor A pointer to the OrtValue containing the output logits from the ONNX model.
+ * @param g_ort A pointer to the ONNX Runtime API.
+ * @param same_labels Boolean indicating if all texts share the same set of labels.
+ * @param labels A 2D array of strings containing the labels for each class.
+ * @param num_labels A dynamic array indicating the number of labels for each text.
+ * @param num_labels_size The number of labels if all texts share the same set.
+ * @param threshold The probability threshold for multi-label classification.
+ * @param num_texts The number of texts in the batch.
+ * @param texts A dynamic array containing the input texts.
+ * @param classification_type A string specifying the type of classification ("multi-label" or "single-label").
+ */
+void process_output_tensor(OrtValue* output_tensor, const OrtApi* g_ort, bool same_labels, const char** const* labels,
+                            const size_t* num_labels, size_t num_labels_size, float threshold, size_t num_texts, const char** texts,
+                            const char* classification_type) {
+    float* output_data = NULL;
+    int64_t dims[2] = { 0, 0 };
+    if (get_output_logits(output_tensor, g_ort, &output_data, &dims[0], &dims[1]) != 0) {
+        return;
+    }
+    if (strcmp(classification_type, "multi-label") != 0 && strcmp(classification_type, "single-label") != 0) {
         printf("This type of classification is not supported\n");
+        return;
+    }
+
+    // Process logits
+    StageSample sample;
+    stage_begin(&sample);
+    size_t batch_size = (size_t)dims[0];
+    size_t num_classes = (size_t)dims[1];
+    for (size_t i = 0; i < batch_size && i < num_texts; i++) {
+        const char* const* text_labels = same_labels ? labels[0] : labels[i];
+        size_t text_num_labels = same_labels ? num_labels_size : num_labels[i];
+        write_text_predictions(stdout, (int)i, texts[i], &output_data[i * num_classes], num_classes,
+                               text_labels, text_num_labels, threshold, classification_type);
     }
+    stage_end(STAGE_POSTPROCESS, &sample);
+}
 
+/**
+ * Checks whether the prediction for one text is confident enough to be final.
+ * For multi-label classification every score must be at least margin away from the threshold,
+ * for single-label classification the best score must beat the second best by at least margin.
+ * Texts that could not be run (NaN logits) are never confident.
+ * 
+ * @param logits The logits of the text (one per class).
+ * @param num_classes The number of logits.
+ * @param threshold The probability threshold for multi-label classification.
+ * @param margin The required distance from the threshold (multi-label) or between the two best scores (single-label).
+ * @param classification_type A string specifying the type of classification ("multi-label" or "single-label").
+ * @return true if the prediction is confident, false otherwise.
+ */
+bool is_confident_prediction(const float* logits, size_t num_classes, float threshold, float margin,
+                             const char* classification_type) {
+    if (num_classes > 0 && isnan(logits[0])) {
+        return false;
+    }
+    if (strcmp(classification_type, "multi-label") == 0) {
+        for (size_t j = 0; j < num_classes; j++) {
+            if (fabsf(sigmoid(logits[j]) - threshold) < margin) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-    if (dims) free(dims);
-    if (type_info) g_ort->ReleaseTensorTypeAndShapeInfo(type_info);
-    if (status) g_ort->ReleaseStatus(status);
-}
\ No newline at end of file
+    float best = 0.0f, second = 0.0f;
+    for (size_t j = 0; j < num_classes; j++) {
+        float prob = sigmoid(logits[j]);
+        if (prob > best) {
+            second = best;
+            best = prob;
+        } else if (prob > second) {
+            second = prob;
+        }
+    }
+    return best - second >= margin;
+}
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 
 #include "preprocessor.h"
+#include "memory_tracker.h"
 
 /**
  * Prepares inputs for further processing by combining texts with their corresponding labels.
@@ -48,6 +49,13 @@ const char** prepare_inputs(const char* texts[], const char** const* labels, siz
         }
         
     }
+    if (memory_tracking_enabled()) {
+        size_t bytes = num_texts * sizeof(char*);
+        for (size_t i = 0; i < num_texts; ++i) {
+            bytes += strlen(inputs[i]) + 1;
+        }
+        track_allocation(MEMORY_PROMPTS, bytes);
+    }
 
     return (const char **)inputs;
 }
@@ -117,6 +125,13 @@ char* prepare_input(const char* text, const char* labels[], size_t num_labels, b
  * @param num_texts The number of input texts (size of the prepared_inputs array).
  */
 void free_prepared_inputs(char** prepared_inputs, size_t num_texts){
+    if (memory_tracking_enabled()) {
+        size_t bytes = num_texts * sizeof(char*);
+        for (size_t i = 0; i < num_texts; ++i) {
+            bytes += strlen(prepared_inputs[i]) + 1;
+        }
+        track_release(MEMORY_PROMPTS, bytes);
+    }
     for (size_t i = 0; i < num_texts; i++){
         free(prepared_inputs[i]);
     }
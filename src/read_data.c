@@ -3,13 +3,18 @@
 #include <string.h>
 #include <stdbool.h>
 #include "cJSON.h" 
+#include "read_data.h"
+#include "configs.h"
+#include "compressed_io.h"
+#include "memory_tracker.h"
 
 /**
  * Reads the entire content of a file and returns it as a string.
+ * gzip and zstd compressed files are detected by their first bytes and decompressed while they are read.
  *
  * @param filename The name of the file to read.
- * @return A dynamically allocated string containing the file content, or NULL if the file could not be opened.
- *         The caller is responsible for freeing the allocated memory.
+ * @return A dynamically allocated string containing the file content, or NULL if the file could not be opened
+ *         or decompressed. The caller is responsible for freeing the allocated memory.
  */
 char* read_file(const char* filename) {
     FILE* file = fopen(filename, "rb");
@@ -17,6 +22,21 @@ char* read_file(const char* filename) {
         fprintf(stderr, "Error: Faild to open file %s\n", filename);
         return NULL;
     }
+    setvbuf(file, NULL, _IONBF, 0); // Compressed data after the magic bytes is read from the descriptor
+    unsigned char magic[COMPRESSION_MAGIC_SIZE];
+    size_t magic_size = fread(magic, 1, sizeof(magic), file);
+    CompressionFormat format = detect_compression(magic, magic_size);
+    if (format != COMPRESSION_NONE) {
+        char* content = NULL;
+        size_t length = 0;
+        int result = decompress_to_buffer(fileno(file), magic, magic_size, format, &content, &length);
+        fclose(file);
+        if (result != 0) {
+            fprintf(stderr, "Error: Failed to decompress file %s\n", filename);
+            return NULL;
+        }
+        return content;
+    }
     fseek(file, 0, SEEK_END);
     long length = ftell(file);
     fseek(file, 0, SEEK_SET);
@@ -28,9 +48,9 @@ char* read_file(const char* filename) {
 }
 
 /**
- * Parses a JSON string to extract information such as texts, labels, and classification type.
+ * Extracts texts, labels, and classification type from a parsed JSON request object.
  *
- * @param json_string The JSON string to parse.
+ * @param json The parsed JSON object of one request.
  * @param texts Pointer to an array of strings that will store the extracted texts.
  * @param num_texts Pointer to a size_t that will store the number of texts extracted.
  * @param labels Pointer to an array of arrays that will store the extracted labels for each text.
@@ -38,24 +58,14 @@ char* read_file(const char* filename) {
  * @param num_labels_size Pointer to a size_t that will store the number of labels (if all texts have the same labels).
  * @param same_labels Pointer to a boolean that indicates whether all texts share the same labels.
  * @param classification_type Pointer to a string that will store the classification type.
- *
- * This function dynamically allocates memory for texts, labels, and related data. 
- * It is the caller's responsibility to free the allocated memory.
  */
-void parse_json(const char* json_string, char*** texts, size_t* num_texts, char**** labels,
-                size_t** num_labels, size_t* num_labels_size, bool* same_labels, char** classification_type) {
-    // Parse json
-    cJSON* json = cJSON_Parse(json_string);
-    if (!json) {
-        fprintf(stderr, "Failed to parse JSON: %s\n", cJSON_GetErrorPtr());
-        return;
-    }
-    
+static void parse_json_object(const cJSON* json, char*** texts, size_t* num_texts, char**** labels,
+                              size_t** num_labels, size_t* num_labels_size, bool* same_labels, char** classification_type) {
     // Get array texts
     cJSON* texts_json = cJSON_GetObjectItemCaseSensitive(json, "texts");
     if (cJSON_IsArray(texts_json)) {
         *num_texts = cJSON_GetArraySize(texts_json);
-        *texts = (char**)malloc(*num_texts * sizeof(char*));
+        *texts = (char**)calloc(*num_texts, sizeof(char*));
         for (size_t i = 0; i < *num_texts; ++i) {
             cJSON* text = cJSON_GetArrayItem(texts_json, i);
             if (cJSON_IsString(text)) {
@@ -86,7 +96,7 @@ void parse_json(const char* json_string, char*** texts, size_t* num_texts, char*
                 if (cJSON_IsArray(first_labels_group)) {
                     *num_labels_size = cJSON_GetArraySize(first_labels_group);
                     *labels = (char***)malloc(sizeof(char**));  // One set of labels for all texts
-                    (*labels)[0] = (char**)malloc(*num_labels_size * sizeof(char*));
+                    (*labels)[0] = (char**)calloc(*num_labels_size, sizeof(char*));
                     
                     for (size_t i = 0; i < *num_labels_size; ++i) {
                         cJSON* label = cJSON_GetArrayItem(first_labels_group, i);
@@ -110,12 +120,11 @@ void parse_json(const char* json_string, char*** texts, size_t* num_texts, char*
             // We check that the number of tags matches the number of texts
             if (cJSON_GetArraySize(labels_json) != *num_texts) {
                 fprintf(stderr, "Error:the number of arrays of labels does not match the number of texts.\n");
-                cJSON_Delete(json);
                 return;
             }
 
-            *num_labels = (size_t*)malloc(*num_texts * sizeof(size_t)); // dynamic array num_labels
-            *labels = (char***)malloc(*num_texts * sizeof(char**));     // array of arrays for each group of labels
+            *num_labels = (size_t*)calloc(*num_texts, sizeof(size_t)); // dynamic array num_labels
+            *labels = (char***)calloc(*num_texts, sizeof(char**));      // array of arrays for each group of labels
             
             // We iterate over each text
             for (size_t i = 0; i < *num_texts; ++i) {
@@ -123,10 +132,9 @@ void parse_json(const char* json_string, char*** texts, size_t* num_texts, char*
                 if (cJSON_IsArray(text_labels_json)) {
                     size_t num_labels_for_text = cJSON_GetArraySize(text_labels_json);
                     (*num_labels)[i] = num_labels_for_text;
-                    (*labels)[i] = (char**)malloc(num_labels_for_text * sizeof(char*));
+                    (*labels)[i] = (char**)calloc(num_labels_for_text, sizeof(char*));
                     if (!(*labels)[i]) {
                         fprintf(stderr, "Error: failed to allocate memory for text labels %zu.\n", i);
-                        cJSON_Delete(json);
                         return;
                     }
                     for (size_t j = 0; j < num_labels_for_text; ++j) {
@@ -141,9 +149,464 @@ void parse_json(const char* json_string, char*** texts, size_t* num_texts, char*
             }
         }
     }
+}
+
+
+/**
+ * Frees the children of a taxonomy node (recursively) and its label.
+ *
+ * @param node The node to clear.
+ */
+static void free_taxonomy_node(TaxonomyNode* node) {
+    for (size_t i = 0; node->children && i < node->num_children; ++i) {
+        free_taxonomy_node(&node->children[i]);
+    }
+    free(node->children);
+    free(node->label);
+    memset(node, 0, sizeof(*node));
+}
+
+/**
+ * Parses the children of a taxonomy node. Every child is either a label string (a leaf) or an object
+ * {"label": "...", "children": [...]}.
+ *
+ * @param children_json The JSON array of children.
+ * @param node The node to attach the children to.
+ * @param depth The depth of the children (1 for the top-level labels).
+ * @return 0 if successful, or 1 if the tree is malformed or deeper than TAXONOMY_MAX_DEPTH.
+ */
+static int parse_taxonomy_children(const cJSON* children_json, TaxonomyNode* node, size_t depth) {
+    if (!cJSON_IsArray(children_json) || cJSON_GetArraySize(children_json) == 0) {
+        fprintf(stderr, "Error: taxonomy children must be a non-empty array\n");
+        return 1;
+    }
+    if (depth > TAXONOMY_MAX_DEPTH) {
+        fprintf(stderr, "Error: taxonomy is deeper than %d levels\n", TAXONOMY_MAX_DEPTH);
+        return 1;
+    }
+    node->num_children = cJSON_GetArraySize(children_json);
+    node->children = (TaxonomyNode*)calloc(node->num_children, sizeof(TaxonomyNode));
+    if (!node->children) {
+        fprintf(stderr, "Error: failed to allocate memory for the taxonomy.\n");
+        node->num_children = 0;
+        return 1;
+    }
+    for (size_t i = 0; i < node->num_children; ++i) {
+        cJSON* child_json = cJSON_GetArrayItem(children_json, i);
+        TaxonomyNode* child = &node->children[i];
+        cJSON* label_json = cJSON_IsObject(child_json) ? cJSON_GetObjectItemCaseSensitive(child_json, "label") : child_json;
+        if (!cJSON_IsString(label_json)) {
+            fprintf(stderr, "Error: taxonomy node must be a label or a {\"label\", \"children\"} object\n");
+            return 1;
+        }
+        child->label = strdup(label_json->valuestring);
+        cJSON* grandchildren_json = cJSON_IsObject(child_json) ? cJSON_GetObjectItemCaseSensitive(child_json, "children") : NULL;
+        if (grandchildren_json && parse_taxonomy_children(grandchildren_json, child, depth + 1) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parses a JSON string to extract information such as texts, labels, and classification type.
+ *
+ * @param json_string The JSON string to parse.
+ * @param texts Pointer to an array of strings that will store the extracted texts.
+ * @param num_texts Pointer to a size_t that will store the number of texts extracted.
+ * @param labels Pointer to an array of arrays that will store the extracted labels for each text.
+ * @param num_labels Pointer to a dynamic array of size_t representing the number of labels for each text.
+ * @param num_labels_size Pointer to a size_t that will store the number of labels (if all texts have the same labels).
+ * @param same_labels Pointer to a boolean that indicates whether all texts share the same labels.
+ * @param classification_type Pointer to a string that will store the classification type.
+ *
+ * This function dynamically allocates memory for texts, labels, and related data. 
+ * It is the caller's responsibility to free the allocated memory.
+ */
+void parse_json(const char* json_string, char*** texts, size_t* num_texts, char**** labels,
+                size_t** num_labels, size_t* num_labels_size, bool* same_labels, char** classification_type) {
+    // Parse json
+    cJSON* json = cJSON_Parse(json_string);
+    if (!json) {
+        fprintf(stderr, "Failed to parse JSON: %s\n", cJSON_GetErrorPtr());
+        return;
+    }
+    parse_json_object(json, texts, num_texts, labels, num_labels, num_labels_size, same_labels, classification_type);
     cJSON_Delete(json);  // free memory
 }
 
+/**
+ * Parses one request object, including the optional name of the model it is routed to
+ * and its scheduling hints (priority class and deadline).
+ *
+ * @param json The parsed JSON object of the request.
+ * @param request Pointer to the ClassificationRequest to fill.
+ * @return 0 if successful, or 1 if the request has no texts, labels or classification type, or invalid scheduling hints.
+ */
+static int parse_request_object(const cJSON* json, ClassificationRequest* request) {
+    memset(request, 0, sizeof(*request));
+    parse_json_object(json, &request->texts, &request->num_texts, &request->labels, &request->num_labels,
+                      &request->num_labels_size, &request->same_labels, &request->classification_type);
+
+    cJSON* model_json = cJSON_GetObjectItemCaseSensitive(json, "model");
+    if (cJSON_IsString(model_json)) {
+        request->model_name = strdup(model_json->valuestring);
+    }
+
+    // Scheduling hints
+    request->priority = PRIORITY_NORMAL;
+    cJSON* priority_json = cJSON_GetObjectItemCaseSensitive(json, "priority");
+    if (cJSON_IsString(priority_json)) {
+        int priority = -1;
+        for (int i = 0; i < NUM_PRIORITY_CLASSES; ++i) {
+            if (strcmp(priority_json->valuestring, priority_class_name((RequestPriority)i)) == 0) {
+                priority = i;
+            }
+        }
+        if (priority < 0) {
+            fprintf(stderr, "Error: unknown priority %s (expected interactive, normal or bulk)\n", priority_json->valuestring);
+            return 1;
+        }
+        request->priority = (RequestPriority)priority;
+    } else if (cJSON_IsNumber(priority_json)) {
+        if (priority_json->valueint < 0 || priority_json->valueint >= NUM_PRIORITY_CLASSES) {
+            fprintf(stderr, "Error: priority %d is out of range\n", priority_json->valueint);
+            return 1;
+        }
+        request->priority = (RequestPriority)priority_json->valueint;
+    }
+    cJSON* deadline_json = cJSON_GetObjectItemCaseSensitive(json, "deadline_ms");
+    if (cJSON_IsNumber(deadline_json) && deadline_json->valuedouble > 0) {
+        request->deadline_ms = deadline_json->valuedouble;
+    }
+    cJSON* miss_json = cJSON_GetObjectItemCaseSensitive(json, "on_deadline_miss");
+    if (cJSON_IsString(miss_json)) {
+        if (strcmp(miss_json->valuestring, "shed") != 0 && strcmp(miss_json->valuestring, "defer") != 0) {
+            fprintf(stderr, "Error: on_deadline_miss must be shed or defer\n");
+            return 1;
+        }
+        request->shed_late = strcmp(miss_json->valuestring, "shed") == 0;
+    }
+
+    // Label tree in place of the flat labels
+    cJSON* taxonomy_json = cJSON_GetObjectItemCaseSensitive(json, "taxonomy");
+    if (taxonomy_json) {
+        if (request->labels) {
+            fprintf(stderr, "Error: request has both labels and a taxonomy\n");
+            return 1;
+        }
+        request->taxonomy = (TaxonomyNode*)calloc(1, sizeof(TaxonomyNode));
+        if (!request->taxonomy || parse_taxonomy_children(taxonomy_json, request->taxonomy, 1) != 0) {
+            return 1;
+        }
+        request->top_k = TAXONOMY_TOP_K;
+        cJSON* top_k_json = cJSON_GetObjectItemCaseSensitive(json, "top_k");
+        if (cJSON_IsNumber(top_k_json) && top_k_json->valueint > 0) {
+            request->top_k = (size_t)top_k_json->valueint;
+        }
+    }
+
+    if (request->num_texts == 0 || (request->labels == NULL && request->taxonomy == NULL) ||
+        request->classification_type == NULL) {
+        fprintf(stderr, "Error: request has no texts, labels or classification type\n");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Computes the bytes of the texts and labels of a request, as counted by the memory tracking.
+ */
+static size_t request_memory_bytes(const ClassificationRequest* request) {
+    size_t bytes = request->num_texts * sizeof(char*);
+    for (size_t i = 0; request->texts && i < request->num_texts; ++i) {
+        bytes += strlen(request->texts[i]) + 1;
+    }
+    size_t num_label_sets = request->same_labels ? 1 : request->num_texts;
+    for (size_t i = 0; request->labels && request->num_labels && i < num_label_sets; ++i) {
+        bytes += sizeof(char**) + sizeof(size_t) + request->num_labels[i] * sizeof(char*);
+        for (size_t j = 0; request->labels[i] && j < request->num_labels[i]; ++j) {
+            bytes += strlen(request->labels[i][j]) + 1;
+        }
+    }
+    return bytes;
+}
+
+/**
+ * Parses a JSON string with one or several classification requests.
+ * The input is either a single request (the regular input format) or an object with a "requests" array
+ * of such objects. Each request may name the model it is routed to in the "model" field.
+ *
+ * @param json_string The JSON string to parse.
+ * @param requests Pointer that will store the dynamically allocated array of requests.
+ * @param num_requests Pointer that will store the number of requests.
+ * @return 0 if successful, or 1 if the JSON is invalid or a request is incomplete.
+ *         The caller is responsible for freeing the requests with free_request and the array with free.
+ */
+int parse_requests(const char* json_string, ClassificationRequest** requests, size_t* num_requests) {
+    *requests = NULL;
+    *num_requests = 0;
+
+    cJSON* json = cJSON_Parse(json_string);
+    if (!json) {
+        fprintf(stderr, "Failed to parse JSON: %s\n", cJSON_GetErrorPtr());
+        return 1;
+    }
+
+    cJSON* requests_json = cJSON_GetObjectItemCaseSensitive(json, "requests");
+    size_t count = cJSON_IsArray(requests_json) ? (size_t)cJSON_GetArraySize(requests_json) : 1;
+    *requests = (ClassificationRequest*)calloc(count, sizeof(ClassificationRequest));
+    if (!*requests) {
+        fprintf(stderr, "Error: failed to allocate memory for requests.\n");
+        cJSON_Delete(json);
+        return 1;
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const cJSON* request_json = cJSON_IsArray(requests_json) ? cJSON_GetArrayItem(requests_json, i) : json;
+        *num_requests = i + 1;
+        if (!cJSON_IsObject(request_json) || parse_request_object(request_json, &(*requests)[i]) != 0) {
+            fprintf(stderr, "Error: request %zu is invalid.\n", i);
+            result = 1;
+            break;
+        }
+        if (memory_tracking_enabled()) {
+            (*requests)[i].memory_bytes = request_memory_bytes(&(*requests)[i]);
+            track_allocation(MEMORY_REQUESTS, (*requests)[i].memory_bytes);
+        }
+    }
+    cJSON_Delete(json);
+    return result;
+}
+
+/**
+ * Serializes a slice of the texts of a request into a request JSON object (the regular input format),
+ * e.g. to hand a shard of a large request to another process.
+ *
+ * @param request The request.
+ * @param start The index of the first text of the slice.
+ * @param count The number of texts of the slice.
+ * @return A dynamically allocated JSON string, or NULL if an error occurs. The caller is responsible for freeing it.
+ */
+char* request_slice_to_json(const ClassificationRequest* request, size_t start, size_t count) {
+    cJSON* json = cJSON_CreateObject();
+    cJSON* texts_json = cJSON_AddArrayToObject(json, "texts");
+    cJSON* labels_json = cJSON_AddArrayToObject(json, "labels");
+    if (!texts_json || !labels_json) {
+        cJSON_Delete(json);
+        return NULL;
+    }
+    size_t num_label_sets = request->same_labels ? 1 : count;
+    for (size_t i = 0; i < count; ++i) {
+        cJSON_AddItemToArray(texts_json, cJSON_CreateString(request->texts[start + i]));
+    }
+    for (size_t i = 0; i < num_label_sets; ++i) {
+        size_t text = request->same_labels ? 0 : start + i;
+        size_t num_labels = request->same_labels ? request->num_labels_size : request->num_labels[text];
+        cJSON* label_set_json = cJSON_CreateArray();
+        for (size_t j = 0; j < num_labels; ++j) {
+            cJSON_AddItemToArray(label_set_json, cJSON_CreateString(request->labels[text][j]));
+        }
+        cJSON_AddItemToArray(labels_json, label_set_json);
+    }
+    cJSON_AddBoolToObject(json, "same_labels", request->same_labels);
+    cJSON_AddStringToObject(json, "classification_type", request->classification_type);
+    if (request->model_name) {
+        cJSON_AddStringToObject(json, "model", request->model_name);
+    }
+
+    char* json_string = cJSON_PrintUnformatted(json);
+    cJSON_Delete(json);
+    return json_string;
+}
+
+/**
+ * Frees the memory allocated for a classification request.
+ *
+ * @param request Pointer to the ClassificationRequest to free.
+ */
+void free_request(ClassificationRequest* request) {
+    track_release(MEMORY_REQUESTS, request->memory_bytes);
+    size_t num_label_sets = request->same_labels ? 1 : request->num_texts;
+    for (size_t i = 0; request->labels && request->num_labels && i < num_label_sets; ++i) {
+        for (size_t j = 0; request->labels[i] && j < request->num_labels[i]; ++j) {
+            free(request->labels[i][j]);
+        }
+        free(request->labels[i]);
+    }
+    for (size_t i = 0; request->texts && i < request->num_texts; ++i) {
+        free(request->texts[i]);
+    }
+    free(request->labels);
+    free(request->num_labels);
+    free(request->texts);
+    free(request->classification_type);
+    free(request->model_name);
+    if (request->taxonomy) {
+        free_taxonomy_node(request->taxonomy);
+        free(request->taxonomy);
+    }
+    memset(request, 0, sizeof(*request));
+}
+
+/**
+ * Parses a rerank request: {"query": "...", "passages": ["...", ...], "top_k": 5, "min_score": 0.5}.
+ * "top_k" and "min_score" are optional.
+ *
+ * @param json_string The JSON string to parse.
+ * @param request Pointer to the RerankRequest structure to fill.
+ * @return 0 if successful, or 1 if the JSON is invalid or has no query or passages.
+ *         The caller is responsible for freeing the request with free_rerank_request.
+ */
+int parse_rerank_request(const char* json_string, RerankRequest* request) {
+    memset(request, 0, sizeof(*request));
+    cJSON* json = cJSON_Parse(json_string);
+    if (!json) {
+        fprintf(stderr, "Failed to parse JSON: %s\n", cJSON_GetErrorPtr());
+        return 1;
+    }
+
+    cJSON* query_json = cJSON_GetObjectItemCaseSensitive(json, "query");
+    cJSON* passages_json = cJSON_GetObjectItemCaseSensitive(json, "passages");
+    if (!cJSON_IsString(query_json) || !cJSON_IsArray(passages_json) || cJSON_GetArraySize(passages_json) == 0) {
+        fprintf(stderr, "Error: rerank request needs a \"query\" string and a non-empty \"passages\" array\n");
+        cJSON_Delete(json);
+        return 1;
+    }
+    request->query = strdup(query_json->valuestring);
+    request->num_passages = cJSON_GetArraySize(passages_json);
+    request->passages = (char**)calloc(request->num_passages, sizeof(char*));
+    if (!request->query || !request->passages) {
+        fprintf(stderr, "Error: failed to allocate memory for the rerank request.\n");
+        cJSON_Delete(json);
+        free_rerank_request(request);
+        return 1;
+    }
+    for (size_t i = 0; i < request->num_passages; ++i) {
+        cJSON* passage_json = cJSON_GetArrayItem(passages_json, i);
+        request->passages[i] = strdup(cJSON_IsString(passage_json) ? passage_json->valuestring : "");
+    }
+
+    cJSON* top_k_json = cJSON_GetObjectItemCaseSensitive(json, "top_k");
+    if (cJSON_IsNumber(top_k_json) && top_k_json->valueint > 0) {
+        request->top_k = (size_t)top_k_json->valueint;
+    }
+    cJSON* min_score_json = cJSON_GetObjectItemCaseSensitive(json, "min_score");
+    if (cJSON_IsNumber(min_score_json)) {
+        request->min_score = (float)min_score_json->valuedouble;
+    }
+    cJSON_Delete(json);
+    return 0;
+}
+
+/**
+ * Frees the memory allocated for a rerank request.
+ *
+ * @param request Pointer to the RerankRequest to free.
+ */
+void free_rerank_request(RerankRequest* request) {
+    for (size_t i = 0; request->passages && i < request->num_passages; ++i) {
+        free(request->passages[i]);
+    }
+    free(request->passages);
+    free(request->query);
+    memset(request, 0, sizeof(*request));
+}
+
+/**
+ * Parses one record of a stream: {"text": "...", "labels": ["...", ...], "classification_type": "multi-label"}.
+ * "classification_type" is optional and defaults to "single-label".
+ *
+ * @param json_string The JSON string of the record (one line of the stream).
+ * @param text Pointer that will store the text.
+ * @param labels Pointer that will store the array of labels.
+ * @param num_labels Pointer that will store the number of labels.
+ * @param classification_type Pointer that will store the classification type.
+ * @return 0 if successful, or 1 if the record is invalid (nothing is allocated in this case).
+ *         The caller is responsible for freeing the text, every label, the labels array and the classification type.
+ */
+int parse_stream_record(const char* json_string, char** text, char*** labels, size_t* num_labels,
+                        char** classification_type) {
+    *text = NULL;
+    *labels = NULL;
+    *num_labels = 0;
+    *classification_type = NULL;
+    cJSON* json = cJSON_Parse(json_string);
+    if (!json) {
+        return 1;
+    }
+
+    cJSON* text_json = cJSON_GetObjectItemCaseSensitive(json, "text");
+    cJSON* labels_json = cJSON_GetObjectItemCaseSensitive(json, "labels");
+    cJSON* classification_type_json = cJSON_GetObjectItemCaseSensitive(json, "classification_type");
+    const char* type = cJSON_IsString(classification_type_json) ? classification_type_json->valuestring : "single-label";
+    if (!cJSON_IsString(text_json) || !cJSON_IsArray(labels_json) || cJSON_GetArraySize(labels_json) == 0 ||
+        (strcmp(type, "single-label") != 0 && strcmp(type, "multi-label") != 0)) {
+        cJSON_Delete(json);
+        return 1;
+    }
+
+    size_t count = cJSON_GetArraySize(labels_json);
+    *text = strdup(text_json->valuestring);
+    *labels = (char**)calloc(count, sizeof(char*));
+    *classification_type = strdup(type);
+    int result = (*text && *labels && *classification_type) ? 0 : 1;
+    for (size_t i = 0; result == 0 && i < count; ++i) {
+        cJSON* label = cJSON_GetArrayItem(labels_json, i);
+        (*labels)[i] = strdup(cJSON_IsString(label) ? label->valuestring : "");
+        if (!(*labels)[i]) {
+            result = 1;
+        }
+    }
+    *num_labels = count;
+    cJSON_Delete(json);
+
+    if (result != 0) {
+        for (size_t i = 0; *labels && i < count; ++i) {
+            free((*labels)[i]);
+        }
+        free(*labels);
+        free(*text);
+        free(*classification_type);
+        *text = NULL;
+        *labels = NULL;
+        *num_labels = 0;
+        *classification_type = NULL;
+    }
+    return result;
+}
+
+/**
+ * Parses a control record of a stream: {"control": "reload"}. Control records carry commands for the
+ * process instead of texts to classify.
+ *
+ * @param json_string The JSON string of the record (one line of the stream).
+ * @return The dynamically allocated command, or NULL if the record is not a control record.
+ *         The caller is responsible for freeing the command.
+ */
+char* parse_stream_control(const char* json_string) {
+    cJSON* json = cJSON_Parse(json_string);
+    if (!json) {
+        return NULL;
+    }
+    cJSON* control_json = cJSON_GetObjectItemCaseSensitive(json, "control");
+    char* command = cJSON_IsString(control_json) ? strdup(control_json->valuestring) : NULL;
+    cJSON_Delete(json);
+    return command;
+}
+
+/**
+ * Returns the name of a priority class as used in the "priority" field of requests.
+ *
+ * @param priority The priority class.
+ * @return "interactive", "normal" or "bulk".
+ */
+const char* priority_class_name(RequestPriority priority) {
+    static const char* const names[NUM_PRIORITY_CLASSES] = { "interactive", "normal", "bulk" };
+    return (priority >= 0 && priority < NUM_PRIORITY_CLASSES) ? names[priority] : "unknown";
+}
+
 /**
  * Converts a string to a boolean value.
  * 
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "reranker.h"
+#include "preprocessor.h"
+#include "postprocessor.h"
+#include "parallel_processor.h"
+#include "tokenizer.h"
+#include "model.h"
+#include "memory_tracker.h"
+#include "configs.h"
+
+/**
+ * Structure to store the tokens of the query prompt shared by all rows of a rerank.
+ * ids holds the prompt tokenized with special tokens: [prefix | prompt | suffix].
+ */
+typedef struct {
+    int* ids;               /**< Prompt tokens with the special tokens of the tokenizer. */
+    size_t len;             /**< Number of tokens in ids. */
+    size_t prompt_start;    /**< Start of the prompt tokens in ids (= length of the special token prefix). */
+    size_t prompt_len;      /**< Number of prompt tokens. */
+} QueryTokens;
+
+static int compare_results(const void* a, const void* b) {
+    const RerankResult* x = (const RerankResult*)a;
+    const RerankResult* y = (const RerankResult*)b;
+    if (x->score != y->score) {
+        return (x->score < y->score) - (x->score > y->score);
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/**
+ * Tokenizes the "<<LABEL>>query<<SEP>>" prompt once for all rows of a rerank.
+ * The prompt is encoded with and without special tokens; the tokens around the plain encoding are
+ * the special tokens every row starts and ends with (e.g. [CLS] and [SEP]).
+ *
+ * @param tokenizer The tokenizer of the model.
+ * @param query The query.
+ * @param query_tokens Pointer to the QueryTokens structure to fill.
+ * @return 0 if successful, -1 if the prompt could not be tokenized.
+ */
+static int tokenize_query(TokenizerHandle tokenizer, const char* query, QueryTokens* query_tokens) {
+    memset(query_tokens, 0, sizeof(*query_tokens));
+    const char* labels[] = { query };
+    char* prompt = prepare_input("", labels, 1, true);
+    if (!prompt) {
+        return -1;
+    }
+
+    TokenizerEncodeResult with_special, plain;
+    tokenizers_encode(tokenizer, prompt, strlen(prompt), 1, &with_special);
+    tokenizers_encode(tokenizer, prompt, strlen(prompt), 0, &plain);
+    free(prompt);
+
+    int result = -1;
+    bool found = false;
+    for (size_t start = 0; plain.len <= with_special.len && start <= with_special.len - plain.len; ++start) {
+        if (memcmp(&with_special.token_ids[start], plain.token_ids, plain.len * sizeof(int)) == 0) {
+            found = true;
+            query_tokens->ids = (int*)malloc((with_special.len ? with_special.len : 1) * sizeof(int));
+            if (!query_tokens->ids) {
+                fprintf(stderr, "Error: Memory allocation for query tokens failed\n");
+                break;
+            }
+            memcpy(query_tokens->ids, with_special.token_ids, with_special.len * sizeof(int));
+            query_tokens->len = with_special.len;
+            query_tokens->prompt_start = start;
+            query_tokens->prompt_len = plain.len;
+            result = 0;
+            break;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "Error: Failed to locate the query prompt among the special tokens of the tokenizer\n");
+    }
+
+    tokenizers_free_encode_results(&with_special, 1);
+    tokenizers_free_encode_results(&plain, 1);
+    return result;
+}
+
+/**
+ * Builds the input tensors of one batch of passages: every row is the query prompt tokens joined with
+ * the passage tokens, so only the passages are tokenized per batch. The prompt ends in the <<SEP>>
+ * special token, which the tokenizer never merges with its neighbours, so the rows have the same
+ * tokens as rows tokenized as a whole. Passages are cut to fit into MAX_LENGTH next to the prompt.
+ *
+ * @param tokenizer The tokenizer of the model.
+ * @param query_tokens The tokenized query prompt.
+ * @param prompt_first Whether the prompt goes before the passage.
+ * @param passages The passages of the batch.
+ * @param count The number of passages in the batch.
+ * @param input_ids_tensor Output input ids tensor.
+ * @param attention_mask_tensor Output attention mask tensor.
+ * @return The number of truncated passages, or -1 if the tensors could not be created.
+ */
+static int prepare_rerank_batch(TokenizerHandle tokenizer, const QueryTokens* query_tokens, bool prompt_first,
+                                const char* const* passages, size_t count,
+                                OrtValue** input_ids_tensor, OrtValue** attention_mask_tensor) {
+    TokenizerEncodeResult* results = (TokenizerEncodeResult*)malloc(count * sizeof(TokenizerEncodeResult));
+    size_t* input_lengths = (size_t*)malloc(count * sizeof(size_t));
+    if (!results || !input_lengths) {
+        fprintf(stderr, "Error: Memory allocation for passage tokens failed\n");
+        free(results);
+        free(input_lengths);
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        input_lengths[i] = strlen(passages[i]);
+    }
+    tokenizers_encode_batch(tokenizer, (const char**)passages, input_lengths, count, 0, results);
+    free(input_lengths);
+
+    size_t passage_budget = MAX_LENGTH - query_tokens->len;
+    size_t seq_length = 0;
+    int num_truncated = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (results[i].len > passage_budget) {
+            num_truncated++;
+        }
+        size_t passage_len = results[i].len < passage_budget ? results[i].len : passage_budget;
+        if (query_tokens->len + passage_len > seq_length) {
+            seq_length = query_tokens->len + passage_len;
+        }
+    }
+    seq_length = bucket_sequence_length(seq_length, MAX_LENGTH);
+
+    TokenizedInputs tokenized;
+    tokenized.input_ids = (int**)calloc(count, sizeof(int*));
+    tokenized.token_type_ids = (int**)calloc(count, sizeof(int*));
+    tokenized.attention_mask = (int**)calloc(count, sizeof(int*));
+    tokenized.batch_size = count;
+    tokenized.seq_length = seq_length;
+    int result = (tokenized.input_ids && tokenized.token_type_ids && tokenized.attention_mask) ? 0 : -1;
+    if (result == 0) {
+        track_allocation(MEMORY_TOKENS, 3 * count * (sizeof(int*) + seq_length * sizeof(int))); // Released by free_tokenized_inputs
+    }
+
+    const int* prefix = query_tokens->ids;
+    const int* prompt = &query_tokens->ids[query_tokens->prompt_start];
+    const int* suffix = &prompt[query_tokens->prompt_len];
+    size_t suffix_len = query_tokens->len - query_tokens->prompt_start - query_tokens->prompt_len;
+    for (size_t i = 0; i < count && result == 0; ++i) {
+        tokenized.input_ids[i] = (int*)calloc(seq_length, sizeof(int));
+        tokenized.token_type_ids[i] = (int*)calloc(seq_length, sizeof(int));
+        tokenized.attention_mask[i] = (int*)calloc(seq_length, sizeof(int));
+        if (!tokenized.input_ids[i] || !tokenized.token_type_ids[i] || !tokenized.attention_mask[i]) {
+            result = -1;
+            break;
+        }
+
+        // [prefix | prompt | passage | suffix] or [prefix | passage | prompt | suffix]
+        int* row = tokenized.input_ids[i];
+        size_t passage_len = results[i].len < passage_budget ? results[i].len : passage_budget;
+        size_t pos = 0;
+        memcpy(&row[pos], prefix, query_tokens->prompt_start * sizeof(int));
+        pos += query_tokens->prompt_start;
+        if (prompt_first) {
+            memcpy(&row[pos], prompt, query_tokens->prompt_len * sizeof(int));
+            pos += query_tokens->prompt_len;
+        }
+        memcpy(&row[pos], results[i].token_ids, passage_len * sizeof(int));
+        pos += passage_len;
+        if (!prompt_first) {
+            memcpy(&row[pos], prompt, query_tokens->prompt_len * sizeof(int));
+            pos += query_tokens->prompt_len;
+        }
+        memcpy(&row[pos], suffix, suffix_len * sizeof(int));
+        pos += suffix_len;
+        for (size_t j = 0; j < pos; ++j) {
+            tokenized.attention_mask[i][j] = 1;
+        }
+    }
+    tokenizers_free_encode_results(results, count); // Frees the token ids of the results, not the array
+    free(results);
+
+    if (result == 0 && prepare_input_tensors(&tokenized, input_ids_tensor, attention_mask_tensor) != 0) {
+        result = -1;
+    }
+    if (tokenized.input_ids && tokenized.token_type_ids && tokenized.attention_mask) {
+        free_tokenized_inputs(&tokenized);
+    } else {
+        free(tokenized.input_ids);
+        free(tokenized.token_type_ids);
+        free(tokenized.attention_mask);
+    }
+    if (result != 0) {
+        fprintf(stderr, "Error: Failed to prepare a batch of passages\n");
+        *input_ids_tensor = NULL;
+        *attention_mask_tensor = NULL;
+        return -1;
+    }
+    return num_truncated;
+}
+
+/**
+ * Scores candidate passages against one query and returns the best ones.
+ * Every row is the query in the label slot next to a passage, the relevance of a passage is the
+ * sigmoid of the logit of its row. The query prompt is tokenized once; only passages are tokenized
+ * per batch.
+ *
+ * Batches run in waves of one batch per OpenMP thread. With early_stop set, no further wave starts
+ * once top_k passages reached min_score: the result is then top_k good enough passages among the
+ * ones scored so far rather than the best passages of the whole input.
+ *
+ * @param session The ONNX Runtime session of the model.
+ * @param tokenizer The tokenizer of the model.
+ * @param prompt_first Whether the model puts the prompt before the text.
+ * @param query The query.
+ * @param passages The candidate passages.
+ * @param num_passages The number of passages.
+ * @param config The rerank settings.
+ * @param results Output array of at least config->top_k results, best first.
+ * @param num_results Output number of results (passages below min_score are left out).
+ * @param stats Pointer to the RerankStats structure to fill.
+ * @return 0 if successful, -1 if the query does not fit into MAX_LENGTH or memory could not be allocated.
+ */
+int rerank_passages(OrtSession* session, TokenizerHandle tokenizer, bool prompt_first, const char* query,
+                    const char* const* passages, size_t num_passages, const RerankConfig* config,
+                    RerankResult* results, size_t* num_results, RerankStats* stats) {
+    double start_time = omp_get_wtime();
+    memset(stats, 0, sizeof(*stats));
+    stats->num_passages = num_passages;
+    *num_results = 0;
+
+    QueryTokens query_tokens;
+    if (tokenize_query(tokenizer, query, &query_tokens) != 0) {
+        return -1;
+    }
+    if (query_tokens.len >= MAX_LENGTH) {
+        fprintf(stderr, "Error: The query takes %zu tokens, no room is left for passages within %d tokens\n",
+                query_tokens.len, MAX_LENGTH);
+        free(query_tokens.ids);
+        return -1;
+    }
+
+    size_t num_batches = (num_passages + BATCH_SIZE - 1) / BATCH_SIZE;
+    size_t wave_size = num_batches;
+    if (config->early_stop) {
+        wave_size = (size_t)omp_get_max_threads();
+        if (wave_size == 0) wave_size = 1;
+    }
+    RerankResult* candidates = (RerankResult*)malloc((num_passages ? num_passages : 1) * sizeof(RerankResult));
+    OrtValue** input_ids_tensors = (OrtValue**)calloc(wave_size ? wave_size : 1, sizeof(OrtValue*));
+    OrtValue** attention_mask_tensors = (OrtValue**)calloc(wave_size ? wave_size : 1, sizeof(OrtValue*));
+    OrtValue** output_tensors = (OrtValue**)calloc(wave_size ? wave_size : 1, sizeof(OrtValue*));
+    int result = 0;
+    if (!candidates || !input_ids_tensors || !attention_mask_tensors || !output_tensors) {
+        fprintf(stderr, "Error: Memory allocation for rerank failed\n");
+        result = -1;
+        goto cleanup;
+    }
+
+    size_t num_candidates = 0;
+    for (size_t first = 0; first < num_batches; first += wave_size) {
+        size_t count = (first + wave_size > num_batches) ? (num_batches - first) : wave_size;
+        size_t num_truncated = 0;
+
+        #pragma omp parallel for schedule(dynamic) reduction(+:num_truncated)
+        for (size_t b = 0; b < count; ++b) {
+            size_t start = (first + b) * BATCH_SIZE;
+            size_t batch_size = (start + BATCH_SIZE > num_passages) ? (num_passages - start) : BATCH_SIZE;
+            int truncated = prepare_rerank_batch(tokenizer, &query_tokens, prompt_first, &passages[start],
+                                                 batch_size, &input_ids_tensors[b], &attention_mask_tensors[b]);
+            if (truncated > 0) num_truncated += (size_t)truncated;
+        }
+        stats->num_truncated += num_truncated;
+
+        parallel_inference(session, input_ids_tensors, attention_mask_tensors, output_tensors, count);
+
+        for (size_t b = 0; b < count; ++b) {
+            float* logits = NULL;
+            int64_t rows = 0, cols = 0;
+            size_t start = (first + b) * BATCH_SIZE;
+            if (get_output_logits(output_tensors[b], g_ort, &logits, &rows, &cols) == 0 && cols > 0) {
+                for (size_t i = 0; i < (size_t)rows && start + i < num_passages; ++i) {
+                    if (isnan(logits[i * cols])) {
+                        continue; // The passage could not be run (see run_inference_adaptive)
+                    }
+                    float score = sigmoid(logits[i * cols]);
+                    stats->num_scored++;
+                    if (score >= config->min_score) {
+                        candidates[num_candidates].index = start + i;
+                        candidates[num_candidates].score = score;
+                        num_candidates++;
+                    }
+                }
+            }
+            if (output_tensors[b]) g_ort->ReleaseValue(output_tensors[b]);
+            if (input_ids_tensors[b]) g_ort->ReleaseValue(input_ids_tensors[b]);
+            if (attention_mask_tensors[b]) g_ort->ReleaseValue(attention_mask_tensors[b]);
+            output_tensors[b] = input_ids_tensors[b] = attention_mask_tensors[b] = NULL;
+        }
+
+        if (config->early_stop && num_candidates >= config->top_k) {
+            break;
+        }
+    }
+
+    qsort(candidates, num_candidates, sizeof(RerankResult), compare_results);
+    *num_results = num_candidates < config->top_k ? num_candidates : config->top_k;
+    memcpy(results, candidates, *num_results * sizeof(RerankResult));
+
+cleanup:
+    free(candidates);
+    free(input_ids_tensors);
+    free(attention_mask_tensors);
+    free(output_tensors);
+    free(query_tokens.ids);
+    stats->time = omp_get_wtime() - start_time;
+    return result;
+}
+
+/**
+ * Prints the ranked passages, best first.
+ *
+ * @param results The ranked passages.
+ * @param num_results The number of ranked passages.
+ */
+void print_rerank_results(const RerankResult* results, size_t num_results) {
+    for (size_t i = 0; i < num_results; ++i) {
+        printf("Rank %zu: passage %zu, Score: %.6f\n", i + 1, results[i].index, results[i].score);
+    }
+}
+
+/**
+ * Prints the statistics of a rerank.
+ *
+ * @param stats The statistics to print.
+ */
+void print_rerank_stats(const RerankStats* stats) {
+    double time = stats->time > 0 ? stats->time : 1e-9;
+    printf("Reranked %zu passages: scored %zu (%zu truncated) in %f seconds, %.1f passages/s\n",
+           stats->num_passages, stats->num_scored, stats->num_truncated, stats->time,
+           stats->num_scored / time);
+}
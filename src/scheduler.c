@@ -0,0 +1,338 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <omp.h>
+#include <pthread.h>
+
+#include "scheduler.h"
+#include "parallel_processor.h"
+#include "postprocessor.h"
+#include "model.h"
+#include "configs.h"
+
+#define LATE_PRIORITY NUM_PRIORITY_CLASSES // Queue position of deferred batches, behind every priority class
+#define COST_SMOOTHING 0.2                 // Weight of the latest batch in the per-model cost estimate
+
+typedef enum {
+    BATCH_PENDING,
+    BATCH_DONE,
+    BATCH_FAILED,
+    BATCH_SHED
+} BatchState;
+
+/**
+ * One batch of texts of a request waiting in (or taken from) the scheduler queue.
+ */
+typedef struct {
+    size_t request;         /**< Index of the request. */
+    size_t start;           /**< Index of the first text of the batch in the request. */
+    size_t count;           /**< Number of texts in the batch. */
+    size_t model_index;     /**< Index of the model in the cost table. */
+    int priority;           /**< Queue priority (the request class, LATE_PRIORITY once deferred). */
+    double deadline;        /**< Absolute deadline (omp_get_wtime), 0 if none. */
+    double arrival;         /**< Time the batch was queued. */
+    double start_time;      /**< Time the batch was taken from the queue. */
+    double finish_time;     /**< Time the batch was finished. */
+    BatchState state;       /**< State of the batch. */
+    char* output;           /**< Predictions of the batch, printed after the run in request order. */
+    size_t output_size;     /**< Size of the output. */
+} ScheduledBatch;
+
+/**
+ * Shared state of the worker threads.
+ */
+typedef struct {
+    ScheduledBatch* batches;
+    size_t* heap;                   /**< Binary heap of pending batch indices, most urgent first. */
+    size_t heap_size;
+    HostedModel** cost_models;      /**< Distinct models of the run. */
+    double* cost_per_text;          /**< Estimated seconds per text of every model (0 until measured). */
+    size_t num_cost_models;
+    pthread_mutex_t mutex;
+} SchedulerQueue;
+
+/**
+ * Orders batches by priority class, then earliest deadline (batches without one last), then arrival.
+ */
+static bool more_urgent(const ScheduledBatch* a, const ScheduledBatch* b, size_t a_index, size_t b_index) {
+    if (a->priority != b->priority) {
+        return a->priority < b->priority;
+    }
+    if (a->deadline != b->deadline) {
+        if (a->deadline == 0 || b->deadline == 0) {
+            return b->deadline == 0;
+        }
+        return a->deadline < b->deadline;
+    }
+    if (a->arrival != b->arrival) {
+        return a->arrival < b->arrival;
+    }
+    return a_index < b_index;
+}
+
+static void heap_push(SchedulerQueue* queue, size_t index) {
+    size_t pos = queue->heap_size++;
+    queue->heap[pos] = index;
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+        size_t a = queue->heap[pos], b = queue->heap[parent];
+        if (!more_urgent(&queue->batches[a], &queue->batches[b], a, b)) {
+            break;
+        }
+        queue->heap[pos] = b;
+        queue->heap[parent] = a;
+        pos = parent;
+    }
+}
+
+static size_t heap_pop(SchedulerQueue* queue) {
+    size_t top = queue->heap[0];
+    queue->heap[0] = queue->heap[--queue->heap_size];
+    size_t pos = 0;
+    for (;;) {
+        size_t best = pos;
+        for (size_t child = 2 * pos + 1; child <= 2 * pos + 2 && child < queue->heap_size; ++child) {
+            size_t c = queue->heap[child], b = queue->heap[best];
+            if (more_urgent(&queue->batches[c], &queue->batches[b], c, b)) {
+                best = child;
+            }
+        }
+        if (best == pos) {
+            break;
+        }
+        size_t tmp = queue->heap[pos];
+        queue->heap[pos] = queue->heap[best];
+        queue->heap[best] = tmp;
+        pos = best;
+    }
+    return top;
+}
+
+/**
+ * Takes the most urgent batch that can still meet its deadline from the queue.
+ * Batches that can not meet it any more are shed or moved behind all other work, depending on their request.
+ *
+ * @return The index of the batch, or (size_t)-1 if the queue is empty.
+ */
+static size_t next_batch(SchedulerQueue* queue, const ClassificationRequest* requests, PriorityClassStats* classes) {
+    size_t index = (size_t)-1;
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->heap_size > 0) {
+        size_t candidate = heap_pop(queue);
+        ScheduledBatch* batch = &queue->batches[candidate];
+        const ClassificationRequest* request = &requests[batch->request];
+        double now = omp_get_wtime();
+        double estimate = queue->cost_per_text[batch->model_index] * (double)batch->count;
+        if (batch->deadline > 0 && now + estimate > batch->deadline) {
+            if (request->shed_late) {
+                batch->state = BATCH_SHED;
+                batch->start_time = batch->finish_time = now;
+                classes[request->priority].shed_texts += batch->count;
+                continue;
+            }
+            batch->deadline = 0;
+            batch->priority = LATE_PRIORITY;
+            classes[request->priority].deferred_batches++;
+            heap_push(queue, candidate);
+            continue;
+        }
+        batch->start_time = now;
+        index = candidate;
+        break;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return index;
+}
+
+/**
+ * Preprocesses, runs and postprocesses one batch and keeps its predictions in the batch output.
+ */
+static void run_batch(SchedulerQueue* queue, ScheduledBatch* batch, const ClassificationRequest* request) {
+    HostedModel* model = queue->cost_models[batch->model_index];
+    OrtValue* output_tensor = run_request_batch(model->session, model->tokenizer, model->prompt_first,
+                                                request, batch->start, batch->count);
+
+    FILE* stream = open_memstream(&batch->output, &batch->output_size);
+    batch->state = BATCH_FAILED;
+    if (stream && write_batch_predictions(stream, output_tensor, request, batch->start, batch->count, 0) == 0) {
+        batch->state = BATCH_DONE;
+    }
+    if (stream) fclose(stream);
+    if (output_tensor) g_ort->ReleaseValue(output_tensor);
+    batch->finish_time = omp_get_wtime();
+
+    // Update the cost estimate of the model used for deadline checks
+    double cost = (batch->finish_time - batch->start_time) / (double)batch->count;
+    pthread_mutex_lock(&queue->mutex);
+    double* estimate = &queue->cost_per_text[batch->model_index];
+    *estimate = (*estimate == 0) ? cost : (1.0 - COST_SMOOTHING) * *estimate + COST_SMOOTHING * cost;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+/**
+ * Classifies the texts of all requests with batches formed from the most urgent work first.
+ * Batches are ordered by the priority class of their request, then by the earliest deadline (EDF).
+ * A batch that can no longer meet its deadline (judged by the measured cost per text of its model)
+ * is shed or deferred behind all other work, as set by the request. The predictions are printed
+ * per request in text order after all batches are finished.
+ *
+ * @param requests The requests to classify, all of them arrive at the start of the run.
+ * @param num_requests The number of requests.
+ * @param models The model of every request (NULL for requests routed to an unknown model, they are skipped).
+ * @param stats Pointer to the SchedulerStats structure to fill.
+ * @return 0 if successful, -1 if memory could not be allocated or some texts failed.
+ */
+int run_scheduled_requests(const ClassificationRequest* requests, size_t num_requests, HostedModel* const* models,
+                           SchedulerStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    size_t num_batches = 0;
+    for (size_t r = 0; r < num_requests; ++r) {
+        num_batches += (requests[r].num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+    }
+
+    SchedulerQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.batches = (ScheduledBatch*)calloc(num_batches ? num_batches : 1, sizeof(ScheduledBatch));
+    queue.heap = (size_t*)malloc((num_batches ? num_batches : 1) * sizeof(size_t));
+    queue.cost_models = (HostedModel**)calloc(num_requests ? num_requests : 1, sizeof(HostedModel*));
+    queue.cost_per_text = (double*)calloc(num_requests ? num_requests : 1, sizeof(double));
+    if (!queue.batches || !queue.heap || !queue.cost_models || !queue.cost_per_text) {
+        fprintf(stderr, "Error: Memory allocation for the scheduler failed\n");
+        free(queue.batches);
+        free(queue.heap);
+        free(queue.cost_models);
+        free(queue.cost_per_text);
+        return -1;
+    }
+    pthread_mutex_init(&queue.mutex, NULL);
+
+    // Queue every batch of every request
+    double arrival = omp_get_wtime();
+    size_t b = 0;
+    int result = 0;
+    for (size_t r = 0; r < num_requests; ++r) {
+        const ClassificationRequest* request = &requests[r];
+        PriorityClassStats* class_stats = &stats->classes[request->priority];
+        class_stats->num_requests++;
+        class_stats->num_texts += request->num_texts;
+        if (models[r] == NULL) {
+            result = -1;
+            continue;
+        }
+
+        size_t model_index = 0;
+        while (model_index < queue.num_cost_models && queue.cost_models[model_index] != models[r]) {
+            model_index++;
+        }
+        if (model_index == queue.num_cost_models) {
+            queue.cost_models[queue.num_cost_models++] = models[r];
+        }
+
+        for (size_t start = 0; start < request->num_texts; start += BATCH_SIZE) {
+            ScheduledBatch* batch = &queue.batches[b];
+            batch->request = r;
+            batch->start = start;
+            batch->count = (start + BATCH_SIZE > request->num_texts) ? (request->num_texts - start) : BATCH_SIZE;
+            batch->model_index = model_index;
+            batch->priority = request->priority;
+            batch->deadline = request->deadline_ms > 0 ? arrival + request->deadline_ms / 1000.0 : 0;
+            batch->arrival = arrival;
+            batch->state = BATCH_PENDING;
+            heap_push(&queue, b);
+            b++;
+        }
+    }
+    num_batches = b;
+
+    // Workers take the most urgent batch whenever they are free
+    #pragma omp parallel
+    {
+        size_t index;
+        while ((index = next_batch(&queue, requests, stats->classes)) != (size_t)-1) {
+            run_batch(&queue, &queue.batches[index], &requests[queue.batches[index].request]);
+        }
+    }
+    stats->total_time = omp_get_wtime() - arrival;
+
+    // Statistics per priority class
+    double* finish_times = (double*)calloc(num_requests ? num_requests : 1, sizeof(double));
+    bool* shed = (bool*)calloc(num_requests ? num_requests : 1, sizeof(bool));
+    for (size_t i = 0; i < num_batches; ++i) {
+        ScheduledBatch* batch = &queue.batches[i];
+        PriorityClassStats* class_stats = &stats->classes[requests[batch->request].priority];
+        if (batch->state != BATCH_SHED) {
+            double delay = batch->start_time - batch->arrival;
+            class_stats->num_batches++;
+            class_stats->total_queue_delay += delay;
+            if (delay > class_stats->max_queue_delay) {
+                class_stats->max_queue_delay = delay;
+            }
+        }
+        if (finish_times && shed) {
+            if (batch->finish_time > finish_times[batch->request]) {
+                finish_times[batch->request] = batch->finish_time;
+            }
+            shed[batch->request] |= batch->state == BATCH_SHED;
+        }
+    }
+    for (size_t r = 0; finish_times && shed && r < num_requests; ++r) {
+        double deadline = arrival + requests[r].deadline_ms / 1000.0;
+        if (models[r] && requests[r].deadline_ms > 0 && (shed[r] || finish_times[r] > deadline)) {
+            stats->classes[requests[r].priority].missed_deadlines++;
+        }
+    }
+    free(finish_times);
+    free(shed);
+
+    // Results per request in text order
+    b = 0;
+    for (size_t r = 0; r < num_requests; ++r) {
+        if (models[r] == NULL) {
+            fprintf(stderr, "Error: Request %zu is routed to unknown model %s.\n", r, requests[r].model_name);
+            continue;
+        }
+        printf("Request %zu (model %s, priority %s):\n", r, models[r]->name, priority_class_name(requests[r].priority));
+        for (; b < num_batches && queue.batches[b].request == r; ++b) {
+            ScheduledBatch* batch = &queue.batches[b];
+            for (size_t i = batch->start; batch->state != BATCH_DONE && i < batch->start + batch->count; ++i) {
+                printf("Text_%zu: %s:\n  Text_%zu %s\n\n", i, requests[r].texts[i], i,
+                       batch->state == BATCH_SHED ? "shed (deadline missed)" : "failed");
+            }
+            if (batch->state == BATCH_DONE) {
+                fwrite(batch->output, 1, batch->output_size, stdout);
+            } else if (batch->state == BATCH_FAILED) {
+                result = -1;
+            }
+            free(batch->output);
+        }
+    }
+
+    pthread_mutex_destroy(&queue.mutex);
+    free(queue.batches);
+    free(queue.heap);
+    free(queue.cost_models);
+    free(queue.cost_per_text);
+    return result;
+}
+
+/**
+ * Prints the queueing delay, missed deadlines, deferred batches and shed texts of every priority class.
+ *
+ * @param stats The statistics of the run.
+ */
+void print_scheduler_stats(const SchedulerStats* stats) {
+    printf("Scheduler: %f seconds\n", stats->total_time);
+    for (int c = 0; c < NUM_PRIORITY_CLASSES; ++c) {
+        const PriorityClassStats* class_stats = &stats->classes[c];
+        if (class_stats->num_requests == 0) {
+            continue;
+        }
+        double mean_delay = class_stats->num_batches ? class_stats->total_queue_delay / class_stats->num_batches : 0.0;
+        printf("  %-11s requests: %zu, texts: %zu, queueing delay mean: %f s, max: %f s, "
+               "missed deadlines: %zu, deferred batches: %zu, shed texts: %zu\n",
+               priority_class_name((RequestPriority)c), class_stats->num_requests, class_stats->num_texts,
+               mean_delay, class_stats->max_queue_delay, class_stats->missed_deadlines,
+               class_stats->deferred_batches, class_stats->shed_texts);
+    }
+}
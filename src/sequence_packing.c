@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "sequence_packing.h"
+#include "parallel_processor.h"
+#include "postprocessor.h"
+#include "preprocessor.h"
+#include "tokenizer.h"
+#include "model.h"
+#include "stage_counters.h"
+#include "memory_tracker.h"
+#include "startup.h"
+#include "configs.h"
+
+#define NUM_PACKED_INPUTS 5
+
+// Inputs of a model exported with convert_to_onnx.py --packed
+static const char* const packed_input_names[NUM_PACKED_INPUTS] = {
+    "input_ids",    // [rows, row_length] prompts packed one after another, 0 after the last one
+    "segment_ids",  // [rows, row_length] 1, 2, ... for the prompts of a row, 0 for padding (tokens only attend within their segment)
+    "position_ids", // [rows, row_length] positions restarting at 0 for every prompt
+    "token_index",  // [segments, segment_length] flat index (row * row_length + column) of the tokens of every prompt
+    "token_mask"    // [segments, segment_length] 1 for the tokens of the prompt, 0 for padding
+};
+
+/**
+ * Structure to store the tokens of every prompt of a request, unpadded.
+ */
+typedef struct {
+    int** token_ids;        /**< Token ids of every prompt. */
+    size_t* lengths;        /**< Tokens of every prompt (at most MAX_LENGTH). */
+    size_t bytes;           /**< Bytes of the token arrays, as counted by the memory tracking. */
+} PromptTokens;
+
+/**
+ * Structure to store where a prompt is placed in its packed batch.
+ */
+typedef struct {
+    size_t row;             /**< Row of the batch. */
+    size_t offset;          /**< First column of the prompt in the row. */
+    size_t segment;         /**< Segment id of the prompt in the row, starting at 1. */
+} SegmentPlace;
+
+/**
+ * Structure to store a packed batch: consecutive texts of the request placed in up to BATCH_SIZE rows.
+ */
+typedef struct {
+    size_t start;           /**< Index of the first text of the batch in the request. */
+    size_t count;           /**< Number of texts in the batch. */
+    size_t num_rows;        /**< Rows of the batch. */
+    size_t row_length;      /**< Columns of the rows (longest row, padded to its bucket). */
+    size_t segment_length;  /**< Tokens of the longest prompt of the batch. */
+} PackedBatch;
+
+/**
+ * Tokenizes the prompts of a request in chunks of BATCH_SIZE texts and keeps their tokens without padding.
+ * Also counts the token slots the chunks take when they are run unpacked.
+ *
+ * @return 0 if successful, -1 if an error occurs. The caller frees tokens with free_prompt_tokens in both cases.
+ */
+static int tokenize_prompts(TokenizerHandle tokenizer_handler, bool prompt_first, const ClassificationRequest* request,
+                            PromptTokens* tokens, size_t* padded_slots) {
+    size_t num_texts = request->num_texts;
+    size_t num_chunks = (num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+    tokens->token_ids = (int**)calloc(num_texts > 0 ? num_texts : 1, sizeof(int*));
+    tokens->lengths = (size_t*)calloc(num_texts > 0 ? num_texts : 1, sizeof(size_t));
+    tokens->bytes = 0;
+    if (!tokens->token_ids || !tokens->lengths) {
+        fprintf(stderr, "Error: Memory allocation for packed prompts failed\n");
+        return -1;
+    }
+
+    int failed = 0;
+    size_t slots = 0;
+    size_t bytes = 0;
+    #pragma omp parallel for schedule(dynamic) reduction(|:failed) reduction(+:slots, bytes)
+    for (size_t c = 0; c < num_chunks; ++c) {
+        size_t start = c * BATCH_SIZE;
+        size_t count = num_texts - start < BATCH_SIZE ? num_texts - start : BATCH_SIZE;
+        const char*** chunk_labels = (const char***)(request->same_labels ? (void*)request->labels
+                                                                          : (void*)&request->labels[start]);
+        StageSample sample;
+        stage_begin(&sample);
+        const char** prepared_inputs = prepare_inputs((const char**)&request->texts[start], chunk_labels, count,
+                                                      &request->num_labels[start], request->same_labels, prompt_first);
+        stage_end(STAGE_PROMPT, &sample);
+        if (prepared_inputs == NULL) {
+            failed = 1;
+            continue;
+        }
+        stage_begin(&sample);
+        TokenizedInputs tokenized = tokenize_inputs(tokenizer_handler, prepared_inputs, count, MAX_LENGTH);
+        stage_end(STAGE_TOKENIZE, &sample);
+        slots += count * tokenized.seq_length;
+
+        for (size_t i = 0; i < count; ++i) {
+            size_t length = 0;
+            while (length < tokenized.seq_length && tokenized.attention_mask[i][length]) {
+                length++;
+            }
+            int* token_ids = (int*)malloc((length > 0 ? length : 1) * sizeof(int));
+            if (!token_ids) {
+                failed = 1;
+                continue;
+            }
+            memcpy(token_ids, tokenized.input_ids[i], length * sizeof(int));
+            tokens->token_ids[start + i] = token_ids;
+            tokens->lengths[start + i] = length;
+            bytes += length * sizeof(int);
+        }
+        free_prepared_inputs((char**)prepared_inputs, count);
+        free_tokenized_inputs(&tokenized);
+    }
+    tokens->bytes = bytes;
+    track_allocation(MEMORY_TOKENS, bytes);
+    *padded_slots = slots;
+    if (failed) {
+        fprintf(stderr, "Error: Failed to tokenize the prompts to pack\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void free_prompt_tokens(PromptTokens* tokens, size_t num_texts) {
+    track_release(MEMORY_TOKENS, tokens->bytes);
+    for (size_t i = 0; tokens->token_ids && i < num_texts; ++i) {
+        free(tokens->token_ids[i]);
+    }
+    free(tokens->token_ids);
+    free(tokens->lengths);
+}
+
+/**
+ * Closes the batch being packed and starts the next one at text next_start.
+ */
+static void close_packed_batch(PackedBatch* batches, size_t* num_batches, size_t next_start,
+                               const size_t* row_fill, size_t num_rows, size_t segment_length) {
+    PackedBatch* batch = &batches[*num_batches];
+    size_t longest_row = 0;
+    for (size_t r = 0; r < num_rows; ++r) {
+        if (row_fill[r] > longest_row) {
+            longest_row = row_fill[r];
+        }
+    }
+    batch->count = next_start - batch->start;
+    batch->num_rows = num_rows;
+    batch->row_length = bucket_sequence_length(longest_row > 0 ? longest_row : 1, MAX_LENGTH);
+    batch->segment_length = segment_length > 0 ? segment_length : 1;
+    (*num_batches)++;
+    batches[*num_batches].start = next_start;
+}
+
+/**
+ * Packs the prompts into batches in text order. Every prompt goes to the first row of the current batch
+ * with room for it, a new row is opened if none has room, and the batch is closed once it has BATCH_SIZE
+ * full rows. Prompts longer than row_length run alone in a batch of one row as long as the prompt.
+ * Predictions are thus written per batch in input order without reordering the logits.
+ *
+ * @param batches Output array of at least num_texts + 1 batches.
+ * @param places Output array of num_texts places.
+ * @return The number of batches.
+ */
+static size_t pack_prompts(const PromptTokens* tokens, size_t num_texts, size_t row_length,
+                           PackedBatch* batches, SegmentPlace* places) {
+    size_t row_fill[BATCH_SIZE] = { 0 };
+    size_t row_segments[BATCH_SIZE] = { 0 };
+    size_t num_rows = 0;
+    size_t segment_length = 0;
+    size_t num_batches = 0;
+    batches[0].start = 0;
+    for (size_t i = 0; i < num_texts; ++i) {
+        size_t length = tokens->lengths[i];
+        if (length > row_length) {
+            if (num_rows > 0) {
+                close_packed_batch(batches, &num_batches, i, row_fill, num_rows, segment_length);
+            }
+            SegmentPlace place = { 0, 0, 1 };
+            places[i] = place;
+            close_packed_batch(batches, &num_batches, i + 1, &length, 1, length);
+            num_rows = 0;
+            segment_length = 0;
+            continue;
+        }
+        size_t row = 0;
+        while (row < num_rows && row_fill[row] + length > row_length) {
+            row++;
+        }
+        if (row == BATCH_SIZE) {
+            close_packed_batch(batches, &num_batches, i, row_fill, num_rows, segment_length);
+            num_rows = 0;
+            segment_length = 0;
+            row = 0;
+        }
+        if (row == num_rows) {
+            row_fill[row] = 0;
+            row_segments[row] = 0;
+            num_rows++;
+        }
+        SegmentPlace place = { row, row_fill[row], ++row_segments[row] };
+        places[i] = place;
+        row_fill[row] += length;
+        if (length > segment_length) {
+            segment_length = length;
+        }
+    }
+    if (num_rows > 0) {
+        close_packed_batch(batches, &num_batches, num_texts, row_fill, num_rows, segment_length);
+    }
+    return num_batches;
+}
+
+/**
+ * Builds the packed input tensors of a batch and runs it.
+ *
+ * @return The logits tensor of the batch, one row per text in text order, or NULL if an error occurs.
+ */
+static OrtValue* run_packed_batch(OrtSession* session, const PromptTokens* tokens, const SegmentPlace* places,
+                                  const PackedBatch* batch) {
+    size_t row_length = batch->row_length;
+    size_t segment_length = batch->segment_length;
+    OrtValue* tensors[NUM_PACKED_INPUTS] = { NULL };
+    int64_t* data[NUM_PACKED_INPUTS] = { NULL };
+    OrtValue* output_tensor = NULL;
+    memory_batch_begin();
+    memory_batch_shape(batch->num_rows, row_length);
+    StageSample sample;
+    stage_begin(&sample);
+    int created = 1;
+    for (size_t k = 0; k < NUM_PACKED_INPUTS; ++k) {
+        size_t rows = k < 3 ? batch->num_rows : batch->count;
+        size_t cols = k < 3 ? row_length : segment_length;
+        tensors[k] = create_int64_tensor_zeros(rows, cols, &data[k]);
+        created &= tensors[k] != NULL;
+    }
+    if (created) {
+        int64_t* input_ids = data[0];
+        int64_t* segment_ids = data[1];
+        int64_t* position_ids = data[2];
+        int64_t* token_index = data[3];
+        int64_t* token_mask = data[4];
+        for (size_t s = 0; s < batch->count; ++s) {
+            size_t text = batch->start + s;
+            const SegmentPlace* place = &places[text];
+            size_t base = place->row * row_length + place->offset;
+            for (size_t j = 0; j < tokens->lengths[text]; ++j) {
+                input_ids[base + j] = tokens->token_ids[text][j];
+                segment_ids[base + j] = (int64_t)place->segment;
+                position_ids[base + j] = (int64_t)j;
+                token_index[s * segment_length + j] = (int64_t)(base + j);
+                token_mask[s * segment_length + j] = 1;
+            }
+        }
+    }
+    stage_end(STAGE_TENSORS, &sample);
+
+    if (created) {
+        output_tensor = run_session(session, packed_input_names, tensors, NUM_PACKED_INPUTS);
+    }
+    for (size_t k = 0; k < NUM_PACKED_INPUTS; ++k) {
+        if (tensors[k]) g_ort->ReleaseValue(tensors[k]);
+    }
+    memory_batch_end();
+    if (output_tensor) {
+        note_first_result();
+    }
+    return output_tensor;
+}
+
+/**
+ * @brief Classifies all texts of a request with a model taking packed rows and prints the results.
+ *
+ * Short prompts waste most of a padded batch: a batch of BATCH_SIZE texts is as long as its longest prompt.
+ * Here the prompts are tokenized first and packed one after another into rows of row_length tokens. The
+ * segment ids of a row give the model a block-diagonal attention mask, so every prompt only attends to
+ * itself, and the position ids restart for every prompt. The model gathers the tokens of every prompt
+ * back into one row per text before its classification head, so the logits come out per text.
+ *
+ * @param session The ONNX Runtime session of a model exported with convert_to_onnx.py --packed.
+ * @param tokenizer_handler Handle for the tokenizer of the model.
+ * @param prompt_first Flag indicating if the prompt should be placed before the input text.
+ * @param request The request with texts, labels and classification type.
+ * @param row_length The tokens of a packed row, longer prompts run alone.
+ * @param stats Pointer to the PackingStats structure to fill.
+ * @return 0 if successful, -1 if an error occurs (texts of batches that could not be run are written as not classified).
+ */
+int classify_request_packed(OrtSession* session, TokenizerHandle tokenizer_handler, bool prompt_first,
+                            const ClassificationRequest* request, size_t row_length, PackingStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    size_t num_texts = request->num_texts;
+    stats->num_texts = num_texts;
+    PromptTokens tokens;
+    if (tokenize_prompts(tokenizer_handler, prompt_first, request, &tokens, &stats->padded_slots) != 0) {
+        free_prompt_tokens(&tokens, num_texts);
+        return -1;
+    }
+
+    PackedBatch* batches = (PackedBatch*)calloc(num_texts + 1, sizeof(PackedBatch));
+    SegmentPlace* places = (SegmentPlace*)calloc(num_texts > 0 ? num_texts : 1, sizeof(SegmentPlace));
+    OrtValue** output_tensors = (OrtValue**)calloc(num_texts > 0 ? num_texts : 1, sizeof(OrtValue*));
+    if (!batches || !places || !output_tensors) {
+        fprintf(stderr, "Error: Memory allocation for packed batches failed\n");
+        free(batches);
+        free(places);
+        free(output_tensors);
+        free_prompt_tokens(&tokens, num_texts);
+        return -1;
+    }
+    size_t num_batches = pack_prompts(&tokens, num_texts, row_length, batches, places);
+    stats->num_batches = num_batches;
+    for (size_t i = 0; i < num_texts; ++i) {
+        stats->tokens += tokens.lengths[i];
+    }
+    for (size_t b = 0; b < num_batches; ++b) {
+        stats->num_rows += batches[b].num_rows;
+        stats->packed_slots += batches[b].num_rows * batches[b].row_length;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t b = 0; b < num_batches; ++b) {
+        output_tensors[b] = run_packed_batch(session, &tokens, places, &batches[b]);
+    }
+
+    int result = 0;
+    const float failed = NAN;
+    for (size_t b = 0; b < num_batches; ++b) {
+        if (write_batch_predictions(stdout, output_tensors[b], request, batches[b].start, batches[b].count, 0) != 0) {
+            // Packed batches are not split and retried, their texts are written as not classified
+            fprintf(stderr, "Error: Packed batch of texts %zu-%zu could not be run\n",
+                    batches[b].start, batches[b].start + batches[b].count - 1);
+            for (size_t text = batches[b].start; text < batches[b].start + batches[b].count; ++text) {
+                const char* const* labels = (const char* const*)(request->same_labels ? request->labels[0]
+                                                                                      : request->labels[text]);
+                write_text_predictions(stdout, (int)text, request->texts[text], &failed, 1, labels,
+                                       request->num_labels[text], THRESHOLD, request->classification_type);
+            }
+            stats->failed_batches++;
+            result = -1;
+        }
+        if (output_tensors[b]) g_ort->ReleaseValue(output_tensors[b]);
+    }
+
+    free(batches);
+    free(places);
+    free(output_tensors);
+    free_prompt_tokens(&tokens, num_texts);
+    return result;
+}
+
+/**
+ * Prints the token utilization of the packed batches next to the one of the same texts run unpacked.
+ *
+ * @param stats The stats filled by classify_request_packed.
+ */
+void print_packing_stats(const PackingStats* stats) {
+    double packed = stats->packed_slots > 0 ? 100.0 * (double)stats->tokens / (double)stats->packed_slots : 0.0;
+    double padded = stats->padded_slots > 0 ? 100.0 * (double)stats->tokens / (double)stats->padded_slots : 0.0;
+    printf("Packing: %zu texts in %zu rows of %zu batches, %.1f%% token utilization (%.1f%% unpacked)",
+           stats->num_texts, stats->num_rows, stats->num_batches, packed, padded);
+    if (stats->failed_batches > 0) {
+        printf(", %zu batches failed", stats->failed_batches);
+    }
+    printf("\n");
+}
@@ -0,0 +1,743 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <omp.h>
+
+#include "shard_runner.h"
+#include "parallel_processor.h"
+#include "postprocessor.h"
+#include "model.h"
+#include "configs.h"
+
+/*
+ * Protocol between the coordinator and the workers (one TCP connection per worker, text headers):
+ *   worker      -> coordinator: "READY <pid> <host>\n"
+ *   coordinator -> worker:      "SHARD <id> <prompt_first> <first_text> <bytes>\n" followed by a request JSON object
+ *   worker      -> coordinator: "RESULT <id> <status> <seconds> <bytes>\n" followed by the printed predictions
+ *   coordinator -> worker:      "DONE\n" when all shards are finished
+ */
+
+#define SHARD_HEADER_SIZE 256 // Maximum length of a header line
+
+typedef enum {
+    SHARD_PENDING = 0,
+    SHARD_RUNNING = 1,
+    SHARD_DONE = 2
+} ShardState;
+
+/**
+ * Structure to store a slice of the texts of one request handed to a worker.
+ */
+typedef struct {
+    size_t request;         /**< Index of the request. */
+    size_t start;           /**< Index of the first text in the request. */
+    size_t count;           /**< Number of texts. */
+    ShardState state;       /**< Progress of the shard. */
+    size_t copies;          /**< Workers currently running the shard (more than one after a straggler re-issue). */
+    double sent_time;       /**< Time the first running copy was sent. */
+    bool failed;            /**< The worker reported an error for the shard. */
+    char* output;           /**< Predictions printed by the worker. */
+    size_t output_size;     /**< Length of the output. */
+} Shard;
+
+/**
+ * Structure to store the connection to one worker and its utilization.
+ */
+typedef struct {
+    int fd;                 /**< Socket, -1 after the worker left. */
+    char name[96];          /**< "<host>:<pid>" reported by the worker. */
+    bool ready;             /**< The worker sent READY. */
+    long shard;             /**< Shard the worker is running, -1 if idle. */
+    char* input;            /**< Received bytes not consumed yet. */
+    size_t input_size;      /**< Number of received bytes. */
+    size_t input_capacity;  /**< Capacity of the input buffer. */
+    size_t num_shards;      /**< Shards finished by the worker (including duplicates of re-issued shards). */
+    size_t num_texts;       /**< Texts classified by the worker. */
+    double busy_time;       /**< Seconds the worker spent classifying, as reported by it. */
+    double join_time;       /**< Time the worker connected. */
+    double leave_time;      /**< Time the worker left (0 while connected). */
+} WorkerConnection;
+
+/**
+ * Splits "host:port" and resolves it.
+ *
+ * @return The address list (free with freeaddrinfo), or NULL if the address is invalid.
+ */
+static struct addrinfo* resolve_address(const char* address, bool passive) {
+    const char* separator = strrchr(address, ':');
+    if (separator == NULL || separator == address || separator[1] == '\0') {
+        fprintf(stderr, "Error: Invalid address %s (expected host:port)\n", address);
+        return NULL;
+    }
+    char host[128];
+    snprintf(host, sizeof(host), "%.*s", (int)(separator - address), address);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    struct addrinfo* result = NULL;
+    int error = getaddrinfo(host, separator + 1, &hints, &result);
+    if (error != 0) {
+        fprintf(stderr, "Error: Failed to resolve %s: %s\n", address, gai_strerror(error));
+        return NULL;
+    }
+    return result;
+}
+
+/**
+ * Writes the whole buffer to a socket.
+ *
+ * @return 0 if successful, -1 if the connection is broken.
+ */
+static int send_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        size -= (size_t)sent;
+    }
+    return 0;
+}
+
+///// COORDINATOR /////
+
+/**
+ * Starts a local worker process: the same executable with --worker and the model options of the coordinator.
+ *
+ * @return The pid of the worker, or -1 if it could not be started.
+ */
+static pid_t spawn_local_worker(const char* address, int argc, char* argv[]) {
+    char** worker_argv = (char**)calloc(argc + 3, sizeof(char*));
+    if (!worker_argv) {
+        return -1;
+    }
+    int n = 0;
+    worker_argv[n++] = argv[0];
+    worker_argv[n++] = "--worker";
+    worker_argv[n++] = (char*)address;
+    for (int i = 3; i < argc; ++i) { // Skip the data path and prompt_first, the shards carry both
+        if (strcmp(argv[i], "--coordinate") == 0 || strcmp(argv[i], "--bind") == 0 || strcmp(argv[i], "--output") == 0) {
+            i++;
+            continue;
+        }
+        worker_argv[n++] = argv[i];
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(STDERR_FILENO, STDOUT_FILENO); // Keep the merged predictions of the coordinator apart from worker logs
+        execv("/proc/self/exe", worker_argv);
+        execvp(argv[0], worker_argv);
+        fprintf(stderr, "Error: Failed to start worker %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    free(worker_argv);
+    return pid;
+}
+
+/**
+ * Sends a shard to an idle worker.
+ *
+ * @return 0 if successful, -1 if the connection is broken or memory could not be allocated.
+ */
+static int send_shard(WorkerConnection* worker, Shard* shards, size_t index, const ClassificationRequest* requests,
+                      bool prompt_first) {
+    Shard* shard = &shards[index];
+    char* payload = request_slice_to_json(&requests[shard->request], shard->start, shard->count);
+    if (!payload) {
+        fprintf(stderr, "Error: Failed to serialize shard %zu\n", index);
+        return -1;
+    }
+    char header[SHARD_HEADER_SIZE];
+    size_t payload_size = strlen(payload);
+    int header_size = snprintf(header, sizeof(header), "SHARD %zu %d %zu %zu\n", index, prompt_first ? 1 : 0,
+                               shard->start, payload_size);
+    int result = send_all(worker->fd, header, (size_t)header_size);
+    if (result == 0) {
+        result = send_all(worker->fd, payload, payload_size);
+    }
+    free(payload);
+    if (result != 0) {
+        return -1;
+    }
+    if (shard->copies++ == 0) {
+        shard->sent_time = omp_get_wtime();
+    }
+    shard->state = SHARD_RUNNING;
+    worker->shard = (long)index;
+    return 0;
+}
+
+/**
+ * Picks the shard for an idle worker: the next pending one, otherwise a running shard that takes more than
+ * SHARD_STRAGGLER_FACTOR times the time expected from the finished shards (it is then run twice and the
+ * first result wins).
+ *
+ * @return The index of the shard, or -1 if there is nothing to run.
+ */
+static long pick_shard(const Shard* shards, size_t num_shards, double cost_per_text, bool* reissue) {
+    *reissue = false;
+    for (size_t i = 0; i < num_shards; ++i) {
+        if (shards[i].state == SHARD_PENDING) {
+            return (long)i;
+        }
+    }
+    if (cost_per_text <= 0) {
+        return -1;
+    }
+    double now = omp_get_wtime();
+    long slowest = -1;
+    double slowest_ratio = SHARD_STRAGGLER_FACTOR;
+    for (size_t i = 0; i < num_shards; ++i) {
+        if (shards[i].state != SHARD_RUNNING || shards[i].copies != 1) {
+            continue;
+        }
+        double ratio = (now - shards[i].sent_time) / (cost_per_text * (double)shards[i].count);
+        if (ratio > slowest_ratio) {
+            slowest_ratio = ratio;
+            slowest = (long)i;
+        }
+    }
+    *reissue = slowest >= 0;
+    return slowest;
+}
+
+/**
+ * Closes the connection to a worker and puts its shard back into the queue unless another copy is running.
+ */
+static void drop_worker(WorkerConnection* worker, Shard* shards) {
+    if (worker->shard >= 0) {
+        Shard* shard = &shards[worker->shard];
+        shard->copies--;
+        if (shard->state == SHARD_RUNNING && shard->copies == 0) {
+            shard->state = SHARD_PENDING;
+        }
+        worker->shard = -1;
+    }
+    if (worker->fd >= 0) {
+        close(worker->fd);
+        worker->fd = -1;
+        worker->leave_time = omp_get_wtime();
+        fprintf(stderr, "Warning: Worker %s left\n", worker->name);
+    }
+}
+
+/**
+ * Handles the complete messages in the input buffer of a worker.
+ *
+ * @return 0 if successful, -1 if the worker sent an invalid message.
+ */
+static int handle_worker_messages(WorkerConnection* worker, Shard* shards, size_t num_shards, size_t* num_done,
+                                  double* total_busy, size_t* total_texts) {
+    for (;;) {
+        char* newline = (char*)memchr(worker->input, '\n', worker->input_size);
+        if (newline == NULL) {
+            return worker->input_size < SHARD_HEADER_SIZE ? 0 : -1;
+        }
+        size_t header_size = (size_t)(newline - worker->input) + 1;
+        char header[SHARD_HEADER_SIZE];
+        if (header_size >= sizeof(header)) {
+            return -1;
+        }
+        memcpy(header, worker->input, header_size - 1);
+        header[header_size - 1] = '\0';
+
+        size_t consumed = header_size;
+        long pid = 0;
+        char host[64];
+        size_t index = 0, size = 0;
+        int status = 0;
+        double seconds = 0;
+        if (sscanf(header, "READY %ld %63s", &pid, host) == 2) {
+            snprintf(worker->name, sizeof(worker->name), "%s:%ld", host, pid);
+            worker->ready = true;
+            printf("Worker %s joined\n", worker->name);
+        } else if (sscanf(header, "RESULT %zu %d %lf %zu", &index, &status, &seconds, &size) == 4) {
+            if (index >= num_shards || (long)index != worker->shard) {
+                return -1;
+            }
+            if (worker->input_size < header_size + size) {
+                return 0; // Wait for the rest of the predictions
+            }
+            consumed += size;
+            Shard* shard = &shards[index];
+            shard->copies--;
+            worker->shard = -1;
+            worker->num_shards++;
+            worker->num_texts += shard->count;
+            worker->busy_time += seconds;
+            *total_busy += seconds;
+            *total_texts += shard->count;
+            if (shard->state != SHARD_DONE) {
+                // First result of the shard wins, results of re-issued copies are dropped
+                shard->state = SHARD_DONE;
+                shard->failed = status != 0;
+                shard->output = (char*)malloc(size + 1);
+                if (shard->output) {
+                    memcpy(shard->output, worker->input + header_size, size);
+                    shard->output[size] = '\0';
+                    shard->output_size = size;
+                } else {
+                    shard->failed = true;
+                }
+                (*num_done)++;
+            }
+        } else {
+            return -1;
+        }
+        memmove(worker->input, worker->input + consumed, worker->input_size - consumed);
+        worker->input_size -= consumed;
+    }
+}
+
+/**
+ * Reads what a worker sent.
+ *
+ * @return 0 if successful, -1 if the connection is closed or broken.
+ */
+static int receive_from_worker(WorkerConnection* worker) {
+    if (worker->input_capacity - worker->input_size < 65536) {
+        size_t capacity = worker->input_capacity ? worker->input_capacity * 2 : 131072;
+        char* grown = (char*)realloc(worker->input, capacity);
+        if (!grown) {
+            return -1;
+        }
+        worker->input = grown;
+        worker->input_capacity = capacity;
+    }
+    ssize_t received = recv(worker->fd, worker->input + worker->input_size,
+                            worker->input_capacity - worker->input_size, 0);
+    if (received < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if (received <= 0) {
+        return -1;
+    }
+    worker->input_size += (size_t)received;
+    return 0;
+}
+
+/**
+ * Opens the listening socket of the coordinator.
+ *
+ * @param bind_address "host:port" to listen on (port 0 picks a free port).
+ * @param address Buffer that will store the address workers connect to.
+ * @param address_size Size of the buffer.
+ * @return The socket, or -1 if an error occurs.
+ */
+static int open_listener(const char* bind_address, char* address, size_t address_size) {
+    struct addrinfo* addresses = resolve_address(bind_address, true);
+    if (!addresses) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* a = addresses; a != NULL && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(fd, a->ai_addr, a->ai_addrlen) != 0 || listen(fd, 64) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Failed to listen on %s: %s\n", bind_address, strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_storage bound;
+    socklen_t bound_size = sizeof(bound);
+    char host[128] = "127.0.0.1";
+    char port[16] = "0";
+    if (getsockname(fd, (struct sockaddr*)&bound, &bound_size) == 0) {
+        getnameinfo((struct sockaddr*)&bound, bound_size, host, sizeof(host), port, sizeof(port),
+                    NI_NUMERICHOST | NI_NUMERICSERV);
+    }
+    // Workers on this host reach a wildcard address through the loopback interface
+    if (strcmp(host, "0.0.0.0") == 0 || strcmp(host, "::") == 0) {
+        snprintf(host, sizeof(host), "127.0.0.1");
+    }
+    snprintf(address, address_size, "%s:%s", host, port);
+    return fd;
+}
+
+/**
+ * Prints the aggregate throughput and the utilization of every worker.
+ */
+static void print_shard_stats(const WorkerConnection* workers, size_t num_workers, size_t num_shards,
+                              size_t num_reissued, size_t num_texts, double start_time, double end_time) {
+    double wall_time = end_time - start_time;
+    printf("Sharded run: %zu texts in %zu shards, %f seconds, %.1f texts/s, %zu shards re-issued\n",
+           num_texts, num_shards, wall_time, wall_time > 0 ? (double)num_texts / wall_time : 0.0, num_reissued);
+    for (size_t w = 0; w < num_workers; ++w) {
+        const WorkerConnection* worker = &workers[w];
+        double joined = worker->join_time > start_time ? worker->join_time : start_time;
+        double left = worker->leave_time > 0 ? worker->leave_time : end_time;
+        double connected = left > joined ? left - joined : 0.0;
+        printf("  worker %s: %zu shards, %zu texts, %f seconds busy, %.1f%% utilization\n",
+               worker->name, worker->num_shards, worker->num_texts, worker->busy_time,
+               connected > 0 ? 100.0 * worker->busy_time / connected : 0.0);
+    }
+}
+
+/**
+ * Classifies the texts of all requests on worker processes and prints the merged predictions in input order.
+ * The requests are split into shards of SHARD_SIZE texts. Workers connect over TCP, either started locally
+ * by the coordinator or on other hosts with --worker host:port, and every idle worker gets the next shard,
+ * so faster workers take more shards. When the queue is empty, a shard that runs SHARD_STRAGGLER_FACTOR times
+ * longer than expected is also sent to an idle worker, and the shard of a worker that disconnects is queued again.
+ *
+ * @param requests The requests to classify.
+ * @param num_requests The number of requests.
+ * @param prompt_first Whether the label prompt is placed before the text (sent to the workers with each shard).
+ * @param bind_address "host:port" the coordinator listens on.
+ * @param num_local_workers Number of worker processes started on this host (0 to rely on remote workers).
+ * @param argc The number of command-line arguments of the coordinator.
+ * @param argv The command-line arguments of the coordinator (the model options are passed to local workers).
+ * @return 0 if successful, -1 if the coordinator failed or some shards failed.
+ */
+int run_shard_coordinator(const ClassificationRequest* requests, size_t num_requests, bool prompt_first,
+                          const char* bind_address, size_t num_local_workers, int argc, char* argv[]) {
+    size_t num_shards = 0;
+    for (size_t r = 0; r < num_requests; ++r) {
+        num_shards += (requests[r].num_texts + SHARD_SIZE - 1) / SHARD_SIZE;
+    }
+    Shard* shards = (Shard*)calloc(num_shards ? num_shards : 1, sizeof(Shard));
+    pid_t* children = (pid_t*)calloc(num_local_workers ? num_local_workers : 1, sizeof(pid_t));
+    if (!shards || !children) {
+        fprintf(stderr, "Error: Memory allocation for shards failed\n");
+        free(shards);
+        free(children);
+        return -1;
+    }
+    size_t s = 0;
+    for (size_t r = 0; r < num_requests; ++r) {
+        for (size_t start = 0; start < requests[r].num_texts; start += SHARD_SIZE) {
+            shards[s].request = r;
+            shards[s].start = start;
+            shards[s].count = requests[r].num_texts - start < SHARD_SIZE ? requests[r].num_texts - start : SHARD_SIZE;
+            s++;
+        }
+    }
+
+    char address[160];
+    int listen_fd = open_listener(bind_address, address, sizeof(address));
+    if (listen_fd < 0) {
+        free(shards);
+        free(children);
+        return -1;
+    }
+    printf("Coordinator listening on %s (%zu shards of up to %d texts)\n", address, num_shards, SHARD_SIZE);
+    fflush(stdout);
+
+    size_t num_children = 0;
+    for (size_t i = 0; i < num_local_workers; ++i) {
+        pid_t pid = spawn_local_worker(address, argc, argv);
+        if (pid > 0) {
+            children[num_children++] = pid;
+        } else {
+            fprintf(stderr, "Warning: Failed to start local worker %zu\n", i);
+        }
+    }
+
+    WorkerConnection* workers = NULL;
+    size_t num_workers = 0;
+    size_t num_done = 0, num_reissued = 0, total_texts = 0;
+    double total_busy = 0;
+    double start_time = omp_get_wtime();
+    double idle_since = start_time;
+    int result = 0;
+
+    while (num_done < num_shards) {
+        // Hand out work to idle workers
+        for (size_t w = 0; w < num_workers; ++w) {
+            WorkerConnection* worker = &workers[w];
+            if (worker->fd < 0 || !worker->ready || worker->shard >= 0) {
+                continue;
+            }
+            bool reissue = false;
+            double cost_per_text = total_texts ? total_busy / (double)total_texts : 0.0;
+            long index = pick_shard(shards, num_shards, cost_per_text, &reissue);
+            if (index < 0) {
+                break;
+            }
+            if (send_shard(worker, shards, (size_t)index, requests, prompt_first) != 0) {
+                drop_worker(worker, shards);
+                continue;
+            }
+            num_reissued += reissue ? 1 : 0;
+        }
+
+        // Wait for results and new workers
+        struct pollfd* fds = (struct pollfd*)calloc(num_workers + 1, sizeof(struct pollfd));
+        if (!fds) {
+            fprintf(stderr, "Error: Memory allocation for poll failed\n");
+            result = -1;
+            break;
+        }
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (size_t w = 0; w < num_workers; ++w) {
+            fds[w + 1].fd = workers[w].fd; // Negative descriptors are ignored by poll
+            fds[w + 1].events = POLLIN;
+        }
+        int ready = poll(fds, num_workers + 1, 100);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "Error: poll failed: %s\n", strerror(errno));
+            free(fds);
+            result = -1;
+            break;
+        }
+        for (size_t w = 0; ready > 0 && w < num_workers; ++w) {
+            WorkerConnection* worker = &workers[w];
+            if (worker->fd < 0 || !(fds[w + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            if (receive_from_worker(worker) != 0 ||
+                handle_worker_messages(worker, shards, num_shards, &num_done, &total_busy, &total_texts) != 0) {
+                drop_worker(worker, shards);
+            }
+        }
+        if (ready > 0 && (fds[0].revents & POLLIN)) {
+            int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            WorkerConnection* grown = fd >= 0 ? (WorkerConnection*)realloc(workers, (num_workers + 1) * sizeof(WorkerConnection)) : NULL;
+            if (grown) {
+                int nodelay = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+                workers = grown;
+                memset(&workers[num_workers], 0, sizeof(WorkerConnection));
+                workers[num_workers].fd = fd;
+                workers[num_workers].shard = -1;
+                workers[num_workers].join_time = omp_get_wtime();
+                snprintf(workers[num_workers].name, sizeof(workers[num_workers].name), "#%zu", num_workers);
+                num_workers++;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+        free(fds);
+
+        // Local workers that exit before joining would otherwise leave the coordinator waiting
+        for (size_t i = 0; i < num_children; ++i) {
+            if (children[i] > 0 && waitpid(children[i], NULL, WNOHANG) == children[i]) {
+                children[i] = 0;
+            }
+        }
+        bool connected = false;
+        for (size_t w = 0; w < num_workers && !connected; ++w) {
+            connected = workers[w].fd >= 0;
+        }
+        if (connected) {
+            idle_since = omp_get_wtime();
+        } else if (omp_get_wtime() - idle_since > SHARD_JOIN_TIMEOUT) {
+            fprintf(stderr, "Error: No worker connected to %s for %d seconds\n", address, SHARD_JOIN_TIMEOUT);
+            result = -1;
+            break;
+        }
+    }
+    double end_time = omp_get_wtime();
+
+    // Release the workers; local ones still running a dropped duplicate are stopped
+    for (size_t w = 0; w < num_workers; ++w) {
+        if (workers[w].fd >= 0) {
+            send_all(workers[w].fd, "DONE\n", 5);
+            close(workers[w].fd);
+            workers[w].fd = -1;
+        }
+    }
+    close(listen_fd);
+    for (size_t i = 0; i < num_children; ++i) {
+        if (children[i] > 0) {
+            kill(children[i], SIGTERM);
+            waitpid(children[i], NULL, 0);
+        }
+    }
+
+    // Merged predictions in input order
+    for (size_t i = 0; i < num_shards; ++i) {
+        if (shards[i].start == 0 && num_requests > 1) {
+            printf("Request %zu:\n", shards[i].request);
+        }
+        if (shards[i].state != SHARD_DONE || shards[i].failed) {
+            fprintf(stderr, "Error: Shard %zu (request %zu, texts %zu-%zu) failed\n", i, shards[i].request,
+                    shards[i].start, shards[i].start + shards[i].count - 1);
+            result = -1;
+        }
+        if (shards[i].output) {
+            fwrite(shards[i].output, 1, shards[i].output_size, stdout);
+        }
+    }
+    print_shard_stats(workers, num_workers, num_shards, num_reissued, total_texts, start_time, end_time);
+
+    for (size_t i = 0; i < num_shards; ++i) {
+        free(shards[i].output);
+    }
+    for (size_t w = 0; w < num_workers; ++w) {
+        free(workers[w].input);
+    }
+    free(workers);
+    free(shards);
+    free(children);
+    return result;
+}
+
+///// WORKER /////
+
+/**
+ * Classifies the texts of a shard and writes the predictions, numbered from first_text, to a stream.
+ *
+ * @return 0 if successful, -1 if some batches failed.
+ */
+static int classify_shard(HostedModel* model, bool prompt_first, const ClassificationRequest* request,
+                          size_t first_text, FILE* stream) {
+    size_t num_batches = (request->num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+    OrtValue** input_ids_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    OrtValue** attention_mask_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    OrtValue** output_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    if (!input_ids_tensors || !attention_mask_tensors || !output_tensors) {
+        fprintf(stderr, "Error: Memory allocation for batch tensors failed\n");
+        free(input_ids_tensors);
+        free(attention_mask_tensors);
+        free(output_tensors);
+        return -1;
+    }
+
+    parallel_preprocess(request->texts, request->labels, request->num_labels, request->num_texts,
+                        request->same_labels, prompt_first, model->tokenizer,
+                        input_ids_tensors, attention_mask_tensors);
+    parallel_inference(model->session, input_ids_tensors, attention_mask_tensors, output_tensors, num_batches);
+
+    int result = 0;
+    for (size_t b = 0; b < num_batches; ++b) {
+        size_t start = b * BATCH_SIZE;
+        size_t count = request->num_texts - start < BATCH_SIZE ? request->num_texts - start : BATCH_SIZE;
+        if (write_batch_predictions(stream, output_tensors[b], request, start, count, first_text) != 0) {
+            result = -1;
+        }
+        if (output_tensors[b]) g_ort->ReleaseValue(output_tensors[b]);
+        if (input_ids_tensors[b]) g_ort->ReleaseValue(input_ids_tensors[b]);
+        if (attention_mask_tensors[b]) g_ort->ReleaseValue(attention_mask_tensors[b]);
+    }
+    free(input_ids_tensors);
+    free(attention_mask_tensors);
+    free(output_tensors);
+    return result;
+}
+
+/**
+ * Runs a worker: connects to the coordinator, classifies the shards it receives with the model
+ * and sends back the predictions until the coordinator reports that all shards are done.
+ *
+ * @param coordinator_address "host:port" of the coordinator.
+ * @param model The model (session and tokenizer) to classify with.
+ * @return 0 if successful, -1 if the connection failed or was lost.
+ */
+int run_shard_worker(const char* coordinator_address, HostedModel* model) {
+    struct addrinfo* addresses = resolve_address(coordinator_address, false);
+    if (!addresses) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* a = addresses; a != NULL && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Failed to connect to coordinator %s: %s\n", coordinator_address, strerror(errno));
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    FILE* input = fdopen(dup(fd), "r");
+    if (!input) {
+        close(fd);
+        return -1;
+    }
+
+    char header[SHARD_HEADER_SIZE];
+    char host[64] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    int header_size = snprintf(header, sizeof(header), "READY %ld %s\n", (long)getpid(), host);
+    int result = send_all(fd, header, (size_t)header_size);
+
+    size_t processed = 0;
+    while (result == 0 && fgets(header, sizeof(header), input) != NULL) {
+        size_t index = 0, first_text = 0, size = 0;
+        int prompt_first = 0;
+        if (strcmp(header, "DONE\n") == 0) {
+            break;
+        }
+        if (sscanf(header, "SHARD %zu %d %zu %zu", &index, &prompt_first, &first_text, &size) != 4) {
+            fprintf(stderr, "Error: Invalid message from coordinator: %s", header);
+            result = -1;
+            break;
+        }
+        char* payload = (char*)malloc(size + 1);
+        if (!payload || fread(payload, 1, size, input) != size) {
+            fprintf(stderr, "Error: Failed to receive shard %zu\n", index);
+            free(payload);
+            result = -1;
+            break;
+        }
+        payload[size] = '\0';
+
+        double start_time = omp_get_wtime();
+        char* output = NULL;
+        size_t output_size = 0;
+        int status = -1;
+        ClassificationRequest* shard_requests = NULL;
+        size_t num_shard_requests = 0;
+        FILE* stream = open_memstream(&output, &output_size);
+        if (stream && parse_requests(payload, &shard_requests, &num_shard_requests) == 0 && num_shard_requests == 1) {
+            status = classify_shard(model, prompt_first != 0, &shard_requests[0], first_text, stream);
+        }
+        if (stream) fclose(stream);
+        for (size_t r = 0; r < num_shard_requests; ++r) {
+            free_request(&shard_requests[r]);
+        }
+        free(shard_requests);
+        free(payload);
+
+        header_size = snprintf(header, sizeof(header), "RESULT %zu %d %f %zu\n", index, status == 0 ? 0 : 1,
+                               omp_get_wtime() - start_time, output ? output_size : 0);
+        bool sent = send_all(fd, header, (size_t)header_size) == 0 && (!output || send_all(fd, output, output_size) == 0);
+        free(output);
+        if (!sent) {
+            // The coordinator finished without this result (e.g. a re-issued copy won)
+            fprintf(stderr, "Warning: Coordinator %s closed the connection\n", coordinator_address);
+            break;
+        }
+        processed++;
+    }
+    fclose(input);
+    close(fd);
+    printf("Worker finished %zu shards\n", processed);
+    return result;
+}
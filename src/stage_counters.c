@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <omp.h>
+
+#include "stage_counters.h"
+
+#define NUM_HARDWARE_COUNTERS 4 // COUNTER_CYCLES to COUNTER_BRANCH_MISSES, read as one group
+
+/**
+ * Structure to store the counter totals of one stage.
+ */
+typedef struct {
+    uint64_t values[NUM_STAGE_COUNTERS];
+    double time;
+    size_t calls;
+} StageTotals;
+
+/**
+ * Structure to store the counters of one thread. Counters that could not be opened have fd -1.
+ */
+typedef struct ThreadCounters {
+    int hardware_fds[NUM_HARDWARE_COUNTERS];   /**< Group led by the cycles counter. */
+    int task_clock_fd;                          /**< Leader of the software group. */
+    int context_switches_fd;
+    pid_t tid;
+    StageTotals totals[NUM_PIPELINE_STAGES];
+    struct ThreadCounters* next;
+} ThreadCounters;
+
+static bool counters_enabled = false;
+static _Thread_local ThreadCounters* thread_counters = NULL;
+static ThreadCounters* all_thread_counters = NULL;
+static pthread_mutex_t counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool hardware_unavailable_reported = false;
+
+static const char* stage_names[NUM_PIPELINE_STAGES] = { "prompt", "tokenize", "tensors", "inference", "postprocess" };
+
+static int open_counter(uint32_t type, uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    if (type == PERF_TYPE_HARDWARE) {
+        // User space only, allowed with perf_event_paranoid 2 (context switches and task clock are kernel events)
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+    }
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * Opens the counters of the calling thread on its first stage. Counters only count the thread that opened them.
+ */
+static ThreadCounters* get_thread_counters(void) {
+    if (thread_counters) {
+        return thread_counters;
+    }
+    ThreadCounters* counters = (ThreadCounters*)calloc(1, sizeof(ThreadCounters));
+    if (!counters) {
+        return NULL;
+    }
+    static const uint64_t hardware_events[NUM_HARDWARE_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int hardware_error = 0;
+    for (int i = 0; i < NUM_HARDWARE_COUNTERS; ++i) {
+        counters->hardware_fds[i] = -1;
+        if (i == 0 || counters->hardware_fds[0] >= 0) {
+            counters->hardware_fds[i] = open_counter(PERF_TYPE_HARDWARE, hardware_events[i],
+                                                     i == 0 ? -1 : counters->hardware_fds[0]);
+            if (counters->hardware_fds[i] < 0 && hardware_error == 0) {
+                hardware_error = errno;
+            }
+        }
+    }
+    counters->task_clock_fd = open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1);
+    counters->context_switches_fd = counters->task_clock_fd < 0 ? -1 :
+                                    open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, counters->task_clock_fd);
+    counters->tid = (pid_t)syscall(SYS_gettid);
+
+    pthread_mutex_lock(&counters_mutex);
+    if (hardware_error != 0 && !hardware_unavailable_reported) {
+        fprintf(stderr, "Error: Hardware performance counters are not available (%s), check "
+                        "/proc/sys/kernel/perf_event_paranoid; only software counters are reported\n", strerror(hardware_error));
+        hardware_unavailable_reported = true;
+    }
+    counters->next = all_thread_counters;
+    all_thread_counters = counters;
+    pthread_mutex_unlock(&counters_mutex);
+    thread_counters = counters;
+    return counters;
+}
+
+/**
+ * Reads a counter group: members with fd -1 are left at 0. Values are scaled by enabled / running time,
+ * so they estimate the full count when the kernel multiplexes more counters than the CPU has.
+ */
+static void read_group(int leader_fd, const int* member_fds, int num_members, uint64_t* values) {
+    if (leader_fd < 0) {
+        return;
+    }
+    uint64_t buffer[3 + NUM_STAGE_COUNTERS]; // nr, time_enabled, time_running, values
+    ssize_t size = read(leader_fd, buffer, sizeof(buffer));
+    if (size < (ssize_t)(3 * sizeof(uint64_t))) {
+        return;
+    }
+    uint64_t count = buffer[0];
+    double scale = buffer[2] > 0 ? (double)buffer[1] / (double)buffer[2] : 1.0;
+    for (int i = 0, slot = 0; i < num_members && (uint64_t)slot < count; ++i) {
+        if (member_fds[i] < 0) {
+            continue; // Members that failed to open are not part of the group
+        }
+        values[i] = (uint64_t)((double)buffer[3 + slot] * scale);
+        slot++;
+    }
+}
+
+static void read_counters(const ThreadCounters* counters, uint64_t* values) {
+    memset(values, 0, NUM_STAGE_COUNTERS * sizeof(uint64_t));
+    read_group(counters->hardware_fds[0], counters->hardware_fds, NUM_HARDWARE_COUNTERS, &values[COUNTER_CYCLES]);
+    int software_fds[2] = { counters->task_clock_fd, counters->context_switches_fd };
+    read_group(counters->task_clock_fd, software_fds, 2, &values[COUNTER_TASK_CLOCK]);
+}
+
+/**
+ * Enables the per-stage counters (--perf-counters). Must be called before the first stage runs.
+ */
+void enable_stage_counters(void) {
+    counters_enabled = true;
+}
+
+/**
+ * Reads the counters of the calling thread at the start of a stage. Does nothing unless the counters are enabled.
+ *
+ * @param sample Pointer to the StageSample structure to fill, passed to stage_end.
+ */
+void stage_begin(StageSample* sample) {
+    sample->active = false;
+    if (!counters_enabled) {
+        return;
+    }
+    ThreadCounters* counters = get_thread_counters();
+    if (!counters) {
+        return;
+    }
+    sample->time = omp_get_wtime();
+    read_counters(counters, sample->values);
+    sample->active = true;
+}
+
+/**
+ * Adds the counters of the calling thread since stage_begin to the totals of a stage.
+ *
+ * @param stage The stage that ran.
+ * @param start The sample of stage_begin on the same thread.
+ */
+void stage_end(PipelineStage stage, const StageSample* start) {
+    if (!start->active || !thread_counters) {
+        return;
+    }
+    uint64_t values[NUM_STAGE_COUNTERS];
+    read_counters(thread_counters, values);
+    StageTotals* totals = &thread_counters->totals[stage];
+    for (int i = 0; i < NUM_STAGE_COUNTERS; ++i) {
+        totals->values[i] += values[i] >= start->values[i] ? values[i] - start->values[i] : 0;
+    }
+    totals->time += omp_get_wtime() - start->time;
+    totals->calls++;
+}
+
+static void print_totals_row(const char* name, const StageTotals* totals, bool hardware) {
+    printf("%-14s %8zu %10.3f %10.3f", name, totals->calls, totals->time, totals->values[COUNTER_TASK_CLOCK] / 1e9);
+    if (hardware) {
+        double instructions = (double)totals->values[COUNTER_INSTRUCTIONS];
+        printf(" %14llu %14llu %6.2f %10.2f %10.2f",
+               (unsigned long long)totals->values[COUNTER_CYCLES], (unsigned long long)totals->values[COUNTER_INSTRUCTIONS],
+               totals->values[COUNTER_CYCLES] ? instructions / totals->values[COUNTER_CYCLES] : 0.0,
+               instructions > 0 ? 1000.0 * totals->values[COUNTER_CACHE_MISSES] / instructions : 0.0,
+               instructions > 0 ? 1000.0 * totals->values[COUNTER_BRANCH_MISSES] / instructions : 0.0);
+    } else {
+        printf(" %14s %14s %6s %10s %10s", "n/a", "n/a", "n/a", "n/a", "n/a");
+    }
+    printf(" %9llu\n", (unsigned long long)totals->values[COUNTER_CONTEXT_SWITCHES]);
+}
+
+static void add_totals(StageTotals* sum, const StageTotals* totals) {
+    for (int i = 0; i < NUM_STAGE_COUNTERS; ++i) {
+        sum->values[i] += totals->values[i];
+    }
+    sum->time += totals->time;
+    sum->calls += totals->calls;
+}
+
+/**
+ * Prints the counters per stage and per thread: wall and CPU time, cycles, instructions, instructions
+ * per cycle, cache and branch misses per 1000 instructions and context switches. A low IPC with many
+ * cache misses points to a memory-bound stage. Call it after all stages finished.
+ */
+void print_stage_counters(void) {
+    if (!counters_enabled) {
+        return;
+    }
+    pthread_mutex_lock(&counters_mutex);
+    bool hardware = false;
+    for (ThreadCounters* counters = all_thread_counters; counters; counters = counters->next) {
+        hardware = hardware || counters->hardware_fds[0] >= 0;
+    }
+    const char* header = "%-14s %8s %10s %10s %14s %14s %6s %10s %10s %9s\n";
+
+    printf("\nPerformance counters per stage:\n");
+    printf(header, "stage", "calls", "wall(s)", "cpu(s)", "cycles", "instructions", "IPC", "LLC-mpki", "br-mpki", "ctx-sw");
+    StageTotals total;
+    memset(&total, 0, sizeof(total));
+    for (int s = 0; s < NUM_PIPELINE_STAGES; ++s) {
+        StageTotals stage;
+        memset(&stage, 0, sizeof(stage));
+        for (ThreadCounters* counters = all_thread_counters; counters; counters = counters->next) {
+            add_totals(&stage, &counters->totals[s]);
+        }
+        add_totals(&total, &stage);
+        print_totals_row(stage_names[s], &stage, hardware);
+    }
+    print_totals_row("total", &total, hardware);
+
+    printf("\nPerformance counters per thread:\n");
+    printf(header, "thread", "calls", "wall(s)", "cpu(s)", "cycles", "instructions", "IPC", "LLC-mpki", "br-mpki", "ctx-sw");
+    for (ThreadCounters* counters = all_thread_counters; counters; counters = counters->next) {
+        StageTotals thread;
+        memset(&thread, 0, sizeof(thread));
+        for (int s = 0; s < NUM_PIPELINE_STAGES; ++s) {
+            add_totals(&thread, &counters->totals[s]);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "tid %d", (int)counters->tid);
+        print_totals_row(name, &thread, counters->hardware_fds[0] >= 0);
+    }
+    printf("Inference counts the calling threads only, the ONNX Runtime intra-op pool threads are not included.\n");
+    pthread_mutex_unlock(&counters_mutex);
+}
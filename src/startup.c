@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <omp.h>
+
+#include "startup.h"
+#include "tokenizer.h"
+
+static double process_start_time = 0.0;         // Set by mark_process_start
+static atomic_bool first_result_noted = false;  // The first batch of logits is there
+static double first_result_time = 0.0;          // Seconds from the process start to the first batch of logits
+
+/**
+ * Records the start of the process, the reference of the time to the first result. Called first thing in main.
+ */
+void mark_process_start(void) {
+    process_start_time = omp_get_wtime();
+}
+
+/**
+ * Records the time of the first batch of logits of the process. Later calls do nothing.
+ */
+void note_first_result(void) {
+    if (atomic_load_explicit(&first_result_noted, memory_order_relaxed)) {
+        return;
+    }
+    double now = omp_get_wtime();
+    if (!atomic_exchange(&first_result_noted, true)) {
+        first_result_time = now - process_start_time;
+    }
+}
+
+/**
+ * Prints the time from the process start to the first batch of logits, nothing if no batch ran.
+ */
+void print_time_to_first_result(void) {
+    if (atomic_load(&first_result_noted)) {
+        printf("Time to first result: %f seconds\n", first_result_time);
+    }
+}
+
+static void* tokenizer_thread(void* arg) {
+    StartupLoader* loader = (StartupLoader*)arg;
+    double start_time = omp_get_wtime();
+    loader->tokenizer = create_tokenizer(loader->tokenizer_path);
+    loader->tokenizer_time = omp_get_wtime() - start_time;
+    if (loader->tokenizer) {
+        printf("DONE: create_tokenizer;\n");
+    }
+    return NULL;
+}
+
+static void* session_thread(void* arg) {
+    StartupLoader* loader = (StartupLoader*)arg;
+    double start_time = omp_get_wtime();
+    OrtSession* session = create_ort_session_with_config(loader->env, loader->model_path, &loader->config);
+    if (session) {
+        printf("DONE: create_ort_session;\n");
+    }
+    pthread_mutex_lock(&loader->mutex);
+    loader->session = session;
+    loader->session_time = omp_get_wtime() - start_time;
+    loader->session_done = true;
+    pthread_cond_broadcast(&loader->session_ready);
+    pthread_mutex_unlock(&loader->mutex);
+    return NULL;
+}
+
+/**
+ * Starts creating the tokenizer and the session of a model on two background threads. Both only read
+ * their files, so they run while the input is read and parsed and while the first batches are tokenized.
+ *
+ * @param loader Pointer to the StartupLoader structure to initialize.
+ * @param env The environment the session is created in.
+ * @param model_path The model file.
+ * @param tokenizer_path The tokenizer file.
+ * @param config How the session is created.
+ * @return 0 if both threads were started, -1 otherwise (nothing is left running).
+ */
+int start_startup_loader(StartupLoader* loader, OrtEnv* env, const char* model_path, const char* tokenizer_path,
+                         const SessionConfig* config) {
+    memset(loader, 0, sizeof(*loader));
+    loader->env = env;
+    loader->model_path = model_path;
+    loader->tokenizer_path = tokenizer_path;
+    loader->config = *config;
+    pthread_mutex_init(&loader->mutex, NULL);
+    pthread_cond_init(&loader->session_ready, NULL);
+    if (pthread_create(&loader->session_thread, NULL, session_thread, loader) != 0) {
+        fprintf(stderr, "Error: Failed to start the thread creating the session\n");
+        pthread_cond_destroy(&loader->session_ready);
+        pthread_mutex_destroy(&loader->mutex);
+        return -1;
+    }
+    if (pthread_create(&loader->tokenizer_thread, NULL, tokenizer_thread, loader) != 0) {
+        fprintf(stderr, "Error: Failed to start the thread creating the tokenizer\n");
+        loader->tokenizer_joined = true;
+        finish_startup_loader(loader);
+        release_ort_session(loader->session);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Waits until the tokenizer was created. Only called by the thread that started the loader.
+ *
+ * @param loader The loader.
+ * @return The tokenizer, NULL if it could not be created.
+ */
+TokenizerHandle wait_startup_tokenizer(StartupLoader* loader) {
+    if (!loader->tokenizer_joined) {
+        pthread_join(loader->tokenizer_thread, NULL);
+        loader->tokenizer_joined = true;
+    }
+    return loader->tokenizer;
+}
+
+/**
+ * Waits until the session was created. Any number of threads may wait, e.g. batch workers
+ * that tokenized their first batch before the session was ready.
+ *
+ * @param loader The loader.
+ * @return The session, NULL if it could not be created.
+ */
+OrtSession* wait_startup_session(StartupLoader* loader) {
+    if (loader->session_joined) {
+        return loader->session;
+    }
+    pthread_mutex_lock(&loader->mutex);
+    while (!loader->session_done) {
+        pthread_cond_wait(&loader->session_ready, &loader->mutex);
+    }
+    OrtSession* session = loader->session;
+    pthread_mutex_unlock(&loader->mutex);
+    return session;
+}
+
+/**
+ * Joins the threads of the loader that are still running. The tokenizer and session stay in the loader
+ * and are owned by the caller. Calling it again does nothing.
+ *
+ * @param loader The loader.
+ */
+void finish_startup_loader(StartupLoader* loader) {
+    wait_startup_tokenizer(loader);
+    if (!loader->session_joined) {
+        pthread_join(loader->session_thread, NULL);
+        loader->session_joined = true;
+        pthread_cond_destroy(&loader->session_ready);
+        pthread_mutex_destroy(&loader->mutex);
+    }
+}
@@ -0,0 +1,493 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <omp.h>
+
+#include "stream_runner.h"
+#include "parallel_processor.h"
+#include "postprocessor.h"
+#include "read_data.h"
+#include "model.h"
+#include "model_reloader.h"
+#include "configs.h"
+
+#define STREAM_READ_SIZE 65536 // Bytes read from the input at once
+
+/**
+ * Structure to store one micro-batch of stream records.
+ */
+typedef struct {
+    ClassificationRequest request;      /**< Texts and labels of the records (one label set per text). */
+    size_t record_ids[BATCH_SIZE];      /**< Index of every record in the stream. */
+    size_t sequence;                    /**< Number of the batch, batches are written in this order. */
+} StreamBatch;
+
+/**
+ * Structure to store the state shared by the reader and the batch workers.
+ *
+ * The queue of flushed batches is bounded: when all workers are busy the reader blocks on it and stops
+ * reading the input, so a fast producer is held back by the pipe instead of by unbounded memory.
+ */
+typedef struct {
+    StreamBatch** queue;        /**< Ring buffer of flushed batches. */
+    size_t capacity;            /**< Capacity of the queue. */
+    size_t head;                /**< Position of the oldest batch in the queue. */
+    size_t count;               /**< Number of batches in the queue. */
+    bool closed;                /**< No more batches will be queued. */
+    pthread_mutex_t mutex;      /**< Protects the queue. */
+    pthread_cond_t not_empty;   /**< Signaled when a batch is queued or the queue is closed. */
+    pthread_cond_t not_full;    /**< Signaled when a batch is taken from the queue. */
+
+    FILE* output;               /**< Where predictions are written. */
+    size_t next_output;         /**< Sequence of the next batch to write. */
+    bool output_failed;         /**< Writing failed (e.g. the reader of the output went away). */
+    size_t failed_batches;      /**< Batches whose inference failed. */
+    pthread_mutex_t output_mutex; /**< Protects the output state. */
+    pthread_cond_t turn;        /**< Signaled when a batch has been written. */
+
+    ModelReloader* models;      /**< Current generation of the model and tokenizer, replaced by reloads. */
+    bool prompt_first;          /**< Whether the label prompt is placed before the text. */
+} StreamState;
+
+static StreamBatch* create_stream_batch(size_t sequence) {
+    StreamBatch* batch = (StreamBatch*)calloc(1, sizeof(StreamBatch));
+    if (!batch) {
+        return NULL;
+    }
+    batch->request.texts = (char**)calloc(BATCH_SIZE, sizeof(char*));
+    batch->request.labels = (char***)calloc(BATCH_SIZE, sizeof(char**));
+    batch->request.num_labels = (size_t*)calloc(BATCH_SIZE, sizeof(size_t));
+    batch->request.same_labels = false;
+    batch->request.priority = PRIORITY_NORMAL;
+    batch->sequence = sequence;
+    if (!batch->request.texts || !batch->request.labels || !batch->request.num_labels) {
+        free_request(&batch->request);
+        free(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+static void free_stream_batch(StreamBatch* batch) {
+    if (batch) {
+        free_request(&batch->request);
+        free(batch);
+    }
+}
+
+static bool output_failed(StreamState* state) {
+    pthread_mutex_lock(&state->output_mutex);
+    bool failed = state->output_failed;
+    pthread_mutex_unlock(&state->output_mutex);
+    return failed;
+}
+
+/**
+ * Queues a flushed batch, blocking while the queue is full.
+ */
+static void push_batch(StreamState* state, StreamBatch* batch) {
+    pthread_mutex_lock(&state->mutex);
+    while (state->count == state->capacity) {
+        pthread_cond_wait(&state->not_full, &state->mutex);
+    }
+    state->queue[(state->head + state->count) % state->capacity] = batch;
+    state->count++;
+    pthread_cond_signal(&state->not_empty);
+    pthread_mutex_unlock(&state->mutex);
+}
+
+/**
+ * Takes the oldest batch from the queue, blocking while it is empty.
+ *
+ * @return The batch, or NULL if the queue is closed and empty.
+ */
+static StreamBatch* pop_batch(StreamState* state) {
+    pthread_mutex_lock(&state->mutex);
+    while (state->count == 0 && !state->closed) {
+        pthread_cond_wait(&state->not_empty, &state->mutex);
+    }
+    StreamBatch* batch = NULL;
+    if (state->count > 0) {
+        batch = state->queue[state->head];
+        state->head = (state->head + 1) % state->capacity;
+        state->count--;
+        pthread_cond_signal(&state->not_full);
+    }
+    pthread_mutex_unlock(&state->mutex);
+    return batch;
+}
+
+/**
+ * Writes the predictions of a batch, numbered by the index of every record in the stream.
+ *
+ * @return 0 if successful, -1 if the output tensor does not match the batch.
+ */
+static int write_stream_predictions(FILE* stream, OrtValue* output_tensor, const StreamBatch* batch) {
+    const ClassificationRequest* request = &batch->request;
+    float* logits = NULL;
+    int64_t rows = 0, cols = 0;
+    if (get_output_logits(output_tensor, g_ort, &logits, &rows, &cols) != 0 || (size_t)rows != request->num_texts) {
+        return -1;
+    }
+    for (size_t i = 0; i < request->num_texts; ++i) {
+        size_t num_classes = request->num_labels[i] < (size_t)cols ? request->num_labels[i] : (size_t)cols;
+        write_text_predictions(stream, (int)batch->record_ids[i], request->texts[i], &logits[i * cols], num_classes,
+                               (const char* const*)request->labels[i], request->num_labels[i], THRESHOLD,
+                               request->classification_type);
+    }
+    return 0;
+}
+
+/**
+ * Writes every record of a batch that could not be run as not classified, like the batch mode does.
+ */
+static void write_stream_failures(FILE* stream, const StreamBatch* batch) {
+    const ClassificationRequest* request = &batch->request;
+    const float failed = NAN;
+    for (size_t i = 0; i < request->num_texts; ++i) {
+        write_text_predictions(stream, (int)batch->record_ids[i], request->texts[i], &failed, 1,
+                               (const char* const*)request->labels[i], request->num_labels[i], THRESHOLD,
+                               request->classification_type);
+    }
+}
+
+/**
+ * Body of a batch worker: runs queued batches and writes their predictions in batch order.
+ * Predictions are formatted into memory first, so only the write itself waits for the turn of the batch.
+ */
+static void* stream_worker(void* arg) {
+    StreamState* state = (StreamState*)arg;
+    StreamBatch* batch;
+    while ((batch = pop_batch(state)) != NULL) {
+        char* text = NULL;
+        size_t size = 0;
+        bool ok = false;
+        if (!output_failed(state)) {
+            // The batch finishes on the generation it started on, even if a reload swaps in a new one
+            LoadedModel* model = acquire_model(state->models);
+            FILE* buffer = open_memstream(&text, &size);
+            OrtValue* output_tensor = run_request_batch(model->session, model->tokenizer, state->prompt_first,
+                                                        &batch->request, 0, batch->request.num_texts);
+            ok = buffer && output_tensor && write_stream_predictions(buffer, output_tensor, batch) == 0;
+            if (output_tensor) g_ort->ReleaseValue(output_tensor);
+            if (buffer) fclose(buffer);
+            release_model(state->models, model);
+        }
+
+        pthread_mutex_lock(&state->output_mutex);
+        while (state->next_output != batch->sequence) {
+            pthread_cond_wait(&state->turn, &state->output_mutex);
+        }
+        if (ok && !state->output_failed) {
+            if (fwrite(text, 1, size, state->output) != size || fflush(state->output) != 0) {
+                fprintf(stderr, "Error: Failed to write predictions: %s\n", strerror(errno));
+                state->output_failed = true;
+            }
+        } else if (!ok && !state->output_failed) {
+            fprintf(stderr, "Error: Inference failed for records %zu-%zu\n", batch->record_ids[0],
+                    batch->record_ids[batch->request.num_texts - 1]);
+            state->failed_batches++;
+            write_stream_failures(state->output, batch);
+            if (fflush(state->output) != 0 || ferror(state->output)) {
+                fprintf(stderr, "Error: Failed to write predictions: %s\n", strerror(errno));
+                state->output_failed = true;
+            }
+        }
+        state->next_output++;
+        pthread_cond_broadcast(&state->turn);
+        pthread_mutex_unlock(&state->output_mutex);
+
+        free(text);
+        free_stream_batch(batch);
+    }
+    return NULL;
+}
+
+/**
+ * Structure to store the reader side of a stream: the batch being filled and the counters.
+ */
+typedef struct {
+    StreamState* state;         /**< Shared state. */
+    StreamBatch* batch;         /**< Batch being filled, NULL if none. */
+    double deadline;            /**< Time the batch being filled must be flushed at. */
+    double max_wait;            /**< Longest wait of a record for its batch to fill up in seconds. */
+    size_t next_sequence;       /**< Sequence of the next batch. */
+    StreamStats* stats;         /**< Statistics of the stream. */
+} StreamReader;
+
+static void flush_batch(StreamReader* reader) {
+    if (!reader->batch) {
+        return;
+    }
+    reader->stats->num_batches++;
+    push_batch(reader->state, reader->batch);
+    reader->batch = NULL;
+}
+
+/**
+ * Parses one line of the input and adds the record to the batch being filled.
+ * A batch only holds records of one classification type, a record of another type flushes it.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+static int add_record(StreamReader* reader, const char* line) {
+    if (strstr(line, "\"control\"")) {
+        char* command = parse_stream_control(line);
+        if (command) {
+            reader->stats->num_controls++;
+            if (strcmp(command, "reload") == 0) {
+                request_model_reload(reader->state->models);
+            } else {
+                fprintf(stderr, "Error: Unknown control command \"%s\", skipped\n", command);
+            }
+            free(command);
+            return 0;
+        }
+    }
+    size_t record_id = reader->stats->num_records++;
+    char* text = NULL;
+    char** labels = NULL;
+    size_t num_labels = 0;
+    char* classification_type = NULL;
+    if (parse_stream_record(line, &text, &labels, &num_labels, &classification_type) != 0) {
+        fprintf(stderr, "Error: Record %zu is not a valid {\"text\", \"labels\"} object, skipped\n", record_id);
+        reader->stats->num_invalid++;
+        return 0;
+    }
+
+    if (reader->batch && strcmp(reader->batch->request.classification_type, classification_type) != 0) {
+        flush_batch(reader);
+    }
+    if (!reader->batch) {
+        reader->batch = create_stream_batch(reader->next_sequence);
+        if (!reader->batch) {
+            fprintf(stderr, "Error: Memory allocation for a stream batch failed\n");
+            for (size_t i = 0; i < num_labels; ++i) free(labels[i]);
+            free(labels);
+            free(text);
+            free(classification_type);
+            return -1;
+        }
+        reader->next_sequence++;
+        reader->batch->request.classification_type = classification_type;
+        reader->deadline = omp_get_wtime() + reader->max_wait;
+    } else {
+        free(classification_type);
+    }
+
+    ClassificationRequest* request = &reader->batch->request;
+    request->texts[request->num_texts] = text;
+    request->labels[request->num_texts] = labels;
+    request->num_labels[request->num_texts] = num_labels;
+    reader->batch->record_ids[request->num_texts] = record_id;
+    request->num_texts++;
+    if (request->num_texts == BATCH_SIZE) {
+        reader->stats->full_batches++;
+        flush_batch(reader);
+    }
+    return 0;
+}
+
+/**
+ * Reads newline-delimited records from the input until EOF and flushes micro-batches to the workers.
+ * A batch is flushed when it holds BATCH_SIZE records or its oldest record waited max_wait.
+ *
+ * @return 0 if the input was read to the end, -1 on a read error, a failed output or memory shortage.
+ */
+static int read_records(int input_fd, StreamReader* reader) {
+    size_t size = STREAM_READ_SIZE, length = 0;
+    char* buffer = (char*)malloc(size + 1);
+    if (!buffer) {
+        fprintf(stderr, "Error: Memory allocation for the input buffer failed\n");
+        return -1;
+    }
+
+    int result = 0;
+    bool eof = false;
+    while (!eof) {
+        if (output_failed(reader->state)) {
+            result = -1;
+            break;
+        }
+        int timeout = -1;
+        if (reader->batch) {
+            double remaining = reader->deadline - omp_get_wtime();
+            if (remaining <= 0) {
+                reader->stats->waited_batches++;
+                flush_batch(reader);
+                continue;
+            }
+            timeout = (int)(remaining * 1000.0) + 1;
+        }
+        struct pollfd fd = { input_fd, POLLIN, 0 };
+        int ready = poll(&fd, 1, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: Failed to wait for input: %s\n", strerror(errno));
+            result = -1;
+            break;
+        }
+        if (ready == 0) {
+            continue; // The deadline of the batch is handled at the top of the loop
+        }
+
+        if (length == size) {
+            char* grown = (char*)realloc(buffer, size * 2 + 1);
+            if (!grown) {
+                fprintf(stderr, "Error: Memory allocation for the input buffer failed\n");
+                result = -1;
+                break;
+            }
+            buffer = grown;
+            size *= 2;
+        }
+        ssize_t bytes = read(input_fd, buffer + length, size - length);
+        if (bytes < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            fprintf(stderr, "Error: Failed to read input: %s\n", strerror(errno));
+            result = -1;
+            break;
+        }
+        if (bytes == 0) {
+            eof = true;
+            if (length > 0 && buffer[length - 1] != '\n') {
+                buffer[length++] = '\n'; // The last record may lack its newline (room is kept by the + 1)
+            }
+        }
+        length += (size_t)bytes;
+
+        // Hand over all complete lines, keep the incomplete tail for the next read
+        size_t start = 0;
+        for (size_t i = 0; i < length && result == 0; ++i) {
+            if (buffer[i] != '\n') {
+                continue;
+            }
+            buffer[i] = '\0';
+            if (i > start && buffer[i - 1] == '\r') {
+                buffer[i - 1] = '\0';
+            }
+            if (buffer[start] != '\0' && add_record(reader, &buffer[start]) != 0) {
+                result = -1;
+            }
+            start = i + 1;
+        }
+        memmove(buffer, buffer + start, length - start);
+        length -= start;
+        if (result != 0) {
+            break;
+        }
+    }
+    flush_batch(reader);
+    free(buffer);
+    return result;
+}
+
+/**
+ * Classifies newline-delimited records read from a file descriptor (e.g. a pipe on stdin) as they arrive.
+ * Every line is a record {"text": "...", "labels": [...], "classification_type": "single-label"}.
+ * Records are grouped into micro-batches that are flushed when they reach BATCH_SIZE or when their oldest
+ * record waited max_wait seconds, and run on num_workers batch workers. The predictions are written in
+ * arrival order, numbered by the index of the record in the stream; invalid records are reported on stderr.
+ * At most two batches per worker are pending, beyond that the input is not read until a batch finishes.
+ * A control record {"control": "reload"} reloads the model in the background like SIGHUP; batches keep
+ * running on the old generation until the new one is warmed up.
+ *
+ * @param input_fd The file descriptor to read records from until EOF.
+ * @param output The stream predictions are written to (flushed after every batch).
+ * @param models The model and tokenizer, every batch runs on the generation current when it starts.
+ * @param prompt_first Whether the label prompt is placed before the text.
+ * @param num_workers The number of batch workers.
+ * @param max_wait The longest time a record waits for its batch to fill up, in seconds.
+ * @param stats Pointer to the StreamStats structure to fill.
+ * @return 0 if all records were read and all batches were classified and written, -1 otherwise.
+ */
+int run_stream(int input_fd, FILE* output, ModelReloader* models, bool prompt_first,
+               size_t num_workers, double max_wait, StreamStats* stats) {
+    double start_time = omp_get_wtime();
+    memset(stats, 0, sizeof(*stats));
+    if (num_workers == 0) {
+        num_workers = 1;
+    }
+
+    StreamState state;
+    memset(&state, 0, sizeof(state));
+    state.capacity = 2 * num_workers;
+    state.queue = (StreamBatch**)calloc(state.capacity, sizeof(StreamBatch*));
+    pthread_t* workers = (pthread_t*)calloc(num_workers, sizeof(pthread_t));
+    if (!state.queue || !workers) {
+        fprintf(stderr, "Error: Memory allocation for the stream failed\n");
+        free(state.queue);
+        free(workers);
+        return -1;
+    }
+    pthread_mutex_init(&state.mutex, NULL);
+    pthread_cond_init(&state.not_empty, NULL);
+    pthread_cond_init(&state.not_full, NULL);
+    pthread_mutex_init(&state.output_mutex, NULL);
+    pthread_cond_init(&state.turn, NULL);
+    state.output = output;
+    state.models = models;
+    state.prompt_first = prompt_first;
+
+    // A closed output is reported by the failing write instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
+    size_t num_started = 0;
+    for (; num_started < num_workers; ++num_started) {
+        if (pthread_create(&workers[num_started], NULL, stream_worker, &state) != 0) {
+            fprintf(stderr, "Error: Failed to start stream worker %zu\n", num_started);
+            break;
+        }
+    }
+
+    int result = -1;
+    if (num_started > 0) {
+        StreamReader reader = { &state, NULL, 0.0, max_wait, 0, stats };
+        result = read_records(input_fd, &reader);
+    }
+
+    pthread_mutex_lock(&state.mutex);
+    state.closed = true;
+    pthread_cond_broadcast(&state.not_empty);
+    pthread_mutex_unlock(&state.mutex);
+    for (size_t i = 0; i < num_started; ++i) {
+        pthread_join(workers[i], NULL);
+    }
+
+    stats->failed_batches = state.failed_batches;
+    if (state.output_failed || state.failed_batches > 0) {
+        result = -1;
+    }
+    pthread_cond_destroy(&state.turn);
+    pthread_mutex_destroy(&state.output_mutex);
+    pthread_cond_destroy(&state.not_full);
+    pthread_cond_destroy(&state.not_empty);
+    pthread_mutex_destroy(&state.mutex);
+    free(state.queue);
+    free(workers);
+    stats->time = omp_get_wtime() - start_time;
+    return result;
+}
+
+/**
+ * Prints the statistics of a stream.
+ *
+ * @param stream The stream to print to (stdout carries the predictions in stream mode).
+ * @param stats The statistics to print.
+ */
+void print_stream_stats(FILE* stream, const StreamStats* stats) {
+    size_t valid = stats->num_records - stats->num_invalid;
+    double time = stats->time > 0 ? stats->time : 1e-9;
+    fprintf(stream, "Stream: %zu records (%zu invalid) in %zu batches (%zu full, %zu after max wait, %zu failed), "
+            "%.1f records per batch, %f seconds, %.1f records/s, %zu control records\n",
+            stats->num_records, stats->num_invalid, stats->num_batches, stats->full_batches, stats->waited_batches,
+            stats->failed_batches, stats->num_batches ? (double)valid / stats->num_batches : 0.0, stats->time,
+            valid / time, stats->num_controls);
+}
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+#include "taxonomy.h"
+#include "parallel_processor.h"
+#include "postprocessor.h"
+#include "model.h"
+#include "configs.h"
+
+/**
+ * Structure to store one scored taxonomy node on the way from the top level to a leaf, for one text.
+ */
+typedef struct {
+    const TaxonomyNode* node;   /**< The taxonomy node. */
+    long parent;                /**< Index of the entry of the parent node, -1 for top-level labels. */
+    float prob;                 /**< Probability of the label among its level candidates. */
+    float score;                /**< Product of the probabilities on the path. */
+    bool scored;                /**< The label got a probability (its row was run). */
+    bool confident;             /**< Every label on the path is above THRESHOLD. */
+    bool expanded;              /**< The entry was selected at its level (its children were scored). */
+} PathEntry;
+
+/**
+ * Structure to store the entries explored for one text. The entries of the level being scored are
+ * the ones from level_start on.
+ */
+typedef struct {
+    PathEntry* entries;         /**< Explored entries in level order. */
+    size_t count;               /**< Number of entries. */
+    size_t capacity;            /**< Allocated entries. */
+    size_t level_start;         /**< First entry of the current level. */
+} TextPaths;
+
+static int add_children(TextPaths* paths, const TaxonomyNode* node, long parent) {
+    if (paths->count + node->num_children > paths->capacity) {
+        size_t capacity = paths->capacity ? paths->capacity : 16;
+        while (capacity < paths->count + node->num_children) {
+            capacity *= 2;
+        }
+        PathEntry* entries = (PathEntry*)realloc(paths->entries, capacity * sizeof(PathEntry));
+        if (!entries) {
+            fprintf(stderr, "Error: Memory allocation for taxonomy paths failed\n");
+            return -1;
+        }
+        paths->entries = entries;
+        paths->capacity = capacity;
+    }
+    for (size_t i = 0; i < node->num_children; ++i) {
+        PathEntry* entry = &paths->entries[paths->count++];
+        memset(entry, 0, sizeof(*entry));
+        entry->node = &node->children[i];
+        entry->parent = parent;
+    }
+    return 0;
+}
+
+static size_t count_leaves(const TaxonomyNode* node) {
+    if (node->num_children == 0) {
+        return 1;
+    }
+    size_t leaves = 0;
+    for (size_t i = 0; i < node->num_children; ++i) {
+        leaves += count_leaves(&node->children[i]);
+    }
+    return leaves;
+}
+
+/**
+ * Structure to sort entries of one text by a key without moving the entries themselves.
+ */
+typedef struct {
+    size_t index;               /**< Index of the entry. */
+    float key;                  /**< Probability or path score of the entry. */
+} SortKey;
+
+static int compare_by_key(const void* a, const void* b) {
+    const SortKey* x = (const SortKey*)a;
+    const SortKey* y = (const SortKey*)b;
+    if (x->key != y->key) {
+        return (x->key < y->key) - (x->key > y->key);
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/**
+ * Scores the candidates of the current level of every text that has some. Every text is one row with
+ * its candidate labels, rows are batched like the texts of a regular request.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+static int score_level(OrtSession* session, TokenizerHandle tokenizer, bool prompt_first,
+                       const ClassificationRequest* request, TextPaths* paths, TaxonomyStats* stats) {
+    size_t num_texts = request->num_texts;
+    char** texts = (char**)malloc(num_texts * sizeof(char*));
+    char*** labels = (char***)calloc(num_texts, sizeof(char**));
+    size_t* num_labels = (size_t*)malloc(num_texts * sizeof(size_t));
+    size_t* text_ids = (size_t*)malloc(num_texts * sizeof(size_t));
+    int result = 0;
+    if (!texts || !labels || !num_labels || !text_ids) {
+        fprintf(stderr, "Error: Memory allocation for a taxonomy level failed\n");
+        result = -1;
+        goto cleanup;
+    }
+
+    size_t count = 0;
+    for (size_t t = 0; t < num_texts; ++t) {
+        size_t num_candidates = paths[t].count - paths[t].level_start;
+        if (num_candidates == 0) {
+            continue;
+        }
+        labels[count] = (char**)malloc(num_candidates * sizeof(char*));
+        if (!labels[count]) {
+            fprintf(stderr, "Error: Memory allocation for a taxonomy level failed\n");
+            result = -1;
+            goto cleanup;
+        }
+        for (size_t j = 0; j < num_candidates; ++j) {
+            labels[count][j] = paths[t].entries[paths[t].level_start + j].node->label;
+        }
+        texts[count] = request->texts[t];
+        num_labels[count] = num_candidates;
+        text_ids[count] = t;
+        stats->scored_labels += num_candidates;
+        count++;
+    }
+
+    size_t num_batches = (count + BATCH_SIZE - 1) / BATCH_SIZE;
+    OrtValue** input_ids_tensors = (OrtValue**)calloc(num_batches ? num_batches : 1, sizeof(OrtValue*));
+    OrtValue** attention_mask_tensors = (OrtValue**)calloc(num_batches ? num_batches : 1, sizeof(OrtValue*));
+    OrtValue** output_tensors = (OrtValue**)calloc(num_batches ? num_batches : 1, sizeof(OrtValue*));
+    if (!input_ids_tensors || !attention_mask_tensors || !output_tensors) {
+        fprintf(stderr, "Error: Memory allocation for batch tensors failed\n");
+        free(input_ids_tensors);
+        free(attention_mask_tensors);
+        free(output_tensors);
+        result = -1;
+        goto cleanup;
+    }
+
+    parallel_preprocess(texts, labels, num_labels, count, false, prompt_first, tokenizer,
+                        input_ids_tensors, attention_mask_tensors);
+    parallel_inference(session, input_ids_tensors, attention_mask_tensors, output_tensors, num_batches);
+
+    for (size_t b = 0; b < num_batches; ++b) {
+        float* logits = NULL;
+        int64_t rows = 0, cols = 0;
+        if (get_output_logits(output_tensors[b], g_ort, &logits, &rows, &cols) == 0) {
+            for (size_t i = 0; i < (size_t)rows && b * BATCH_SIZE + i < count; ++i) {
+                size_t row = b * BATCH_SIZE + i;
+                TextPaths* text_paths = &paths[text_ids[row]];
+                for (size_t j = 0; j < num_labels[row] && j < (size_t)cols; ++j) {
+                    if (isnan(logits[i * cols + j])) {
+                        continue; // The row could not be run (see run_inference_adaptive)
+                    }
+                    PathEntry* entry = &text_paths->entries[text_paths->level_start + j];
+                    entry->prob = sigmoid(logits[i * cols + j]);
+                    entry->scored = true;
+                }
+            }
+        } else {
+            fprintf(stderr, "Error: A batch of the taxonomy level failed, its labels are not expanded\n");
+        }
+        if (output_tensors[b]) g_ort->ReleaseValue(output_tensors[b]);
+        if (input_ids_tensors[b]) g_ort->ReleaseValue(input_ids_tensors[b]);
+        if (attention_mask_tensors[b]) g_ort->ReleaseValue(attention_mask_tensors[b]);
+    }
+    free(input_ids_tensors);
+    free(attention_mask_tensors);
+    free(output_tensors);
+
+cleanup:
+    for (size_t i = 0; labels && i < num_texts; ++i) {
+        free(labels[i]);
+    }
+    free(texts);
+    free(labels);
+    free(num_labels);
+    free(text_ids);
+    return result;
+}
+
+/**
+ * Selects the candidates of the current level of a text whose children are scored next: the ones above
+ * THRESHOLD and the top_k best ones. Their children become the candidates of the next level. Candidates
+ * of a failed batch or row have no probability and are never selected.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+static int expand_level(TextPaths* paths, size_t top_k) {
+    size_t start = paths->level_start;
+    size_t end = paths->count;
+    size_t num_candidates = end - start;
+    paths->level_start = end;
+    if (num_candidates == 0) {
+        return 0;
+    }
+    SortKey* order = (SortKey*)malloc(num_candidates * sizeof(SortKey));
+    if (!order) {
+        fprintf(stderr, "Error: Memory allocation for taxonomy paths failed\n");
+        return -1;
+    }
+    size_t num_scored = 0;
+    for (size_t i = start; i < end; ++i) {
+        if (paths->entries[i].scored) {
+            order[num_scored].index = i;
+            order[num_scored].key = paths->entries[i].prob;
+            num_scored++;
+        }
+    }
+    qsort(order, num_scored, sizeof(SortKey), compare_by_key);
+
+    int result = 0;
+    for (size_t rank = 0; rank < num_scored && result == 0; ++rank) {
+        PathEntry* entry = &paths->entries[order[rank].index];
+        if (rank >= top_k && entry->prob <= THRESHOLD) {
+            break;
+        }
+        const PathEntry* parent = entry->parent >= 0 ? &paths->entries[entry->parent] : NULL;
+        entry->expanded = true;
+        entry->score = (parent ? parent->score : 1.0f) * entry->prob;
+        entry->confident = (parent ? parent->confident : true) && entry->prob > THRESHOLD;
+        long index = (long)order[rank].index;
+        const TaxonomyNode* node = entry->node; // add_children may move the entries
+        result = add_children(paths, node, index);
+    }
+    free(order);
+    return result;
+}
+
+/**
+ * Prints the labels on the path from the top level to an entry, separated by " > ".
+ */
+static void print_path(const TextPaths* paths, size_t index) {
+    const PathEntry* entry = &paths->entries[index];
+    if (entry->parent >= 0) {
+        print_path(paths, (size_t)entry->parent);
+        printf(" > ");
+    }
+    printf("%s", entry->node->label);
+}
+
+/**
+ * Prints the final paths of a text. Multi-label: every leaf path with all labels above THRESHOLD.
+ * Single-label: the leaf path with the highest product of probabilities.
+ */
+static void print_text_paths(int text_index, const char* text, const TextPaths* paths, bool multi_label) {
+    printf("Text_%d: %s:\n", text_index, text);
+    SortKey* leaves = (SortKey*)malloc((paths->count ? paths->count : 1) * sizeof(SortKey));
+    size_t num_leaves = 0;
+    for (size_t i = 0; leaves && i < paths->count; ++i) {
+        const PathEntry* entry = &paths->entries[i];
+        if (entry->expanded && entry->node->num_children == 0 && (!multi_label || entry->confident)) {
+            leaves[num_leaves].index = i;
+            leaves[num_leaves].key = entry->score;
+            num_leaves++;
+        }
+    }
+    qsort(leaves, num_leaves, sizeof(SortKey), compare_by_key);
+    if (!multi_label && num_leaves > 1) {
+        num_leaves = 1;
+    }
+    for (size_t i = 0; i < num_leaves; ++i) {
+        printf("  Text_%d Path: ", text_index);
+        print_path(paths, leaves[i].index);
+        printf(", Score: %.6f\n", leaves[i].key);
+    }
+    printf("\n");
+    free(leaves);
+}
+
+/**
+ * Classifies the texts of a request against its label taxonomy level by level.
+ * The top-level labels are scored first. For every text, only the children of the labels above THRESHOLD
+ * or among the top_k best of the level are scored in the next round, so the work grows with the depth of
+ * the tree and the number of expanded branches rather than with the number of leaves.
+ * The result of a text is a set of paths from the top level to a leaf; the score of a path is the
+ * product of the probabilities of its labels.
+ *
+ * @param session The ONNX Runtime session of the model.
+ * @param tokenizer The tokenizer of the model.
+ * @param prompt_first Whether the label prompt is placed before the text.
+ * @param request The request with texts and a taxonomy.
+ * @param stats Pointer to the TaxonomyStats structure to fill.
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+int classify_request_taxonomy(OrtSession* session, TokenizerHandle tokenizer, bool prompt_first,
+                              const ClassificationRequest* request, TaxonomyStats* stats) {
+    double start_time = omp_get_wtime();
+    memset(stats, 0, sizeof(*stats));
+    stats->num_texts = request->num_texts;
+    stats->num_leaves = count_leaves(request->taxonomy);
+
+    TextPaths* paths = (TextPaths*)calloc(request->num_texts, sizeof(TextPaths));
+    if (!paths) {
+        fprintf(stderr, "Error: Memory allocation for taxonomy paths failed\n");
+        return -1;
+    }
+    int result = 0;
+    for (size_t t = 0; t < request->num_texts && result == 0; ++t) {
+        result = add_children(&paths[t], request->taxonomy, -1);
+    }
+
+    bool pending = result == 0;
+    while (pending) {
+        if (score_level(session, tokenizer, prompt_first, request, paths, stats) != 0) {
+            result = -1;
+            break;
+        }
+        stats->num_levels++;
+        pending = false;
+        for (size_t t = 0; t < request->num_texts; ++t) {
+            if (expand_level(&paths[t], request->top_k) != 0) {
+                result = -1;
+            }
+            pending = pending || paths[t].count > paths[t].level_start;
+        }
+        if (result != 0) {
+            break;
+        }
+    }
+
+    if (result == 0) {
+        bool multi_label = strcmp(request->classification_type, "multi-label") == 0;
+        for (size_t t = 0; t < request->num_texts; ++t) {
+            print_text_paths((int)t, request->texts[t], &paths[t], multi_label);
+        }
+    }
+    for (size_t t = 0; t < request->num_texts; ++t) {
+        free(paths[t].entries);
+    }
+    free(paths);
+    stats->time = omp_get_wtime() - start_time;
+    return result;
+}
+
+/**
+ * Prints the statistics of a taxonomy classification.
+ *
+ * @param stats The statistics to print.
+ */
+void print_taxonomy_stats(const TaxonomyStats* stats) {
+    double texts = stats->num_texts ? (double)stats->num_texts : 1.0;
+    printf("Taxonomy: %zu levels, %.1f labels scored per text (a flat classification scores %zu leaves)\n",
+           stats->num_levels, stats->scored_labels / texts, stats->num_leaves);
+}
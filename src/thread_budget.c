@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <omp.h>
+
+#include "thread_budget.h"
+#include "configs.h"
+
+static pthread_mutex_t run_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_slot_freed = PTHREAD_COND_INITIALIZER;
+static int run_slots = 0;       // Runs allowed at once, 0 for no limit
+static int runs_in_flight = 0;  // Runs currently holding a slot
+
+/**
+ * Counts the CPUs the process may run on (its affinity mask, e.g. as limited by taskset or a container).
+ *
+ * @return The number of available CPUs, at least 1.
+ */
+int count_available_cpus(void) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 0) {
+        return CPU_COUNT(&allowed);
+    }
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (int)online : 1;
+}
+
+/**
+ * Divides a core budget between batch workers, the ONNX Runtime pools and the tokenizer.
+ * By default there is one batch worker, i.e. one Run at a time, per NUM_THREADS cores. The intra-op
+ * pool gets the cores the batch workers leave, so inference keeps at most cores threads runnable.
+ * Preparing prompts, tokenizing and postprocessing do not use the intra-op pool and run on one
+ * OpenMP thread per core. Sessions run graph nodes sequentially, so the inter-op pool is not used
+ * and gets a single thread.
+ *
+ * @param cores The core budget, 0 to use all available CPUs.
+ * @param batch_workers The number of batch workers, 0 to derive it from the budget.
+ * @param budget Pointer to the ThreadBudget structure to fill.
+ * @return 0 if successful, -1 if there are more batch workers than cores.
+ */
+int plan_thread_budget(int cores, int batch_workers, ThreadBudget* budget) {
+    memset(budget, 0, sizeof(*budget));
+    if (cores <= 0) {
+        cores = count_available_cpus();
+    }
+    if (batch_workers <= 0) {
+        batch_workers = cores / NUM_THREADS > 1 ? cores / NUM_THREADS : 1;
+    }
+    if (batch_workers > cores) {
+        fprintf(stderr, "Error: %d batch workers do not fit into a budget of %d cores\n", batch_workers, cores);
+        return -1;
+    }
+
+    budget->cores = cores;
+    budget->batch_workers = batch_workers;
+    budget->omp_threads = cores;
+    budget->intra_op_threads = cores - batch_workers + 1;
+    budget->inter_op_threads = 1;
+    budget->tokenizer_threads = 1;
+    return 0;
+}
+
+/**
+ * Applies the thread budget to OpenMP, the Run slots and the tokenizer. Must be called before the
+ * first parallel region and before the first tokenizer call; the ORT pools are sized when the
+ * environment is created (see initialize_ort_environment_with_global_thread_pools).
+ *
+ * @param budget The budget to apply.
+ */
+void apply_thread_budget(const ThreadBudget* budget) {
+    omp_set_dynamic(0);
+    omp_set_max_active_levels(1);
+    omp_set_num_threads(budget->omp_threads);
+
+    set_run_slots(budget->batch_workers);
+
+    // The Rust tokenizer parallelizes batches on its own pool unless told otherwise
+    char value[16];
+    snprintf(value, sizeof(value), "%d", budget->tokenizer_threads);
+    setenv("RAYON_NUM_THREADS", value, 1);
+    setenv("TOKENIZERS_PARALLELISM", budget->tokenizer_threads > 1 ? "true" : "false", 1);
+}
+
+/**
+ * Sets how many Runs may be in flight at once.
+ *
+ * @param slots The number of Runs, 0 for no limit.
+ */
+void set_run_slots(int slots) {
+    pthread_mutex_lock(&run_slots_mutex);
+    run_slots = slots;
+    pthread_cond_broadcast(&run_slot_freed);
+    pthread_mutex_unlock(&run_slots_mutex);
+}
+
+/**
+ * Waits until fewer Runs than set by set_run_slots are in flight and takes a slot. Threads whose
+ * batch is tokenized sleep here while the intra-op pool is busy, so the OpenMP threads that are not
+ * running inference only prepare and postprocess batches. Without an applied budget there is no limit.
+ */
+void acquire_run_slot(void) {
+    pthread_mutex_lock(&run_slots_mutex);
+    while (run_slots > 0 && runs_in_flight >= run_slots) {
+        pthread_cond_wait(&run_slot_freed, &run_slots_mutex);
+    }
+    runs_in_flight++;
+    pthread_mutex_unlock(&run_slots_mutex);
+}
+
+/**
+ * Gives back a slot taken by acquire_run_slot.
+ */
+void release_run_slot(void) {
+    pthread_mutex_lock(&run_slots_mutex);
+    runs_in_flight--;
+    pthread_cond_signal(&run_slot_freed);
+    pthread_mutex_unlock(&run_slots_mutex);
+}
+
+/**
+ * Prints how the core budget is divided.
+ *
+ * @param budget The budget to print.
+ */
+void print_thread_budget(const ThreadBudget* budget) {
+    printf("Thread budget: %d cores = %d batch workers + %d intra-op pool threads "
+           "(preprocessing: %d OpenMP threads, inter-op pool: %d, tokenizer: %d per OpenMP thread)\n",
+           budget->cores, budget->batch_workers, budget->intra_op_threads - 1,
+           budget->omp_threads, budget->inter_op_threads, budget->tokenizer_threads);
+}
@@ -5,6 +5,92 @@
 #include <stdbool.h>
 
 #include "tokenizer.h"
+#include "memory_tracker.h"
+
+// Buckets the sequence length of every batch is padded up to (empty by default)
+static SequenceBuckets sequence_buckets = { { 0 }, 0 };
+
+static int compare_sizes(const void* a, const void* b) {
+    size_t x = *(const size_t*)a;
+    size_t y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Parses a comma separated list of sequence lengths (e.g. "64,128,256,512,1024") into buckets.
+ * The lengths are sorted, duplicates are removed.
+ *
+ * @param list The comma separated list of positive lengths.
+ * @param buckets Pointer to the SequenceBuckets structure to fill.
+ * @return 0 if successful, -1 if the list is empty, has invalid values or more than MAX_SEQ_BUCKETS entries.
+ */
+int parse_sequence_buckets(const char* list, SequenceBuckets* buckets) {
+    buckets->count = 0;
+    const char* p = list;
+    while (*p) {
+        char* end = NULL;
+        long value = strtol(p, &end, 10);
+        if (end == p || value <= 0 || (*end != ',' && *end != '\0') || buckets->count == MAX_SEQ_BUCKETS) {
+            fprintf(stderr, "Error: Invalid sequence length buckets \"%s\"\n", list);
+            buckets->count = 0;
+            return -1;
+        }
+        buckets->lengths[buckets->count++] = (size_t)value;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    if (buckets->count == 0) {
+        fprintf(stderr, "Error: Sequence length buckets are empty\n");
+        return -1;
+    }
+
+    qsort(buckets->lengths, buckets->count, sizeof(size_t), compare_sizes);
+    size_t unique = 1;
+    for (size_t i = 1; i < buckets->count; ++i) {
+        if (buckets->lengths[i] != buckets->lengths[unique - 1]) {
+            buckets->lengths[unique++] = buckets->lengths[i];
+        }
+    }
+    buckets->count = unique;
+    return 0;
+}
+
+/**
+ * Sets the buckets that tokenize_inputs pads the sequence length of every batch up to.
+ * Must be called before tokenization starts.
+ *
+ * @param buckets The buckets to use, or NULL to disable bucketing.
+ */
+void set_sequence_buckets(const SequenceBuckets* buckets) {
+    if (buckets) {
+        sequence_buckets = *buckets;
+    } else {
+        sequence_buckets.count = 0;
+    }
+}
+
+/**
+ * Rounds a sequence length up to the smallest bucket that fits it.
+ * Lengths above the largest bucket are kept as is, buckets are never larger than max_length.
+ *
+ * @param seq_length The length of the longest sequence in the batch.
+ * @param max_length The maximum length of tokens for each text.
+ * @return The padded sequence length.
+ */
+size_t bucket_sequence_length(size_t seq_length, size_t max_length) {
+    for (size_t i = 0; i < sequence_buckets.count; ++i) {
+        if (sequence_buckets.lengths[i] >= seq_length) {
+            return sequence_buckets.lengths[i] < max_length ? sequence_buckets.lengths[i] : max_length;
+        }
+    }
+    return seq_length;
+}
+
+/**
+ * Computes the bytes of the token id, token type and attention mask arrays, as counted by the memory tracking.
+ */
+static size_t tokenized_inputs_bytes(const TokenizedInputs* tokenized) {
+    return 3 * tokenized->batch_size * (sizeof(int*) + tokenized->seq_length * sizeof(int));
+}
 
 /**
  * Tokenizes a batch of input texts using the provided tokenizer.
@@ -13,6 +99,7 @@
  * @param inputs An array of input texts to be tokenized.
  * @param num_texts The number of input texts in the batch.
  * @param max_length The maximum length of tokens for each text. Sequences longer than this will be truncated.
+ *                   The batch is padded up to the sequence length bucket set with set_sequence_buckets.
  * @return A TokenizedInputs structure containing token IDs, token type IDs, and attention masks for the input texts.
  *         The caller is responsible for freeing the memory allocated for the returned structure.
  */
@@ -31,6 +118,11 @@ TokenizedInputs tokenize_inputs(TokenizerHandle tokenizer, const char* inputs[],
 
     int add_special_tokens = 1;
     tokenizers_encode_batch(tokenizer, inputs, input_lengths, num_texts, add_special_tokens, results);
+    size_t results_bytes = num_texts * sizeof(TokenizerEncodeResult);
+    for (size_t i = 0; i < num_texts; ++i) {
+        results_bytes += results[i].len * sizeof(int);
+    }
+    track_allocation(MEMORY_TOKENS, results_bytes);
 
     // We trim the sequences to max_length and find the maximum length after trimming
     size_t* seq_lengths = (size_t*)malloc(num_texts * sizeof(size_t));
@@ -53,6 +145,9 @@ TokenizedInputs tokenize_inputs(TokenizerHandle tokenizer, const char* inputs[],
         }
     }
 
+    // Pad up to the sequence length bucket (if buckets are set)
+    seq_length = bucket_sequence_length(seq_length, max_length);
+
     // Mem alloc for tokenized data
     TokenizedInputs tokenized;
     tokenized.input_ids = (int**)malloc(num_texts * sizeof(int*));
@@ -83,7 +178,11 @@ TokenizedInputs tokenize_inputs(TokenizerHandle tokenizer, const char* inputs[],
         }
     }
 
-    tokenizers_free_encode_results(results, num_texts);
+    track_allocation(MEMORY_TOKENS, tokenized_inputs_bytes(&tokenized));
+
+    tokenizers_free_encode_results(results, num_texts); // Frees the token ids of the results, not the array
+    free(results);
+    track_release(MEMORY_TOKENS, results_bytes);
     free(input_lengths);
     free(seq_lengths);
 
@@ -124,6 +223,7 @@ void print_tokenized_inputs(const TokenizedInputs* tokenized) {
  * @param tokenized Pointer to the TokenizedInputs structure to be freed.
  */
 void free_tokenized_inputs(TokenizedInputs* tokenized) {
+    track_release(MEMORY_TOKENS, tokenized_inputs_bytes(tokenized));
     for (size_t i = 0; i < tokenized->batch_size; ++i) {
         free(tokenized->input_ids[i]);
         free(tokenized->token_type_ids[i]);
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include <pthread.h>
+
+#include "worker_groups.h"
+#include "parallel_processor.h"
+#include "model.h"
+#include "batch_splitter.h"
+#include "startup.h"
+#include "configs.h"
+
+/**
+ * Parses the name of a dispatch policy.
+ *
+ * @param name "round-robin" or "load".
+ * @param policy Pointer that will store the policy.
+ * @return 0 if successful, -1 if the name is unknown.
+ */
+int parse_dispatch_policy(const char* name, DispatchPolicy* policy) {
+    if (strcmp(name, "round-robin") == 0) {
+        *policy = DISPATCH_ROUND_ROBIN;
+        return 0;
+    }
+    if (strcmp(name, "load") == 0) {
+        *policy = DISPATCH_LOAD;
+        return 0;
+    }
+    fprintf(stderr, "Error: Unknown dispatch policy %s (expected round-robin or load)\n", name);
+    return -1;
+}
+
+/**
+ * Builds the value of "session.intra_op_thread_affinities" for a group: one entry per intra-op thread
+ * except the caller thread, which runs on the first CPU of the group. ONNX Runtime numbers processors from 1.
+ *
+ * @return The dynamically allocated affinity string, or NULL for a group with a single CPU or on allocation failure.
+ */
+static char* build_intra_op_affinities(const WorkerGroup* group) {
+    if (group->num_cpus < 2) {
+        return NULL;
+    }
+    size_t capacity = group->num_cpus * 12;
+    char* affinities = (char*)malloc(capacity);
+    if (!affinities) {
+        return NULL;
+    }
+    size_t length = 0;
+    for (size_t i = 1; i < group->num_cpus; ++i) {
+        length += snprintf(affinities + length, capacity - length, "%s%d", i > 1 ? ";" : "", group->cpus[i] + 1);
+    }
+    return affinities;
+}
+
+/**
+ * Arguments of a thread that creates the session of a group.
+ */
+typedef struct {
+    OrtEnv* env;
+    const char* model_path;
+    bool use_mmap;
+    OrtPrepackedWeightsContainer* container;
+    WorkerGroup* group;
+} GroupLoadTask;
+
+/**
+ * Creates the session of a group from a thread pinned to the group, so that the session state, the prepacked
+ * weights and the intra-op threads (which inherit the memory policy) are allocated on the node of the group.
+ */
+static void* load_group_session(void* arg) {
+    GroupLoadTask* task = (GroupLoadTask*)arg;
+    WorkerGroup* group = task->group;
+    pin_thread_to_cpus(group->cpus, 1);
+    prefer_memory_node(group->node);
+
+    char* affinities = build_intra_op_affinities(group);
+    SessionConfig session_config = { (int)group->num_cpus, task->use_mmap, affinities, task->container };
+    group->session = create_ort_session_with_config(task->env, task->model_path, &session_config);
+    free(affinities);
+    return NULL;
+}
+
+/**
+ * Creates the worker groups: groups_per_node groups on every NUMA node, each with a session whose intra-op threads
+ * are pinned to a disjoint share of the CPUs of the node. The groups of a node share one prepacked weights container,
+ * so the weights are prepacked once per node instead of once per session.
+ *
+ * @param env A pointer to the ONNX Runtime environment (without global thread pools).
+ * @param model_path The file path to the ONNX model.
+ * @param use_mmap Create the sessions from read-only memory mappings of the model file.
+ * @param topology The NUMA topology of the host.
+ * @param groups_per_node Number of groups per node, limited to the number of CPUs of the node.
+ * @param policy Dispatch policy of the batches.
+ * @param groups Pointer to the WorkerGroups structure to fill.
+ * @return 0 if successful, -1 if a session could not be created or memory could not be allocated.
+ */
+int create_worker_groups(OrtEnv* env, const char* model_path, bool use_mmap, const NumaTopology* topology,
+                         size_t groups_per_node, DispatchPolicy policy, WorkerGroups* groups) {
+    groups->num_groups = 0;
+    groups->num_containers = 0;
+    groups->policy = policy;
+    if (groups_per_node == 0) {
+        groups_per_node = 1;
+    }
+
+    size_t max_groups = topology->num_nodes * groups_per_node;
+    groups->groups = (WorkerGroup*)calloc(max_groups, sizeof(WorkerGroup));
+    groups->containers = (OrtPrepackedWeightsContainer**)calloc(topology->num_nodes, sizeof(OrtPrepackedWeightsContainer*));
+    if (!groups->groups || !groups->containers) {
+        fprintf(stderr, "Error: Memory allocation for worker groups failed\n");
+        free_worker_groups(groups);
+        return -1;
+    }
+
+    for (size_t n = 0; n < topology->num_nodes; ++n) {
+        const NumaNode* node = &topology->nodes[n];
+        OrtStatus* status = g_ort->CreatePrepackedWeightsContainer(&groups->containers[n]);
+        if (status != NULL) {
+            const char* msg = g_ort->GetErrorMessage(status);
+            fprintf(stderr, "Error: Failed to create prepacked weights container: %s\n", msg);
+            g_ort->ReleaseStatus(status);
+            free_worker_groups(groups);
+            return -1;
+        }
+        groups->num_containers++;
+
+        // Split the CPUs of the node into contiguous shares
+        size_t node_groups = groups_per_node < node->num_cpus ? groups_per_node : node->num_cpus;
+        for (size_t g = 0; g < node_groups; ++g) {
+            size_t first = g * node->num_cpus / node_groups;
+            size_t last = (g + 1) * node->num_cpus / node_groups;
+            WorkerGroup* group = &groups->groups[groups->num_groups];
+            group->node = node->id;
+            group->cpus = &node->cpus[first];
+            group->num_cpus = last - first;
+
+            // Groups load one after the other: they may write the same model cache file
+            GroupLoadTask task = { env, model_path, use_mmap, groups->containers[n], group };
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, load_group_session, &task) != 0) {
+                fprintf(stderr, "Error: Failed to start the loader thread of worker group %zu\n", groups->num_groups);
+                free_worker_groups(groups);
+                return -1;
+            }
+            pthread_join(thread, NULL);
+            if (group->session == NULL) {
+                fprintf(stderr, "Error: Failed to create the session of worker group %zu (node %d)\n",
+                        groups->num_groups, node->id);
+                free_worker_groups(groups);
+                return -1;
+            }
+            groups->num_groups++;
+            printf("\tWorker group %zu: node %d, CPUs %d-%d\n", groups->num_groups - 1, node->id,
+                   group->cpus[0], group->cpus[group->num_cpus - 1]);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Arguments of a thread that runs the batches of a group.
+ */
+typedef struct {
+    WorkerGroups* groups;
+    size_t group_index;
+    OrtValue** input_ids_tensors;
+    OrtValue** attention_mask_tensors;
+    OrtValue** output_tensors;
+    size_t num_batches;
+    size_t* next_batch;             /**< Next batch to take (DISPATCH_LOAD). */
+    pthread_mutex_t* next_mutex;    /**< Guards next_batch. */
+} GroupRunTask;
+
+/**
+ * Returns the next batch the group runs, or num_batches if there is none left.
+ */
+static size_t take_batch(GroupRunTask* task, size_t* round) {
+    if (task->groups->policy == DISPATCH_ROUND_ROBIN) {
+        size_t batch = task->group_index + (*round)++ * task->groups->num_groups;
+        return batch < task->num_batches ? batch : task->num_batches;
+    }
+    pthread_mutex_lock(task->next_mutex);
+    size_t batch = (*task->next_batch)++;
+    pthread_mutex_unlock(task->next_mutex);
+    return batch < task->num_batches ? batch : task->num_batches;
+}
+
+/**
+ * Runs batches on the session of a group from a thread pinned to the group.
+ */
+static void* run_group_batches(void* arg) {
+    GroupRunTask* task = (GroupRunTask*)arg;
+    WorkerGroup* group = &task->groups->groups[task->group_index];
+    pin_thread_to_cpus(group->cpus, 1);
+    prefer_memory_node(group->node);
+
+    size_t round = 0;
+    size_t batch;
+    while ((batch = take_batch(task, &round)) < task->num_batches) {
+        if (!task->input_ids_tensors[batch] || !task->attention_mask_tensors[batch]) {
+            continue; // Preprocessing failed
+        }
+        double start_time = omp_get_wtime();
+        task->output_tensors[batch] = run_inference_adaptive(group->session, task->input_ids_tensors[batch],
+                                                             task->attention_mask_tensors[batch], batch * BATCH_SIZE, 0);
+        group->busy_time += omp_get_wtime() - start_time;
+        group->num_batches++;
+        if (task->output_tensors[batch]) {
+            note_first_result();
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Runs inference for all batches on the worker groups, one pinned thread per group.
+ * The threads are created per call so the pinning and memory policy never leak into the OpenMP pool
+ * used by the preprocessing and postprocessing stages.
+ *
+ * @param groups The worker groups.
+ * @param input_ids_tensors Array of input ID tensors for each batch.
+ * @param attention_mask_tensors Array of attention mask tensors for each batch.
+ * @param output_tensors Output array of logits tensors for each batch (NULL for failed batches).
+ * @param num_batches Number of batches.
+ */
+void grouped_inference(WorkerGroups* groups, OrtValue** input_ids_tensors, OrtValue** attention_mask_tensors,
+                       OrtValue** output_tensors, size_t num_batches) {
+    size_t next_batch = 0;
+    pthread_mutex_t next_mutex = PTHREAD_MUTEX_INITIALIZER;
+    GroupRunTask* tasks = (GroupRunTask*)calloc(groups->num_groups, sizeof(GroupRunTask));
+    pthread_t* threads = (pthread_t*)calloc(groups->num_groups, sizeof(pthread_t));
+    bool* started = (bool*)calloc(groups->num_groups, sizeof(bool));
+    if (!tasks || !threads || !started) {
+        fprintf(stderr, "Error: Memory allocation for worker group threads failed\n");
+        free(tasks);
+        free(threads);
+        free(started);
+        return;
+    }
+
+    for (size_t g = 0; g < groups->num_groups; ++g) {
+        GroupRunTask task = { groups, g, input_ids_tensors, attention_mask_tensors, output_tensors,
+                              num_batches, &next_batch, &next_mutex };
+        tasks[g] = task;
+        started[g] = pthread_create(&threads[g], NULL, run_group_batches, &tasks[g]) == 0;
+        if (!started[g]) {
+            fprintf(stderr, "Warning: Failed to start the thread of worker group %zu\n", g);
+        }
+    }
+    for (size_t g = 0; g < groups->num_groups; ++g) {
+        if (started[g]) {
+            pthread_join(threads[g], NULL);
+        }
+    }
+    pthread_mutex_destroy(&next_mutex);
+    free(tasks);
+    free(threads);
+    free(started);
+}
+
+/**
+ * Classifies all texts of a request on the worker groups and prints the results.
+ * Preprocessing and postprocessing run on the OpenMP threads as in classify_request.
+ *
+ * @param groups The worker groups.
+ * @param tokenizer_handler Handle for the tokenizer of the model.
+ * @param prompt_first Flag indicating if the prompt should be placed before the input text.
+ * @param request The request with texts, labels and classification type.
+ * @return 0 if successful, -1 if memory for the tensors could not be allocated.
+ */
+int classify_request_grouped(WorkerGroups* groups, TokenizerHandle tokenizer_handler, bool prompt_first,
+                             const ClassificationRequest* request) {
+    size_t num_batches = (request->num_texts + BATCH_SIZE - 1) / BATCH_SIZE;
+    OrtValue** input_ids_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    OrtValue** attention_mask_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    OrtValue** output_tensors = (OrtValue**)calloc(num_batches, sizeof(OrtValue*));
+    if (!input_ids_tensors || !attention_mask_tensors || !output_tensors) {
+        fprintf(stderr, "Error: Memory allocation for batch tensors failed\n");
+        free(input_ids_tensors);
+        free(attention_mask_tensors);
+        free(output_tensors);
+        return -1;
+    }
+
+    parallel_preprocess(request->texts, request->labels, request->num_labels, request->num_texts,
+                        request->same_labels, prompt_first, tokenizer_handler,
+                        input_ids_tensors, attention_mask_tensors);
+
+    grouped_inference(groups, input_ids_tensors, attention_mask_tensors, output_tensors, num_batches);
+
+    parallel_postprocess(output_tensors, num_batches, request->num_texts,
+                         request->texts, request->labels, request->num_labels,
+                         request->same_labels, request->num_labels_size, request->classification_type);
+
+    for (size_t i = 0; i < num_batches; i++) {
+        if (input_ids_tensors[i]) g_ort->ReleaseValue(input_ids_tensors[i]);
+        if (attention_mask_tensors[i]) g_ort->ReleaseValue(attention_mask_tensors[i]);
+    }
+    free(input_ids_tensors);
+    free(attention_mask_tensors);
+    free(output_tensors);
+    return 0;
+}
+
+/**
+ * Prints the number of batches and the busy time of every worker group.
+ *
+ * @param groups The worker groups.
+ */
+void print_worker_group_stats(const WorkerGroups* groups) {
+    printf("Worker groups (%s dispatch):\n", groups->policy == DISPATCH_ROUND_ROBIN ? "round-robin" : "load");
+    for (size_t g = 0; g < groups->num_groups; ++g) {
+        const WorkerGroup* group = &groups->groups[g];
+        printf("  group %zu (node %d, %zu CPUs): %zu batches, %f seconds busy\n",
+               g, group->node, group->num_cpus, group->num_batches, group->busy_time);
+    }
+}
+
+/**
+ * Releases the sessions of the groups and the prepacked weights containers.
+ *
+ * @param groups The worker groups.
+ */
+void free_worker_groups(WorkerGroups* groups) {
+    for (size_t g = 0; groups->groups && g < groups->num_groups; ++g) {
+        release_ort_session(groups->groups[g].session);
+    }
+    // Containers must outlive the sessions that use them
+    for (size_t n = 0; groups->containers && n < groups->num_containers; ++n) {
+        g_ort->ReleasePrepackedWeightsContainer(groups->containers[n]);
+    }
+    free(groups->groups);
+    free(groups->containers);
+    groups->groups = NULL;
+    groups->containers = NULL;
+    groups->num_groups = 0;
+    groups->num_containers = 0;
+}